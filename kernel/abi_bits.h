@@ -78,4 +78,79 @@ struct css_req_set_ccw_data {
 #define SVC_FUTEX_WAIT 31
 #define SVC_FUTEX_WAKE 32
 
+#define SVC_VFS_READV 33 /* Read into a list of buffers */
+#define SVC_VFS_WRITEV 34 /* Write from a list of buffers */
+#define VFS_IOV_MAX 64 /* Most buffers taken by a single READV/WRITEV */
+struct vfs_iovec {
+	void *iov_base; /* Start of the buffer */
+	size_t iov_len; /* Size of the buffer */
+};
+
+#define SVC_AIO_SETUP 35 /* Register a ring of asynchronous requests */
+#define SVC_AIO_ENTER 36 /* Submit the requests placed on a ring, optionally wait for completions */
+#define SVC_AIO_DESTROY 37 /* Unregister a ring, waits for it's requests to complete */
+#define AIO_RING_ENTRIES 32 /* Entries of each queue of a ring, must be a power of 2 */
+
+/* Operations of a submission */
+#define AIO_OP_NOP 0
+#define AIO_OP_READ 1
+#define AIO_OP_WRITE 2
+#define AIO_OP_IOCTL 3 /* buf is the argument of the command, len is the command, only commands taking a single number are allowed */
+#define AIO_OP_READV 4 /* buf points to an array of len vfs_iovec */
+#define AIO_OP_WRITEV 5
+#define AIO_OP_FLUSH 6
+
+/* SVC_AIO_ENTER flags */
+#define AIO_ENTER_WAIT 0x01 /* Sleep until a completion is posted if there are none */
+
+struct aio_sqe {
+	int opcode; /* One of AIO_OP_* */
+	int handle; /* Handle as returned by SVC_VFS_OPEN */
+	void *buf;
+	size_t len;
+	uintptr_t user_data; /* Given back as it is on the completion */
+};
+
+struct aio_cqe {
+	uintptr_t user_data; /* Of the submission */
+	int result; /* What the synchronous SVC would have returned */
+};
+
+/* Shared between the program and the kernel, the program produces on sq_tail
+ * and consumes on cq_head, the kernel consumes on sq_head and produces on
+ * cq_tail. Indexes run freely and are masked with AIO_RING_ENTRIES - 1 */
+struct aio_ring {
+	volatile unsigned int sq_head;
+	volatile unsigned int sq_tail;
+	volatile unsigned int cq_head;
+	volatile unsigned int cq_tail;
+	struct aio_sqe sqes[AIO_RING_ENTRIES];
+	struct aio_cqe cqes[AIO_RING_ENTRIES];
+};
+
+/* Start a new job running the program of the current one at an entry point, the
+ * pages of the program are shared with the new job until either stores on them */
+#define SVC_JOB_SPAWN 38
+
+/* Set the priority of the calling thread, or query it when negative, returns the
+ * previous one. Programs can't go above the priority of their job */
+#define SVC_SCHED_PRIORITY 39
+#define SCHED_PRIORITY_LEVELS 8 /* Priorities go from 0 (the highest) to SCHED_PRIORITY_LEVELS - 1 */
+
+/* Obtain the CPU used by the calling thread, or by it's task or job with the threads
+ * that ended included, arg1 is one of SCHED_USAGE_* and arg2 the struct sched_usage
+ * it's placed on */
+#define SVC_SCHED_USAGE 40
+#define SCHED_USAGE_THREAD 0
+#define SCHED_USAGE_TASK 1
+#define SCHED_USAGE_JOB 2
+
+struct sched_usage {
+	uint64_t su_user_usec; /* Running the program */
+	uint64_t su_system_usec; /* Running the kernel on behalf of the program */
+	uint64_t su_wait_usec; /* Runnable, waiting for a CPU */
+	size_t su_n_voluntary; /* Gave up the CPU to sleep or yield */
+	size_t su_n_involuntary; /* Preempted by the end of the slice or a higher priority thread */
+};
+
 #endif
@@ -0,0 +1,402 @@
+// aio.cxx
+//
+// Asynchronous I/O, programs place their requests on a ring shared with the kernel
+// and a pool of kernel threads performs them, posting the completions back on the
+// same ring so a program can have several requests in flight with a single SVC
+
+#include <aio.hxx>
+#include <service.hxx>
+#include <arch/handlers.hxx>
+#include <storage.hxx>
+#include <printf.hxx>
+#include <errcode.hxx>
+
+constinit static storage::global_wrapper<async_io::table> g_aio;
+
+namespace async_io {
+	static bool scalar_ioctl(size_t cmd);
+	static bool handle_busy(const async_io::request& req);
+	static async_io::request *take_request();
+	static int perform(async_io::request& req);
+	static void post_completion(async_io::context& ctx, uintptr_t user_data, int result);
+	static void worker_fn();
+}
+
+/// @brief Create the worker threads, the scheduler must be running
+int async_io::init()
+{
+	auto& aio = *(g_aio.operator->());
+	storage::fill(&aio, 0, sizeof(aio));
+
+	auto *sys_job = timeshare::get_current_job();
+	auto *task = timeshare::task::create(*sys_job, *"AIO");
+	if(task == nullptr)
+		return error::ALLOCATION;
+	for(size_t i = 0; i < AIO_WORKERS; i++) {
+		auto *thread = timeshare::thread::create(*sys_job, *task, AIO_WORKER_STACK_SIZE);
+		if(thread == nullptr)
+			return error::ALLOCATION;
+		thread->set_pc((void *)&async_io::worker_fn, true);
+	}
+	return 0;
+}
+
+/// @brief Check if an ioctl takes a single number, the only ones the workers can
+/// perform since the program's storage isn't reachable from them
+static bool async_io::scalar_ioctl(size_t cmd)
+{
+	return cmd == VDISK_IOCTL_CACHE_SET_BUDGET || cmd == VDISK_IOCTL_CACHE_SET_POLICY || cmd == VDISK_IOCTL_CACHE_FLUSH
+		|| cmd == VDISK_IOCTL_BUFFER_HIGH_WATER || cmd == VDISK_IOCTL_PAGE_CACHE_SET_BUDGET;
+}
+
+/// @brief Check if an earlier request on the same handle hasn't completed, the lock
+/// must be held
+static bool async_io::handle_busy(const async_io::request& req)
+{
+	for(size_t i = 0; i < AIO_MAX_REQUESTS; i++) {
+		const auto& other = g_aio->requests[i];
+		if(&other == &req || other.status == async_io::FREE || other.hdl != req.hdl)
+			continue;
+		if(other.status == async_io::ACTIVE || (int32_t)(other.seq - req.seq) < 0)
+			return true;
+	}
+	return false;
+}
+
+/// @brief Take the oldest queued request that can be performed now, the lock must be held
+static async_io::request *async_io::take_request()
+{
+	async_io::request *oldest = nullptr;
+	for(size_t i = 0; i < AIO_MAX_REQUESTS; i++) {
+		auto& req = g_aio->requests[i];
+		if(req.status != async_io::QUEUED)
+			continue;
+		if(oldest != nullptr && (int32_t)(req.seq - oldest->seq) > 0)
+			continue;
+		if(async_io::handle_busy(req))
+			continue;
+		oldest = &req;
+	}
+
+	if(oldest != nullptr) {
+		oldest->status = async_io::ACTIVE;
+		g_aio->n_active++;
+		if(g_aio->n_active > g_aio->stats.max_inflight)
+			g_aio->stats.max_inflight = g_aio->n_active;
+	}
+	return oldest;
+}
+
+/// @brief Perform a request on the handle, may sleep waiting for the device
+/// @return int What the synchronous SVC would have returned
+static int async_io::perform(async_io::request& req)
+{
+	auto& sqe = req.sqe;
+	switch(sqe.opcode) {
+	case AIO_OP_NOP:
+		return 0;
+	case AIO_OP_READ:
+	case AIO_OP_READV:
+		return req.hdl->readv(req.iov, req.n_iov);
+	case AIO_OP_WRITE:
+	case AIO_OP_WRITEV:
+		return req.hdl->writev(req.iov, req.n_iov);
+	case AIO_OP_IOCTL: {
+		// Checked by enter, each command is given the type it reads
+		const auto arg = reinterpret_cast<uintptr_t>(sqe.buf);
+		if(sqe.len == VDISK_IOCTL_CACHE_SET_POLICY)
+			return req.hdl->ioctl((int)sqe.len, static_cast<int>(arg));
+		return req.hdl->ioctl((int)sqe.len, static_cast<size_t>(arg));
+	}
+	case AIO_OP_FLUSH:
+		return req.hdl->flush();
+	default:
+		break;
+	}
+	return error::INVALID_PARAM;
+}
+
+/// @brief Place a completion on the ring, room for it was reserved when the request
+/// was submitted so the queue never overflows
+static void async_io::post_completion(async_io::context& ctx, uintptr_t user_data, int result)
+{
+	auto *ring = ctx.ring;
+	auto& cqe = ring->cqes[ring->cq_tail & (AIO_RING_ENTRIES - 1)];
+	cqe.user_data = user_data;
+	cqe.result = result;
+	// The program may be reading the ring right now, the entry must be visible first
+	base::release_barrier();
+	ring->cq_tail = ring->cq_tail + 1;
+}
+
+static void async_io::worker_fn()
+{
+	while(1) {
+		timeshare::prepare_sleep(g_aio->requests);
+		// Requests are performed with interrupts disabled, like the SVCs are, so a
+		// program entering the kernel never spins on a lock (ours or the ones of the
+		// caches) owned by a preempted worker, workers give up the CPU while they
+		// wait for the device
+		timeshare::disable();
+		g_aio->lock.lock();
+		auto *req = async_io::take_request();
+		g_aio->lock.unlock();
+		if(req == nullptr) {
+			timeshare::enable();
+			io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+			timeshare::finish_sleep();
+			continue;
+		}
+		timeshare::finish_sleep();
+
+		const int r = async_io::perform(*req);
+		auto *ctx = req->ctx;
+		// Closes it if the program closed it meanwhile
+		virtual_disk::handle::close(req->hdl);
+		if(req->iov != nullptr)
+			storage::free(req->iov);
+		req->iov = nullptr;
+
+		virtual_storage::address_space *dead_aspace = nullptr;
+		g_aio->lock.lock();
+		if(!ctx->orphaned)
+			async_io::post_completion(*ctx, req->sqe.user_data, r);
+		ctx->n_inflight--;
+		if(ctx->orphaned && ctx->n_inflight == 0) {
+			dead_aspace = ctx->aspace;
+			ctx->orphaned = false;
+			ctx->used = false;
+			ctx->ring = nullptr;
+			ctx->aspace = nullptr;
+			// Other rings of the job may still have requests storing on it
+			for(size_t i = 0; i < AIO_MAX_CONTEXTS; i++)
+				if(g_aio->contexts[i].orphaned && g_aio->contexts[i].aspace == dead_aspace)
+					dead_aspace = nullptr;
+		}
+		req->status = async_io::FREE;
+		g_aio->n_active--;
+		g_aio->stats.n_completed++;
+		g_aio->lock.unlock();
+		if(dead_aspace != nullptr)
+			virtual_storage::address_space::destroy(dead_aspace);
+		timeshare::enable();
+
+		timeshare::wakeup(ctx);
+		// Requests queued behind this one on the same handle can now be taken
+		timeshare::wakeup(g_aio->requests);
+	}
+}
+
+/// @brief Register a ring
+/// @param ring Address of the ring on the job, obtained with SVC_GET_STORAGE
+/// @return int Identifier of the ring, negative on error
+int async_io::setup(timeshare::job& job, struct aio_ring *ring)
+{
+	auto *real = reinterpret_cast<struct aio_ring *>(job.virtual_to_real(ring));
+	auto *real_end = reinterpret_cast<uint8_t *>(job.virtual_to_real(reinterpret_cast<uint8_t *>(ring) + sizeof(*ring) - 1));
+	// The kernel accesses the ring by it's real address, so it must be on the heap,
+	// which is contiguous and never shared with the jobs spawned from this one
+	if(real == nullptr || real != ring || real_end != reinterpret_cast<uint8_t *>(real) + sizeof(*ring) - 1)
+		return error::INVALID_PARAM;
+
+	base::scoped_mutex lock(g_aio->lock);
+	for(size_t i = 0; i < AIO_MAX_CONTEXTS; i++) {
+		auto& ctx = g_aio->contexts[i];
+		if(ctx.used)
+			continue;
+		ctx.ring = real;
+		ctx.job_id = timeshare::get_current_jobid();
+		ctx.n_inflight = 0;
+		ctx.used = true;
+		ctx.orphaned = false;
+		ctx.aspace = nullptr;
+		real->sq_head = 0;
+		real->sq_tail = 0;
+		real->cq_head = 0;
+		real->cq_tail = 0;
+		return (int)i;
+	}
+	return error::RESOURCE_UNAVAILABLE;
+}
+
+/// @brief Take the submissions placed on the ring and queue them for the workers
+/// @param flags AIO_ENTER_WAIT to sleep until there is a completion to consume
+/// @return int Submissions taken, less than were placed if too many requests are in flight,
+/// error::RESOURCE_EXPECTED when asked to wait with nothing in flight
+int async_io::enter(timeshare::job& job, usersys::user& user, int ctx_id, unsigned int flags)
+{
+	if(ctx_id < 0 || ctx_id >= AIO_MAX_CONTEXTS)
+		return error::INVALID_PARAM;
+
+	auto& ctx = g_aio->contexts[ctx_id];
+	if(!ctx.used || ctx.job_id != timeshare::get_current_jobid())
+		return error::INVALID_PARAM;
+
+	auto *ring = ctx.ring;
+	int n_taken = 0;
+	bool queued = false;
+	g_aio->lock.lock();
+	while(ring->sq_head != ring->sq_tail) {
+		// Keep room on the completion queue for everything in flight
+		if((ring->cq_tail - ring->cq_head) + ctx.n_inflight >= AIO_RING_ENTRIES)
+			break;
+
+		async_io::request *req = nullptr;
+		for(size_t i = 0; i < AIO_MAX_REQUESTS; i++) {
+			if(g_aio->requests[i].status == async_io::FREE) {
+				req = &g_aio->requests[i];
+				break;
+			}
+		}
+		if(req == nullptr)
+			break;
+
+		// Copied since the program may reuse the entry once sq_head moves past it
+		const auto sqe = ring->sqes[ring->sq_head & (AIO_RING_ENTRIES - 1)];
+		req->sqe = sqe;
+		req->iov = nullptr;
+		req->n_iov = 0;
+		ring->sq_head = ring->sq_head + 1;
+		n_taken++;
+
+		// Bad submissions complete right away
+		int r = 0;
+		const auto hdl_idx = static_cast<size_t>(sqe.handle);
+		if(sqe.opcode != AIO_OP_NOP && (hdl_idx >= user.handles.size() || user.handles[hdl_idx] == nullptr)) {
+			r = error::INVALID_PARAM;
+		} else if(sqe.opcode == AIO_OP_IOCTL && !async_io::scalar_ioctl(sqe.len)) {
+			r = error::INVALID_PARAM;
+		} else if(sqe.opcode == AIO_OP_READ || sqe.opcode == AIO_OP_WRITE || sqe.opcode == AIO_OP_READV || sqe.opcode == AIO_OP_WRITEV) {
+			// The workers don't run on the job, the buffers are translated (and the
+			// pages faulted in or copied if shared) now, like the SVCs do
+			struct vfs_iovec one = { sqe.buf, sqe.len };
+			const bool vector = sqe.opcode == AIO_OP_READV || sqe.opcode == AIO_OP_WRITEV;
+			auto *iov = vector ? service::copy_iovec(job, reinterpret_cast<const struct vfs_iovec *>(sqe.buf), sqe.len) : &one;
+			req->iov = iov != nullptr ? service::translate_iovec(job, iov, vector ? sqe.len : 1, &req->n_iov) : nullptr;
+			if(vector && iov != nullptr)
+				storage::free(iov);
+			if(req->iov == nullptr)
+				r = error::INVALID_PARAM;
+		}
+		if(r < 0) {
+			async_io::post_completion(ctx, sqe.user_data, r);
+			continue;
+		}
+
+		req->ctx = &ctx;
+		req->hdl = sqe.opcode != AIO_OP_NOP ? user.handles[hdl_idx] : nullptr;
+		// The program may close the handle before the request is performed
+		if(req->hdl != nullptr)
+			req->hdl->hold();
+		req->seq = g_aio->next_seq++;
+		req->status = async_io::QUEUED;
+		ctx.n_inflight++;
+		g_aio->stats.n_submitted++;
+		queued = true;
+	}
+
+	if((flags & AIO_ENTER_WAIT) && ring->cq_tail == ring->cq_head && ctx.n_inflight == 0) {
+		// Nothing could ever be posted
+		g_aio->lock.unlock();
+		return error::RESOURCE_EXPECTED;
+	} else if((flags & AIO_ENTER_WAIT) && ring->cq_tail == ring->cq_head) {
+		// Returns to the program once a worker posts a completion, it must check the
+		// ring again since the wakeup may be for an earlier completion
+		timeshare::prepare_sleep(&ctx);
+		g_aio->lock.unlock();
+		if(queued)
+			timeshare::wakeup(g_aio->requests);
+		timeshare::yield();
+		return n_taken;
+	}
+	g_aio->lock.unlock();
+	if(queued)
+		timeshare::wakeup(g_aio->requests);
+	return n_taken;
+}
+
+/// @brief Unregister a ring, queued requests that were not started are dropped
+/// @return int error::RESOURCE_BUSY if requests are still being performed
+int async_io::destroy(int ctx_id)
+{
+	if(ctx_id < 0 || ctx_id >= AIO_MAX_CONTEXTS)
+		return error::INVALID_PARAM;
+
+	virtual_disk::handle *dropped[AIO_MAX_REQUESTS];
+	size_t n_dropped = 0;
+	g_aio->lock.lock();
+	auto& ctx = g_aio->contexts[ctx_id];
+	if(!ctx.used || ctx.orphaned || ctx.job_id != timeshare::get_current_jobid()) {
+		g_aio->lock.unlock();
+		return error::INVALID_PARAM;
+	}
+
+	for(size_t i = 0; i < AIO_MAX_REQUESTS; i++) {
+		if(g_aio->requests[i].ctx == &ctx && g_aio->requests[i].status == async_io::ACTIVE) {
+			g_aio->lock.unlock();
+			return error::RESOURCE_BUSY;
+		}
+	}
+	for(size_t i = 0; i < AIO_MAX_REQUESTS; i++) {
+		auto& req = g_aio->requests[i];
+		if(req.ctx == &ctx && req.status == async_io::QUEUED) {
+			req.status = async_io::FREE;
+			dropped[n_dropped++] = req.hdl;
+			if(req.iov != nullptr)
+				storage::free(req.iov);
+			req.iov = nullptr;
+		}
+	}
+	ctx.used = false;
+	ctx.ring = nullptr;
+	debug_printf("aio: submitted=%u,completed=%u,max_inflight=%u", g_aio->stats.n_submitted, g_aio->stats.n_completed, g_aio->stats.max_inflight);
+	g_aio->lock.unlock();
+
+	// Closing may have to write what the handle buffered, not done with the lock held
+	for(size_t i = 0; i < n_dropped; i++)
+		virtual_disk::handle::close(dropped[i]);
+	return 0;
+}
+
+/// @brief Unregister the rings of a job that exited, queued requests are dropped and
+/// the ones being performed complete without posting to the ring, which may be gone
+/// @param job_id The job
+/// @param aspace Address space of the job, nullptr if it has none
+/// @return bool True if requests are still being performed, the address space is then
+/// destroyed once the last of them completes instead of by the caller
+bool async_io::exit_job(timeshare::job::job_t job_id, virtual_storage::address_space *aspace)
+{
+	virtual_disk::handle *dropped[AIO_MAX_REQUESTS];
+	size_t n_dropped = 0;
+	bool busy = false;
+	g_aio->lock.lock();
+	for(size_t i = 0; i < AIO_MAX_CONTEXTS; i++) {
+		auto& ctx = g_aio->contexts[i];
+		if(!ctx.used || ctx.orphaned || ctx.job_id != job_id)
+			continue;
+		for(size_t j = 0; j < AIO_MAX_REQUESTS; j++) {
+			auto& req = g_aio->requests[j];
+			if(req.ctx == &ctx && req.status == async_io::QUEUED) {
+				req.status = async_io::FREE;
+				dropped[n_dropped++] = req.hdl;
+				if(req.iov != nullptr)
+					storage::free(req.iov);
+				req.iov = nullptr;
+				ctx.n_inflight--;
+			}
+		}
+		if(ctx.n_inflight != 0) {
+			ctx.orphaned = true;
+			ctx.aspace = aspace;
+			busy = aspace != nullptr;
+			continue;
+		}
+		ctx.used = false;
+		ctx.ring = nullptr;
+	}
+	g_aio->lock.unlock();
+
+	for(size_t i = 0; i < n_dropped; i++)
+		virtual_disk::handle::close(dropped[i]);
+	return busy;
+}
@@ -0,0 +1,72 @@
+#ifndef ASYNC_IO_HXX
+#define ASYNC_IO_HXX
+
+#include <types.hxx>
+#include <mutex.hxx>
+#include <abi_bits.h>
+#include <timeshr.hxx>
+#include <user.hxx>
+#include <vdisk.hxx>
+
+#define AIO_MAX_CONTEXTS 16 // Rings that can be registered at once
+#define AIO_MAX_REQUESTS 64 // Requests taken from the rings and not yet completed
+#define AIO_WORKERS 4 // Kernel threads performing the requests, bounds how many are in flight
+#define AIO_WORKER_STACK_SIZE 8192
+
+namespace async_io {
+	/// @brief A ring registered by a program
+	struct context {
+		struct aio_ring *ring; // Real address of the ring
+		timeshare::job::job_t job_id;
+		size_t n_inflight; // Taken from the submission queue and without a completion yet
+		bool used;
+		// The job exited with requests being performed, their completions are dropped
+		// and the context is released once the last one completes
+		bool orphaned;
+		// Of the job that exited, the requests may still store on it's frames, so
+		// it's destroyed along with the last context orphaned by the job
+		virtual_storage::address_space *aspace;
+	};
+
+	enum request_status {
+		FREE = 0,
+		QUEUED = 1, // Waiting for a worker
+		ACTIVE = 2, // Being performed by a worker
+	};
+
+	/// @brief A submission taken from a ring
+	struct request {
+		async_io::context *ctx;
+		virtual_disk::handle *hdl;
+		struct aio_sqe sqe;
+		// Buffers of a read or a write on their real addresses, translated by enter
+		// since the workers don't run on the job
+		struct vfs_iovec *iov;
+		size_t n_iov;
+		uint32_t seq; // Order of submission, requests on the same handle are performed in this order
+		int status;
+	};
+
+	struct stats {
+		size_t n_submitted = 0;
+		size_t n_completed = 0;
+		size_t max_inflight = 0; // Most requests being performed at once
+	};
+
+	struct table {
+		async_io::context contexts[AIO_MAX_CONTEXTS];
+		async_io::request requests[AIO_MAX_REQUESTS];
+		uint32_t next_seq;
+		size_t n_active;
+		async_io::stats stats;
+		base::mutex lock;
+	};
+
+	int init();
+	int setup(timeshare::job& job, struct aio_ring *ring);
+	int enter(timeshare::job& job, usersys::user& user, int ctx_id, unsigned int flags);
+	int destroy(int ctx_id);
+	bool exit_job(timeshare::job::job_t job_id, virtual_storage::address_space *aspace);
+}
+
+#endif
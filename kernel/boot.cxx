@@ -16,6 +16,7 @@
 #include <errcode.hxx>
 #include <elf.hxx>
 #include <locale.hxx>
+#include <zdsfs.hxx>
 
 namespace boot {
 	static inline int limine_parse_request(void *req);
@@ -147,7 +148,11 @@ static inline int boot::limine(virtual_disk::handle& hdl)
 	// Fill out data that can't be const-evaled
 	g_terminal_resp.terminals = g_terminals->get_as_array();
 
+	// Size the buffer to the configuration file when the disk can tell it
 	size_t size = 32767 * 10;
+	virtual_disk::node_stat st;
+	if(hdl.ioctl(VDISK_IOCTL_STAT, &st) == 0 && st.size > 0)
+		size = st.size;
 	void *buf = storage::alloc(size);
 	if(buf == nullptr) return error::ALLOCATION;
 	int r = hdl.read(buf, size);
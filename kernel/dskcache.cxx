@@ -0,0 +1,415 @@
+// dskcache.cxx
+//
+// Cache of the records of seeking disks, sits between the virtual disk handles and
+// the disk drivers so filesystems can re-read their metadata without going to the disk
+
+#include <dskcache.hxx>
+#include <storage.hxx>
+#include <printf.hxx>
+#include <errcode.hxx>
+
+constinit static storage::global_wrapper<disk_cache::table> g_cache;
+
+namespace disk_cache {
+	static size_t get_bucket(const virtual_disk::node *node, const virtual_disk::disk_loc& loc);
+	static disk_cache::entry *lookup(const virtual_disk::node *node, const virtual_disk::disk_loc& loc);
+	static void lru_remove(disk_cache::entry *entry);
+	static void lru_push(disk_cache::entry *entry);
+	static void link(disk_cache::entry *entry);
+	static void unlink(disk_cache::entry *entry);
+	static disk_cache::entry *evict();
+	static int write_back(disk_cache::entry *entry);
+	static int insert(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& next_loc, const void *buf, size_t size, size_t requested, bool dirty);
+	static void read_ahead(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, size_t record_size);
+}
+
+int disk_cache::init()
+{
+	auto& cache = *(g_cache.operator->());
+	storage::fill(&cache, 0, sizeof(cache));
+	cache.stats.budget = DISK_CACHE_DEFAULT_BUDGET;
+	cache.stats.policy = disk_cache::WRITE_THROUGH;
+	return 0;
+}
+
+static size_t disk_cache::get_bucket(const virtual_disk::node *node, const virtual_disk::disk_loc& loc)
+{
+	size_t hash = reinterpret_cast<uintptr_t>(node) >> 4;
+	hash = hash * 31 + loc.cylinder;
+	hash = hash * 31 + loc.track;
+	hash = hash * 31 + loc.record;
+	return hash % DISK_CACHE_BUCKETS;
+}
+
+/// @brief Find a record, the cache lock must be held
+static disk_cache::entry *disk_cache::lookup(const virtual_disk::node *node, const virtual_disk::disk_loc& loc)
+{
+	auto *entry = g_cache->buckets[disk_cache::get_bucket(node, loc)];
+	while(entry != nullptr) {
+		if(entry->node == node && entry->loc.cylinder == loc.cylinder && entry->loc.track == loc.track && entry->loc.record == loc.record)
+			return entry;
+		entry = entry->hash_next;
+	}
+	return nullptr;
+}
+
+static void disk_cache::lru_remove(disk_cache::entry *entry)
+{
+	if(entry->lru_prev != nullptr)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		g_cache->lru_head = entry->lru_next;
+	if(entry->lru_next != nullptr)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		g_cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = nullptr;
+}
+
+static void disk_cache::lru_push(disk_cache::entry *entry)
+{
+	entry->lru_prev = nullptr;
+	entry->lru_next = g_cache->lru_head;
+	if(g_cache->lru_head != nullptr)
+		g_cache->lru_head->lru_prev = entry;
+	g_cache->lru_head = entry;
+	if(g_cache->lru_tail == nullptr)
+		g_cache->lru_tail = entry;
+}
+
+/// @brief Place a record on the hash table and as the most recently used, the cache lock
+/// must be held
+static void disk_cache::link(disk_cache::entry *entry)
+{
+	auto **bucket = &g_cache->buckets[disk_cache::get_bucket(entry->node, entry->loc)];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	disk_cache::lru_push(entry);
+	g_cache->stats.used_size += sizeof(disk_cache::entry) + entry->size;
+	g_cache->stats.n_entries++;
+}
+
+/// @brief Take a record out of the hash table and the LRU list, the cache lock must be held
+static void disk_cache::unlink(disk_cache::entry *entry)
+{
+	auto **link = &g_cache->buckets[disk_cache::get_bucket(entry->node, entry->loc)];
+	while(*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+	disk_cache::lru_remove(entry);
+	g_cache->stats.used_size -= sizeof(disk_cache::entry) + entry->size;
+	g_cache->stats.n_entries--;
+}
+
+/// @brief Take the least recently used record out of the cache, the cache lock must be held
+/// @return disk_cache::entry* The record, the caller must write it back if dirty and free it
+static disk_cache::entry *disk_cache::evict()
+{
+	auto *entry = g_cache->lru_tail;
+	if(entry == nullptr)
+		return nullptr;
+	disk_cache::unlink(entry);
+	g_cache->stats.n_evictions++;
+	return entry;
+}
+
+/// @brief Write a dirty record to the disk, the cache lock must not be held since this
+/// waits for the device
+static int disk_cache::write_back(disk_cache::entry *entry)
+{
+	auto *driver = entry->node->driver;
+	if(driver == nullptr || driver->write_disk == nullptr)
+		return error::INVALID_SETUP;
+
+	// The handle that wrote the record may be closed by now
+	virtual_disk::handle hdl;
+	hdl.node = entry->node;
+	hdl.mode = virtual_disk::mode::WRITE;
+	hdl.driver_data = entry->driver_data;
+	const int r = driver->write_disk(hdl, entry->loc, entry->data(), entry->size);
+	if(r >= 0) {
+		g_cache->lock.lock();
+		g_cache->stats.n_write_backs++;
+		g_cache->lock.unlock();
+	}
+	return r;
+}
+
+/// @brief Place a record on the cache, evicting the least recently used ones to make room,
+/// a dirty copy of the record is newer than what the disk has so it's never replaced by
+/// clean data
+static int disk_cache::insert(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& next_loc, const void *buf, size_t size, size_t requested, bool dirty)
+{
+	const size_t entry_size = sizeof(disk_cache::entry) + size;
+	if(entry_size > g_cache->stats.budget)
+		return error::ALLOCATION;
+
+	auto *entry = static_cast<disk_cache::entry *>(storage::alloc(entry_size));
+	if(entry == nullptr)
+		return error::ALLOCATION;
+	entry->node = hdl.node;
+	entry->driver_data = hdl.driver_data;
+	entry->loc = loc;
+	entry->next_loc = next_loc;
+	entry->size = size;
+	entry->requested = requested;
+	entry->dirty = dirty;
+	storage::copy(entry->data(), buf, size);
+
+	g_cache->lock.lock();
+	// Replace the previous copy of the record
+	auto *old = disk_cache::lookup(hdl.node, loc);
+	if(old != nullptr && old->dirty && !dirty) {
+		g_cache->lock.unlock();
+		storage::free(entry);
+		return 0;
+	}
+	if(old != nullptr)
+		disk_cache::unlink(old);
+	while(g_cache->stats.used_size + entry_size > g_cache->stats.budget) {
+		auto *victim = disk_cache::evict();
+		if(victim == nullptr)
+			break;
+		if(victim->dirty) {
+			g_cache->lock.unlock();
+			disk_cache::write_back(victim);
+			g_cache->lock.lock();
+		}
+		storage::free(victim);
+	}
+
+	disk_cache::link(entry);
+	g_cache->lock.unlock();
+	if(old != nullptr)
+		storage::free(old);
+	return 0;
+}
+
+/// @brief Bring the rest of the track following a record into the cache with a single
+/// operation, used when the caller is walking the records in order, the records that
+/// are cached already are left as they are since they may be dirty
+static void disk_cache::read_ahead(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, size_t record_size)
+{
+	auto *driver = hdl.node->driver;
+	if(driver->read_disk_extent == nullptr)
+		return;
+
+	g_cache->lock.lock();
+	const bool cached = disk_cache::lookup(hdl.node, loc) != nullptr;
+	g_cache->lock.unlock();
+	if(cached)
+		return;
+
+	const size_t buf_size = record_size * DISK_CACHE_MAX_READ_AHEAD;
+	auto *buf = storage::alloc<uint8_t>(buf_size);
+	if(buf == nullptr)
+		return;
+	virtual_disk::disk_record records[DISK_CACHE_MAX_READ_AHEAD];
+	size_t n_records = DISK_CACHE_MAX_READ_AHEAD;
+	const virtual_disk::disk_loc end = loc;
+	if(driver->read_disk_extent(hdl, loc, end, buf, buf_size, record_size, records, &n_records) > 0) {
+		size_t offset = 0;
+		for(size_t i = 0; i < n_records; i++) {
+			auto next_loc = records[i].loc;
+			next_loc.record++;
+			g_cache->lock.lock();
+			const bool present = disk_cache::lookup(hdl.node, records[i].loc) != nullptr;
+			g_cache->lock.unlock();
+			if(!present)
+				disk_cache::insert(hdl, records[i].loc, next_loc, &buf[offset], records[i].size, record_size, false);
+			offset += records[i].size;
+		}
+		g_cache->stats.n_read_ahead += n_records;
+	}
+	storage::free(buf);
+}
+
+/// @brief Read a record thru the cache
+/// @param hdl Handle of the disk
+/// @param loc Location of the record
+/// @param buf Buffer to read into
+/// @param n Size of the buffer
+/// @return int Number of bytes read, negative is error
+int disk_cache::read(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, void *buf, size_t n)
+{
+	// Detect callers walking the disk so the following records can be read ahead
+	if(loc.cylinder == hdl.last_loc.cylinder && loc.track == hdl.last_loc.track && loc.record == hdl.last_loc.record)
+		hdl.n_sequential++;
+	else
+		hdl.n_sequential = 0;
+
+	g_cache->lock.lock();
+	auto *entry = disk_cache::lookup(hdl.node, loc);
+	// Only usable if it holds everything the caller wants, a dirty record holds all
+	// that was written to it so the disk has nothing more recent
+	if(entry != nullptr && (n <= entry->requested || entry->size < entry->requested || entry->dirty)) {
+		const size_t size = n < entry->size ? n : entry->size;
+		storage::copy(buf, entry->data(), size);
+		hdl.last_loc = entry->next_loc;
+		disk_cache::lru_remove(entry);
+		disk_cache::lru_push(entry);
+		g_cache->stats.n_hits++;
+		g_cache->lock.unlock();
+		if(hdl.n_sequential >= DISK_CACHE_SEQUENTIAL)
+			disk_cache::read_ahead(hdl, hdl.last_loc, n);
+		return static_cast<int>(size);
+	}
+	g_cache->stats.n_misses++;
+	g_cache->lock.unlock();
+
+	auto *driver = hdl.node->driver;
+	const int r = driver->read_disk(hdl, loc, buf, n);
+	if(r < 0)
+		return r;
+	const auto next_loc = driver->get_last_disk_loc != nullptr ? driver->get_last_disk_loc(hdl) : loc;
+	hdl.last_loc = next_loc;
+	disk_cache::insert(hdl, loc, next_loc, buf, static_cast<size_t>(r), n, false);
+	if(hdl.n_sequential >= DISK_CACHE_SEQUENTIAL)
+		disk_cache::read_ahead(hdl, next_loc, n);
+	return r;
+}
+
+/// @brief Write a record thru the cache
+/// @param hdl Handle of the disk
+/// @param loc Location of the record
+/// @param buf Data to write
+/// @param n Size of the data
+/// @return int Number of bytes written, negative is error
+int disk_cache::write(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const void *buf, size_t n)
+{
+	hdl.n_sequential = 0;
+	if(g_cache->stats.policy == disk_cache::WRITE_BACK) {
+		// The disk isn't touched so the following record is assumed to be on the same
+		// track, like read-ahead does, reading past the end moves on to the next track
+		auto next_loc = loc;
+		next_loc.record++;
+		if(disk_cache::insert(hdl, loc, next_loc, buf, n, n, true) == 0) {
+			hdl.last_loc = next_loc;
+			return static_cast<int>(n);
+		}
+		// No room on the cache, write it directly
+	}
+
+	auto *driver = hdl.node->driver;
+	const int r = driver->write_disk(hdl, loc, buf, n);
+	if(r < 0)
+		return r;
+	hdl.last_loc = driver->get_last_disk_loc != nullptr ? driver->get_last_disk_loc(hdl) : loc;
+
+	// The cached copy is stale now
+	g_cache->lock.lock();
+	auto *entry = disk_cache::lookup(hdl.node, loc);
+	if(entry != nullptr)
+		disk_cache::unlink(entry);
+	g_cache->lock.unlock();
+	if(entry != nullptr)
+		storage::free(entry);
+	return r;
+}
+
+/// @brief Write the dirty records of a disk
+/// @param node The disk, nullptr for every disk
+/// @return int Return code of the last failed write, 0 if all succeeded
+int disk_cache::flush(virtual_disk::node *node)
+{
+	int r = 0;
+	disk_cache::entry *failed = nullptr; // Still dirty, put back once done
+	g_cache->lock.lock();
+	auto *entry = g_cache->lru_head;
+	while(entry != nullptr) {
+		if(entry->dirty && (node == nullptr || entry->node == node)) {
+			// Out of reach of eviction and of other flushes while we're unlocked
+			disk_cache::unlink(entry);
+			g_cache->lock.unlock();
+			const int wr = disk_cache::write_back(entry);
+			g_cache->lock.lock();
+			if(wr < 0) {
+				r = wr;
+				entry->hash_next = failed;
+				failed = entry;
+			} else if(disk_cache::lookup(entry->node, entry->loc) != nullptr) {
+				// Written again meanwhile, the new copy is the one kept
+				storage::free(entry);
+			} else {
+				// Kept on the cache, clean now
+				entry->dirty = false;
+				disk_cache::link(entry);
+			}
+			// The list may have changed while unlocked, start over
+			entry = g_cache->lru_head;
+			continue;
+		}
+		entry = entry->lru_next;
+	}
+	while(failed != nullptr) {
+		entry = failed;
+		failed = failed->hash_next;
+		if(disk_cache::lookup(entry->node, entry->loc) != nullptr)
+			storage::free(entry);
+		else
+			disk_cache::link(entry);
+	}
+	g_cache->lock.unlock();
+	return r;
+}
+
+int disk_cache::set_budget(size_t budget)
+{
+	g_cache->lock.lock();
+	g_cache->stats.budget = budget;
+	while(g_cache->stats.used_size > g_cache->stats.budget) {
+		auto *victim = disk_cache::evict();
+		if(victim == nullptr)
+			break;
+		if(victim->dirty) {
+			g_cache->lock.unlock();
+			disk_cache::write_back(victim);
+			g_cache->lock.lock();
+		}
+		storage::free(victim);
+	}
+	g_cache->lock.unlock();
+	return 0;
+}
+
+int disk_cache::set_policy(disk_cache::policy policy)
+{
+	if(policy != disk_cache::WRITE_THROUGH && policy != disk_cache::WRITE_BACK)
+		return error::INVALID_PARAM;
+	// Nothing may be left dirty once writes stop going thru the cache
+	if(policy == disk_cache::WRITE_THROUGH) {
+		const int r = disk_cache::flush(nullptr);
+		if(r < 0)
+			return r;
+	}
+	g_cache->stats.policy = policy;
+	return 0;
+}
+
+void disk_cache::get_stats(disk_cache::stats *stats)
+{
+	g_cache->lock.lock();
+	*stats = g_cache->stats;
+	g_cache->lock.unlock();
+}
+
+int disk_cache::ioctl(virtual_disk::handle& hdl, int cmd, va_list args)
+{
+	switch(cmd) {
+	case VDISK_IOCTL_CACHE_STATS: {
+		auto *stats = va_arg(args, disk_cache::stats *);
+		if(stats == nullptr)
+			return error::INVALID_PARAM;
+		disk_cache::get_stats(stats);
+	} break;
+	case VDISK_IOCTL_CACHE_SET_BUDGET:
+		return disk_cache::set_budget(va_arg(args, size_t));
+	case VDISK_IOCTL_CACHE_SET_POLICY:
+		return disk_cache::set_policy(static_cast<disk_cache::policy>(va_arg(args, int)));
+	case VDISK_IOCTL_CACHE_FLUSH:
+		return disk_cache::flush(hdl.node);
+	default:
+		return error::INVALID_PARAM;
+	}
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef DISK_CACHE_HXX
+#define DISK_CACHE_HXX
+
+#include <stdarg.h>
+#include <types.hxx>
+#include <mutex.hxx>
+#include <vdisk.hxx>
+
+#define DISK_CACHE_BUCKETS 64 // Buckets of the record hash table
+#define DISK_CACHE_DEFAULT_BUDGET (256 * 1024) // Storage the cached records may use
+#define DISK_CACHE_SEQUENTIAL 2 // Consecutive reads before the rest of the track is read ahead
+#define DISK_CACHE_MAX_READ_AHEAD 32 // Records read ahead at once
+
+namespace disk_cache {
+	enum policy {
+		WRITE_THROUGH = 0, // Writes go to the disk right away
+		WRITE_BACK = 1, // Writes stay on the cache until evicted or flushed
+	};
+
+	/// @brief A cached record, keyed by the disk node and the location it was read from,
+	/// the data of the record follows this header
+	struct entry {
+		entry& operator=(entry&) = delete;
+		const entry& operator=(const entry&) = delete;
+
+		inline void *data() { return reinterpret_cast<void *>(this + 1); }
+
+		disk_cache::entry *hash_next;
+		disk_cache::entry *lru_prev; // Towards the most recently used
+		disk_cache::entry *lru_next; // Towards the least recently used
+		virtual_disk::node *node;
+		void *driver_data; // Of the handle that wrote it, used to write back dirty records
+		virtual_disk::disk_loc loc;
+		virtual_disk::disk_loc next_loc; // What the driver reported as the next location
+		size_t size; // Bytes held
+		size_t requested; // Bytes asked for when it was read, a shorter size means it's the whole record
+		bool dirty;
+	};
+
+	struct stats {
+		size_t n_hits = 0;
+		size_t n_misses = 0;
+		size_t n_read_ahead = 0; // Records brought by read-ahead
+		size_t n_evictions = 0;
+		size_t n_write_backs = 0;
+		size_t n_entries = 0;
+		size_t used_size = 0;
+		size_t budget = 0;
+		int policy = disk_cache::WRITE_THROUGH;
+	};
+
+	struct table {
+		disk_cache::entry *buckets[DISK_CACHE_BUCKETS];
+		disk_cache::entry *lru_head; // Most recently used
+		disk_cache::entry *lru_tail; // Least recently used
+		disk_cache::stats stats;
+		base::mutex lock;
+	};
+
+	int init();
+	int read(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, void *buf, size_t n);
+	int write(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const void *buf, size_t n);
+	int flush(virtual_disk::node *node);
+	int set_budget(size_t budget);
+	int set_policy(disk_cache::policy policy);
+	void get_stats(disk_cache::stats *stats);
+	int ioctl(virtual_disk::handle& hdl, int cmd, va_list args);
+}
+
+#endif
@@ -336,6 +336,21 @@ static inline int elf64::load_section(elf64::reader& rdr, const elf64::section_h
 				return error::INVALID_SETUP;
 			}
 
+			// Pages are copied from the image the first time they're touched, the PLT and
+			// the GOT are patched by their real address so they're loaded right away
+			if(rdr.job->aspace != nullptr && IS_IN_BOUNDS_REL(rdr, shdr->offset + shdr->size - 1)
+			&& storage_string::compare(elf64::get_string(rdr, shdr->name), ".plt")
+			&& storage_string::compare(elf64::get_string(rdr, shdr->name), ".got")) {
+				auto *vaddr = reinterpret_cast<void *>(sect_offset + static_cast<uintptr_t>(shdr->addr));
+				// Read-only sections are shared as they are by the jobs spawned from this one
+				const int flags = (shdr->flags & elf::section_flags::WRITE) ? 0 : virtual_storage::page_rdonly;
+				if(rdr.job->aspace->reserve(vaddr, (size_t)shdr->size, flags, src_addr, (size_t)shdr->size) == 0) {
+					debug_printf("LOADER-RESERVE %p->(VIRT=%p)", src_addr, vaddr);
+					rdr.job->image = hdr;
+					return 0;
+				}
+			}
+
 			// Destination address to copy to
 			size_t align = (size_t)shdr->addralign; // Make sure to meet alignment criteria
 			if(align < virtual_storage::page_align) align = virtual_storage::page_align;
@@ -366,9 +381,19 @@ static inline int elf64::load_section(elf64::reader& rdr, const elf64::section_h
 	else if(shdr->type == elf::section_types::NOBITS) {
 		if(shdr->size == 0) return error::INVALID_SETUP; // Skip if the section is empty
 
-		/// @todo Map pages to the address in the virtual space
 		// Sections that needs to be allocated
 		if(shdr->flags & elf::section_flags::ALLOC) {
+			// Zero-filled pages are given the first time they're touched
+			if(rdr.job->aspace != nullptr
+			&& storage_string::compare(elf64::get_string(rdr, shdr->name), ".plt")
+			&& storage_string::compare(elf64::get_string(rdr, shdr->name), ".got")) {
+				auto *vaddr = reinterpret_cast<void *>(sect_offset + static_cast<uintptr_t>(shdr->addr));
+				if(rdr.job->aspace->reserve(vaddr, (size_t)shdr->size, 0, nullptr, 0) == 0) {
+					debug_printf("LOADER-RESERVE VIRT=%p(%u)", vaddr, (size_t)shdr->size);
+					return 0;
+				}
+			}
+
 			// Obtain memory from the real storage
 			addr = real_storage::alloc((size_t)shdr->size, (size_t)shdr->addralign);
 			if(addr == nullptr) return error::INVALID_SETUP;
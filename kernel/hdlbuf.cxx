@@ -0,0 +1,125 @@
+// hdlbuf.cxx
+//
+// Chunked buffers used by the virtual disk handles opened in buffered mode
+
+#include <hdlbuf.hxx>
+#include <storage.hxx>
+#include <printf.hxx>
+
+namespace handle_buffer {
+	static handle_buffer::chunk *get_chunk(handle_buffer::chain& chain);
+	static void put_chunk(handle_buffer::chain& chain, handle_buffer::chunk *chunk);
+}
+
+static handle_buffer::chunk *handle_buffer::get_chunk(handle_buffer::chain& chain)
+{
+	auto *chunk = chain.spare;
+	if(chunk != nullptr) {
+		chain.spare = nullptr;
+	} else {
+		chunk = static_cast<handle_buffer::chunk *>(storage::alloc(sizeof(handle_buffer::chunk) + HDLBUF_CHUNK_SIZE));
+		if(chunk == nullptr)
+			return nullptr;
+	}
+	chunk->next = nullptr;
+	chunk->start = chunk->end = 0;
+	return chunk;
+}
+
+static void handle_buffer::put_chunk(handle_buffer::chain& chain, handle_buffer::chunk *chunk)
+{
+	if(chain.spare == nullptr) {
+		chain.spare = chunk;
+		return;
+	}
+	storage::free(chunk);
+}
+
+/// @brief Obtain room at the end of the buffer to place data into
+/// @param avail Set to the bytes that can be placed
+/// @return uint8_t* Where to place the data, nullptr if out of storage
+uint8_t *handle_buffer::chain::fill_chunk(size_t *avail)
+{
+	if(this->tail == nullptr || this->tail->end == HDLBUF_CHUNK_SIZE) {
+		auto *chunk = handle_buffer::get_chunk(*this);
+		if(chunk == nullptr)
+			return nullptr;
+		if(this->tail != nullptr)
+			this->tail->next = chunk;
+		else
+			this->head = chunk;
+		this->tail = chunk;
+	}
+	*avail = HDLBUF_CHUNK_SIZE - this->tail->end;
+	return &this->tail->data()[this->tail->end];
+}
+
+/// @brief Account for the data placed on the room given by fill_chunk
+void handle_buffer::chain::commit_fill(size_t n)
+{
+	debug_assert(this->tail != nullptr && this->tail->end + n <= HDLBUF_CHUNK_SIZE);
+	this->tail->end += n;
+	this->size += n;
+}
+
+/// @brief Place data at the end of the buffer
+/// @return size_t Bytes placed, less than n if out of storage
+size_t handle_buffer::chain::append(const void *buf, size_t n)
+{
+	size_t done = 0;
+	while(done < n) {
+		size_t avail;
+		auto *p = this->fill_chunk(&avail);
+		if(p == nullptr)
+			break;
+		const size_t len = n - done < avail ? n - done : avail;
+		storage::copy(p, reinterpret_cast<const uint8_t *>(buf) + done, len);
+		this->commit_fill(len);
+		done += len;
+	}
+	return done;
+}
+
+/// @brief Take data from the start of the buffer
+/// @param buf Where to copy the data to, nullptr to discard it
+/// @return size_t Bytes taken
+size_t handle_buffer::chain::consume(void *buf, size_t n)
+{
+	size_t done = 0;
+	while(done < n && this->head != nullptr) {
+		auto *chunk = this->head;
+		size_t len = chunk->end - chunk->start;
+		if(len > n - done)
+			len = n - done;
+		if(buf != nullptr)
+			storage::copy(reinterpret_cast<uint8_t *>(buf) + done, &chunk->data()[chunk->start], len);
+		chunk->start += len;
+		this->size -= len;
+		done += len;
+
+		if(chunk->start == chunk->end) {
+			if(chunk == this->tail) {
+				// Last chunk, rewind it so it's room can be reused
+				chunk->start = chunk->end = 0;
+				break;
+			}
+			this->head = chunk->next;
+			handle_buffer::put_chunk(*this, chunk);
+		}
+	}
+	return done;
+}
+
+/// @brief Drop everything buffered and release the storage of the buffer
+void handle_buffer::chain::clear()
+{
+	while(this->head != nullptr) {
+		auto *next = this->head->next;
+		storage::free(this->head);
+		this->head = next;
+	}
+	if(this->spare != nullptr)
+		storage::free(this->spare);
+	this->tail = this->spare = nullptr;
+	this->size = 0;
+}
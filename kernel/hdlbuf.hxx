@@ -0,0 +1,43 @@
+#ifndef HANDLE_BUFFER_HXX
+#define HANDLE_BUFFER_HXX
+
+#include <types.hxx>
+
+#define HDLBUF_CHUNK_SIZE 4096 // Bytes held by each chunk of a buffer
+#define HDLBUF_DEFAULT_HIGH_WATER (64 * 1024) // Buffered bytes that trigger a flush
+
+namespace handle_buffer {
+	/// @brief Fixed size piece of a buffer, the data follows this header
+	struct chunk {
+		chunk& operator=(chunk&) = delete;
+		const chunk& operator=(const chunk&) = delete;
+
+		inline uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+		handle_buffer::chunk *next;
+		size_t start; // First byte not yet consumed
+		size_t end; // One past the last byte stored
+	};
+
+	/// @brief FIFO of bytes kept as a chain of chunks, so growing it never
+	/// copies what is already buffered
+	struct chain {
+		constexpr chain() = default;
+		~chain() = default;
+		chain& operator=(chain&) = delete;
+		const chain& operator=(const chain&) = delete;
+
+		size_t append(const void *buf, size_t n);
+		size_t consume(void *buf, size_t n);
+		uint8_t *fill_chunk(size_t *avail);
+		void commit_fill(size_t n);
+		void clear();
+
+		handle_buffer::chunk *head = nullptr; // Oldest data
+		handle_buffer::chunk *tail = nullptr; // Where new data is appended
+		handle_buffer::chunk *spare = nullptr; // Kept around so steady streams don't allocate
+		size_t size = 0; // Bytes buffered
+	};
+}
+
+#endif
@@ -7,6 +7,8 @@
 
 namespace virtual_storage {
 	constexpr auto page_align = 4096; // Page alignment
+	constexpr auto page_rdonly = 0; // Flags of pages that can't be stored on
+	constexpr auto page_private = 0; // Flags of pages not shared with the clones
 
 	struct page_entry {
 		using entry_size = uint32_t;
@@ -26,10 +28,15 @@ namespace virtual_storage {
 
 		static virtual_storage::address_space *create();
 		static void destroy(virtual_storage::address_space* aspace);
+		virtual_storage::address_space *clone();
 		int map_page(void *virtaddr, void *physaddr, int flags);
 		int map_range(void *virtaddr, void *physaddr, int flags, size_t size);
 		void *virtual_to_real(void *virtaddr);
 		void *phys2virt(void *physaddr);
+		int reserve(void *virtaddr, size_t size, int flags, const void *image, size_t image_size);
+		void release(void *virtaddr);
+		int fault(void *virtaddr);
+		int copy_on_write(void *virtaddr);
 		
 		inline void set_primary() const
 		{
@@ -144,20 +144,28 @@ void csup_init()
 static inline void exec_user()
 {
 	const auto load_mod = [](const auto *path, size_t *final_size) -> void * {
+		auto *hdl = virtual_disk::handle::open_path(path, virtual_disk::mode::READ);
+		if(hdl == nullptr) {
+			debug_printf("Can't open %s", path);
+			return nullptr;
+		}
+
+		// Allocate just what the module needs when the size can be known
 		size_t size = (32767 * 10);
+		virtual_disk::node_stat st;
+		if(hdl->ioctl(VDISK_IOCTL_STAT, &st) == 0 && st.size > 0)
+			size = st.size;
 		void *buf = storage::alloc(size);
 		if(buf == nullptr) {
 			debug_printf("\x01\x0B");
-			return nullptr;
-		}
-
-		auto *hdl = virtual_disk::handle::open_path(path, virtual_disk::mode::READ);
-		if(hdl == nullptr) {
-			debug_printf("Can't open %s", path);
-			storage::free(buf);
+			virtual_disk::handle::close(hdl);
 			return nullptr;
 		}
 		
+#if defined TARGET_S390 && defined DEBUG
+		// Load time of the modules, used to benchmark the disk I/O path
+		const auto start_tod = s390_intrin::get_tod();
+#endif
 		int r = hdl->read(buf, size);
 		size = (size_t)r;
 		if(r < 0) {
@@ -165,6 +173,9 @@ static inline void exec_user()
 			storage::free(buf);
 			return nullptr;
 		}
+#if defined TARGET_S390 && defined DEBUG
+		debug_printf("%s: %u bytes in %u us", path, size, (size_t)CSS_TOD_TO_USEC(s390_intrin::get_tod() - start_tod));
+#endif
 
 		buf = storage::realloc(buf, size);
 		if(buf == nullptr) {
@@ -195,7 +206,9 @@ static inline void exec_user()
 	//elf64::load(user_job, libio_buf, libio_size, &entry);
 	//storage::free(libio_buf);
 	elf64::load(user_job, jda_buf, jda_size, &entry);
-	storage::free(jda_buf);
+	// The job keeps the image when it's pages are populated from it on demand
+	if(user_job->image != jda_buf)
+		storage::free(jda_buf);
 
 	auto *new_task = timeshare::task::create(*user_job, *"JDATASK");
 	auto *new_thread = timeshare::thread::create(*user_job, *new_task, 8192 * 16);
@@ -223,6 +236,8 @@ static inline void exec_user()
 	virtual_storage::init();
 
 	init_smp();
+	// Scheduler statistics, the reports are taken when the nodes are opened
+	timeshare::create_nodes();
 	// --- After this point, device I/O is safe to use.
 	debug_printf("\x01\x09\x01\x0C kernel");
 
@@ -305,8 +320,20 @@ static inline void exec_user()
 	kprintf("Welcome to\x01\x0C\r\n");
 	boot::init();
 	exec_user();
+#if defined DEBUG
+	// Contention seen while booting and loading the programs
+	virtual_disk::dump_locks();
+#	ifdef TARGET_S390
+	css::dump_stats();
+#	endif
+#endif
 
-	/* Constantly yield to the scheduler */
+	/* Nothing is left for the kernel thread, it sleeps for good so the CPU can wait
+	 * when the programs don't need it */
 	debug_printf("Running on loop");
-	while(1) {}
+	static const char main_done = 0;
+	while(1) {
+		timeshare::prepare_sleep(&main_done);
+		io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+	}
 }
@@ -1,44 +1,283 @@
 #ifndef MUTEX_HXX
 #define MUTEX_HXX
 
+#include <types.hxx>
+#include <printf.hxx>
+
 namespace base {
 	typedef volatile int short atomic_int;
+	typedef volatile uint32_t atomic_word;
 
-	struct mutex {
-		enum {
-			UNLOCKED = 0,
-			LOCKED = 1,
-		};
+	/// @brief Atomically compare a word with an expected value and replace it if they match
+	/// @param ptr The word
+	/// @param expected Value the word must have
+	/// @param desired Value to store on the word
+	/// @return uint32_t Value the word had, the swap was done if it equals expected
+	inline uint32_t compare_and_swap(base::atomic_word *ptr, uint32_t expected, uint32_t desired)
+	{
+#if defined TARGET_S390 && MACHINE > M_S360
+		// CS loads the current value into the first operand when the comparison fails
+		asm volatile("CS %0,%2,%1\r\n" : "+d"(expected), "+Q"(*ptr) : "d"(desired) : "cc", "memory");
+		return expected;
+#elif defined TARGET_X86
+		asm volatile("lock cmpxchgl %2, %1" : "+a"(expected), "+m"(*ptr) : "r"(desired) : "cc", "memory");
+		return expected;
+#elif defined TARGET_RISCV
+		uint32_t prev, fail;
+		asm volatile(
+			"1: lr.w.aqrl %0, (%2)\r\n"
+			"bne %0, %3, 2f\r\n"
+			"sc.w.aqrl %1, %4, (%2)\r\n"
+			"bnez %1, 1b\r\n"
+			"2:\r\n"
+			: "=&r"(prev), "=&r"(fail)
+			: "r"(ptr), "r"(expected), "r"(desired)
+			: "memory");
+		return prev;
+#else
+		return __sync_val_compare_and_swap(ptr, expected, desired);
+#endif
+	}
+
+	/// @brief Atomically add a value to a word
+	/// @param ptr The word
+	/// @param value Value to add
+	/// @return uint32_t Value the word had before the addition
+	inline uint32_t fetch_add(base::atomic_word *ptr, uint32_t value)
+	{
+#if defined TARGET_X86
+		asm volatile("lock xaddl %0, %1" : "+r"(value), "+m"(*ptr) : : "cc", "memory");
+		return value;
+#elif defined TARGET_RISCV
+		uint32_t prev;
+		asm volatile("amoadd.w.aqrl %0, %2, (%1)\r\n" : "=r"(prev) : "r"(ptr), "r"(value) : "memory");
+		return prev;
+#else
+		uint32_t prev = *ptr, old;
+		while((old = base::compare_and_swap(ptr, prev, prev + value)) != prev)
+			prev = old;
+		return prev;
+#endif
+	}
+
+	/// @brief Ensure stores done inside a critical section are seen before the store
+	/// that releases it
+	inline void release_barrier()
+	{
+#if defined TARGET_RISCV
+		asm volatile("fence rw, w\r\n" : : : "memory");
+#else
+		// s390 and x86 don't reorder stores with older accesses
+		asm volatile("" : : : "memory");
+#endif
+	}
+
+	/// @brief Ensure accesses done inside a critical section aren't performed before
+	/// the load that saw the lock being given to us
+	inline void acquire_barrier()
+	{
+#if defined TARGET_RISCV
+		asm volatile("fence r, rw\r\n" : : : "memory");
+#else
+		// s390 and x86 don't reorder loads with younger accesses
+		asm volatile("" : : : "memory");
+#endif
+	}
+
+	/// @brief Hint the processor that we're spinning on a lock
+	inline void cpu_relax()
+	{
+#if defined TARGET_X86
+		asm volatile("pause" : : : "memory");
+#else
+		asm volatile("" : : : "memory");
+#endif
+	}
+
+	/// @brief Exponential backoff for lock waiters, so they don't hammer the
+	/// cacheline of the lock while it's owner is trying to release it
+	struct backoff {
+		static constexpr uint32_t max_delay = 1024;
 
+		inline void wait()
+		{
+			for(uint32_t i = 0; i < this->delay; i++)
+				base::cpu_relax();
+			this->spins += this->delay;
+			if(this->delay < base::backoff::max_delay)
+				this->delay <<= 1;
+		}
+
+		uint32_t delay = 1;
+		size_t spins = 0;
+	};
+
+	/// @brief Contention counters of a lock, only updated while the lock is held
+	struct lock_stats {
+		size_t n_acquired = 0; // Times the lock was taken
+		size_t n_contended = 0; // Times the lock had to be waited for
+		size_t n_spins = 0; // Backoff iterations spent waiting
+
+		inline void dump(const char *name) const
+		{
+			kprintf("lock %s: acquired=%u,contended=%u,spins=%u\r\n", name, this->n_acquired, this->n_contended, this->n_spins);
+		}
+	};
+
+	/// @brief Ticket spin lock, waiters are given the lock in the order they arrived
+	struct mutex {
 		mutex(mutex& lhs) = delete;
 		mutex(const mutex& lhs) = delete;
 		mutex(mutex&& lhs) = delete;
 		mutex(const mutex&& lhs) = delete;
-		
+
 		constexpr mutex() = default;
 		~mutex() = default;
 
 		inline bool try_lock()
 		{
-			if(this->_lock == base::mutex::LOCKED)
+			// The lock is free only when there are no tickets given out beyond the
+			// one being served
+			const uint32_t ticket = this->serving;
+			if(base::compare_and_swap(&this->next, ticket, ticket + 1) != ticket)
 				return false;
-			this->_lock = base::mutex::LOCKED;
+			this->stats.n_acquired++;
 			return true;
 		}
 
 		inline void lock()
 		{
-			while(!this->try_lock()) {
+			const uint32_t ticket = base::fetch_add(&this->next, 1);
+			if(this->serving == ticket) {
+				base::acquire_barrier();
+				this->stats.n_acquired++;
+				return;
+			}
+
+			base::backoff backoff;
+			while(this->serving != ticket) {
 				// Loop until mutex is aquired
+				backoff.wait();
+			}
+			base::acquire_barrier();
+			this->stats.n_acquired++;
+			this->stats.n_contended++;
+			this->stats.n_spins += backoff.spins;
+		}
+
+		inline void unlock()
+		{
+			// Only the owner writes to serving, so no atomic operation is needed
+			base::release_barrier();
+			this->serving = this->serving + 1;
+		}
+
+		inline bool is_locked() const
+		{
+			return this->next != this->serving;
+		}
+
+		inline void dump(const char *name) const
+		{
+			this->stats.dump(name);
+		}
+
+		base::atomic_word next = 0; // Next ticket to give out
+		base::atomic_word serving = 0; // Ticket that owns the lock
+		base::lock_stats stats;
+	};
+
+	/// @brief Reader-writer spin lock for read-mostly structures, a waiting writer
+	/// stops new readers from coming in so writers are never starved
+	struct rw_mutex {
+		static constexpr uint32_t WRITER = 0x80000000;
+		static constexpr uint32_t WRITER_WAITING = 0x40000000;
+		static constexpr uint32_t READERS = 0x3FFFFFFF;
+
+		rw_mutex(rw_mutex& lhs) = delete;
+		rw_mutex(const rw_mutex& lhs) = delete;
+		rw_mutex(rw_mutex&& lhs) = delete;
+		rw_mutex(const rw_mutex&& lhs) = delete;
+
+		constexpr rw_mutex() = default;
+		~rw_mutex() = default;
+
+		inline bool try_lock_shared()
+		{
+			const uint32_t cur = this->state;
+			if((cur & (base::rw_mutex::WRITER | base::rw_mutex::WRITER_WAITING)) != 0)
+				return false;
+			return base::compare_and_swap(&this->state, cur, cur + 1) == cur;
+		}
+
+		inline void lock_shared()
+		{
+			if(this->try_lock_shared())
+				return;
+
+			base::backoff backoff;
+			while(!this->try_lock_shared())
+				backoff.wait();
+			this->contended_readers++;
+		}
+
+		inline void unlock_shared()
+		{
+			base::release_barrier();
+			base::fetch_add(&this->state, (uint32_t)-1);
+		}
+
+		inline bool try_lock()
+		{
+			const uint32_t cur = this->state;
+			if((cur & (base::rw_mutex::WRITER | base::rw_mutex::READERS)) != 0)
+				return false;
+			if(base::compare_and_swap(&this->state, cur, base::rw_mutex::WRITER) != cur)
+				return false;
+			this->stats.n_acquired++;
+			return true;
+		}
+
+		inline void lock()
+		{
+			if(this->try_lock())
+				return;
+
+			base::backoff backoff;
+			while(1) {
+				const uint32_t cur = this->state;
+				if((cur & (base::rw_mutex::WRITER | base::rw_mutex::READERS)) == 0) {
+					// Taking the lock clears the waiting flag, other waiting writers
+					// will set it again
+					if(base::compare_and_swap(&this->state, cur, base::rw_mutex::WRITER) == cur)
+						break;
+				} else if((cur & base::rw_mutex::WRITER_WAITING) == 0) {
+					base::compare_and_swap(&this->state, cur, cur | base::rw_mutex::WRITER_WAITING);
+				}
+				backoff.wait();
 			}
+			this->stats.n_acquired++;
+			this->stats.n_contended++;
+			this->stats.n_spins += backoff.spins;
 		}
 
 		inline void unlock()
 		{
-			this->_lock = base::mutex::UNLOCKED;
+			base::release_barrier();
+			uint32_t cur = this->state, old;
+			while((old = base::compare_and_swap(&this->state, cur, cur & ~base::rw_mutex::WRITER)) != cur)
+				cur = old;
+		}
+
+		inline void dump(const char *name) const
+		{
+			this->stats.dump(name);
+			kprintf("lock %s: contended readers=%u\r\n", name, this->contended_readers);
 		}
 
-		atomic_int _lock = base::mutex::UNLOCKED;
+		base::atomic_word state = 0;
+		base::lock_stats stats; // Counters of the writers
+		size_t contended_readers = 0; // Readers may update this concurrently, so it is approximate
 	};
 
 	struct scoped_mutex {
@@ -61,6 +300,50 @@ namespace base {
 
 		base::mutex& lock;
 	};
+
+	/// @brief Holds a reader-writer lock as a reader for the lifetime of the object
+	struct scoped_read_mutex {
+		scoped_read_mutex() = delete;
+		scoped_read_mutex(scoped_read_mutex& lhs) = delete;
+		scoped_read_mutex(const scoped_read_mutex& lhs) = delete;
+		scoped_read_mutex(scoped_read_mutex&& lhs) = delete;
+		scoped_read_mutex(const scoped_read_mutex&& lhs) = delete;
+
+		scoped_read_mutex(base::rw_mutex& _lock)
+			: lock{ _lock }
+		{
+			this->lock.lock_shared();
+		}
+
+		~scoped_read_mutex()
+		{
+			this->lock.unlock_shared();
+		}
+
+		base::rw_mutex& lock;
+	};
+
+	/// @brief Holds a reader-writer lock as a writer for the lifetime of the object
+	struct scoped_write_mutex {
+		scoped_write_mutex() = delete;
+		scoped_write_mutex(scoped_write_mutex& lhs) = delete;
+		scoped_write_mutex(const scoped_write_mutex& lhs) = delete;
+		scoped_write_mutex(scoped_write_mutex&& lhs) = delete;
+		scoped_write_mutex(const scoped_write_mutex&& lhs) = delete;
+
+		scoped_write_mutex(base::rw_mutex& _lock)
+			: lock{ _lock }
+		{
+			this->lock.lock();
+		}
+
+		~scoped_write_mutex()
+		{
+			this->lock.unlock();
+		}
+
+		base::rw_mutex& lock;
+	};
 }
 
 #endif
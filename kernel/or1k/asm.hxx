@@ -3,6 +3,8 @@
 
 #include <types.hxx>
 
+#define MAX_CPUS 1 // Only the boot processor is run
+
 namespace arch_dep {
 	typedef uintptr_t register_t;
 
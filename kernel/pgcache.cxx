@@ -0,0 +1,525 @@
+// pgcache.cxx
+//
+// Cache of the pages of the nodes whose drivers can read at any offset, sits between the
+// virtual disk handles and the drivers so every handle opened on a node shares it's pages
+
+#include <pgcache.hxx>
+#include <storage.hxx>
+#include <real.hxx>
+#include <timeshr.hxx>
+#include <arch/handlers.hxx>
+#include <printf.hxx>
+#include <errcode.hxx>
+
+constinit static storage::global_wrapper<page_cache::table> g_pgcache;
+
+namespace page_cache {
+	static size_t get_bucket(const virtual_disk::node *node, size_t index);
+	static page_cache::page *lookup(const virtual_disk::node *node, size_t index);
+	static void lru_remove(page_cache::page *page);
+	static void lru_push(page_cache::page *page);
+	static void insert(page_cache::page *page);
+	static void unlink(page_cache::page *page);
+	static bool storage_low();
+	static void reclaim(size_t needed, size_t n_force);
+	static int fill(virtual_disk::node& node, size_t index, size_t n_pages);
+	static int read_direct(virtual_disk::node& node, size_t pos, uint8_t *buf, size_t n);
+	static int write_back(page_cache::page *page);
+	static void writeback_fn();
+}
+
+int page_cache::init()
+{
+	auto& cache = *(g_pgcache.operator->());
+	storage::fill(&cache, 0, sizeof(cache));
+	cache.stats.budget = PGCACHE_DEFAULT_BUDGET;
+	return 0;
+}
+
+/// @brief Create the writeback thread, the scheduler must be running
+int page_cache::start_writeback()
+{
+	auto *sys_job = timeshare::get_current_job();
+	auto *task = timeshare::task::create(*sys_job, *"PGWRITER");
+	if(task == nullptr)
+		return error::ALLOCATION;
+	auto *thread = timeshare::thread::create(*sys_job, *task, PGCACHE_WRITEBACK_STACK_SIZE);
+	if(thread == nullptr)
+		return error::ALLOCATION;
+	thread->set_pc((void *)&page_cache::writeback_fn, true);
+	return 0;
+}
+
+static size_t page_cache::get_bucket(const virtual_disk::node *node, size_t index)
+{
+	size_t hash = reinterpret_cast<uintptr_t>(node) >> 4;
+	hash = hash * 31 + index;
+	return hash % PGCACHE_BUCKETS;
+}
+
+/// @brief Find a page, the cache lock must be held
+static page_cache::page *page_cache::lookup(const virtual_disk::node *node, size_t index)
+{
+	auto *page = g_pgcache->buckets[page_cache::get_bucket(node, index)];
+	while(page != nullptr) {
+		if(page->node == node && page->index == index)
+			return page;
+		page = page->hash_next;
+	}
+	return nullptr;
+}
+
+static void page_cache::lru_remove(page_cache::page *page)
+{
+	if(page->lru_prev != nullptr)
+		page->lru_prev->lru_next = page->lru_next;
+	else
+		g_pgcache->lru_head = page->lru_next;
+	if(page->lru_next != nullptr)
+		page->lru_next->lru_prev = page->lru_prev;
+	else
+		g_pgcache->lru_tail = page->lru_prev;
+	page->lru_prev = page->lru_next = nullptr;
+}
+
+static void page_cache::lru_push(page_cache::page *page)
+{
+	page->lru_prev = nullptr;
+	page->lru_next = g_pgcache->lru_head;
+	if(g_pgcache->lru_head != nullptr)
+		g_pgcache->lru_head->lru_prev = page;
+	g_pgcache->lru_head = page;
+	if(g_pgcache->lru_tail == nullptr)
+		g_pgcache->lru_tail = page;
+}
+
+/// @brief Place a page on the hash table and the LRU list, the cache lock must be held
+static void page_cache::insert(page_cache::page *page)
+{
+	auto **bucket = &g_pgcache->buckets[page_cache::get_bucket(page->node, page->index)];
+	page->hash_next = *bucket;
+	*bucket = page;
+	page_cache::lru_push(page);
+	g_pgcache->stats.used_size += sizeof(page_cache::page) + PGCACHE_PAGE_SIZE;
+	g_pgcache->stats.n_pages++;
+}
+
+/// @brief Take a page out of the hash table and the LRU list, the cache lock must be held
+static void page_cache::unlink(page_cache::page *page)
+{
+	auto **link = &g_pgcache->buckets[page_cache::get_bucket(page->node, page->index)];
+	while(*link != page)
+		link = &(*link)->hash_next;
+	*link = page->hash_next;
+	page_cache::lru_remove(page);
+	g_pgcache->stats.used_size -= sizeof(page_cache::page) + PGCACHE_PAGE_SIZE;
+	g_pgcache->stats.n_pages--;
+	if(page->dirty)
+		g_pgcache->stats.n_dirty--;
+}
+
+/// @brief Check if the real storage is running low, it takes the locks of the
+/// regions so the cache lock must not be held
+static bool page_cache::storage_low()
+{
+	real_storage::stats stats;
+	if(real_storage::get_stats(&stats) < 0)
+		return false;
+	return stats.free_size < PGCACHE_MIN_FREE;
+}
+
+/// @brief Drop clean pages from the least recently used end, the cache lock must be held
+/// @param needed Bytes about to be added to the cache, pages are dropped until they fit the budget
+/// @param n_force Pages to drop regardless of the budget, used when the storage runs low
+static void page_cache::reclaim(size_t needed, size_t n_force)
+{
+	auto *page = g_pgcache->lru_tail;
+	bool skipped = false;
+	while(page != nullptr) {
+		if(n_force == 0 && g_pgcache->stats.used_size + needed <= g_pgcache->stats.budget)
+			return;
+		auto *prev = page->lru_prev;
+		if(!page->dirty && !page->busy) {
+			page_cache::unlink(page);
+			storage::free(page);
+			g_pgcache->stats.n_reclaimed++;
+			if(n_force != 0)
+				n_force--;
+		} else {
+			skipped = true;
+		}
+		page = prev;
+	}
+	// What is left is dirty, the writeback thread has to clean it first
+	if(skipped)
+		g_pgcache->pressure = true;
+}
+
+/// @brief Bring consecutive pages of a node into the cache with a single read
+/// @param node The node
+/// @param index First page
+/// @param n_pages Pages to read, the pages already cached are left as they are
+/// @return int Bytes read by the driver, error::ALLOCATION if the first page couldn't be cached
+static int page_cache::fill(virtual_disk::node& node, size_t index, size_t n_pages)
+{
+	auto *scratch = storage::alloc<uint8_t>(n_pages * PGCACHE_PAGE_SIZE);
+	if(scratch == nullptr)
+		return error::ALLOCATION;
+	const int r = node.driver->read_at(node, index * PGCACHE_PAGE_SIZE, scratch, n_pages * PGCACHE_PAGE_SIZE);
+	if(r < 0) {
+		storage::free(scratch);
+		return r;
+	}
+
+	// A short read ends the node, the page holding the end is cached too (even if
+	// empty) so reads at the end don't go to the driver again
+	size_t n_filled = static_cast<size_t>(r) / PGCACHE_PAGE_SIZE + 1;
+	if(n_filled > n_pages)
+		n_filled = n_pages;
+	const bool low = page_cache::storage_low();
+
+	bool cached = false;
+	g_pgcache->lock.lock();
+	page_cache::reclaim(n_filled * (sizeof(page_cache::page) + PGCACHE_PAGE_SIZE), low ? n_filled : 0);
+	for(size_t i = 0; i < n_filled; i++) {
+		// Someone else may have cached it while we were reading
+		if(page_cache::lookup(&node, index + i) != nullptr) {
+			cached |= i == 0;
+			continue;
+		}
+
+		auto *page = static_cast<page_cache::page *>(storage::alloc(sizeof(page_cache::page) + PGCACHE_PAGE_SIZE));
+		if(page == nullptr)
+			break;
+		const size_t offset = i * PGCACHE_PAGE_SIZE;
+		page->node = &node;
+		page->index = index + i;
+		page->size = static_cast<size_t>(r) - offset < PGCACHE_PAGE_SIZE ? static_cast<size_t>(r) - offset : PGCACHE_PAGE_SIZE;
+		page->dirty = page->busy = false;
+		storage::copy(page->data(), &scratch[offset], page->size);
+		page_cache::insert(page);
+		cached |= i == 0;
+	}
+	const bool pressure = g_pgcache->pressure;
+	g_pgcache->lock.unlock();
+	storage::free(scratch);
+
+	if(pressure)
+		timeshare::wakeup(g_pgcache.operator->());
+	return cached ? r : error::ALLOCATION;
+}
+
+/// @brief Read a range of a node around the cache, the pages cached dirty (or being
+/// written back) are newer than what the driver has so they're copied over it
+/// @return int Bytes read by the driver, negative is error
+static int page_cache::read_direct(virtual_disk::node& node, size_t pos, uint8_t *buf, size_t n)
+{
+	const int r = node.driver->read_at(node, pos, buf, n);
+	if(r <= 0)
+		return r;
+
+	const size_t index = pos / PGCACHE_PAGE_SIZE;
+	g_pgcache->lock.lock();
+	for(size_t offset = 0; offset < static_cast<size_t>(r); offset += PGCACHE_PAGE_SIZE) {
+		auto *page = page_cache::lookup(&node, index + offset / PGCACHE_PAGE_SIZE);
+		if(page == nullptr || !(page->dirty || page->busy))
+			continue;
+		const size_t left = static_cast<size_t>(r) - offset;
+		storage::copy(&buf[offset], page->data(), page->size < left ? page->size : left);
+	}
+	g_pgcache->lock.unlock();
+	return r;
+}
+
+/// @brief Read a range of a node thru the cache, the large misses starting on a page
+/// are read around it (see PGCACHE_DIRECT_SIZE)
+/// @param node The node, it's driver must have read_at
+/// @param pos Offset to read from
+/// @param buf Buffer to read into
+/// @param n Bytes to read
+/// @return int Bytes read, less than n at the end of the node, negative is error
+int page_cache::read(virtual_disk::node& node, size_t pos, void *buf, size_t n)
+{
+	// Pages filled by this call aren't counted as hits when copied out
+	size_t fill_start = 0, fill_end = 0;
+	size_t done = 0;
+	while(done < n) {
+		const size_t cur = pos + done;
+		const size_t index = cur / PGCACHE_PAGE_SIZE;
+		const size_t in_page = cur % PGCACHE_PAGE_SIZE;
+
+		g_pgcache->lock.lock();
+		auto *page = page_cache::lookup(&node, index);
+		if(page != nullptr) {
+			size_t len = page->size > in_page ? page->size - in_page : 0;
+			if(len > n - done)
+				len = n - done;
+			storage::copy(reinterpret_cast<uint8_t *>(buf) + done, page->data() + in_page, len);
+			page_cache::lru_remove(page);
+			page_cache::lru_push(page);
+			if(index < fill_start || index >= fill_end) {
+				g_pgcache->stats.n_hits++;
+				node.n_page_hits++;
+			}
+			const bool at_end = page->size < PGCACHE_PAGE_SIZE && in_page + len >= page->size;
+			g_pgcache->lock.unlock();
+			done += len;
+			if(at_end)
+				break;
+			continue;
+		}
+
+		if(in_page == 0 && n - done >= PGCACHE_DIRECT_SIZE) {
+			// Large reads go straight into the caller's buffer so the data is moved only
+			// once, and they don't push the pages read by everyone else out of the cache
+			g_pgcache->stats.n_direct++;
+			g_pgcache->lock.unlock();
+			const size_t len = (n - done) & ~static_cast<size_t>(PGCACHE_PAGE_SIZE - 1);
+			const int r = page_cache::read_direct(node, cur, reinterpret_cast<uint8_t *>(buf) + done, len);
+			if(r < 0)
+				return done != 0 ? static_cast<int>(done) : r;
+			done += static_cast<size_t>(r);
+			if(static_cast<size_t>(r) < len)
+				break;
+			continue;
+		}
+
+		// Read the pages covering the rest of the request at once
+		size_t n_pages = (in_page + (n - done) + PGCACHE_PAGE_SIZE - 1) / PGCACHE_PAGE_SIZE;
+		if(n_pages > PGCACHE_CLUSTER)
+			n_pages = PGCACHE_CLUSTER;
+		g_pgcache->stats.n_misses += n_pages;
+		node.n_page_misses += n_pages;
+		g_pgcache->lock.unlock();
+
+		int r = page_cache::fill(node, index, n_pages);
+		if(r == error::ALLOCATION) {
+			// No storage for the pages, read around the cache
+			r = node.driver->read_at(node, cur, reinterpret_cast<uint8_t *>(buf) + done, n - done);
+			if(r > 0)
+				done += static_cast<size_t>(r);
+			else if(r < 0 && done == 0)
+				return r;
+			break;
+		} else if(r < 0) {
+			return done != 0 ? static_cast<int>(done) : r;
+		}
+		fill_start = index;
+		fill_end = index + n_pages;
+	}
+	return static_cast<int>(done);
+}
+
+/// @brief Write a range of a node into the cache, the pages are written to the driver
+/// by the writeback thread or when the node is flushed
+/// @param node The node, it's driver must have read_at and write_at
+/// @param pos Offset to write to
+/// @param buf Data to write
+/// @param n Bytes to write
+/// @return int Bytes written, negative is error
+int page_cache::write(virtual_disk::node& node, size_t pos, const void *buf, size_t n)
+{
+	bool wake = false;
+	size_t done = 0;
+	while(done < n) {
+		const size_t cur = pos + done;
+		const size_t index = cur / PGCACHE_PAGE_SIZE;
+		const size_t in_page = cur % PGCACHE_PAGE_SIZE;
+		const size_t len = PGCACHE_PAGE_SIZE - in_page < n - done ? PGCACHE_PAGE_SIZE - in_page : n - done;
+		const auto *src = reinterpret_cast<const uint8_t *>(buf) + done;
+
+		g_pgcache->lock.lock();
+		auto *page = page_cache::lookup(&node, index);
+		if(page == nullptr && len < PGCACHE_PAGE_SIZE) {
+			// Partially written, the rest of the page must come from the driver
+			g_pgcache->lock.unlock();
+			const int r = page_cache::fill(node, index, 1);
+			if(r < 0 && r != error::ALLOCATION)
+				return done != 0 ? static_cast<int>(done) : r;
+			g_pgcache->lock.lock();
+			page = page_cache::lookup(&node, index);
+		}
+		if(page == nullptr) {
+			page = static_cast<page_cache::page *>(storage::alloc(sizeof(page_cache::page) + PGCACHE_PAGE_SIZE));
+			if(page == nullptr) {
+				// No storage for the page, write around the cache
+				g_pgcache->lock.unlock();
+				const int r = node.driver->write_at(node, cur, src, len);
+				if(r < 0)
+					return done != 0 ? static_cast<int>(done) : r;
+				done += static_cast<size_t>(r);
+				if(static_cast<size_t>(r) < len)
+					break;
+				continue;
+			}
+			page->node = &node;
+			page->index = index;
+			page->size = 0;
+			page->dirty = page->busy = false;
+			page_cache::insert(page);
+		}
+
+		// Writing past the end of the node leaves a hole of zeroes
+		if(in_page > page->size)
+			storage::fill(page->data() + page->size, 0, in_page - page->size);
+		storage::copy(page->data() + in_page, src, len);
+		if(in_page + len > page->size)
+			page->size = in_page + len;
+		if(!page->dirty) {
+			page->dirty = true;
+			g_pgcache->stats.n_dirty++;
+		}
+		page_cache::lru_remove(page);
+		page_cache::lru_push(page);
+		wake |= g_pgcache->stats.n_dirty >= PGCACHE_DIRTY_HIGH;
+		g_pgcache->lock.unlock();
+		done += len;
+	}
+
+	if(wake)
+		timeshare::wakeup(g_pgcache.operator->());
+	return static_cast<int>(done);
+}
+
+/// @brief Write a dirty page to the driver, the cache lock must not be held since this
+/// waits for the device
+static int page_cache::write_back(page_cache::page *page)
+{
+	auto *driver = page->node->driver;
+	if(driver == nullptr || driver->write_at == nullptr)
+		return error::INVALID_SETUP;
+	return driver->write_at(*page->node, page->index * PGCACHE_PAGE_SIZE, page->data(), page->size);
+}
+
+/// @brief Write the dirty pages of a node
+/// @param node The node, nullptr for every node
+/// @return int Return code of the failed write, 0 if all succeeded
+int page_cache::flush(virtual_disk::node *node)
+{
+	int r = 0;
+	g_pgcache->lock.lock();
+	auto *page = g_pgcache->lru_head;
+	while(page != nullptr) {
+		if(page->dirty && !page->busy && (node == nullptr || page->node == node)) {
+			// Cleared first, a write done while we wait for the device dirties it again
+			page->dirty = false;
+			g_pgcache->stats.n_dirty--;
+			// Stays on the cache, but can't be reclaimed while we're unlocked
+			page->busy = true;
+			g_pgcache->lock.unlock();
+			const int wr = page_cache::write_back(page);
+			g_pgcache->lock.lock();
+			page->busy = false;
+			if(wr >= 0 && static_cast<size_t>(wr) < page->size) {
+				// The driver can't grow the node, what it didn't take is dropped so the
+				// page matches the node, unless it was written again meanwhile
+				if(!page->dirty)
+					page->size = static_cast<size_t>(wr);
+				r = error::RESOURCE_UNAVAILABLE;
+			} else if(wr < 0) {
+				// Kept dirty, the next flush retries it
+				if(!page->dirty) {
+					page->dirty = true;
+					g_pgcache->stats.n_dirty++;
+				}
+				r = wr;
+				break;
+			}
+			g_pgcache->stats.n_write_backs++;
+			// The list may have changed while unlocked, start over
+			page = g_pgcache->lru_head;
+			continue;
+		}
+		page = page->lru_next;
+	}
+	if(r == 0 && node == nullptr)
+		g_pgcache->pressure = false;
+	g_pgcache->lock.unlock();
+	return r;
+}
+
+/// @brief Drop every page of a node, called before the node is destroyed
+void page_cache::invalidate(virtual_disk::node& node)
+{
+	page_cache::flush(&node);
+	g_pgcache->lock.lock();
+	auto *page = g_pgcache->lru_head;
+	while(page != nullptr) {
+		auto *next = page->lru_next;
+		if(page->node == &node && !page->busy) {
+			page_cache::unlink(page);
+			storage::free(page);
+		}
+		page = next;
+	}
+	g_pgcache->lock.unlock();
+}
+
+int page_cache::set_budget(size_t budget)
+{
+	g_pgcache->lock.lock();
+	g_pgcache->stats.budget = budget;
+	page_cache::reclaim(0, 0);
+	const bool pressure = g_pgcache->pressure;
+	g_pgcache->lock.unlock();
+	if(pressure)
+		timeshare::wakeup(g_pgcache.operator->());
+	return 0;
+}
+
+/// @brief Obtain the stats of the cache
+/// @param node Node whose hits and misses are also wanted, may be nullptr
+void page_cache::get_stats(virtual_disk::node *node, page_cache::stats *stats)
+{
+	g_pgcache->lock.lock();
+	*stats = g_pgcache->stats;
+	if(node != nullptr) {
+		stats->node_hits = node->n_page_hits;
+		stats->node_misses = node->n_page_misses;
+	}
+	g_pgcache->lock.unlock();
+}
+
+int page_cache::ioctl(virtual_disk::handle& hdl, int cmd, va_list args)
+{
+	switch(cmd) {
+	case VDISK_IOCTL_PAGE_CACHE_STATS: {
+		auto *stats = va_arg(args, page_cache::stats *);
+		if(stats == nullptr)
+			return error::INVALID_PARAM;
+		page_cache::get_stats(hdl.node, stats);
+	} break;
+	case VDISK_IOCTL_PAGE_CACHE_SET_BUDGET:
+		return page_cache::set_budget(va_arg(args, size_t));
+	default:
+		return error::INVALID_PARAM;
+	}
+	return 0;
+}
+
+static void page_cache::writeback_fn()
+{
+	while(1) {
+		timeshare::prepare_sleep(g_pgcache.operator->());
+		if(g_pgcache->stats.n_dirty < PGCACHE_DIRTY_HIGH && !g_pgcache->pressure) {
+			io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+			timeshare::finish_sleep();
+			continue;
+		}
+		timeshare::finish_sleep();
+
+		// Interrupts stay disabled while the cache lock may be held, so a program
+		// entering the kernel never spins on a lock owned by a preempted writer, the
+		// thread gives up the CPU while it waits for the device
+		timeshare::disable();
+		const bool pressure = g_pgcache->pressure;
+		page_cache::flush(nullptr);
+		if(pressure) {
+			// The pages just cleaned are what couldn't be reclaimed before
+			g_pgcache->lock.lock();
+			page_cache::reclaim(0, PGCACHE_CLUSTER);
+			g_pgcache->lock.unlock();
+		}
+		timeshare::enable();
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef PAGE_CACHE_HXX
+#define PAGE_CACHE_HXX
+
+#include <stdarg.h>
+#include <types.hxx>
+#include <mutex.hxx>
+#include <vdisk.hxx>
+
+#define PGCACHE_PAGE_SIZE 4096
+#define PGCACHE_BUCKETS 128 // Buckets of the page hash table
+#define PGCACHE_DEFAULT_BUDGET (1024 * 1024) // Storage the cached pages may use
+#define PGCACHE_MIN_FREE (256 * 1024) // Real storage kept free, pages are reclaimed below it
+#define PGCACHE_CLUSTER 8 // Pages read from the driver at once on a miss
+#define PGCACHE_DIRECT_SIZE (PGCACHE_CLUSTER * PGCACHE_PAGE_SIZE) // Page aligned misses this large skip the cache
+#define PGCACHE_DIRTY_HIGH 16 // Dirty pages that wake up the writeback thread
+#define PGCACHE_WRITEBACK_STACK_SIZE 8192
+
+namespace page_cache {
+	/// @brief A page of a node, keyed by the node and the offset of the page within it,
+	/// the data of the page follows this header
+	struct page {
+		page& operator=(page&) = delete;
+		const page& operator=(const page&) = delete;
+
+		inline uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+		page_cache::page *hash_next;
+		page_cache::page *lru_prev; // Towards the most recently used
+		page_cache::page *lru_next; // Towards the least recently used
+		virtual_disk::node *node;
+		size_t index; // Offset of the page within the node divided by the page size
+		size_t size; // Valid bytes, only the last page of a node has less than a page
+		bool dirty;
+		bool busy; // Being written back, can't be reclaimed
+	};
+
+	struct stats {
+		size_t n_hits = 0;
+		size_t n_misses = 0;
+		size_t n_reclaimed = 0; // Pages dropped to stay within the budget or the free storage
+		size_t n_write_backs = 0;
+		size_t n_direct = 0; // Large reads that went straight into the caller's buffer
+		size_t n_pages = 0;
+		size_t n_dirty = 0;
+		size_t used_size = 0;
+		size_t budget = 0;
+		// Of the node the stats were asked on
+		size_t node_hits = 0;
+		size_t node_misses = 0;
+	};
+
+	struct table {
+		page_cache::page *buckets[PGCACHE_BUCKETS];
+		page_cache::page *lru_head; // Most recently used
+		page_cache::page *lru_tail; // Least recently used
+		page_cache::stats stats;
+		bool pressure; // Storage ran low and only dirty pages were left to reclaim
+		base::mutex lock;
+	};
+
+	int init();
+	int start_writeback();
+	int read(virtual_disk::node& node, size_t pos, void *buf, size_t n);
+	int write(virtual_disk::node& node, size_t pos, const void *buf, size_t n);
+	int flush(virtual_disk::node *node);
+	void invalidate(virtual_disk::node& node);
+	int set_budget(size_t budget);
+	void get_stats(virtual_disk::node *node, page_cache::stats *stats);
+	int ioctl(virtual_disk::handle& hdl, int cmd, va_list args);
+}
+
+#endif
@@ -1,10 +1,39 @@
 #include <types.hxx>
 #include <real.hxx>
 #include <storage.hxx>
+#ifdef TARGET_S390
+#	include <s390/smp.hxx>
+#endif
 
 extern uint8_t heap_start[];
 constinit static storage::global_wrapper<real_storage::table> g_real_storage_regions;
 
+namespace real_storage {
+	static inline size_t get_free_list(size_t size);
+	static inline size_t get_block_size(size_t size);
+	static inline size_t get_block_align(size_t align);
+	static inline uintptr_t block_fit(const real_storage::block& block, size_t size, size_t align);
+	static void block_insert(real_storage::region& region, real_storage::block& block);
+	static void block_remove(real_storage::region& region, real_storage::block& block);
+	static real_storage::block *block_carve(real_storage::region& region, real_storage::block& block, uintptr_t data, size_t size);
+	static void block_release(real_storage::region& region, real_storage::block *block);
+	static void *region_alloc(real_storage::region& region, size_t size, size_t align);
+	static bool region_free(real_storage::region& region, void *ptr);
+	static inline real_storage::region *get_region(const void *ptr);
+	static inline real_storage::slab *get_slab(const void *ptr);
+	static inline size_t get_slab_class(size_t size, size_t align);
+	static real_storage::slab *slab_create(size_t size_class);
+	static size_t slab_alloc(size_t size_class, void **objs, size_t n);
+	static void slab_put(real_storage::slab_class& sc, real_storage::slab& slab, void *ptr);
+	static void slab_free(real_storage::slab& slab, void *ptr);
+	static void slab_free(size_t size_class, void *const *objs, size_t n);
+	static inline unsigned int get_cpu();
+	static real_storage::cpu_cache *get_cpu_cache();
+	static void *cache_alloc(size_t size_class);
+	static void cache_free(real_storage::slab& slab, void *ptr);
+	static bool cache_drain();
+}
+
 /// @brief (WIP) Obtains the total real storage size
 /// @todo Maybe create a map (i.e non-contigous real storage) instead of assuming contiguity
 /// @return size_t The total real storage size
@@ -78,6 +107,22 @@ int real_storage::init()
 
 	for(size_t i = 0; i < PMM_TEST_NPTR; i++) // Free the allocated ptrs for the testing
 		real_storage::free(ptrs[i]);
+
+	debug_printf("Slab allocation, every size class");
+	for(size_t i = 0; i < PMM_TEST_NPTR; i++) {
+		const size_t size = (size_t)1 << (PMM_SLAB_MIN_SHIFT + (i % PMM_SLAB_CLASSES));
+		ptrs[i] = real_storage::alloc(size, 0);
+		debug_assert(real_storage::get_slab(ptrs[i]) != nullptr);
+		debug_assert((uintptr_t)ptrs[i] % size == 0);
+		storage::fill(ptrs[i], static_cast<char>(i), size);
+	}
+	for(size_t i = 0; i < PMM_TEST_NPTR; i++) {
+		const size_t size = (size_t)1 << (PMM_SLAB_MIN_SHIFT + (i % PMM_SLAB_CLASSES));
+		volatile const uint8_t *u8_ptr = (volatile const uint8_t *)ptrs[i];
+		for(size_t j = 0; j < size; j++)
+			debug_assert(u8_ptr[j] == static_cast<uint8_t>(i));
+		real_storage::free(ptrs[i]);
+	}
 	debug_printf("RealAlloc: reliable");
 #endif
 	return 0;
@@ -89,56 +134,52 @@ void real_storage::check_heap()
 {
 	for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
 		const auto *region = &g_real_storage_regions->regions[i];
-		const auto *block = region->head;
-		size_t size = 0, free = 0, used = 0;
-		// Used for printing sequences of blocks instead of printing every one of them
-		// individually - thus not spamming the entire screen with repeated info
-		size_t last_cnt = 1, last_size = 0;
-		auto last_flags = real_storage::block::NOT_PRESENT;
+		auto *block = region->head;
+		size_t size = 0, free = 0, used = 0, n_blocks = 0;
+		bool prev_free = false;
 
 		if(region->head == nullptr || region->flags != real_storage::region::PUBLIC) continue;
 
-		/* Present regions have to have correct values */
-		debug_assert(region->head != nullptr);
-		size_t n_blocks = region->head->size / sizeof(real_storage::block);
-
-		debug_printf("Check region %u (%u blocks)", i, n_blocks);
-		auto current_ptr = reinterpret_cast<uintptr_t>(region->base);
-		while(block != nullptr) {
-			/* Block can't be bigger than the region */
-			debug_assert(block->size <= region->size - (size_t)(current_ptr - (uintptr_t)region->base));
+		// The walk ends on the fence, the only block with a size of 0
+		while(block->get_size() != 0) {
 			/* Blocks can't be outside the region */
-			debug_assert((uintptr_t)block >= (uintptr_t)region->base && (uintptr_t)block < (uintptr_t)region->base + region->size);
-
-			size += block->size;
-			if(block->flags == real_storage::block::FREE) {
-				free += block->size;
-			} else if(block->flags == real_storage::block::USED) {
-				used += block->size;
-			}
-
-			if(last_flags == block->flags) {
-				last_size += block->size;
-				last_cnt++;
+			debug_assert((uintptr_t)block >= (uintptr_t)region->base && (uintptr_t)block + block->get_size() < (uintptr_t)region->base + region->size);
+			debug_assert(block->get_size() >= sizeof(real_storage::block) && block->get_size() % PMM_BLOCK_GRANULE == 0);
+			/* The tag of the previous block must match it */
+			debug_assert(block->is_prev_free() == prev_free);
+			if(prev_free)
+				debug_assertm(!block->is_free(), "Adjacent free blocks");
+
+			size += block->get_size();
+			if(block->is_free()) {
+				free += block->get_size();
+				debug_assert(block->get_next()->prev_size == block->get_size());
 			} else {
-				last_flags = block->flags;
-				last_size = block->size;
-				last_cnt = 1;
+				used += block->get_size();
 			}
-
 #if defined DEBUG_PMM
-			debug_printf("%s (%zuB @ %p) %p -> %p", (block->flags == real_storage::block::FREE) ? "Free" : "Used", block->size, (void *)current_ptr, block, block->next);
+			debug_printf("%s (%zuB @ %p)", block->is_free() ? "Free" : "Used", block->get_size(), block);
 #endif
-			current_ptr += block->size;
-			block = block->next;
-			if(block != nullptr && block == block->next)
-				kpanic("Pointer to self");
+			prev_free = block->is_free();
+			block = block->get_next();
+			n_blocks++;
 		}
-		
-		if(size != region->size)
-			kpanic("Size %u, however it should be %u", size, region->size);
+		debug_assert(block->is_prev_free() == prev_free);
+
+		// Every free block must be on the list of it's size
+		size_t listed = 0;
+		for(size_t j = 0; j < PMM_FREE_LISTS; j++) {
+			for(const auto *fblock = region->free_lists[j]; fblock != nullptr; fblock = fblock->next_free) {
+				debug_assert(fblock->is_free() && real_storage::get_free_list(fblock->get_size()) == j);
+				debug_assert(fblock->next_free == nullptr || fblock->next_free->prev_free == fblock);
+				listed += fblock->get_size();
+			}
+		}
+
+		if(free != region->free_size || listed != free)
+			kpanic("Free %u, listed %u, however it should be %u", free, listed, region->free_size);
 		debug_assert(size == free + used);
-		debug_printf("Storage: %u free, %u used", free, used);
+		debug_printf("Storage: %u blocks, %u free, %u used", n_blocks, free, used);
 	}
 }
 #endif
@@ -159,25 +200,35 @@ real_storage::region *real_storage::region::create(void *base, size_t size)
 		// Region must not be already taken
 		if(region->flags != real_storage::region::NOT_PRESENT) continue;
 
-		// The heap is always created at base for each region
+		// The region is a single free block followed by a fence, a used block of size 0
+		// which stops coalescing from running past the end of the region
+		const auto start = ((uintptr_t)base + PMM_BLOCK_GRANULE - 1) & ~((uintptr_t)PMM_BLOCK_GRANULE - 1);
+		const auto end = (((uintptr_t)base + size) & ~((uintptr_t)PMM_BLOCK_GRANULE - 1)) - PMM_BLOCK_HEADER;
+		if(end <= start || end - start < sizeof(real_storage::block))
+			return nullptr;
+
 		region->base = base;
 		region->size = size;
-		region->head = reinterpret_cast<real_storage::block *>(base);
+		region->free_size = 0;
+		for(size_t j = 0; j < PMM_FREE_LISTS; j++)
+			region->free_lists[j] = nullptr;
+		region->head = reinterpret_cast<real_storage::block *>(start);
+		region->head->prev_size = 0;
+		region->head->size = (end - start) | real_storage::block::FREE;
+		auto *fence = reinterpret_cast<real_storage::block *>(end);
+		fence->prev_size = end - start;
+		fence->size = real_storage::block::USED | real_storage::block::PREV_FREE;
+		real_storage::block_insert(*region, *region->head);
 		region->flags = real_storage::region::PUBLIC;
 
-		size_t n_blocks = (region->size / 8192) + 1;
-		for(size_t j = 0; j < n_blocks; j++)
-			region->head[j].flags = real_storage::block::NOT_PRESENT;
-		region->head[0].size = n_blocks * sizeof(real_storage::block);
-		region->head[0].flags = real_storage::block::USED;
-		region->head[0].next = &region->head[1];
-
-		// Block is created next to the head
-		region->head[1].size = region->size - region->head[0].size;
-		region->head[1].flags = real_storage::block::FREE;
-		region->head[1].next = nullptr;
-
-		debug_assert(region->head[0].size + region->head[1].size == region->size);
+		// Slab descriptors, one per page - if they can't be allocated the region
+		// simply won't back any slab
+		const size_t n_slabs = (region->size / PMM_SLAB_SIZE) + 2;
+		region->slabs = static_cast<real_storage::slab *>(real_storage::region_alloc(*region, sizeof(real_storage::slab) * n_slabs, alignof(real_storage::slab)));
+		if(region->slabs != nullptr) {
+			storage::fill(region->slabs, 0, sizeof(real_storage::slab) * n_slabs);
+			region->n_slabs = n_slabs;
+		}
 		return region;
 	}
 
@@ -192,217 +243,574 @@ void real_storage::region::destroy(real_storage::region *region)
 	region->flags = real_storage::region::NOT_PRESENT;
 }
 
-/// @brief Create a new block on a region, expands the heap if nescesary
-/// @param region Region the block would be in
-/// @param size The size the block represents
-/// @param flags Flags
-/// @param next Next-linked-list block
-/// @return real_storage::block* The new allocated block on the heap, nullptr means failure to allocate
-real_storage::block *real_storage::block::create(real_storage::region *region, size_t size, real_storage::block::flag flags, real_storage::block *next)
-{
-	auto *heap = reinterpret_cast<real_storage::block *>(region->base);
-	real_storage::block *block;
-	
-	size_t n_blocks = region->head->size / sizeof(real_storage::block);
-	for(size_t i = 0; i < n_blocks; i++) {
-		block = &heap[i];
-		if(block->flags != real_storage::block::NOT_PRESENT)
-			continue;
-		goto set_block;
-	}
+/// @brief Obtains the free list that holds blocks of a given size, list n holds the
+/// blocks in the range [2^(n+5), 2^(n+6)) and the last list everything bigger
+/// @param size Size of the block
+/// @return size_t Index of the free list
+static inline size_t real_storage::get_free_list(size_t size)
+{
+	size_t i = 0;
+	for(size >>= 6; size != 0 && i < PMM_FREE_LISTS - 1; size >>= 1)
+		i++;
+	return i;
+}
 
-	if(heap[1].flags != real_storage::block::FREE || heap[1].size < sizeof(real_storage::block) * 32)
-		return nullptr;
+/// @brief Obtains the size of the block needed to hold an allocation
+/// @param size Size of the allocation
+/// @return size_t Size of the block, header included
+static inline size_t real_storage::get_block_size(size_t size)
+{
+	size = (size + PMM_BLOCK_HEADER + PMM_BLOCK_GRANULE - 1) & ~((size_t)PMM_BLOCK_GRANULE - 1);
+	return size < sizeof(real_storage::block) ? sizeof(real_storage::block) : size;
+}
 
-	heap[0].size += sizeof(real_storage::block) * 32;
-	heap[1].size -= sizeof(real_storage::block) * 32;
-	block = &heap[n_blocks];
-	
-	// Set all to zero when expanding to prevent spurious blocks
-	// n_blocks = region->head->size / sizeof(real_storage::block);
-	storage::fill(&heap[n_blocks], 0, sizeof(real_storage::block) * 32);
-set_block:
-	block->flags = flags;
-	block->size = size;
-	block->next = next;
-	return block;
-}
-
-/// @brief Merges various blocks into one by coalscencing them
-/// @todo We should probably make block be a pointer to a pointer and set the resulting block
-/// or return it via the functor
-/// @param prev The block previous to this one, gets invalidated after operation
-/// @param block The block to be merged
-/// @param flags Flags that needs to match to merge
-/// @return real_storage::block * Returned block
-real_storage::block *real_storage::block::merge(real_storage::block *prev, real_storage::block *block, real_storage::block::flag flags)
-{
-	debug_assert(block != nullptr);
-
-	// Coalescence behind
-	if(prev != nullptr && prev->flags == flags) {
-		block->flags = real_storage::block::NOT_PRESENT;
-		prev->size += block->size;
-		prev->next = block->next;
-		block = prev;
-		debug_assert(block != nullptr);
-		// prev is now invalidated
-	}
+/// @brief Obtains the alignment data of a block has to follow, blocks are always placed
+/// at multiples of the granule so the least common multiple of both is used
+/// @param align Alignment requested by the caller, 0 means none
+/// @return size_t The alignment to place the data at
+static inline size_t real_storage::get_block_align(size_t align)
+{
+	if(align <= 1)
+		return PMM_BLOCK_GRANULE;
+	size_t gcd = align & (~align + 1); // Lowest set bit
+	if(gcd > PMM_BLOCK_GRANULE)
+		gcd = PMM_BLOCK_GRANULE;
+	return (align / gcd) * PMM_BLOCK_GRANULE;
+}
 
-	// Coalescence after
-	while(block != nullptr && block->next != nullptr && block->next->flags == flags) {
-		block->next->flags = real_storage::block::NOT_PRESENT;
-		block->size += block->next->size;
-		block->next = block->next->next;
-		block = block->next; // Continue to next block (probably a multi-merge?)
+/// @brief Checks if a free block can hold an allocation
+/// @param block The free block
+/// @param size Size of the block needed
+/// @param align Alignment of the data, as given by get_block_align
+/// @return uintptr_t Where the data would be placed, 0 if the block can't hold it
+static inline uintptr_t real_storage::block_fit(const real_storage::block& block, size_t size, size_t align)
+{
+	const auto start = (uintptr_t)&block + PMM_BLOCK_HEADER;
+	auto data = start;
+	if(align > PMM_BLOCK_GRANULE) {
+		data += (align - (data % align)) % align;
+		// The storage left behind has to be able to form a block on it's own
+		while(data != start && data - start < sizeof(real_storage::block))
+			data += align;
 	}
-	return block;
+	if(data - PMM_BLOCK_HEADER + size > (uintptr_t)&block + block.get_size())
+		return 0;
+	return data;
 }
 
-/// @brief Allocate a piece of storage/memory
-/// @param size The size to allocate. It's the caller's responsability to assert this is a non-zero value
-/// @param align Alignment required for allocation, a 0 means "up to the manager/no alignment required"
-/// @return void* The pointer to the storage area
-void *real_storage::alloc(size_t size, size_t align)
+/// @brief Marks a block as free and puts it on it's free list, the tag of the following
+/// block is updated as well
+/// @param region Region the block belongs to
+/// @param block The block
+static void real_storage::block_insert(real_storage::region& region, real_storage::block& block)
 {
-	debug_assert(size != 0);
-	debug_printf("alloc size=%u,align=%u", size, align);
-	for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
-		auto *region = &g_real_storage_regions->regions[i];
-		const base::scoped_mutex lock1(region->lock);
-		if(region->flags != real_storage::region::PUBLIC)
-			continue;
-		
-		// Some allocations can be extremely big - in such case it isn't worth the effort to iterate
-		// everything when the region itself is known to not be able to hold such storage
-		if(size > region->size) continue;
+	const size_t size = block.get_size();
+	block.size = size | real_storage::block::FREE | (block.size & real_storage::block::PREV_FREE);
+	auto *next = block.get_next();
+	next->prev_size = size;
+	next->size |= real_storage::block::PREV_FREE;
+
+	auto& list = region.free_lists[real_storage::get_free_list(size)];
+	block.prev_free = nullptr;
+	block.next_free = list;
+	if(list != nullptr)
+		list->prev_free = &block;
+	list = &block;
+	region.free_size += size;
+}
 
-		auto *block = region->head;
-		uintptr_t current_ptr = reinterpret_cast<uintptr_t>(region->base);
-		while(block != nullptr) {
-			size_t left_size, right_size;
-			// Block can't be bigger than the region
-			debug_assert(block->size <= region->size - (size_t)(current_ptr - (uintptr_t)region->base));
-			// Blocks can't be outside the region
-			debug_assert((uintptr_t)block >= (uintptr_t)region->base && (uintptr_t)block < (uintptr_t)region->base + region->size);
-
-			// Check that the block is not used
-			if(block->flags == real_storage::block::USED)
-				goto next_block;
-
-			// Check that the block is big enough to hold our aligned object
-			// (if there is any align of course)
-			if((align && (uintptr_t)block->size < size + (current_ptr % align)) || (block->size < size))
-				goto next_block;
-
-			// Create a remaining "free" block
-			if(align) {
-				uintptr_t left_size_ptr = (current_ptr + block->size - size) - ((current_ptr + block->size - size) % align) - current_ptr;
-				left_size = (size_t)left_size_ptr;
-				debug_assert((uintptr_t)left_size == left_size_ptr); // Make sure no data was lost
-			}
-			// No alignment - so only size is took in account
-			else {
-				debug_assert(block->size >= size);
-				left_size = block->size - size;
-			}
+/// @brief Takes a free block out of it's free list, the block is still marked as free
+/// @param region Region the block belongs to
+/// @param block The block
+static void real_storage::block_remove(real_storage::region& region, real_storage::block& block)
+{
+	debug_assert(block.is_free());
+	if(block.prev_free != nullptr)
+		block.prev_free->next_free = block.next_free;
+	else
+		region.free_lists[real_storage::get_free_list(block.get_size())] = block.next_free;
+	if(block.next_free != nullptr)
+		block.next_free->prev_free = block.prev_free;
+	region.free_size -= block.get_size();
+}
 
-			// Create a block on the left (previous) to this block
-			if(left_size) {
-				size_t next_size = block->size - left_size;
-				block->size = left_size;
-				block->flags = real_storage::block::FREE;
-				block->next = real_storage::block::create(region, next_size, real_storage::block::USED, block->next);
-				debug_assert(block != block->next && block->next != block->next->next);
-				block = block->next;
-				current_ptr += (uintptr_t)left_size; // Update pointer
-			}
+/// @brief Cuts an used block out of a free block, the storage left before and after
+/// it is given back to the free lists
+/// @param region Region the block belongs to
+/// @param block The free block
+/// @param data Where the data of the used block goes, as given by block_fit
+/// @param size Size of the used block
+/// @return real_storage::block* The used block
+static real_storage::block *real_storage::block_carve(real_storage::region& region, real_storage::block& block, uintptr_t data, size_t size)
+{
+	real_storage::block_remove(region, block);
+	size_t left = block.get_size();
+	auto *used = real_storage::block::from_data(reinterpret_cast<void *>(data));
+	size_t flags = block.size & real_storage::block::PREV_FREE;
+
+	// Storage skipped to align the data
+	const size_t lead = (size_t)((uintptr_t)used - (uintptr_t)&block);
+	if(lead) {
+		block.size = lead;
+		real_storage::block_insert(region, block);
+		left -= lead;
+		flags = real_storage::block::PREV_FREE;
+	}
 
-			// It must be aligned by now, otherwise the algorithm is faulty.
-			if(align)
-				debug_assert(current_ptr % align == 0);
-
-			// Create a block on the right (next) to this block if there are any
-			// remaining bytes.
-			right_size = block->size - size;
-			if(right_size) {
-				block->next = real_storage::block::create(region, right_size, real_storage::block::FREE, block->next);
-				block->size -= right_size;
-			}
+	// Remaining storage after the data
+	if(left - size >= sizeof(real_storage::block)) {
+		used->size = size | flags;
+		auto *tail = used->get_next();
+		tail->size = left - size;
+		real_storage::block_insert(region, *tail);
+	} else {
+		used->size = left | flags;
+		used->get_next()->size &= ~real_storage::block::PREV_FREE;
+	}
+	return used;
+}
+
+/// @brief Gives a used block back to the free lists, coalescing it with it's neighbours
+/// @param region Region the block belongs to
+/// @param block The block
+static void real_storage::block_release(real_storage::region& region, real_storage::block *block)
+{
+	debug_assertm(!block->is_free(), "Double free");
+	auto *next = block->get_next();
+	if(next->is_free()) {
+		real_storage::block_remove(region, *next);
+		block->size += next->get_size();
+	}
+	if(block->is_prev_free()) {
+		auto *prev = block->get_prev();
+		real_storage::block_remove(region, *prev);
+		prev->size += block->get_size();
+		block = prev;
+	}
+	real_storage::block_insert(region, *block);
+}
 
-			block->flags = real_storage::block::USED;
-			debug_printf("alloc %zuB (align %u) @ %p,lsize=%u,rsize=%u", size, align, (void *)current_ptr, left_size, right_size);
+/// @brief Allocate storage from the free lists of a single region, the caller must
+/// hold the lock of the region
+/// @param region Region to allocate from
+/// @param size The size to allocate
+/// @param align Alignment required for allocation
+/// @return void* The pointer to the storage area, nullptr if the region can't hold it
+static void *real_storage::region_alloc(real_storage::region& region, size_t size, size_t align)
+{
+	// Some allocations can be extremely big - in such case it isn't worth the effort to iterate
+	// everything when the region itself is known to not be able to hold such storage
+	if(size > region.free_size) return nullptr;
+
+	const size_t block_size = real_storage::get_block_size(size);
+	const size_t block_align = real_storage::get_block_align(align);
+	// The first list may hold blocks smaller than what we want, the ones after it
+	// only hold bigger ones so the first block found there will do unless it has to
+	// give up storage for the alignment
+	for(size_t i = real_storage::get_free_list(block_size); i < PMM_FREE_LISTS; i++) {
+		for(auto *block = region.free_lists[i]; block != nullptr; block = block->next_free) {
+			const auto data = real_storage::block_fit(*block, block_size, block_align);
+			if(data == 0)
+				continue;
+
+			real_storage::block_carve(region, *block, data, block_size);
+			debug_printf("alloc %zuB (align %u) @ %p", size, align, (void *)data);
+			if(align)
+				debug_assert(data % align == 0);
 #if defined DEBUG
 			real_storage::check_heap();
 #endif
-			return (void *)current_ptr;
-		next_block:
-			current_ptr += block->size;
-			block = block->next;
+			return (void *)data;
 		}
 	}
+	return nullptr;
+}
 
-	debug_printf("Can't alloc %zuB (align %u)", size, align);
+/// @brief Free a block of a single region, the caller must hold the lock of the region
+/// @param region Region the pointer belongs to
+/// @param ptr The pointer to free up
+/// @return bool Whetever the block was found on the region
+static bool real_storage::region_free(real_storage::region& region, void *ptr)
+{
+	if((uintptr_t)ptr % PMM_BLOCK_GRANULE != 0 || (uintptr_t)ptr < (uintptr_t)region.head + PMM_BLOCK_HEADER) {
+		debug_printf("Block %p not found", ptr);
+		return false;
+	}
+
+	real_storage::block_release(region, real_storage::block::from_data(ptr));
 #if defined DEBUG
 	real_storage::check_heap();
 #endif
+	return true;
+}
+
+/// @brief Obtain the region a pointer belongs to
+/// @param ptr The pointer
+/// @return real_storage::region* The region, nullptr if it isn't managed by us
+static inline real_storage::region *real_storage::get_region(const void *ptr)
+{
+	for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
+		auto *region = &g_real_storage_regions->regions[i];
+		if(region->flags != real_storage::region::PUBLIC)
+			continue;
+		if((uintptr_t)ptr >= (uintptr_t)region->base && (uintptr_t)ptr < (uintptr_t)region->base + region->size)
+			return region;
+	}
 	return nullptr;
 }
 
-/// @brief Free a block of real storage
-/// @param ptr The pointer to free up; Note that it is the caller's responsability to assert that ptr != nullptr 
-void real_storage::free(void *ptr)
+/// @brief Obtain the slab descriptor of an object
+/// @param ptr Pointer to the object
+/// @return real_storage::slab* The slab, nullptr if the pointer wasn't given by a slab
+static inline real_storage::slab *real_storage::get_slab(const void *ptr)
+{
+	const auto *region = real_storage::get_region(ptr);
+	if(region == nullptr || region->slabs == nullptr)
+		return nullptr;
+
+	const auto page_base = (uintptr_t)region->base & ~((uintptr_t)PMM_SLAB_SIZE - 1);
+	const auto idx = (size_t)(((uintptr_t)ptr - page_base) / PMM_SLAB_SIZE);
+	if(idx >= region->n_slabs || region->slabs[idx].flags != real_storage::slab::PRESENT)
+		return nullptr;
+	return &region->slabs[idx];
+}
+
+/// @brief Obtains the size class that can serve an allocation
+/// @param size Size of the allocation
+/// @param align Alignment required, objects are aligned to the size of their class
+/// @return size_t The size class, PMM_SLAB_CLASSES if no class can serve it
+static inline size_t real_storage::get_slab_class(size_t size, size_t align)
+{
+	if(size > ((size_t)1 << PMM_SLAB_MAX_SHIFT))
+		return PMM_SLAB_CLASSES;
+
+	size_t size_class = 0;
+	while(((size_t)1 << (size_class + PMM_SLAB_MIN_SHIFT)) < size)
+		size_class++;
+	if(align && (((size_t)1 << (size_class + PMM_SLAB_MIN_SHIFT)) % align) != 0)
+		return PMM_SLAB_CLASSES;
+	return size_class;
+}
+
+/// @brief Carve a new slab out of the first region that can hold it, the caller
+/// must hold the lock of the size class
+/// @param size_class Size class to give the slab to
+/// @return real_storage::slab* The new slab with all of it's objects free
+static real_storage::slab *real_storage::slab_create(size_t size_class)
 {
-	debug_assert(ptr != nullptr);
-	debug_printf("free %p", ptr);
 	for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
 		auto *region = &g_real_storage_regions->regions[i];
 		const base::scoped_mutex lock1(region->lock);
-		if(region->flags != real_storage::region::PUBLIC)
+		if(region->flags != real_storage::region::PUBLIC || region->slabs == nullptr)
 			continue;
 
-		/* Pointer must be also inside region */
-		if((uintptr_t)ptr < (uintptr_t)region->base || (uintptr_t)ptr > (uintptr_t)region->base + region->size)
+		auto *page = real_storage::region_alloc(*region, PMM_SLAB_SIZE, PMM_SLAB_SIZE);
+		if(page == nullptr)
 			continue;
 
-		auto *block = region->head;
-		real_storage::block *prev = nullptr;
-		uintptr_t current_ptr = (uintptr_t)region->base;
-		while(block != nullptr) {
-			// Block can't be bigger than the region
-			debug_assert(block->size <= region->size - (size_t)(current_ptr - (uintptr_t)region->base));
-			// Blocks can't be outside the region
-			debug_assert((uintptr_t)block >= (uintptr_t)region->base && (uintptr_t)block < (uintptr_t)region->base + region->size);
-
-			if((uintptr_t)ptr >= current_ptr && (uintptr_t)ptr < current_ptr + block->size) {
-				// Free the requested block. Check for double frees
-				debug_assertm(block->flags != real_storage::block::FREE, "Double free");
-				// Do not free the heap/genesis blocks
-				debug_assert(block != region->head);
-
-				/// @todo Find out whats wrong with our PMM
-				block->flags = real_storage::block::FREE;
-				block = real_storage::block::merge(prev, block, real_storage::block::FREE);
-#if defined DEBUG
-				real_storage::check_heap();
+		const auto page_base = (uintptr_t)region->base & ~((uintptr_t)PMM_SLAB_SIZE - 1);
+		auto& slab = region->slabs[((uintptr_t)page - page_base) / PMM_SLAB_SIZE];
+		slab.flags = real_storage::slab::PRESENT;
+		slab.size_class = static_cast<uint8_t>(size_class);
+		slab.n_used = 0;
+		slab.base = page;
+		slab.prev = slab.next = nullptr;
+
+		// Thread the free list thru all the objects of the page
+		const size_t obj_size = (size_t)1 << (size_class + PMM_SLAB_MIN_SHIFT);
+		slab.free_list = nullptr;
+		for(size_t off = PMM_SLAB_SIZE; off >= obj_size; off -= obj_size) {
+			auto *obj = reinterpret_cast<void **>((uintptr_t)page + off - obj_size);
+			*obj = slab.free_list;
+			slab.free_list = obj;
+		}
+		return &slab;
+	}
+	return nullptr;
+}
+
+/// @brief Allocate a batch of objects from a size class
+/// @param size_class The size class
+/// @param objs Where to place the objects
+/// @param n Number of objects wanted
+/// @return size_t Number of objects allocated, less than n if no slab could be created
+static size_t real_storage::slab_alloc(size_t size_class, void **objs, size_t n)
+{
+	auto& sc = g_real_storage_regions->slab_classes[size_class];
+	const base::scoped_mutex lock1(sc.lock);
+
+	size_t i;
+	for(i = 0; i < n; i++) {
+		auto *slab = sc.partial;
+		if(slab == nullptr) {
+			slab = real_storage::slab_create(size_class);
+			if(slab == nullptr) break;
+			sc.partial = slab;
+			sc.n_slabs++;
+		}
+
+		objs[i] = slab->free_list;
+		debug_assert(objs[i] != nullptr);
+		slab->free_list = *reinterpret_cast<void **>(objs[i]);
+		slab->n_used++;
+		sc.n_used++;
+		sc.n_allocs++;
+
+		// A full slab leaves the partial list until one of it's objects is freed
+		if(slab->free_list == nullptr) {
+			sc.partial = slab->next;
+			if(slab->next != nullptr)
+				slab->next->prev = nullptr;
+			slab->next = nullptr;
+		}
+	}
+	return i;
+}
+
+/// @brief Return an object to it's slab, slabs that become empty are given back to
+/// the region unless they're the last partial slab of the class. The caller must hold
+/// the lock of the size class
+/// @param sc Size class of the slab
+/// @param slab Slab the object belongs to
+/// @param ptr The object
+static void real_storage::slab_put(real_storage::slab_class& sc, real_storage::slab& slab, void *ptr)
+{
+	debug_assertm(slab.n_used != 0, "Double free");
+
+	// Full slabs aren't on the partial list
+	if(slab.free_list == nullptr) {
+		slab.prev = nullptr;
+		slab.next = sc.partial;
+		if(sc.partial != nullptr)
+			sc.partial->prev = &slab;
+		sc.partial = &slab;
+	}
+
+	*reinterpret_cast<void **>(ptr) = slab.free_list;
+	slab.free_list = ptr;
+	slab.n_used--;
+	sc.n_used--;
+	sc.n_frees++;
+
+	if(slab.n_used == 0 && (sc.partial != &slab || slab.next != nullptr)) {
+		if(slab.prev != nullptr)
+			slab.prev->next = slab.next;
+		else
+			sc.partial = slab.next;
+		if(slab.next != nullptr)
+			slab.next->prev = slab.prev;
+		sc.n_slabs--;
+
+		auto *region = real_storage::get_region(slab.base);
+		debug_assert(region != nullptr);
+		const base::scoped_mutex lock1(region->lock);
+		slab.flags = real_storage::slab::NOT_PRESENT;
+		real_storage::region_free(*region, slab.base);
+	}
+}
+
+/// @brief Return an object to it's slab
+/// @param slab Slab the object belongs to
+/// @param ptr The object
+static void real_storage::slab_free(real_storage::slab& slab, void *ptr)
+{
+	auto& sc = g_real_storage_regions->slab_classes[slab.size_class];
+	const base::scoped_mutex lock1(sc.lock);
+	real_storage::slab_put(sc, slab, ptr);
+}
+
+/// @brief Return a batch of objects of the same size class to their slabs
+/// @param size_class The size class
+/// @param objs The objects
+/// @param n Number of objects
+static void real_storage::slab_free(size_t size_class, void *const *objs, size_t n)
+{
+	auto& sc = g_real_storage_regions->slab_classes[size_class];
+	const base::scoped_mutex lock1(sc.lock);
+	for(size_t i = 0; i < n; i++) {
+		auto *slab = real_storage::get_slab(objs[i]);
+		debug_assert(slab != nullptr && slab->size_class == size_class);
+		real_storage::slab_put(sc, *slab, objs[i]);
+	}
+}
+
+/// @brief Obtain the index of the processor we're running on, it's kept on a per-CPU
+/// variable so no instruction asking the machine is needed on every allocation
+/// @return unsigned int The index of the processor
+static inline unsigned int real_storage::get_cpu()
+{
+#if defined TARGET_S390
+	// Stored on the low storage of each CPU when it's started
+	return static_cast<unsigned int>(smp::cpu_index());
+#else
+	// The other ports only run the boot processor
+	return 0;
 #endif
-				return;
-			}
-			
-			if(current_ptr > (uintptr_t)ptr) {
-				debug_printf("Block %p not found", ptr);
-				return;
-			}
+}
+
+/// @brief Obtain the cache of the current CPU, creating it if it doesn't exist yet
+/// @return real_storage::cpu_cache* The cache, nullptr if it can't be created
+static real_storage::cpu_cache *real_storage::get_cpu_cache()
+{
+	const auto cpu = real_storage::get_cpu();
+	if(cpu >= MAX_CPUS)
+		return nullptr;
 
-			current_ptr += block->size;
-			prev = block;
-			block = block->next;
+	auto *cache = g_real_storage_regions->cpu_caches[cpu];
+	if(cache != nullptr)
+		return cache;
+
+	// The cache is taken straight from the regions, the slab layer can't be used to
+	// allocate it's own front
+	const base::scoped_mutex lock1(g_real_storage_regions->cpu_caches_lock);
+	if(g_real_storage_regions->cpu_caches[cpu] != nullptr)
+		return g_real_storage_regions->cpu_caches[cpu];
+	for(size_t i = 0; i < MAX_PMM_REGIONS && cache == nullptr; i++) {
+		auto *region = &g_real_storage_regions->regions[i];
+		const base::scoped_mutex lock2(region->lock);
+		if(region->flags != real_storage::region::PUBLIC)
+			continue;
+		cache = static_cast<real_storage::cpu_cache *>(real_storage::region_alloc(*region, sizeof(real_storage::cpu_cache), alignof(real_storage::cpu_cache)));
+	}
+	if(cache == nullptr)
+		return nullptr;
+
+	storage::fill(cache, 0, sizeof(real_storage::cpu_cache));
+	g_real_storage_regions->cpu_caches[cpu] = cache;
+	return cache;
+}
+
+/// @brief Allocate an object from the magazine of the current CPU, an empty magazine
+/// is refilled with a batch of objects from the slabs
+/// @param size_class The size class
+/// @return void* The object, nullptr if it can't be allocated
+static void *real_storage::cache_alloc(size_t size_class)
+{
+	auto *cache = real_storage::get_cpu_cache();
+	if(cache == nullptr) {
+		void *ptr;
+		return real_storage::slab_alloc(size_class, &ptr, 1) ? ptr : nullptr;
+	}
+
+	const base::scoped_mutex lock1(cache->lock);
+	auto& mag = cache->magazines[size_class];
+	if(mag.n_objs == 0) {
+		mag.n_misses++;
+		mag.n_objs = real_storage::slab_alloc(size_class, mag.objs, PMM_MAGAZINE_BATCH);
+		if(mag.n_objs == 0) return nullptr;
+	} else {
+		mag.n_hits++;
+	}
+	return mag.objs[--mag.n_objs];
+}
+
+/// @brief Put an object on the magazine of the current CPU, a full magazine gives
+/// a batch of it's objects back to the slabs first
+/// @param slab Slab the object belongs to
+/// @param ptr The object
+static void real_storage::cache_free(real_storage::slab& slab, void *ptr)
+{
+	auto *cache = real_storage::get_cpu_cache();
+	if(cache == nullptr) {
+		real_storage::slab_free(slab, ptr);
+		return;
+	}
+
+	const base::scoped_mutex lock1(cache->lock);
+	auto& mag = cache->magazines[slab.size_class];
+	if(mag.n_objs == PMM_MAGAZINE_SIZE) {
+		mag.n_misses++;
+		mag.n_objs -= PMM_MAGAZINE_BATCH;
+		real_storage::slab_free(slab.size_class, &mag.objs[mag.n_objs], PMM_MAGAZINE_BATCH);
+	} else {
+		mag.n_hits++;
+	}
+	mag.objs[mag.n_objs++] = ptr;
+}
+
+/// @brief Give every object held on the magazines of all CPUs back to the slabs, so
+/// slabs that become empty return to the regions
+/// @return bool Whetever any object was given back
+static bool real_storage::cache_drain()
+{
+	bool drained = false;
+	for(size_t i = 0; i < MAX_CPUS; i++) {
+		auto *cache = g_real_storage_regions->cpu_caches[i];
+		if(cache == nullptr)
+			continue;
+
+		const base::scoped_mutex lock1(cache->lock);
+		for(size_t j = 0; j < PMM_SLAB_CLASSES; j++) {
+			auto& mag = cache->magazines[j];
+			if(mag.n_objs == 0)
+				continue;
+			real_storage::slab_free(j, mag.objs, mag.n_objs);
+			mag.n_objs = 0;
+			drained = true;
 		}
 	}
+	return drained;
+}
 
+/// @brief Allocate a piece of storage/memory, small allocations are served by the magazines
+/// of the current CPU backed by the size classes of the slab layer and the rest (or when no slab can be created) by the
+/// segregated free lists of each region
+/// @param size The size to allocate. It's the caller's responsability to assert this is a non-zero value
+/// @param align Alignment required for allocation, a 0 means "up to the manager/no alignment required"
+/// @return void* The pointer to the storage area
+void *real_storage::alloc(size_t size, size_t align)
+{
+	debug_assert(size != 0);
+	debug_printf("alloc size=%u,align=%u", size, align);
+
+	const auto size_class = real_storage::get_slab_class(size, align);
+	// Objects cached by the CPUs hold their slabs alive, when we run out of storage
+	// they're given back and the allocation is tried again
+	do {
+		if(size_class < PMM_SLAB_CLASSES) {
+			void *ptr = real_storage::cache_alloc(size_class);
+			if(ptr != nullptr) return ptr;
+		}
+
+		for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
+			auto *region = &g_real_storage_regions->regions[i];
+			const base::scoped_mutex lock1(region->lock);
+			if(region->flags != real_storage::region::PUBLIC)
+				continue;
+
+			void *ptr = real_storage::region_alloc(*region, size, align);
+			if(ptr != nullptr) return ptr;
+		}
+	} while(real_storage::cache_drain());
+
+	debug_printf("Can't alloc %zuB (align %u)", size, align);
 #if defined DEBUG
 	real_storage::check_heap();
 #endif
+	return nullptr;
+}
+
+/// @brief Free a block of real storage
+/// @param ptr The pointer to free up; Note that it is the caller's responsability to assert that ptr != nullptr 
+void real_storage::free(void *ptr)
+{
+	debug_assert(ptr != nullptr);
+	debug_printf("free %p", ptr);
+
+	auto *slab = real_storage::get_slab(ptr);
+	if(slab != nullptr) {
+		real_storage::cache_free(*slab, ptr);
+		return;
+	}
+
+	auto *region = real_storage::get_region(ptr);
+	if(region == nullptr) {
+		debug_printf("Block %p not found", ptr);
+		return;
+	}
+
+	const base::scoped_mutex lock1(region->lock);
+	real_storage::region_free(*region, ptr);
 }
 
 /// @brief Reallocates a block of the real storage
@@ -416,114 +824,69 @@ void *real_storage::realloc(void *ptr, size_t size, size_t align)
 	if(size == 0) return nullptr; // Nothing to allocate
 	if(ptr == nullptr) // Behave like malloc
 		return real_storage::alloc(size, align);
-	
-	for(size_t i = 0; i < MAX_PMM_REGIONS; i++) {
-		auto *region = &g_real_storage_regions->regions[i];
-		base::scoped_mutex lock1(region->lock);
-		if(region->flags != real_storage::region::PUBLIC)
-			continue;
 
-		/* Pointer must be also inside region */
-		if((uintptr_t)ptr < (uintptr_t)region->base || (uintptr_t)ptr > (uintptr_t)region->base + region->size)
-			continue;
+	// Objects of the slab layer stay in place as long as they fit on their class
+	auto *slab = real_storage::get_slab(ptr);
+	if(slab != nullptr) {
+		const size_t obj_size = (size_t)1 << (slab->size_class + PMM_SLAB_MIN_SHIFT);
+		if(real_storage::get_slab_class(size, align) == slab->size_class)
+			return ptr;
+
+		void *new_ptr = real_storage::alloc(size, align);
+		if(new_ptr == nullptr) return nullptr;
+		storage::copy(new_ptr, ptr, size < obj_size ? size : obj_size);
+		real_storage::cache_free(*slab, ptr);
+		return new_ptr;
+	}
 
-		auto *block = region->head;
-		real_storage::block *prev = nullptr;
-		uintptr_t current_ptr = (uintptr_t)region->base;
-		while(block != nullptr) {
-			/// @todo There are ways to optimize aligned block reallocations, for now
-			/// we entirely reallocate the entire thing
-
-			// Block can't be bigger than the region
-			debug_assert(block->size <= region->size - (size_t)(current_ptr - (uintptr_t)region->base));
-			// Blocks can't be outside the region
-			debug_assert((uintptr_t)block >= (uintptr_t)region->base && (uintptr_t)block < (uintptr_t)region->base + region->size);
-			// Same size means no need to do anything
-			if(size == block->size) {
-#if defined DEBUG_PMM
-				debug_printf("Same size");
-#endif
-				return reinterpret_cast<void *>(current_ptr);
+	auto *region = real_storage::get_region(ptr);
+	if(region == nullptr) {
+		debug_printf("%p not found", ptr);
+		return nullptr;
+	}
+
+	size_t old_size;
+	{
+		const base::scoped_mutex lock1(region->lock);
+		auto *block = real_storage::block::from_data(ptr);
+		debug_assertm(!block->is_free(), "Reallocating free block");
+		old_size = block->get_size() - PMM_BLOCK_HEADER;
+
+		// Misaligned data has to be moved elsewhere, otherwise the block is resized in
+		// place by giving up it's tail or taking the free block that follows it
+		const size_t block_size = real_storage::get_block_size(size);
+		if((uintptr_t)ptr % real_storage::get_block_align(align) == 0) {
+			auto *next = block->get_next();
+			size_t avail = block->get_size();
+			if(avail < block_size && next->is_free() && avail + next->get_size() >= block_size) {
+				real_storage::block_remove(*region, *next);
+				avail += next->get_size();
+				block->size += next->get_size();
+				next = block->get_next();
+				next->size &= ~real_storage::block::PREV_FREE;
 			}
-			/* Expand the reallocated block */
-			else if(size > block->size && (uintptr_t)ptr >= current_ptr && (uintptr_t)ptr < current_ptr + block->size) {
-				size_t rem_size = size - block->size;
-				debug_assertm(block->flags == real_storage::block::USED, "Reallocating free block");
 
-				/* Check that this block has a next block, that is free, and that has the remainder required size */
-				if(align == 0 && block->next != nullptr && block->next->flags == real_storage::block::FREE && block->next->size >= rem_size) {
-#if defined DEBUG_PMM
-					debug_printf("Take from next");
-#endif
-					debug_assert(block->next->size != 0);
-
-					block->next->size -= rem_size;
-					block->size += rem_size;
-					if(block->next->size == 0) {
-						block->next->flags = real_storage::block::NOT_PRESENT;
-						block->next = block->next->next;
-					}
-					return (void *)current_ptr;
+			if(avail >= block_size) {
+				if(avail - block_size >= sizeof(real_storage::block)) {
+					block->size -= avail - block_size;
+					auto *tail = block->get_next();
+					tail->size = avail - block_size;
+					real_storage::block_release(*region, tail);
 				}
-				// Check the previous block
-				/// @todo Have a previous-previous block :)
-				else if(align == 0 && prev != nullptr && prev->flags == real_storage::block::FREE && prev->size >= rem_size) {
-					if(prev->size > rem_size) {
-						debug_printf("Take from previous");
-						/// @todo Please don't
-						// Move to a lower address
-						storage::move((void *)(current_ptr - rem_size), (void *)current_ptr, block->size);
-						// Apply changes
-						prev->size -= rem_size;
-						block->size += rem_size;
-						current_ptr -= rem_size;
-						return (void *)current_ptr;
-					} else if(prev->size == rem_size) {
-						/// @todo Merge both blocks, that requires prev->prev
-						debug_assertm(0, "Can't handle the edge case of psize==size yet!");
-						return nullptr;
-					}
-				}
-				// Otherwise we have to completely reallocate from 0
-				else {
-					// Allocate entirely new block
-					void *old_ptr = ptr;
-					lock1.~scoped_mutex();
-
-					// Mutex is locked again
-					ptr = real_storage::alloc(size, align);
-					if(ptr == nullptr) return nullptr;
-					storage::move(ptr, old_ptr, size);
-					real_storage::free(old_ptr);
-					return ptr;
-				}
-				return nullptr;
-			}
-			// Shrink the block
-			else {
-				// Allocate entirely new block
-				void *old_ptr = ptr;
-				lock1.~scoped_mutex();
-
-				// Mutex is locked again
-				ptr = real_storage::alloc(size, align);
-				if(ptr == nullptr) return nullptr;
-				storage::move(ptr, old_ptr, size);
-				real_storage::free(old_ptr);
+#if defined DEBUG
+				real_storage::check_heap();
+#endif
 				return ptr;
 			}
-			
-			if(current_ptr > (uintptr_t)ptr) {
-				debug_printf("%p not found", ptr);
-				return nullptr;
-			}
-
-			current_ptr += block->size;
-			prev = block;
-			block = block->next;
 		}
 	}
-	return nullptr;
+
+	// Allocate entirely new block
+	void *new_ptr = real_storage::alloc(size, align);
+	if(new_ptr == nullptr) return nullptr;
+	storage::copy(new_ptr, ptr, size < old_size ? size : old_size);
+	real_storage::free(ptr);
+	return new_ptr;
 }
 
 /// @brief Obtain the usage and other statistics about the real storage allocator
@@ -538,18 +901,30 @@ int real_storage::get_stats(real_storage::stats *stats)
 		const base::scoped_mutex lock1(region->lock);
 		if(region->flags != real_storage::region::PUBLIC) continue;
 
-		const auto *block = region->head;
-		auto current_ptr = reinterpret_cast<uintptr_t>(region->base);
 		stats->n_regions++;
-		while(block != nullptr) {
-			if(block->flags == real_storage::block::FREE) {
-				stats->free_size += block->size;
-			} else if(block->flags == real_storage::block::USED) {
-				stats->used_size += block->size;
-			}
-			
-			current_ptr += block->size;
-			block = block->next;
+		stats->free_size += region->free_size;
+		stats->used_size += region->size - region->free_size;
+	}
+
+	for(size_t i = 0; i < PMM_SLAB_CLASSES; i++) {
+		auto& sc = g_real_storage_regions->slab_classes[i];
+		const base::scoped_mutex lock1(sc.lock);
+		stats->slabs[i].obj_size = (size_t)1 << (i + PMM_SLAB_MIN_SHIFT);
+		stats->slabs[i].n_slabs = sc.n_slabs;
+		stats->slabs[i].n_used = sc.n_used;
+		stats->slabs[i].n_allocs = sc.n_allocs;
+		stats->slabs[i].n_frees = sc.n_frees;
+	}
+
+	for(size_t i = 0; i < MAX_CPUS; i++) {
+		auto *cache = g_real_storage_regions->cpu_caches[i];
+		if(cache == nullptr) continue;
+
+		const base::scoped_mutex lock1(cache->lock);
+		for(size_t j = 0; j < PMM_SLAB_CLASSES; j++) {
+			stats->slabs[j].n_cached += cache->magazines[j].n_objs;
+			stats->slabs[j].n_hits += cache->magazines[j].n_hits;
+			stats->slabs[j].n_misses += cache->magazines[j].n_misses;
 		}
 	}
 	return 0;
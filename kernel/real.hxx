@@ -11,24 +11,100 @@ namespace real_storage {
 #	define PMM_TEST_NPTR 24 // Number of pointers used for alloation
 #	define PMM_TEST_PTRSZ 32 // Size of each allocation unit
 #endif
+#define PMM_BLOCK_HEADER 16 // Size of the boundary tag in front of each block
+#define PMM_BLOCK_GRANULE 16 // Blocks are sized and placed in multiples of this
+#define PMM_FREE_LISTS 32 // Power-of-two buckets of free blocks
+#define PMM_SLAB_SIZE 4096 // Size of the storage backing each slab
+#define PMM_SLAB_MIN_SHIFT 4 // Smallest size class (16 bytes)
+#define PMM_SLAB_MAX_SHIFT 11 // Biggest size class (2048 bytes)
+#define PMM_SLAB_CLASSES (PMM_SLAB_MAX_SHIFT - PMM_SLAB_MIN_SHIFT + 1)
+#define PMM_MAGAZINE_SIZE 32 // Objects each CPU can keep cached per size class
+#define PMM_MAGAZINE_BATCH (PMM_MAGAZINE_SIZE / 2) // Objects moved at once between a magazine and the slabs
 
 	struct block;
 	struct region;
+	struct slab;
 
+	/// @brief Boundary tag placed in front of every block of a region, the size of the
+	/// previous block is only valid when it is free so both neighbours of a block can be
+	/// found without walking the region. Free blocks also hold the links of their free
+	/// list in what would otherwise be the start of the storage handed out.
 	struct block {
 		block& operator=(block&) = delete;
 		const block& operator=(const block&) = delete;
 
 		enum flag {
-			NOT_PRESENT = 0x00,
+			USED = 0x00,
 			FREE = 0x01,
-			USED = 0x02,
-		} flags = real_storage::block::NOT_PRESENT;
-		static real_storage::block *create(real_storage::region *region, size_t size, real_storage::block::flag flags, real_storage::block *next);
-		static real_storage::block *merge(real_storage::block *prev, real_storage::block *block, real_storage::block::flag flags);
+			PREV_FREE = 0x02,
+		};
+		static constexpr size_t flag_mask = real_storage::block::FREE | real_storage::block::PREV_FREE;
+
+		constexpr size_t get_size() const { return this->size & ~flag_mask; }
+		constexpr bool is_free() const { return (this->size & real_storage::block::FREE) != 0; }
+		constexpr bool is_prev_free() const { return (this->size & real_storage::block::PREV_FREE) != 0; }
+		constexpr void *data() { return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(this) + PMM_BLOCK_HEADER); }
+		real_storage::block *get_next() { return reinterpret_cast<real_storage::block *>(reinterpret_cast<uintptr_t>(this) + this->get_size()); }
+		real_storage::block *get_prev() { return reinterpret_cast<real_storage::block *>(reinterpret_cast<uintptr_t>(this) - this->prev_size); }
+		static real_storage::block *from_data(void *ptr) { return reinterpret_cast<real_storage::block *>(reinterpret_cast<uintptr_t>(ptr) - PMM_BLOCK_HEADER); }
+
+		size_t prev_size; // Size of the previous block, only valid when PREV_FREE is set
+		size_t size; // Size of the block (header included) and the flags on the low bits
+		// Only valid while the block is free
+		alignas(PMM_BLOCK_HEADER) real_storage::block *prev_free;
+		real_storage::block *next_free;
+	};
+	static_assert(PMM_BLOCK_HEADER % PMM_BLOCK_GRANULE == 0 && sizeof(real_storage::block) % PMM_BLOCK_GRANULE == 0);
+
+	/// @brief Descriptor of a page carved out of a region to hold objects of a single
+	/// size class, descriptors are kept out-of-line (one per page of the region) so
+	/// the objects can use the entire page and be naturally aligned
+	struct slab {
+		slab& operator=(slab&) = delete;
+		const slab& operator=(const slab&) = delete;
+
+		enum flag {
+			NOT_PRESENT = 0x00,
+			PRESENT = 0x01,
+		} flags = real_storage::slab::NOT_PRESENT;
+		uint8_t size_class = 0;
+		uint16_t n_used = 0; // Objects handed out from this slab
+		void *base = nullptr; // Start of the page
+		void *free_list = nullptr; // Singly linked list threaded thru the free objects
+		real_storage::slab *prev = nullptr; // Partial list links
+		real_storage::slab *next = nullptr;
+	};
+
+	/// @brief A size class of the slab layer, partial holds the slabs that still have
+	/// free objects so alloc/free never have to search for them
+	struct slab_class {
+		slab_class& operator=(slab_class&) = delete;
+		const slab_class& operator=(const slab_class&) = delete;
 
-		size_t size;
-		real_storage::block *next;
+		real_storage::slab *partial = nullptr;
+		size_t n_slabs = 0;
+		size_t n_used = 0;
+		size_t n_allocs = 0;
+		size_t n_frees = 0;
+		base::mutex lock;
+	};
+
+	/// @brief Objects of a single size class cached by a CPU
+	struct magazine {
+		void *objs[PMM_MAGAZINE_SIZE];
+		size_t n_objs = 0;
+		size_t n_hits = 0; // Requests served without going to the slab layer
+		size_t n_misses = 0;
+	};
+
+	/// @brief Per-CPU front of the slab layer, it's lock is only ever contended when a
+	/// thread is moved to another CPU in the middle of an operation
+	struct cpu_cache {
+		cpu_cache& operator=(cpu_cache&) = delete;
+		const cpu_cache& operator=(const cpu_cache&) = delete;
+
+		real_storage::magazine magazines[PMM_SLAB_CLASSES];
+		base::mutex lock;
 	};
 
 	struct region {
@@ -44,7 +120,11 @@ namespace real_storage {
 		} flags = real_storage::region::NOT_PRESENT;
 		void *base = nullptr;
 		size_t size = 0;
-		real_storage::block *head = nullptr;
+		size_t free_size = 0;
+		real_storage::block *head = nullptr; // First block of the region
+		real_storage::block *free_lists[PMM_FREE_LISTS] = {};
+		real_storage::slab *slabs = nullptr; // One descriptor per page of the region
+		size_t n_slabs = 0;
 		base::mutex lock;
 	};
 
@@ -58,15 +138,30 @@ namespace real_storage {
 	void  free(void *ptr);
 	void *realloc(void *ptr, size_t size, size_t align);
 
+	struct slab_stats {
+		size_t obj_size = 0; // Size of the objects of the class
+		size_t n_slabs = 0; // Pages held by the class
+		size_t n_used = 0; // Objects currently handed out, the ones cached by the CPUs included
+		size_t n_allocs = 0;
+		size_t n_frees = 0;
+		size_t n_cached = 0; // Objects held on the magazines of the CPUs
+		size_t n_hits = 0; // Requests served by the magazines
+		size_t n_misses = 0; // Requests that had to go to the slabs
+	};
+
 	struct stats {
 		size_t free_size = 0;
 		size_t used_size = 0;
 		size_t n_regions = 0;
+		real_storage::slab_stats slabs[PMM_SLAB_CLASSES];
 	};
 	int get_stats(real_storage::stats *stats);
 
 	struct table {
 		real_storage::region regions[MAX_PMM_REGIONS];
+		real_storage::slab_class slab_classes[PMM_SLAB_CLASSES];
+		real_storage::cpu_cache *cpu_caches[MAX_CPUS]; // Created the first time a CPU allocates
+		base::mutex cpu_caches_lock;
 	};
 }
 
@@ -60,10 +60,17 @@
 /* Enable z/Arch vector facility */
 #define S390_CR0_ENABLE_VECTOR ((1) << S390_BIT(64, 46))
 
+/* Emergency-signal subclass mask */
+#define S390_CR0_EMERGENCY_MASK ((1) << S390_BIT(64, 49))
+
 /* CPU-Timer subclass mask */
 #define S390_CR0_TIMER_MASK ((1) << S390_BIT(64, 53))
 #endif
 
+/* External interruption codes, stored on the PSA */
+#define S390_EXTINT_EMERGENCY 0x1201
+#define S390_EXTINT_CPU_TIMER 0x1005
+
 #if MACHINE >= M_ZARCH
 /* Primary subspace group control */
 #define S390_CR1_PSG ((1) << S390_BIT(64, 54))
@@ -203,6 +210,12 @@
 // the control register save area respectively
 # define PSA_FLCGRSAV &g_psa.unused10[0]
 # define PSA_FLCCRSAV &g_psa.unused10[16 * sizeof(arch_dep::register_t)]
+// Every CPU has it's own PSA, the interrupt handlers find the top of their stack and
+// the index of the CPU on the scheduler here
+# define PSA_FLCCPUIDX &g_psa.unused10[32 * sizeof(arch_dep::register_t)]
+# define PSA_FLCINTSTK &g_psa.unused10[33 * sizeof(arch_dep::register_t)]
+// Top of the kernel save area of the thread the CPU runs, zero if it has none
+# define PSA_FLCSVCSTK &g_psa.unused10[34 * sizeof(arch_dep::register_t)]
 #else
 // On S/390 and before we can use lower PSA's!
 # error Save areas not implemented yet
@@ -452,21 +465,26 @@ namespace s390_intrin {
 		return (unsigned int)cpuid;
 	}
 
-	static inline int signal(unsigned int cpu_addr, unsigned int param)
+	/// @brief Signal another CPU
+	/// @param cpu_addr Address of the CPU
+	/// @param order The sigp_codes order
+	/// @param param Parameter of the order (i.e the prefix for S390_SIGP_SET_PREFIX)
+	/// @return int Condition code, 2 if the CPU is busy and 3 if it's not operational
+	static inline int signal(unsigned int cpu_addr, unsigned int order, uintptr_t param = 0)
 	{
 		// The s390 spec says that the next odd register number (in short, r1 + 1)
 		// shall contain the parameter for the processor signal
-		register unsigned int r1 asm("0") = 0; // Status
-		register unsigned int r2 asm("1") = param; // Parameter (only lower 32 bits)
-		unsigned int order_code = 0;
+		register uintptr_t r0 asm("0") = 0; // Status
+		register uintptr_t r1 asm("1") = param;
 		int cc = -1;
 
-		asm volatile("SIGP %3, %1, %2\r\n"
+		// The order is taken from the address of the second operand
+		asm volatile("SIGP %1,%3,0(%4)\r\n"
 			"IPM %0"
-			: "+d"(cc)
-			: "r"(cpu_addr), "r"(order_code), "r"(r1), "r"(r2)
+			: "+d"(cc), "+d"(r0)
+			: "d"(r1), "d"(cpu_addr), "a"((uintptr_t)order)
 			: "cc", "memory");
-		return cc >> 28;
+		return (cc >> 28) & 3;
 	}
 
 	/// @brief Wait for an I/O response (overrides the I/O PSW)
@@ -481,6 +499,14 @@ namespace s390_intrin {
 		return 0;
 	}
 
+	/// @brief Read the TOD clock, bit 51 is incremented every microsecond
+	static inline uint64_t get_tod()
+	{
+		uint64_t tod __attribute__((aligned(8)));
+		asm volatile("STCK %0\r\n" : "=Q"(tod) : : "cc");
+		return tod;
+	}
+
 	static inline int set_timer_delta(intptr_t ms)
 	{
 		// Must be aligned to a doubleword boundary
@@ -498,6 +524,17 @@ namespace s390_intrin {
 #endif
 	}
 
+	static inline arch_dep::register_t stcreg0()
+	{
+		arch_dep::register_t value;
+#if MACHINE >= M_ZARCH
+		asm volatile("STCTG 0, 0, %0\r\n" : "=m"(value) : : );
+#else
+		asm volatile("STCTL 0, 0, %0\r\n" : "=m"(value) : : );
+#endif
+		return value;
+	}
+
 	static inline void lcreg1(arch_dep::register_t value)
 	{
 #if MACHINE >= M_ZARCH
@@ -543,7 +580,7 @@ namespace s390_intrin {
 	after_enable:
 		// We don't know how the IPL got us here, but we will just
 		// turn on everything required just in case.
-		s390_intrin::lcreg0(S390_CR0_TIMER_MASK | S390_CR0_AFP_REGISTER);
+		s390_intrin::lcreg0(s390_intrin::stcreg0() | S390_CR0_TIMER_MASK | S390_CR0_EMERGENCY_MASK | S390_CR0_AFP_REGISTER);
 #if MACHINE >= M_ZARCH
 		asm volatile("LCTLG 6, 6, %0\r\n" : : "m"(new_cr6) : );
 #else
@@ -551,14 +588,16 @@ namespace s390_intrin {
 #endif
 	}
 
+	// The other controls of CR0 (i.e EDAT) are kept as they are, the signals of the other
+	// CPUs may reschedule so they're masked along with the timer
 	static inline void disable_int()
 	{
-		s390_intrin::lcreg0(0x00);
+		s390_intrin::lcreg0(s390_intrin::stcreg0() & ~static_cast<arch_dep::register_t>(S390_CR0_TIMER_MASK | S390_CR0_EMERGENCY_MASK));
 	}
 
 	static inline void enable_int()
 	{
-		s390_intrin::lcreg0(S390_CR0_TIMER_MASK | S390_CR0_AFP_REGISTER);
+		s390_intrin::lcreg0(s390_intrin::stcreg0() | S390_CR0_TIMER_MASK | S390_CR0_EMERGENCY_MASK | S390_CR0_AFP_REGISTER);
 	}
 }
 
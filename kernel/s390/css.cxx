@@ -5,21 +5,19 @@
 
 #include <mutex.hxx>
 #include <errcode.hxx>
+#include <timeshr.hxx>
 
 /**
- * @brief The global request queue, here all requests of the entire system are stored
- * so the spooler can schedule them correctly
+ * @brief The device list, each device holds the queue of requests for it's subchannel
+ * so the spooler can keep every subchannel busy at once
  */
 /* @todo SMP support and parallelization of these requests (i.e offload spooler to multiple cores) */
-constinit static storage::global_wrapper<storage::concurrent_dynamic_list<css::request *>> g_queue;
 constinit static storage::global_wrapper<storage::concurrent_dynamic_list<css::device>> g_devlist;
-constinit static storage::global_wrapper<storage::concurrent_dynamic_list<css::request>> g_request_pool;
 
 int css::init()
 {
 	debug_printf("DEVLIST,SIZE=%u", g_devlist->size());
 	debug_assert(g_devlist->size() == 0);
-	debug_assert(g_request_pool->size() == 0);
 	return 0;
 }
 
@@ -34,14 +32,13 @@ int css::init()
  */
 css::request *css::request::create(css::device& dev, size_t n_ccws)
 {
-	auto& request_pool = *(g_request_pool.operator->());
-	const base::scoped_mutex lock(request_pool.lock);
-	debug_printf("g_request_pool->size=%u", request_pool.size());
-	auto *req = request_pool.insert();
+	// Requests are allocated one by one since they must not move while they're
+	// on a queue or being performed by a subchannel
+	auto *req = storage::allocz<css::request>(sizeof(css::request));
 	if(req == nullptr) return nullptr;
 	req->schid = dev.schid;
 	if(req->ccws.resize(n_ccws) != 0) {
-		request_pool.resize(request_pool.size() - 1);
+		storage::free(req);
 		return nullptr;
 	}
 	return req;
@@ -57,26 +54,76 @@ void css::request::destroy(css::request *req)
 	req->lock.lock();
 	req->flags = 0;
 	req->lock.unlock();
-	const base::scoped_mutex lock(g_request_pool->lock);
-	g_request_pool->remove(*req);
+	req->ccws.~dynamic_list();
+	storage::free(req);
 }
 
 /**
- * @brief Sends a CSS request to the main queue. Note that this releases ownership of
- * the request object since the allocated memory is now freed
+ * @brief Sends a CSS request to the queue of it's device, requests of a device are
+ * performed in the order they're sent
  * 
  * @param req The request to send to the queue
  * @return int Return code of operation, negative denotes failure
  */
 int css::request::send()
 {
-	const base::scoped_mutex lock1(g_queue->lock);
-	// Apply changes and put the request on the requests linked list
-	if(g_queue->insert(this) == nullptr)
-		return error::ALLOCATION;
+	auto *dev = css::get_device(this->schid);
+	if(dev == nullptr)
+		return error::RESOURCE_UNAVAILABLE;
+
+	{
+		const base::scoped_mutex lock1(dev->queue.lock);
+		this->queued_at = s390_intrin::get_tod();
+		if(dev->queue.insert(this) == nullptr)
+			return error::ALLOCATION;
+		const size_t n_queued = base::fetch_add(&dev->stats.n_queued, 1) + 1;
+		if(n_queued > dev->stats.max_queued)
+			dev->stats.max_queued = n_queued;
+	}
+	// The spooler may be sleeping waiting for requests
+	timeshare::wakeup(css::spooler_channel());
 	return 0;
 }
 
+/**
+ * @brief Sleep until the request is completed by the I/O interrupt handler, the supervisor
+ * calls of the programs sleep too since they run on the kernel save area of their thread,
+ * only a call on the stack of the CPU (one made by a kernel thread, or a program thread
+ * whose save area couldn't be allocated) can't give up the CPU, the request is driven
+ * from here then
+ * 
+ * @return int Return code of the request
+ */
+int css::request::wait()
+{
+	if(!timeshare::can_yield()) {
+		// The kernel is let go meanwhile, the boot CPU may take the interrupt of the
+		// request and needs the kernel lock to complete it
+		const unsigned int depth = timeshare::drop_kernel();
+		while(!(this->flags & css::request_flags::DONE)) {
+			timeshare::lock_kernel();
+			// The spooler can't run either, start the request if it's still queued
+			css::request_perform();
+			// Takes the status if it's pending, even with the I/O interrupts masked
+			css::handle_interrupt(this->schid);
+			timeshare::unlock_kernel();
+			base::cpu_relax();
+		}
+		timeshare::retake_kernel(depth);
+		base::acquire_barrier();
+		return this->retcode;
+	}
+
+	while(!(this->flags & css::request_flags::DONE)) {
+		timeshare::prepare_sleep(this);
+		// Checked again after going to sleep so a completion in between isn't lost
+		if(!(this->flags & css::request_flags::DONE))
+			io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+		timeshare::finish_sleep();
+	}
+	return this->retcode;
+}
+
 #if defined DEBUG
 #include <s390/dasd.hxx>
 
@@ -150,30 +197,67 @@ void css::request::dump() const
 }
 #endif
 
+namespace css {
+	static void request_complete(css::device& dev, css::request *req, int r);
+	static int request_start(css::device& dev);
+}
+/// @brief Hand the result of a request to it's owner
+/// @param dev Device the request was queued on
+/// @param req The request
+/// @param r Return code of the request
+static void css::request_complete(css::device& dev, css::request *req, int r)
+{
+#if defined DEBUG
+	debug_printf("CSS-%s", (r < 0) ? "Failure" : "Success");
+	req->dump();
+#endif
+	if(req->started_at != 0) {
+		const auto service_time = CSS_TOD_TO_USEC(s390_intrin::get_tod() - req->started_at);
+		dev.stats.service_time += service_time;
+		if(service_time > dev.stats.max_service_time)
+			dev.stats.max_service_time = service_time;
+	}
+	dev.stats.n_completed++;
+	if(r < 0)
+		dev.stats.n_failed++;
+	base::fetch_add(&dev.stats.n_queued, (uint32_t)-1);
+	req->retcode = r;
+	// The owner may destroy the request as soon as it sees DONE
+	base::release_barrier();
+	req->flags = css::request_flags::DONE;
+	timeshare::wakeup(req);
+}
+
 /**
- * @brief Perform one request from the request queue (better used on multithreading CSS/IO stuff) if any part
- * of the process fails the function will return and the queue will be left unaffected, the caller can then
- * retry the request or "drop" the request from the queue 
+ * @brief Start the request at the head of the queue of an idle device, if the start fails
+ * the request is completed right away with the failure
  * 
- * @return int Return code of the operation, negative means some kind of failure
+ * @param dev The device
+ * @return int 1 if a request was taken from the queue, 0 otherwise
  */
-int css::request_perform()
+static int css::request_start(css::device& dev)
 {
 	int r = 0;
 
-	auto& request_queue = *(g_queue.operator->());
+	// Must acquire the queue lock to proceed :)
+	if(!dev.queue.lock.try_lock()) return 0;
+	if(dev.queue.empty() || dev.active != nullptr) {
+		dev.queue.lock.unlock();
+		return 0;
+	}
 
-	// Must acquire the g_queue lock to proceed :)
-	if(!request_queue.lock.try_lock()) return 0;
-	if(request_queue.empty()) {
-		request_queue.lock.unlock();
+	auto *req = dev.queue[0];
+	// Wait for attention (aka. 3270 specifics, for example READ_CCW), the attention
+	// is recorded by the interrupt handler and holds the rest of the queue
+	if((req->flags & css::request_flags::WAIT_ATTENTION) && !dev.attention) {
+		dev.queue.lock.unlock();
 		return 0;
 	}
+	dev.queue.remove(static_cast<size_t>(0));
+	dev.queue.lock.unlock();
 
-	const size_t req_queue_idx = request_queue.size() - 1;
-	auto *req = request_queue[req_queue_idx];
 	const base::scoped_mutex lock1(req->lock);
-	debug_css_printf(req->schid, "Perform request #%u(flags=%x)", req_queue_idx, (unsigned int)req->flags);
+	debug_css_printf(req->schid, "Perform request (flags=%x)", (unsigned int)req->flags);
 
 	auto irb = css::irb{};
 	auto orb = css::orb{};
@@ -203,84 +287,124 @@ int css::request_perform()
 		}
 	}
 
-	// Test that our device is good to go
-	r = css::channel_test(req->schid, &irb);
-	debug_css_print(req->schid, "Test channel");
-	if(r == css::status::NOT_PRESENT && !(req->flags & css::request_flags::IGNORE_CC)) {
-		debug_css_print(req->schid, "Test channel failed");
-		r = error::EXPLICIT_FAILURE;
-		goto end;
-	}
-
-	// Wait for attention (aka. 3270 specifics, for example READ_CCW)
 	if(req->flags & css::request_flags::WAIT_ATTENTION) {
-		/// @todo Subsystem for repeated messages
-		debug_css_printf(req->schid, "Waiting for attention", 0);
-		// Loop until the attention bit is set or the device fails
-		long int timeout = 0;
-		while(!(irb.scsw.device_status & CSS_SCSW_DS_ATTENTION)) {
-			timeout++;
-			s390_intrin::wait_io();
-			// debug_css_print(req->schid, "Test channel (WA)");
-			r = css::channel_test(req->schid, &irb);
-			if(r == css::status::NOT_PRESENT && !(req->flags & css::request_flags::IGNORE_CC)) {
-				debug_css_print(req->schid, "Test channel failed (WA)");
-				r = error::EXPLICIT_FAILURE;
-				goto end;
-			}
-			if(timeout > 65535) {
-				r = error::TIMEOUT;
-				goto end;
-			}
-		}
+		debug_css_print(req->schid, "Attention received");
+		dev.attention = false;
 	}
 
-	/* Send the CSS program to the device */
+	/* Send the CSS program to the device, the interrupt handler takes it from here */
 	debug_css_print(req->schid, "Start channel");
+	req->started_at = s390_intrin::get_tod();
+	dev.stats.n_started++;
+	dev.stats.wait_time += CSS_TOD_TO_USEC(req->started_at - req->queued_at);
+	dev.active = req;
 	r = css::channel_start(req->schid, &orb);
 	if(r == css::status::NOT_PRESENT && !(req->flags & css::request_flags::IGNORE_CC)) {
 		debug_css_print(req->schid, "Start channel failed");
+		dev.active = nullptr;
 		r = error::EXPLICIT_FAILURE;
 		goto end;
 	}
-	
-	// Wait for the above start to fully commence, this will send our CSS program to the channel subsystem
-	// and thus our target device will perform said CSS program... we will just wait for it to respond.
-	/// @todo Do something else while this is being done
-	s390_intrin::wait_io();
-
-	// Obtain the results of the previous operation
-	debug_css_print(req->schid, "Test channel");
-	r = css::channel_test(req->schid, &irb);
-	if(r == css::status::NOT_PRESENT && !(req->flags & css::request_flags::IGNORE_CC)) {
-		debug_css_print(req->schid, "Test channel failed");
-		r = error::EXPLICIT_FAILURE;
-		goto end;
+	return 1;
+end:
+	css::request_complete(dev, req, r);
+	return 1;
+}
+
+/**
+ * @brief Start the requests of every idle subchannel, the requests are completed by the I/O
+ * interrupts of their subchannels so the spooler never waits for a device and the devices
+ * work in parallel
+ * 
+ * @return int Number of requests taken from the queues
+ */
+int css::request_perform()
+{
+	auto& devlist = *(g_devlist.operator->());
+	int n_started = 0;
+	for(size_t i = 0; i < devlist.size(); i++)
+		n_started += css::request_start(devlist[i]);
+	return n_started;
+}
+
+/**
+ * @brief Obtain what the spooler sleeps on while it has no requests it can start
+ * 
+ * @return const void* The wait channel
+ */
+const void *css::spooler_channel()
+{
+	return g_devlist.operator->();
+}
+
+/**
+ * @brief Handle an I/O interrupt for a subchannel, called from the I/O interrupt handler
+ * so no locks can be taken here, the interrupted code may be holding them
+ * 
+ * @param schid Subchannel that presented the interrupt
+ */
+void css::handle_interrupt(css::schid schid)
+{
+	auto *dev = css::get_device(schid);
+	if(dev == nullptr) {
+		debug_css_print(schid, "Interrupt for an unknown device");
+		return;
+	}
+
+	// Clear the status on the subchannel and keep it for the drivers
+	if(css::channel_test(schid, &dev->irb) != css::status::OK)
+		return;
+
+	auto *req = dev->active;
+	if(req == nullptr) {
+		// Unsolicited status, the spooler may have requests waiting for it
+		if(dev->irb.scsw.device_status & CSS_SCSW_DS_ATTENTION) {
+			debug_css_print(schid, "Attention");
+			dev->attention = true;
+			timeshare::wakeup(css::spooler_channel());
+		}
+		return;
 	}
 
+	// Intermediate status (i.e PCI), the channel program is still running
+	if(!(dev->irb.scsw.flags & (CSS_SCSW_SC_PRIMARY | CSS_SCSW_SC_SECONDARY)))
+		return;
+
+	int r = 0;
 	{
 		// Compare that the end address of the CSS request is equal to the last channel word, this must be set
 		// accordingly to know if the request was completed or not - if an application wants to know where the
-		// device failed at they can consult the IRB of their request and the CPA_ADDRESS will be unchanged
+		// device failed at they can consult the IRB of their device and the CPA_ADDRESS will be unchanged
 		// (because happy reminder that requests are not deleted, they're simply removed from the list of requests).
-		/// @todo Test if CPA_ADDR can be used to check where a CSS program failed
 		auto *end_ccw = &req->ccws.unsafe_at(req->ccws.size());
-		if((uintptr_t)irb.scsw.cpa_addr != (uintptr_t)end_ccw) {
-			debug_css_printf(req->schid, "Command chain not completed (CPA=%p,AD=%p)", (uintptr_t)irb.scsw.cpa_addr, end_ccw);
+		if((uintptr_t)dev->irb.scsw.cpa_addr != (uintptr_t)end_ccw && !(req->flags & css::request_flags::ALLOW_SHORT)) {
+			debug_css_printf(schid, "Command chain not completed (CPA=%p,AD=%p)", (uintptr_t)dev->irb.scsw.cpa_addr, end_ccw);
 			r = error::EXPLICIT_FAILURE;
-			goto end;
 		}
 	}
-end:
-#if defined DEBUG
-	debug_printf("CSS-%s", (r < 0) ? "Failure" : "Success");
-	req->dump();
-#endif
-	req->flags = css::request_flags::DONE;
-	req->retcode = r;
-	request_queue.remove(req_queue_idx);
-	request_queue.lock.unlock();
-	return (int)request_queue.size();
+	req->scsw = dev->irb.scsw;
+	dev->active = nullptr;
+	css::request_complete(*dev, req, r);
+	// The subchannel is free for the next request
+	timeshare::wakeup(css::spooler_channel());
+}
+
+void css::device_stats::dump(css::schid schid) const
+{
+	const size_t divisor = this->n_completed != 0 ? this->n_completed : 1;
+	kprintf("css %x:%x: queued=%u,max_queued=%u,started=%u,completed=%u,failed=%u\r\n", (unsigned int)schid.id, (unsigned int)schid.num, (size_t)this->n_queued, this->max_queued, this->n_started, this->n_completed, this->n_failed);
+	kprintf("css %x:%x: avg_wait=%uus,avg_service=%uus,max_service=%uus\r\n", (unsigned int)schid.id, (unsigned int)schid.num, (size_t)(this->wait_time / divisor), (size_t)(this->service_time / divisor), (size_t)this->max_service_time);
+}
+
+/**
+ * @brief Print the statistics of every device on the device list
+ * 
+ */
+void css::dump_stats()
+{
+	auto& devlist = *(g_devlist.operator->());
+	for(size_t i = 0; i < devlist.size(); i++)
+		devlist[i].stats.dump(devlist[i].schid);
 }
 
 /**
@@ -299,6 +423,7 @@ css::device::id css::add_device(css::schid schid)
 	const auto id = static_cast<css::device::id>(devlist.size() - 1);
 
 	/// @todo Check device is not duplicated!
+	storage::fill(dev, 0, sizeof(*dev));
 	dev->schid.id = schid.id;
 	dev->schid.num = schid.num;
 	return id;
@@ -442,8 +567,8 @@ int css::dev_enable(struct css::device& dev)
 	req->ccws[0].length = 0;
 
 	req->send();
-	while(!(req->flags & css::request_flags::DONE)) {}
+	const int r = req->wait();
 	css::request::destroy(req);
-	return req->retcode;
+	return r;
 }
 
@@ -8,6 +8,7 @@
 #include <mutex.hxx>
 
 #define MAX_CSS_REQUESTS 1024
+#define CSS_TOD_TO_USEC(x) ((x) >> 12) // Bit 51 of the TOD clock is a microsecond
 #define CSS_CCW_CD ((1) << S390_BIT(8, 0)) // Command chain word flags
 #define CSS_CCW_CC ((1) << S390_BIT(8, 1))
 #define CSS_CCW_SLI ((1) << S390_BIT(8, 2))
@@ -36,9 +37,15 @@
 #define CSS_ORB_LPM(x) ((x) << S390_BIT(32, 16)) // Logical path mask control
 #define CSS_ORB_MODIFIED_IDA(x) ((x) << S390_BIT(32, 25)) // Modified CCW indirect data addressing control
 #define CSS_ORB_EXTENSION(x) ((x) << S390_BIT(32, 31)) // ORB Extension Control
+#define CSS_SCSW_SC_PENDING ((1) << S390_BIT(32, 31)) // Status pending
+#define CSS_SCSW_SC_SECONDARY ((1) << S390_BIT(32, 30)) // Secondary status (device end)
+#define CSS_SCSW_SC_PRIMARY ((1) << S390_BIT(32, 29)) // Primary status (channel end)
 #define CSS_SCSW_DS_ATTENTION ((1) << S390_BIT(8, 0)) // Attention bit
+#define CSS_SCSW_DS_UNIT_CHECK ((1) << S390_BIT(8, 6)) // Unit check
 
 namespace css {
+	struct request;
+
 	/* Subchannel id */
 	struct schid {
 		uint16_t id;
@@ -184,6 +191,22 @@ namespace css {
 		ciw_t ciw[8];
 	} __attribute__((packed, aligned(4)));
 
+	/// @brief Counters of the requests of a device, times are in microseconds
+	struct device_stats {
+		// Requests waiting on the queue, the active one included, it's decremented by
+		// the interrupt handler so it's updated atomically
+		base::atomic_word n_queued = 0;
+		size_t max_queued = 0; // Deepest the queue has been
+		size_t n_started = 0;
+		size_t n_completed = 0;
+		size_t n_failed = 0;
+		uint64_t wait_time = 0; // Time spent on the queue before being started
+		uint64_t service_time = 0; // Time from the start to the completion
+		uint64_t max_service_time = 0;
+
+		void dump(css::schid schid) const;
+	};
+
 	struct device {
 		using id = int16_t; // For safety!
 
@@ -196,6 +219,13 @@ namespace css {
 		css::schib schib;
 		css::senseid sense;
 		base::mutex lock;
+		// Requests waiting for the subchannel, started in the order they were sent
+		storage::concurrent_dynamic_list<css::request *> queue;
+		// Request started on the subchannel, the I/O interrupt handler completes it
+		css::request *volatile active;
+		// An unsolicited attention was presented while the subchannel was idle
+		volatile bool attention;
+		css::device_stats stats;
 	};
 
 	struct request {
@@ -205,6 +235,7 @@ namespace css {
 		static css::request *create(css::device& dev, size_t n_ccws);
 		static void destroy(css::request *req);
 		int send();
+		int wait();
 		void dump() const;
 
 		// Flags, used both to indicate the spooler how to operate & the status of this request
@@ -214,6 +245,12 @@ namespace css {
 		// Return code set by spooler, not valid until css::request_flags::DONE is set on flags
 		int retcode;
 		base::mutex lock;
+		uint64_t queued_at; // TOD clock when sent
+		uint64_t started_at; // TOD clock when started on the subchannel
+		// Status the channel program ended with (the residual count of the last CCW
+		// among it), kept here since the IRB of the device is overwritten by the
+		// next request, not valid until css::request_flags::DONE is set on flags
+		css::scsw scsw;
 	};
 
 	namespace request_flags {
@@ -221,6 +258,9 @@ namespace css {
 			MODIFY = 0x01,
 			IGNORE_CC = 0x02,
 			WAIT_ATTENTION = 0x04,
+			// The channel program may end before it's last CCW (i.e end of file or end of
+			// cylinder on a chained read), the caller inspects what was transferred
+			ALLOW_SHORT = 0x08,
 			/* Set by the spooler to indicate the request is done */
 			DONE = 0x10,
 		};
@@ -272,9 +312,12 @@ namespace css {
 
 	int init();
 	int request_perform();
+	const void *spooler_channel();
+	void handle_interrupt(css::schid schid);
 	css::device::id add_device(css::schid schid);
 	css::device *get_device(css::schid schid);
 	css::device *get_device(css::device::id id);
 	int probe();
 	int dev_enable(css::device& dev);
+	void dump_stats();
 }
@@ -55,9 +55,20 @@ struct dasd_disk_seek {
 	uint8_t record; /* Record */
 } __attribute__((packed, aligned(8)));
 
+/// @brief Count area of a record, as transferred by the read count CCWs
+struct dasd_count {
+	uint16_t cyl;
+	uint16_t head;
+	uint8_t record;
+	uint8_t key_len;
+	uint16_t data_len;
+} PACKED;
+
 namespace dasd {
 	static inline int read_single(virtual_disk::handle& dev, const virtual_disk::disk_loc& fdscb, void *buf, size_t n);
 	static inline int write_single(virtual_disk::handle& dev, const virtual_disk::disk_loc& fdscb, const void *buf, size_t n);
+	static int read_chain(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& end, void *buf, size_t n, size_t record_size, virtual_disk::disk_loc& next, bool& eof, virtual_disk::disk_record *records, size_t *n_records);
+	static int read_records(virtual_disk::handle& hdl, const virtual_disk::disk_record *records, size_t n_records, void *buf);
 }
 
 /// @brief Reads a single record/buffer
@@ -102,22 +113,14 @@ static inline int dasd::read_single(virtual_disk::handle& hdl, const virtual_dis
 	seek_ptr.record = static_cast<uint8_t>(loc.record);
 
 	req->send();
-	long long timer = 0;
-	while(!(req->flags & css::request_flags::DONE)) {
-		/** @todo This kludge is a very bad way to do this, we MUST find a way to not do this
-		 * like come on we have an spooler why can't we use it? */
-		/* ... */
-		timer++;
-		if(timer >= 0xffff * 16)
-			css::request_perform();
-	}
-	int r = req->retcode;
+	int r = req->wait();
+	const auto residual = req->scsw.count;
 	css::request::destroy(req);
 	if(r < 0) {
 		debug_printf("Not operational - drive was unplugged?");
 		return error::RESOURCE_UNAVAILABLE;
 	}
-	return (int)n - (int)dev.irb.scsw.count;
+	return (int)n - (int)residual;
 }
 
 /// @brief Writes a single record to a disk
@@ -161,23 +164,238 @@ static inline int dasd::write_single(virtual_disk::handle& hdl, const virtual_di
 	seek_ptr.record = static_cast<uint8_t>(loc.record);
 	
 	req->send();
-	long long timer = 0;
-	while(!(req->flags & css::request_flags::DONE)) {
-		/** @todo This kludge is a very bad way to do this, we MUST find a way to not do this
-		 * like come on we have an spooler why can't we use it? */
-		/* ... */
-		timer++;
-		if(timer >= 0xffff * 16) {
-			css::request_perform();
+	r = req->wait();
+	const auto residual = req->scsw.count;
+	css::request::destroy(req);
+	if(r != 0) {
+		debug_printf("Not operational - drive was unplugged?");
+		return error::RESOURCE_UNAVAILABLE;
+	}
+	return (int)n - (int)residual;
+}
+
+/// @brief Reads the records following a location with a single channel program, every
+/// record is read by a multitrack READ CKD data chained so the count lands on a separate
+/// area from the data, the program runs until as many records as fit on the buffer (at
+/// most DASD_MAX_CHAIN) are read or the device stops it (end of file, end of cylinder)
+/// @param hdl The disk device
+/// @param loc Location of the first record
+/// @param end Last track to read from, records past it are discarded
+/// @param buf Buffer to place the data of the records one after the other
+/// @param n Size of the buffer
+/// @param record_size Biggest record expected, longer records are truncated
+/// @param next Set to the location of the record following the last one read
+/// @param eof Set if the end of file record was reached
+/// @param records Optional, where each record was found
+/// @param n_records Capacity of records, incremented for each record read
+/// @return int Number of bytes read, 0 if no records could be read, negative is error
+static int dasd::read_chain(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& end, void *buf, size_t n, size_t record_size, virtual_disk::disk_loc& next, bool& eof, virtual_disk::disk_record *records, size_t *n_records)
+{
+	auto& dev = *css::get_device((css::device::id)((uintptr_t)hdl.driver_data));
+	dasd_disk_seek seek_ptr;
+	dasd_count counts[DASD_MAX_CHAIN];
+	// Every record is read into it's own slot of the buffer since the size of them isn't
+	// known until their count is read, they're packed afterwards, a buffer smaller than
+	// a record gets the start of a single one
+	size_t slot_size = record_size;
+	size_t n_slots = n / record_size;
+	if(n_slots == 0) {
+		slot_size = n;
+		n_slots = 1;
+	}
+	if(n_records != nullptr && *n_records != 0 && *n_records < n_slots)
+		n_slots = *n_records;
+	if(n_slots > DASD_MAX_CHAIN)
+		n_slots = DASD_MAX_CHAIN;
+	auto *slots = reinterpret_cast<uint8_t *>(buf);
+
+	debug_printf("Chain_Reading CYL=%i,HEAD=%i,RECORD=%i", (int)loc.cylinder, (int)loc.track, (int)loc.record);
+
+	auto *req = css::request::create(dev, 3 + n_slots * 2);
+	if(req == nullptr)
+		return error::ALLOCATION;
+	req->flags = css::request_flags::ALLOW_SHORT;
+
+	req->ccws[0].cmd = DASD_CMD_SEEK;
+	req->ccws[0].set_addr(&seek_ptr.block);
+	req->ccws[0].flags = CSS_CCW_CC;
+	req->ccws[0].length = 6;
+
+	// Orient the device on the record before the first one we want, R0 exists on
+	// every track so this works for the first record too
+	req->ccws[1].cmd = DASD_CMD_SEARCH;
+	req->ccws[1].set_addr(&seek_ptr.cyl);
+	req->ccws[1].flags = CSS_CCW_CC;
+	req->ccws[1].length = 5;
+
+	req->ccws[2].cmd = css::cmd::TIC;
+	req->ccws[2].set_addr(&req->ccws[1]);
+	req->ccws[2].flags = 0x00;
+	req->ccws[2].length = 0;
+
+	for(size_t i = 0; i < n_slots; i++) {
+		auto& count_ccw = req->ccws[3 + i * 2];
+		count_ccw.cmd = DASD_CMD_RD_CKD | DASD_CMD_MT;
+		count_ccw.set_addr(&counts[i]);
+		count_ccw.flags = CSS_CCW_CD;
+		count_ccw.length = (uint16_t)sizeof(dasd_count);
+
+		// Continuation of the above, the command code is ignored
+		auto& data_ccw = req->ccws[3 + i * 2 + 1];
+		data_ccw.cmd = 0;
+		data_ccw.set_addr(&slots[i * slot_size]);
+		data_ccw.flags = CSS_CCW_SLI | ((i + 1 < n_slots) ? CSS_CCW_CC : 0);
+		data_ccw.length = (uint16_t)slot_size;
+	}
+	// Counts that aren't transferred are left as an end of track marker
+	storage::fill(counts, (char)0xFF, sizeof(counts));
+
+	seek_ptr.block = 0;
+	seek_ptr.cyl = static_cast<uint16_t>(loc.cylinder);
+	seek_ptr.head = static_cast<uint16_t>(loc.track);
+	seek_ptr.record = static_cast<uint8_t>(loc.record - 1);
+
+	req->send();
+	int r = req->wait();
+	css::request::destroy(req);
+	if(r < 0) {
+		debug_printf("Not operational - drive was unplugged?");
+		return error::RESOURCE_UNAVAILABLE;
+	}
+
+	// Pack the records that belong to the range
+	size_t total = 0, max_records = 0;
+	if(records != nullptr && n_records != nullptr) {
+		max_records = *n_records;
+		*n_records = 0;
+	}
+	next = loc;
+	eof = false;
+	for(size_t i = 0; i < n_slots; i++) {
+		const auto& count = counts[i];
+		if(count.cyl == 0xFFFF && count.head == 0xFFFF)
+			break; // Not transferred
+		if(count.cyl > end.cylinder || (count.cyl == end.cylinder && count.head > end.track))
+			break; // Past the range
+		if(i > 0 && count.cyl == counts[i - 1].cyl && count.head == counts[i - 1].head && count.record <= counts[i - 1].record)
+			break; // Went around the track
+		if(count.record == 0)
+			continue; // Record zero holds no data
+		
+		next.cylinder = count.cyl;
+		next.track = count.head;
+		next.record = count.record;
+		if(count.data_len == 0) {
+			eof = true; // The next read will stop here too
+			break;
 		}
+
+		size_t len = count.data_len;
+		if(count.key_len + len > slot_size)
+			len = count.key_len < slot_size ? slot_size - count.key_len : 0;
+		if(len > n - total)
+			len = n - total;
+		// The records before it took at most their slots, so the data only moves down
+		auto *data = &slots[i * slot_size + count.key_len];
+		if(data != reinterpret_cast<uint8_t *>(buf) + total)
+			storage::move(reinterpret_cast<uint8_t *>(buf) + total, data, len);
+		total += len;
+		if(max_records != 0) {
+			records[*n_records].loc = next;
+			records[*n_records].size = len;
+			(*n_records)++;
+		}
+		next.record++;
+		if(total >= n || (max_records != 0 && *n_records == max_records))
+			break;
 	}
-	r = req->retcode;
+	debug_printf("Chain read %u bytes, next CYL=%i,HEAD=%i,RECORD=%i", total, (int)next.cylinder, (int)next.track, (int)next.record);
+	return (int)total;
+}
+
+/// @brief Reads records of known location and size with a single channel program, the
+/// data CCWs point straight into the buffer so the data is only moved by the channel
+/// @param hdl The disk device
+/// @param records The records, one following the other on the same cylinder
+/// @param n_records Number of records, at most DASD_MAX_CHAIN
+/// @param buf Buffer to place the data of the records one after the other
+/// @return int Number of bytes of the records that were as expected, negative is error
+static int dasd::read_records(virtual_disk::handle& hdl, const virtual_disk::disk_record *records, size_t n_records, void *buf)
+{
+	auto& dev = *css::get_device((css::device::id)((uintptr_t)hdl.driver_data));
+	dasd_disk_seek seek_ptr;
+	dasd_count counts[DASD_MAX_CHAIN];
+	if(n_records > DASD_MAX_CHAIN)
+		n_records = DASD_MAX_CHAIN;
+
+	const auto& loc = records[0].loc;
+	debug_printf("Direct_Reading CYL=%i,HEAD=%i,RECORD=%i,N=%u", (int)loc.cylinder, (int)loc.track, (int)loc.record, n_records);
+
+	auto *req = css::request::create(dev, 3 + n_records * 2);
+	if(req == nullptr)
+		return error::ALLOCATION;
+	req->flags = css::request_flags::ALLOW_SHORT;
+
+	req->ccws[0].cmd = DASD_CMD_SEEK;
+	req->ccws[0].set_addr(&seek_ptr.block);
+	req->ccws[0].flags = CSS_CCW_CC;
+	req->ccws[0].length = 6;
+
+	req->ccws[1].cmd = DASD_CMD_SEARCH;
+	req->ccws[1].set_addr(&seek_ptr.cyl);
+	req->ccws[1].flags = CSS_CCW_CC;
+	req->ccws[1].length = 5;
+
+	req->ccws[2].cmd = css::cmd::TIC;
+	req->ccws[2].set_addr(&req->ccws[1]);
+	req->ccws[2].flags = 0x00;
+	req->ccws[2].length = 0;
+
+	size_t offset = 0;
+	for(size_t i = 0; i < n_records; i++) {
+		auto& count_ccw = req->ccws[3 + i * 2];
+		count_ccw.cmd = DASD_CMD_RD_CKD | DASD_CMD_MT;
+		count_ccw.set_addr(&counts[i]);
+		count_ccw.flags = CSS_CCW_CD;
+		count_ccw.length = (uint16_t)sizeof(dasd_count);
+
+		// The size is known, so the data goes right after the previous record
+		auto& data_ccw = req->ccws[3 + i * 2 + 1];
+		data_ccw.cmd = 0;
+		data_ccw.set_addr(reinterpret_cast<uint8_t *>(buf) + offset);
+		data_ccw.flags = CSS_CCW_SLI | ((i + 1 < n_records) ? CSS_CCW_CC : 0);
+		data_ccw.length = (uint16_t)records[i].size;
+		offset += records[i].size;
+	}
+	storage::fill(counts, (char)0xFF, sizeof(counts));
+
+	seek_ptr.block = 0;
+	seek_ptr.cyl = static_cast<uint16_t>(loc.cylinder);
+	seek_ptr.head = static_cast<uint16_t>(loc.track);
+	seek_ptr.record = static_cast<uint8_t>(loc.record - 1);
+
+	req->send();
+	int r = req->wait();
 	css::request::destroy(req);
-	if(r != 0) {
+	if(r < 0) {
 		debug_printf("Not operational - drive was unplugged?");
 		return error::RESOURCE_UNAVAILABLE;
 	}
-	return (int)n - (int)dev.irb.scsw.count;
+
+	// Only the records found where and as big as expected are good, a record with a
+	// key would have placed it on the buffer too
+	size_t total = 0;
+	for(size_t i = 0; i < n_records; i++) {
+		const auto& count = counts[i];
+		if(count.cyl != records[i].loc.cylinder || count.head != records[i].loc.track || count.record != records[i].loc.record)
+			break;
+		if(count.key_len != 0 || count.data_len != records[i].size)
+			break;
+		total += records[i].size;
+		g_disk_loc = records[i].loc;
+		g_disk_loc.record++;
+	}
+	return (int)total;
 }
 
 int dasd::init(css::device::id id)
@@ -213,6 +431,8 @@ int dasd::init(css::device::id id)
 				}
 				continue;
 			}
+			// Same as reads, the location following the record is kept
+			loc.record++;
 			g_disk_loc = loc;
 			return r;
 		}
@@ -255,6 +475,57 @@ int dasd::init(css::device::id id)
 		return error::RESOURCE_EXPECTED;
 	};
 
+	/// @brief Read the records of a range of tracks, moving to the next track or cylinder
+	/// when the one we're at has no more records
+	/// @param dev Disk device
+	/// @param diskloc Location to start reading at
+	/// @param end Last track to read
+	/// @param buf The buffer to read into
+	/// @param size Size of the buffer
+	/// @param record_size Size of the biggest record
+	/// @param records Optional, filled with where each record was found
+	/// @param n_records Capacity of records, set to the number of records read
+	/// @return int Number of bytes read, 0 at the end of the range or the file
+	driver->read_disk_extent = [](virtual_disk::handle& hdl, const virtual_disk::disk_loc& diskloc, const virtual_disk::disk_loc& end, void *buf, size_t size, size_t record_size, virtual_disk::disk_record *records, size_t *n_records) -> int {
+		const size_t max_records = n_records != nullptr ? *n_records : 0;
+		auto loc = diskloc;
+		int errcnt = 0;
+		while(errcnt < 3) {
+			if(loc.cylinder > end.cylinder || (loc.cylinder == end.cylinder && loc.track > end.track))
+				break;
+
+			virtual_disk::disk_loc next;
+			bool eof;
+			if(n_records != nullptr)
+				*n_records = max_records;
+			const int r = dasd::read_chain(hdl, loc, end, buf, size, record_size, next, eof, records, n_records);
+			if(r < 0)
+				return r;
+			g_disk_loc = next;
+			if(r > 0 || eof)
+				return r;
+
+			// No record found here, try the next track and then the next cylinder
+			errcnt++;
+			if(errcnt == 1) {
+				loc.record = 1;
+				loc.track++;
+			} else if(errcnt == 2) {
+				loc.record = 1;
+				loc.track = 0;
+				loc.cylinder++;
+			}
+		}
+		g_disk_loc = loc;
+		if(n_records != nullptr)
+			*n_records = 0;
+		return 0;
+	};
+
+	driver->read_disk_records = [](virtual_disk::handle& hdl, const virtual_disk::disk_record *records, size_t n_records, void *buf) -> int {
+		return dasd::read_records(hdl, records, n_records, buf);
+	};
+
 	driver->get_last_disk_loc = [](virtual_disk::handle& hdl) {
 		return g_disk_loc;
 	};
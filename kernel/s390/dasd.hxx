@@ -9,6 +9,10 @@
 #define DASD_CMD_WR_LD 0x0D
 #define DASD_CMD_LD 0x0E
 #define DASD_CMD_SEARCH 0x31
+#define DASD_CMD_RD_CKD 0x1E // Read count, key and data
+#define DASD_CMD_MT 0x80 // Multitrack, continue on the next track of the cylinder
+
+#define DASD_MAX_CHAIN 32 // Records read by a single channel program
 
 namespace dasd {
 	int init(css::device::id id);
@@ -4,9 +4,12 @@
 #include <s390/asm.hxx>
 #include <s390/handlers.hxx>
 #include <s390/css.hxx>
+#include <s390/smp.hxx>
 #include <storage.hxx>
 #include <printf.hxx>
 #include <timeshr.hxx>
+#include <aio.hxx>
+#include <pgcache.hxx>
 
 // The first function called (kinit) uses a prologue and epilogue to perform the stack stuff
 // however this uses an additional 72+REGAREA bytes which overwrites important data, sometimes
@@ -74,12 +77,22 @@ ALIGNED(4) NAKED_FUNC void asm_svc_handler() noexcept
 {
 	asm volatile(
 		"STMG %%r0,%%r15,%0\r\n" // 0 - save area
-		"LARL %%r15,%1\r\n" // 1 - stack
+		"LG %%r15,%1\r\n" // 1 - stack of the CPU
+		// The calls of the programs go on the kernel save area of their thread so they
+		// can sleep, the ones made from the kernel stay on the stack of the CPU
+		"TM %4,1\r\n" // 4 - problem state bit of the old psw
+		"JZ 0f\r\n"
+		"LG %%r14,%5\r\n" // 5 - kernel save area
+		"LTGR %%r14,%%r14\r\n"
+		"JZ 0f\r\n"
+		"LGR %%r15,%%r14\r\n"
+		"0:\r\n"
 		"BRASL %%r14,%2\r\n" // 2 - handler
 		"LMG %%r0,%%r15,%0\r\n"
 		"LPSWE %3\r\n" // 3 - old psw
 		:
-		: "i"((uintptr_t)PSA_FLCGRSAV), "i"(STACK_TOP(int_stack)), "i"((uintptr_t)&asc_svc_handler), "i"((uintptr_t)&g_psa.svc_old_psw)
+		: "i"((uintptr_t)PSA_FLCGRSAV), "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&asc_svc_handler), "i"((uintptr_t)&g_psa.svc_old_psw),
+		"i"((uintptr_t)&g_psa.svc_old_psw + 1), "i"((uintptr_t)PSA_FLCSVCSTK)
 		:
 	);
 }
@@ -88,12 +101,12 @@ ALIGNED(4) NAKED_FUNC void asm_io_handler() noexcept
 {
 	asm volatile(
 		"STMG %%r0,%%r15,%0\r\n" // 0 - save area
-		"LARL %%r15,%1\r\n" // 1 - stack
+		"LG %%r15,%1\r\n" // 1 - stack of the CPU
 		"BRASL %%r14,%2\r\n" // 2 - handler
 		"LMG %%r0,%%r15,%0\r\n"
 		"LPSWE %3\r\n" // 3 - old psw
 		:
-		: "i"((uintptr_t)PSA_FLCGRSAV), "i"(STACK_TOP(int_stack)), "i"((uintptr_t)&asc_io_handler), "i"((uintptr_t)&g_psa.io_old_psw)
+		: "i"((uintptr_t)PSA_FLCGRSAV), "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&asc_io_handler), "i"((uintptr_t)&g_psa.io_old_psw)
 		:
 	);
 }
@@ -102,12 +115,12 @@ ALIGNED(4) NAKED_FUNC void asm_pc_handler() noexcept
 {
 	asm volatile(
 		"STMG %%r0,%%r15,%0\r\n" // 0 - save area
-		"LARL %%r15,%1\r\n" // 1 - stack
+		"LG %%r15,%1\r\n" // 1 - stack of the CPU
 		"BRASL %%r14,%2\r\n" // 2 - handler
 		"LMG %%r0,%%r15,%0\r\n"
 		"LPSWE %3\r\n" // 3 - old psw
 		:
-		: "i"((uintptr_t)PSA_FLCGRSAV), "i"(STACK_TOP(int_stack)), "i"((uintptr_t)&asc_pc_handler), "i"((uintptr_t)&g_psa.pc_old_psw)
+		: "i"((uintptr_t)PSA_FLCGRSAV), "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&asc_pc_handler), "i"((uintptr_t)&g_psa.pc_old_psw)
 		:
 	);
 }
@@ -116,12 +129,12 @@ ALIGNED(4) NAKED_FUNC void asm_mc_handler() noexcept
 {
 	asm volatile(
 		"STMG %%r0,%%r15,%0\r\n" // 0 - save area
-		"LARL %%r15,%1\r\n" // 1 - stack
+		"LG %%r15,%1\r\n" // 1 - stack of the CPU
 		"BRASL %%r14,%2\r\n" // 2 - handler
 		"LMG %%r0,%%r15,%0\r\n"
 		"LPSWE %3\r\n" // 3 - old psw
 		:
-		: "i"((uintptr_t)PSA_FLCGRSAV), "i"(STACK_TOP(int_stack)), "i"((uintptr_t)&asc_mc_handler), "i"((uintptr_t)&g_psa.mc_old_psw)
+		: "i"((uintptr_t)PSA_FLCGRSAV), "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&asc_mc_handler), "i"((uintptr_t)&g_psa.mc_old_psw)
 		:
 	);
 }
@@ -130,12 +143,12 @@ ALIGNED(4) NAKED_FUNC void asm_ext_handler() noexcept
 {
 	asm volatile(
 		"STMG %%r0,%%r15,%0\r\n" // 0 - save area
-		"LARL %%r15,%1\r\n" // 1 - stack
+		"LG %%r15,%1\r\n" // 1 - stack of the CPU
 		"BRASL %%r14,%2\r\n" // 2 - handler
 		"LMG %%r0,%%r15,%0\r\n"
 		"LPSWE %3\r\n" // 3 - old psw
 		:
-		: "i"((uintptr_t)PSA_FLCGRSAV), "i"(STACK_TOP(int_stack)), "i"((uintptr_t)&asc_external_handler), "i"((uintptr_t)&g_psa.external_old_psw)
+		: "i"((uintptr_t)PSA_FLCGRSAV), "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&asc_external_handler), "i"((uintptr_t)&g_psa.external_old_psw)
 		:
 	);
 }
@@ -159,6 +172,11 @@ ALIGNED(4) void init() noexcept
 	static_assert(sizeof(uintptr_t) == 4);
 #endif
 	s390_intrin::lcreg0(S390_CR0_AFP_REGISTER);
+
+	// We're the first CPU of the scheduler, the others get their own stacks
+	*reinterpret_cast<volatile uintptr_t *>(PSA_FLCCPUIDX) = 0;
+	*reinterpret_cast<volatile uintptr_t *>(PSA_FLCINTSTK) = STACK_TOP(int_stack);
+	*reinterpret_cast<volatile uintptr_t *>(PSA_FLCSVCSTK) = 0;
 	
 	// Register the interrupt handler PSWs so they are used when something happens and we
 	// can handle that accordingly
@@ -241,40 +259,25 @@ extern "C" {
 	}
 }
 
-ALIGNED(4) NAKED_FUNC void smp_cpu_stub()
-{
-	asm volatile("J .");
-}
-
 static void spooler_thread_fn() {
 	while(1) {
+		// Requests are only started here, the I/O interrupts complete them and wake
+		// us up when a subchannel is free again
+		timeshare::prepare_sleep(css::spooler_channel());
 		/// @todo This is required because mutexes deadlock because the SVC can't switch
 		/// tasks due to the fact that we don't support nested interrupts
-		s390_intrin::disable_int();
-		size_t rem_reqs = 0;
-		while((rem_reqs = css::request_perform()) != 0) {
-			// ...
-			debug_printf("rem_reqs=%u", rem_reqs);
-		}
-		s390_intrin::enable_int();
+		timeshare::disable();
+		size_t n_started = 0, n;
+		while((n = (size_t)css::request_perform()) != 0)
+			n_started += n;
+		debug_printf("n_started=%u", n_started);
+		timeshare::enable();
 		io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+		timeshare::finish_sleep();
 	}
 }
 
 void init_smp() noexcept {
-	kprintf("Waking up the other CPUs\r\n");
-	// The INITIAL RESET signal will make the CPU start at address 0, so we have to copy our little stub
-	// so it does not immediately recognize a PC exception.
-	storage::copy((void *)0x00, (void *)&smp_cpu_stub, 8);
-	for(size_t i = 0; i < MAX_CPUS; i++) {
-		int r;
-		if(i == s390_intrin::cpuid()) continue;
-
-		r = s390_intrin::signal((unsigned int)i, S390_SIGP_INIT_RESET);
-		if(r == 3) continue;
-		debug_printf("\x01\x21 CPU#%usigp=%i", i, r);
-	}
-
 	// Multitasking engine
 	kprintf("\x01\x09 the scheduler\r\n");
 	timeshare::init();
@@ -282,10 +285,19 @@ void init_smp() noexcept {
 	auto *spooler_task = timeshare::task::create(*sys_job, *"SPOOLER");
 	auto *spooler_thread = timeshare::thread::create(*sys_job, *spooler_task, 8192);
 	spooler_thread->set_pc((void *)&spooler_thread_fn, true);
+	if(async_io::init() != 0)
+		kpanic("Can't create the asynchronous I/O workers");
+	if(page_cache::start_writeback() != 0)
+		kpanic("Can't create the page writeback thread");
 	// Allow scheduling and un-sleep
 	sys_job->flags = static_cast<timeshare::job::flag>(sys_job->flags & (~timeshare::job::SLEEP));
 
 	// Kickstart the scheduler for the device spooler to start running.
-	s390_intrin::set_timer_delta(0xF420000);
+	s390_intrin::set_timer_delta(SCHED_USEC_TO_TOD(SCHED_TICK_USEC));
 	s390_intrin::enable_io();
+
+	// The other CPUs take threads from the scheduler once they're started
+	kprintf("Waking up the other CPUs\r\n");
+	const auto n_cpus = smp::start_cpus();
+	kprintf("%u CPUs online\r\n", n_cpus);
 }
@@ -7,6 +7,7 @@
 #include <s390/asm.hxx>
 #include <user.hxx>
 #include <s390/css.hxx>
+#include <s390/smp.hxx>
 
 struct s390_gcc_call_stack {
 	uint32_t backchain;
@@ -74,8 +75,8 @@ static inline void debug_frame_print(const volatile arch_dep::processor_context&
 	// Stack frame dump
 	debug_printf("Stack frame:");
 	const auto *job = timeshare::get_current_job();
-	const auto *task = &job->tasks[job->current_task];
-	const auto *thread = &task->threads[task->current_thread];
+	if(job == nullptr)
+		return;
 
 	size_t i = 0;
 	const auto *stack_frame = reinterpret_cast<const s390x_gcc_call_stack *>(job->virtual_to_real(reinterpret_cast<void *>(frame.r15)));
@@ -100,16 +101,42 @@ static inline void debug_frame_print(const volatile arch_dep::processor_context&
 #include <service.hxx>
 void asc_svc_handler()
 {
+	timeshare::scoped_kernel_lock kernel_lock;
 	volatile auto& frame = *reinterpret_cast<volatile arch_dep::processor_context *>(PSA_FLCGRSAV);
-	const uint16_t code = g_psa.svcint_code;
+	// io_svc always issues SVC 26, the service code is passed on R4
+	const uint16_t code = static_cast<uint16_t>(frame.r4);
 #if defined DEBUG
 	auto *old_psw = &g_psa.svc_old_psw;
 	const uint16_t ilc = g_psa.svcint_ilc;
-	debug_printf("SVC call (id %i) (len=%i) from %p", (int)code, (int)ilc, (uintptr_t)old_psw->address);
+	debug_printf("SVC call (id %i) (svc %i) (len=%i) from %p", (int)code, (int)g_psa.svcint_code, (int)ilc, (uintptr_t)old_psw->address);
 	debug_frame_print(frame);
 #endif
 	// uDOS native applications
-	frame.r4 = service::common(code, frame.r1, frame.r2, frame.r3, frame.r4);
+	auto *thread = timeshare::get_current_thread();
+	if(timeshare::enter_service()) {
+		// On the kernel save area of the thread, the call may sleep and whoever runs
+		// meanwhile takes the save areas of the CPU, so the program is kept here until
+		// the call returns, maybe on another CPU
+		arch_dep::processor_context caller;
+		caller.load_scratch_local();
+		caller.psw = g_psa.svc_old_psw;
+		caller.r4 = service::common(code, caller.r1, caller.r2, caller.r3, caller.r4);
+		caller.save_scratch_local();
+		g_psa.svc_old_psw = caller.psw;
+		// A call that slept was resumed holding the kernel lock, with the timer masked
+		s390_intrin::enable_int();
+		// The thread may have moved on the list while it slept
+		timeshare::leave_service(timeshare::get_current_thread());
+		return;
+	}
+	const auto r = service::common(code, frame.r1, frame.r2, frame.r3, frame.r4);
+	// The frame belongs to another thread if the call yielded, the caller gets the
+	// result once it is switched back in
+	if(timeshare::get_current_thread() == thread)
+		frame.r4 = r;
+	else if(thread != nullptr)
+		thread->context.r4 = r;
+	timeshare::leave_service(thread);
 }
 
 constinit static const char *pc_code_names[] = {
@@ -185,6 +212,7 @@ constinit static const char *pc_code_names[] = {
 static base::mutex pc_handler_lock;
 void asc_pc_handler()
 {
+	timeshare::scoped_kernel_lock kernel_lock;
 	base::scoped_mutex lock(pc_handler_lock);
 	arch_dep::processor_context& frame = *((arch_dep::processor_context *)PSA_FLCGRSAV);
 	while(pc_handler_lock.try_lock()) {}
@@ -193,13 +221,37 @@ void asc_pc_handler()
 	code &= ~(0x200 | 0x80); // According to the POP, the exceptions get 0x200 bitflag and 0x80 bitflags when PER is used
 	const char *codename = (code < sizeof(pc_code_names) / sizeof(pc_code_names[0])) ? pc_code_names[code] : pc_code_names[0];
 	auto* job = timeshare::get_current_job();
-	debug_printf("PC %s (code=%x) occoured at %p,Job=%uTask=%u codename", code, old_pc_psw->address, timeshare::get_current_jobid(), job->current_task);
+	// An idle CPU only runs the kernel
+	if(job == nullptr)
+		kpanic("PC %s (code=%x) while idle at %p", codename, code, old_pc_psw->address);
+#if MACHINE >= M_ZARCH
+	// Segment or page translation on a reserved area that wasn't populated yet, the
+	// instruction was nullified so it's executed again once the page is there
+	if((code == 0x10 || code == 0x11) && job->aspace != nullptr) {
+		const auto addr = static_cast<uintptr_t>(g_psa.trans_exc_id) & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+		if(job->aspace->fault(reinterpret_cast<void *>(addr)) == 0)
+			return;
+	}
+	// Store on a page shared copy-on-write, the instruction was suppressed so it's
+	// executed again once the page has a frame of it's own
+	if(code == 0x04 && job->aspace != nullptr) {
+		const auto addr = static_cast<uintptr_t>(g_psa.trans_exc_id) & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+		if(job->aspace->copy_on_write(reinterpret_cast<void *>(addr)) == 0) {
+			// Unlike nullification, suppression leaves the PSW past the instruction
+			old_pc_psw->address -= g_psa.pcint_ilc & 0x06;
+			return;
+		}
+	}
+#endif
+	auto *task = timeshare::get_current_task();
+	debug_printf("PC %s (code=%x) occoured at %p,Job=%u,Task=%s", codename, code, old_pc_psw->address, timeshare::get_current_jobid(), task->name);
 #if defined DEBUG
 	debug_frame_print(frame);
 #endif
-	job->remove(job->tasks[job->current_task]); // Kill faulting task
-	timeshare::schedule(); // Go to the next task instead
-	s390_intrin::set_timer_delta(0xF420000);
+	job->remove(*task); // Kill faulting task
+	// Go to the next task instead, the faulting one is never resumed so the CPU may
+	// wait if there is nothing else
+	timeshare::reschedule(old_pc_psw, false);
 }
 
 void asc_mc_handler()
@@ -210,13 +262,23 @@ void asc_mc_handler()
 void asc_external_handler()
 {
 	debug_printf("*** External ***");
-	timeshare::schedule();
-	s390_intrin::set_timer_delta(0xF420000);
+	// Another CPU wants something from us, our timer keeps running meanwhile
+	if(g_psa.extint_code == S390_EXTINT_EMERGENCY) {
+		smp::handle_ipi();
+		return;
+	}
+	// The scheduler programs the timer for when it's needed again
+	timeshare::scoped_kernel_lock kernel_lock;
+	timeshare::tick();
 }
 
 volatile int is_io_fire = 0;
 void asc_io_handler()
 {
 	debug_printf("*** I/O ***");
+	timeshare::scoped_kernel_lock kernel_lock;
+	// The subchannel that caused the interrupt is stored on the PSA
+	const auto *schid = reinterpret_cast<const volatile css::schid *>(&g_psa.subsystem_id);
+	css::handle_interrupt(css::schid{ schid->id, schid->num });
 	is_io_fire = 1;
 }
@@ -0,0 +1,200 @@
+// smp.cxx
+//
+// Starts the other CPUs of the machine and lets them signal each other, each one is
+// given it's own low storage through prefixing so it takes it's interrupts on it's own
+
+#include <s390/smp.hxx>
+#include <s390/asm.hxx>
+#include <timeshr.hxx>
+#include <storage.hxx>
+#include <printf.hxx>
+
+static_assert(SMP_MAX_CPUS == SCHED_MAX_CPUS);
+
+constinit static storage::global_wrapper<smp::table> g_smp;
+
+void smp_start() noexcept;
+namespace smp {
+	static void cpu_main();
+	static int order(unsigned int addr, unsigned int code, uintptr_t param);
+	static unsigned int take_ipis(unsigned int mask);
+}
+
+/// @brief Where a started CPU begins, the restart PSW of it's low storage points here
+ALIGNED(4) NAKED_FUNC void smp_start() noexcept
+{
+	asm volatile(
+		"LG %%r15,%0\r\n" // 0 - stack of the CPU
+		"BRASL %%r14,%1\r\n" // 1 - never returns
+		:
+		: "i"((uintptr_t)PSA_FLCINTSTK), "i"((uintptr_t)&smp::cpu_main)
+		:
+	);
+}
+
+static void smp::cpu_main()
+{
+	const auto idx = smp::cpu_index();
+	// The reset cleared the control registers, the I/O interrupts are left to the
+	// boot CPU so CR6 stays clear
+	s390_intrin::lcreg0(g_smp->cr0);
+	g_smp->cpus[idx].online = true;
+	// Programs our timer too
+	timeshare::cpu_online(idx);
+	debug_printf("CPU#%u online", idx);
+
+	// Another CPU signals us when it gives us a thread
+	const auto psw = smp::idle_psw();
+	asm volatile("LPSWE %0\r\n" : : "Q"(psw) : );
+	__builtin_unreachable();
+}
+
+/// @brief Signal a CPU, retrying while it's busy with an earlier order
+/// @return int Condition code of the last signal
+static int smp::order(unsigned int addr, unsigned int code, uintptr_t param)
+{
+	int cc;
+	while((cc = s390_intrin::signal(addr, code, param)) == 2)
+		base::cpu_relax();
+	return cc;
+}
+
+/// @brief Start the other CPUs, each one gets a copy of our low storage as it's prefix
+/// area and an interrupt stack of it's own, the scheduler must be running
+/// @return size_t CPUs online, including us
+size_t smp::start_cpus()
+{
+	auto& smp = *(g_smp.operator->());
+	storage::fill(&smp, 0, sizeof(smp));
+	smp.cr0 = s390_intrin::stcreg0();
+	const auto self = s390_intrin::cpuid();
+	smp.cpus[0].address = static_cast<uint16_t>(self);
+	smp.cpus[0].online = true;
+	smp.n_cpus = 1;
+
+	// The PSA_FLC* fields are addresses on low storage, so they're offsets on a copy of it
+	const auto psa_field = [](void *prefix, void *field) {
+		return reinterpret_cast<volatile uintptr_t *>(static_cast<uint8_t *>(prefix) + (reinterpret_cast<uintptr_t>(field) - reinterpret_cast<uintptr_t>(&g_psa)));
+	};
+	for(unsigned int addr = 0; addr < MAX_CPUS && smp.n_cpus < SMP_MAX_CPUS; addr++) {
+		// There is no CPU on the address
+		if(addr == self || s390_intrin::signal(addr, S390_SIGP_SENSE) == 3)
+			continue;
+
+		const auto idx = smp.n_cpus;
+		auto& data = smp.cpus[idx];
+		data.prefix = storage::allocz(SMP_PREFIX_SIZE, SMP_PREFIX_SIZE);
+		data.int_stack = storage::allocz(SMP_INT_STACK_SIZE, 8);
+		if(data.prefix == nullptr || data.int_stack == nullptr) {
+			kprintf("CPU#%u can't be started, out of storage\r\n", (size_t)addr);
+			break;
+		}
+		data.address = static_cast<uint16_t>(addr);
+		// Takes it's interrupts like we do, it only restarts somewhere else
+		storage::copy(data.prefix, &g_psa, SMP_PREFIX_SIZE);
+		auto& psa = *static_cast<processor_storage_area *>(data.prefix);
+		psa.restart_new_psw = s390_default_psw(PSW_DEFAULT_ARCHMODE, &smp_start);
+		*psa_field(data.prefix, PSA_FLCCPUIDX) = idx;
+		*psa_field(data.prefix, PSA_FLCINTSTK) = reinterpret_cast<uintptr_t>(data.int_stack) + SMP_INT_STACK_SIZE - STACK_FRAME_SIZE;
+		*psa_field(data.prefix, PSA_FLCSVCSTK) = 0; // Copied from ours, it runs no thread yet
+
+		// The prefix can only be set on a stopped CPU
+		if(smp::order(addr, S390_SIGP_INIT_RESET, 0) != 0
+		|| smp::order(addr, S390_SIGP_SET_PREFIX, reinterpret_cast<uintptr_t>(data.prefix)) != 0
+		|| smp::order(addr, S390_SIGP_RESTART, 0) != 0) {
+			kprintf("CPU#%u can't be started\r\n", (size_t)addr);
+			storage::free(data.prefix);
+			storage::free(data.int_stack);
+			data = smp::cpu_data{};
+			continue;
+		}
+		debug_printf("CPU#%u started as %u", (size_t)addr, idx);
+		smp.n_cpus++;
+	}
+	return smp.n_cpus;
+}
+
+/// @brief Ask another CPU to do something, the request is merged with the ones it
+/// hasn't taken yet so a single emergency signal is sent for all of them
+/// @param what smp::ipi requests
+void smp::send_ipi(size_t cpu, unsigned int what)
+{
+	if(cpu >= g_smp->n_cpus || !g_smp->cpus[cpu].online)
+		return;
+	auto& data = g_smp->cpus[cpu];
+	uint32_t pending = data.ipi_pending, old;
+	while((old = base::compare_and_swap(&data.ipi_pending, pending, pending | what)) != pending)
+		pending = old;
+	// A signal is on it's way already, the CPU takes our request along with it
+	if(pending != 0)
+		return;
+	base::fetch_add(&data.n_ipis, 1);
+	smp::order(data.address, S390_SIGP_EGCY_CALL, 0);
+}
+
+/// @brief Take the requests sent to us
+/// @param mask Requests to take, the others are left for later
+/// @return unsigned int Requests taken
+static unsigned int smp::take_ipis(unsigned int mask)
+{
+	auto& data = g_smp->cpus[smp::cpu_index()];
+	uint32_t pending;
+	while(((pending = data.ipi_pending) & mask) != 0) {
+		// The sender waits for the request to be cleared, so we purge first
+		if(pending & mask & smp::IPI_PURGE_TLB)
+			asm volatile("PTLB\r\n" : : : "memory");
+		if(base::compare_and_swap(&data.ipi_pending, pending, pending & ~mask) == pending)
+			return pending & mask;
+	}
+	return 0;
+}
+
+/// @brief Called from the external interrupt handler when another CPU signals us, the
+/// TLB is purged before taking the kernel lock since the sender may be holding it
+void smp::handle_ipi()
+{
+	const auto taken = smp::take_ipis(smp::IPI_RESCHEDULE | smp::IPI_PURGE_TLB);
+	if(taken & smp::IPI_RESCHEDULE) {
+		timeshare::scoped_kernel_lock lock;
+		timeshare::preempt();
+	}
+}
+
+/// @brief Purge the TLB if asked to, called while spinning with the interrupts masked
+/// so a CPU waiting for us to purge doesn't wait forever
+void smp::poll_ipis()
+{
+	smp::take_ipis(smp::IPI_PURGE_TLB);
+}
+
+/// @brief Purge the TLB of every CPU, needed for the changes IPTE and IDTE can't
+/// invalidate on all of them, returns once every CPU has done it
+void smp::purge_tlb()
+{
+	asm volatile("PTLB\r\n" : : : "memory");
+	const auto self = smp::cpu_index();
+	for(size_t i = 0; i < g_smp->n_cpus; i++)
+		if(i != self)
+			smp::send_ipi(i, smp::IPI_PURGE_TLB);
+	base::fetch_add(&g_smp->cpus[self].n_purges, 1);
+
+	for(size_t i = 0; i < g_smp->n_cpus; i++) {
+		if(i == self || !g_smp->cpus[i].online)
+			continue;
+		// It may be waiting for us to do the same
+		base::backoff backoff;
+		while(g_smp->cpus[i].ipi_pending & smp::IPI_PURGE_TLB) {
+			smp::poll_ipis();
+			backoff.wait();
+		}
+	}
+}
+
+/// @brief Obtain what is known of a CPU, for the statistics of the scheduler
+/// @return const smp::cpu_data* nullptr if there is no such CPU
+const smp::cpu_data *smp::get_cpu(size_t cpu)
+{
+	if(cpu >= g_smp->n_cpus)
+		return nullptr;
+	return &g_smp->cpus[cpu];
+}
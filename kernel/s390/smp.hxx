@@ -0,0 +1,56 @@
+#ifndef SMP_HXX
+#define SMP_HXX
+
+#include <types.hxx>
+#include <s390/asm.hxx>
+#include <mutex.hxx>
+
+#define SMP_MAX_CPUS 8 // Same as SCHED_MAX_CPUS, the scheduler can't run threads on more
+#define SMP_PREFIX_SIZE 0x2000 // The prefix area holds the whole 8K of low storage
+#define SMP_INT_STACK_SIZE 8192
+
+namespace smp {
+	/// @brief Requests sent to another CPU with an emergency signal, they're merged
+	/// while the CPU hasn't taken the signal
+	enum ipi {
+		IPI_RESCHEDULE = 0x01, // Look at the run queues, a thread was given to an idle CPU
+		IPI_PURGE_TLB = 0x02, // The TLB may have entries of a removed translation
+	};
+
+	struct cpu_data {
+		void *prefix; // Low storage of the CPU, a copy of the one of the boot CPU
+		void *int_stack;
+		base::atomic_word ipi_pending; // smp::ipi requests not yet taken
+		base::atomic_word n_ipis; // Emergency signals sent to it
+		base::atomic_word n_purges; // TLB purges it broadcast
+		uint16_t address; // Used to signal it
+		bool online;
+	};
+
+	struct table {
+		smp::cpu_data cpus[SMP_MAX_CPUS];
+		size_t n_cpus;
+		arch_dep::register_t cr0; // The other CPUs start with the controls of the boot CPU
+	};
+
+	/// @brief Index of the CPU we're running on, stored on it's low storage
+	inline size_t cpu_index()
+	{
+		return *reinterpret_cast<volatile const uintptr_t *>(PSA_FLCCPUIDX);
+	}
+
+	/// @brief PSW of an idle CPU, it waits for an interrupt of the timer or another CPU
+	inline s390_default_psw idle_psw()
+	{
+		return s390_default_psw(PSW_DEFAULT_ARCHMODE | PSW_ENABLE_MCI | PSW_IO_INT | PSW_EXTERNAL_INT | PSW_WAIT_STATE, (void *)nullptr);
+	}
+
+	size_t start_cpus();
+	void send_ipi(size_t cpu, unsigned int what);
+	void handle_ipi();
+	void poll_ipis();
+	void purge_tlb();
+	const smp::cpu_data *get_cpu(size_t cpu);
+}
+
+#endif
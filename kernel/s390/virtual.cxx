@@ -2,11 +2,232 @@
 #include <storage.hxx>
 #include <printf.hxx>
 
+// Set when the enhanced DAT facility 1 is installed, segment entries may then map
+// a whole 1 MiB frame
+constinit static bool g_large_segments = false;
+// Set when IDTE is installed, otherwise the TLB is purged when a segment entry changes
+constinit static bool g_idte = false;
+constinit static storage::global_wrapper<virtual_storage::rmap_table> g_rmap;
+
+namespace virtual_storage {
+	static size_t rmap_bucket(uintptr_t physaddr);
+	static int rmap_add(virtual_storage::address_space& aspace, uintptr_t virtaddr, uintptr_t physaddr, bool large);
+	static size_t rmap_remove(virtual_storage::address_space& aspace, uintptr_t virtaddr, uintptr_t physaddr, bool large);
+	static int set_page(virtual_storage::address_space& aspace, virtual_storage::page_entry& pte, uintptr_t virtaddr, uintptr_t physaddr, int flags);
+	static void invalidate_page(virtual_storage::page_entry& pte, uintptr_t virtaddr);
+	static void invalidate_segment(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr);
+	static size_t clear_page(virtual_storage::address_space& aspace, virtual_storage::page_entry& pte, uintptr_t virtaddr);
+	static void clear_segment(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr);
+	static virtual_storage::page_entry *get_pagetab(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr);
+	static bool is_mapped(const virtual_storage::address_space& aspace, uintptr_t virtaddr);
+	static virtual_storage::area *find_area(virtual_storage::address_space& aspace, uintptr_t virtaddr, size_t size);
+	static void release_area(virtual_storage::address_space& aspace, virtual_storage::area& area);
+}
+
 int virtual_storage::init()
 {
+	auto& rmap = *(g_rmap.operator->());
+	storage::fill(&rmap, 0, sizeof(rmap));
+#if MACHINE >= M_ZARCH
+	// Facility bit 8, stored by STFL on the PSA at boot
+	const auto *facl = reinterpret_cast<volatile const uint8_t *>(&g_psa.stfl_facility_list);
+	g_large_segments = (facl[1] & PSA_FLCFACL1_DAT) != 0;
+	g_idte = (facl[0] & PSA_FLCFACL0_IDTE) != 0;
+	// The format control of the segment entries is only honoured with EDAT enabled
+	if(g_large_segments)
+		s390_intrin::lcreg0(s390_intrin::stcreg0() | S390_CR0_EDATED);
+#endif
+	debug_printf("EDAT-1 large segments %s", g_large_segments ? "enabled" : "disabled");
+	return 0;
+}
+
+static size_t virtual_storage::rmap_bucket(uintptr_t physaddr)
+{
+	return (physaddr >> virtual_storage::page_shift) % virtual_storage::rmap_buckets;
+}
+
+/// @brief Record that a frame is mapped at a virtual address of the address space
+static int virtual_storage::rmap_add(virtual_storage::address_space& aspace, uintptr_t virtaddr, uintptr_t physaddr, bool large)
+{
+	auto *entry = storage::alloc<virtual_storage::rmap_entry>(sizeof(virtual_storage::rmap_entry));
+	if(entry == nullptr)
+		return error::ALLOCATION;
+	entry->aspace = &aspace;
+	entry->virtaddr = virtaddr;
+	entry->physaddr = physaddr;
+	entry->large = large;
+
+	base::scoped_mutex lock(g_rmap->lock);
+	auto& head = g_rmap->buckets[virtual_storage::rmap_bucket(physaddr)];
+	entry->next = head;
+	head = entry;
+	g_rmap->n_entries++;
 	return 0;
 }
 
+/// @brief Drop the record of a mapping
+/// @return size_t Mappings of the frame left, the frame may be given back once
+/// there are none
+static size_t virtual_storage::rmap_remove(virtual_storage::address_space& aspace, uintptr_t virtaddr, uintptr_t physaddr, bool large)
+{
+	virtual_storage::rmap_entry *entry = nullptr;
+	size_t n_left = 0;
+	{
+		base::scoped_mutex lock(g_rmap->lock);
+		auto **link = &g_rmap->buckets[virtual_storage::rmap_bucket(physaddr)];
+		while(*link != nullptr) {
+			auto *e = *link;
+			if(entry == nullptr && e->aspace == &aspace && e->virtaddr == virtaddr && e->physaddr == physaddr && e->large == large) {
+				*link = e->next;
+				entry = e;
+				g_rmap->n_entries--;
+				continue;
+			}
+			if(e->physaddr == physaddr && e->large == large)
+				n_left++;
+			link = &e->next;
+		}
+	}
+	debug_assert(entry != nullptr);
+	if(entry != nullptr)
+		storage::free(entry);
+	return n_left;
+}
+
+/// @brief Invalidate a page entry and clear the TLB entries formed from it
+static void virtual_storage::invalidate_page(virtual_storage::page_entry& pte, uintptr_t virtaddr)
+{
+	// IPTE takes the origin of the table and picks the entry with the page index
+	auto *pagetab = &pte - ((virtaddr >> virtual_storage::page_shift) & 0xff);
+	asm volatile("IPTE %0,%1\r\n" : : "a"(pagetab), "a"(virtaddr) : "memory");
+	pte.entry = 0;
+	pte.invalid(true);
+}
+
+/// @brief Invalidate a segment entry and clear the TLB entries formed from it, the
+/// ones of the pages of it's table included
+static void virtual_storage::invalidate_segment(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr)
+{
+#if MACHINE >= M_ZARCH
+	if(g_idte) {
+		// Designation type 0 (segment table), the index is taken from the segment
+		// bits of the address and no additional entries are invalidated
+		const uintptr_t designation = reinterpret_cast<uintptr_t>(aspace.segtab);
+		const uintptr_t index = virtaddr & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1);
+		asm volatile(".insn rrf,0xB98E0000,%0,%1,0,0\r\n" : : "a"(designation), "a"(index) : "memory");
+		segment.entry = 0;
+		segment.invalid(true);
+		return;
+	}
+#endif
+	segment.entry = 0;
+	segment.invalid(true);
+	aspace.flush_tlb();
+}
+
+/// @brief Point a page entry to a frame, keeping the reverse map in sync
+static int virtual_storage::set_page(virtual_storage::address_space& aspace, virtual_storage::page_entry& pte, uintptr_t virtaddr, uintptr_t physaddr, int flags)
+{
+	if(!pte.invalid()) {
+		const auto old_physaddr = reinterpret_cast<uintptr_t>(pte.origin());
+		const bool owned = (pte.entry & S390_PTE_OWNED) != 0;
+		if(pte.entry == (physaddr | flags))
+			return 0;
+		// The translation may be cached, it can't be changed in place
+		virtual_storage::invalidate_page(pte, virtaddr);
+		// Mapped to the same frame, only the flags change
+		if(old_physaddr == physaddr) {
+			pte.entry = physaddr | flags;
+			return 0;
+		}
+		if(virtual_storage::rmap_remove(aspace, virtaddr, old_physaddr, false) == 0 && owned)
+			real_storage::free(reinterpret_cast<void *>(old_physaddr));
+	}
+
+	if(virtual_storage::rmap_add(aspace, virtaddr, physaddr, false) < 0)
+		return error::ALLOCATION;
+	pte.entry = physaddr | flags;
+	return 0;
+}
+
+/// @brief Unmap a page, a frame of the address space is given back with it's last mapping
+/// @return size_t Mappings of the frame left on any address space
+static size_t virtual_storage::clear_page(virtual_storage::address_space& aspace, virtual_storage::page_entry& pte, uintptr_t virtaddr)
+{
+	if(pte.invalid())
+		return 0;
+	auto *frame = pte.origin();
+	const bool owned = (pte.entry & S390_PTE_OWNED) != 0;
+	const auto n_left = virtual_storage::rmap_remove(aspace, virtaddr, reinterpret_cast<uintptr_t>(frame), false);
+	virtual_storage::invalidate_page(pte, virtaddr);
+	if(n_left == 0 && owned)
+		real_storage::free(frame);
+	return n_left;
+}
+
+/// @brief Unmap a whole segment, freeing it's page table
+static void virtual_storage::clear_segment(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr)
+{
+	if(segment.invalid())
+		return;
+
+	if(segment.large()) {
+		virtual_storage::rmap_remove(aspace, virtaddr, reinterpret_cast<uintptr_t>(segment.frame()), true);
+		virtual_storage::invalidate_segment(aspace, segment, virtaddr);
+		return;
+	}
+
+	// Invalidating the segment clears the translations of all it's pages at once
+	auto *pagetab = reinterpret_cast<virtual_storage::page_entry *>(segment.origin());
+	virtual_storage::invalidate_segment(aspace, segment, virtaddr);
+	for(size_t i = 0; i < virtual_storage::max_pages; i++) {
+		if(pagetab[i].invalid())
+			continue;
+		auto *frame = pagetab[i].origin();
+		if(virtual_storage::rmap_remove(aspace, virtaddr + (i << virtual_storage::page_shift), reinterpret_cast<uintptr_t>(frame), false) == 0
+		&& (pagetab[i].entry & S390_PTE_OWNED) != 0)
+			real_storage::free(frame);
+	}
+	real_storage::free(pagetab);
+}
+
+/// @brief Obtain the page table of a segment, allocating it if the segment is unmapped
+/// and splitting a large segment into pages, the lock must be held
+static virtual_storage::page_entry *virtual_storage::get_pagetab(virtual_storage::address_space& aspace, virtual_storage::segment_entry& segment, uintptr_t virtaddr)
+{
+	if(!segment.invalid() && !segment.large())
+		return reinterpret_cast<virtual_storage::page_entry *>(segment.origin());
+
+	/// @todo Keep track of VMM allocations with a key
+	auto *pagetab = reinterpret_cast<virtual_storage::page_entry *>(real_storage::alloc(sizeof(virtual_storage::page_entry) * virtual_storage::max_pages, virtual_storage::page_align));
+	if(pagetab == nullptr)
+		return nullptr;
+
+	// Invalidate all page entries
+	for(size_t i = 0; i < virtual_storage::max_pages; i++)
+		pagetab[i].invalid(true); // Mark as invalid
+
+	if(!segment.invalid()) {
+		// Keep the rest of the frame mapped as it was
+		const auto frame = reinterpret_cast<uintptr_t>(segment.frame());
+		const auto flags = segment.protection() ? S390_PTE_RDONLY : 0;
+		for(size_t i = 0; i < virtual_storage::max_pages; i++) {
+			const auto offset = i << virtual_storage::page_shift;
+			if(virtual_storage::set_page(aspace, pagetab[i], virtaddr + offset, frame + offset, flags) < 0) {
+				while(i-- > 0)
+					virtual_storage::clear_page(aspace, pagetab[i], virtaddr + (i << virtual_storage::page_shift));
+				real_storage::free(pagetab);
+				return nullptr;
+			}
+		}
+		virtual_storage::rmap_remove(aspace, virtaddr, frame, true);
+		virtual_storage::invalidate_segment(aspace, segment, virtaddr);
+	}
+	// Set the entry to the newly allocated pagetable
+	segment.entry = (uintptr_t)pagetab;
+	return pagetab;
+}
+
 virtual_storage::address_space *virtual_storage::address_space::create()
 {
 	auto *aspace = storage::allocz<virtual_storage::address_space>(sizeof(virtual_storage::address_space));
@@ -23,6 +244,15 @@ virtual_storage::address_space *virtual_storage::address_space::create()
 
 void virtual_storage::address_space::destroy(virtual_storage::address_space* aspace)
 {
+	// The pages populated on demand and the copies belong to the address space, they
+	// are given back once no clone maps them
+	for(size_t i = 0; i < virtual_storage::max_areas; i++)
+		if(aspace->areas[i].used)
+			virtual_storage::release_area(*aspace, aspace->areas[i]);
+	// Drop the mappings so the reverse map doesn't point to the address space
+	for(size_t i = 0; i < virtual_storage::max_segments; i++)
+		virtual_storage::clear_segment(*aspace, aspace->segtab[i], i << virtual_storage::segment_shift);
+	real_storage::free(aspace->segtab);
 	real_storage::free(aspace);
 }
 
@@ -44,30 +274,11 @@ int virtual_storage::address_space::map_page(void *virtaddr, void *physaddr, int
 	const size_t segment_idx = (_virtaddr >> virtual_storage::segment_shift) & 0x7ff; // SGX, 11-bits
 	const size_t page_idx = (_virtaddr >> virtual_storage::page_shift) & 0xff; // PTX, 8-bits
 
-	auto *segment = &this->segtab[segment_idx];
-	virtual_storage::page_entry *pagetab = nullptr;
-
-	// Entry is unmapped
-	if(segment->invalid()) {
-		/// @todo Keep track of VMM allocations with a key
-		pagetab = reinterpret_cast<virtual_storage::page_entry *>(real_storage::alloc(sizeof(virtual_storage::page_entry) * virtual_storage::max_pages, virtual_storage::page_align));
-		if(pagetab == nullptr) return error::ALLOCATION;
-		// Invalidate all page entries
-		for(size_t i = 0; i < virtual_storage::max_pages; i++)
-			pagetab[i].invalid(true); // Mark as invalid
-		// Set the entry to the newly allocated pagetable
-		segment->entry = (uintptr_t)pagetab;
-	}
-	// Entry is mapped already, take address
-	else {
-		// Take the address component from the segment entry
-		pagetab = reinterpret_cast<virtual_storage::page_entry *>(segment->origin());
-		if(pagetab == nullptr) return error::ALLOCATION;
-	}
+	auto *pagetab = virtual_storage::get_pagetab(*this, this->segtab[segment_idx], segment_idx << virtual_storage::segment_shift);
+	if(pagetab == nullptr) return error::ALLOCATION;
 
 	// And set the specific page to mapped
-	pagetab[page_idx].entry = _physaddr | flags;
-	return 0;
+	return virtual_storage::set_page(*this, pagetab[page_idx], _virtaddr, _physaddr, flags);
 }
 
 void *virtual_storage::address_space::virtual_to_real(void *virtaddr)
@@ -90,47 +301,393 @@ void *virtual_storage::address_space::virtual_to_real(void *virtaddr)
 	// Entry is unmapped
 	if(segment->invalid()) return nullptr;
 
+	// The whole segment is a single frame
+	if(segment->large())
+		return reinterpret_cast<void *>((uintptr_t)segment->frame() | (_virtaddr & (virtual_storage::segment_size - 1)));
+
 	// Take the address component from the segment entry
 	virtual_storage::page_entry *pagetab = (virtual_storage::page_entry *)segment->origin();
-	if(pagetab == nullptr) return nullptr;
+	if(pagetab == nullptr || pagetab[page_idx].invalid()) return nullptr;
 
 	// And set the specific page to mapped, don't forget to append the bits at the end
 	return reinterpret_cast<void *>((uintptr_t)pagetab[page_idx].origin() | ((uintptr_t)virtaddr & 0xfff));
 }
 
+/// @brief Find a virtual address the real address is mapped at, by looking up the
+/// frame on the reverse map
+/// @return void* Any of the virtual addresses when the frame is mapped more than once,
+/// nullptr if it's not mapped by this address space
 void *virtual_storage::address_space::phys2virt(void *physaddr)
 {
 	const auto _physaddr = reinterpret_cast<uintptr_t>(physaddr);
-	const base::scoped_mutex lock1(this->lock); // Acquire lock for ASPACE
-	for(size_t i = 0; i < virtual_storage::max_segments; i++) {
-		auto *segment = &this->segtab[i];
-		if(!segment->invalid()) {
-			for(size_t j = 0; j < virtual_storage::max_pages; j++) {
-				auto *pagetab = &(reinterpret_cast<virtual_storage::page_entry *>(segment->origin()))[j];
-				if(!pagetab->invalid()) {
-					// Physical address pointed here should also be on our side
-					if(reinterpret_cast<uintptr_t>(pagetab->origin()) == _physaddr) {
-						const uintptr_t virtaddr = (i << virtual_storage::segment_shift) | (j << virtual_storage::page_shift);
-						return reinterpret_cast<void *>(virtaddr | (_physaddr & 0xfff));
-					}
-				}
-			}
-		}
-	}
+	const auto page = _physaddr & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+	const auto frame = _physaddr & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1);
+
+	const base::scoped_mutex lock1(g_rmap->lock);
+	for(auto *e = g_rmap->buckets[virtual_storage::rmap_bucket(page)]; e != nullptr; e = e->next)
+		if(e->aspace == this && !e->large && e->physaddr == page)
+			return reinterpret_cast<void *>(e->virtaddr | (_physaddr - page));
+	// Within a large segment
+	for(auto *e = g_rmap->buckets[virtual_storage::rmap_bucket(frame)]; e != nullptr; e = e->next)
+		if(e->aspace == this && e->large && e->physaddr == frame)
+			return reinterpret_cast<void *>(e->virtaddr | (_physaddr - frame));
 	return nullptr;
 }
 
+/// @brief Map a contiguous range taking the lock once, whole segments are mapped with
+/// a single large entry when both addresses are aligned to a segment
 int virtual_storage::address_space::map_range(void *virtaddr, void *physaddr, int flags, size_t size)
 {
 	const auto _virtaddr = reinterpret_cast<uintptr_t>(virtaddr);
 	const auto _physaddr = reinterpret_cast<uintptr_t>(physaddr);
 
+	debug_printf("Mapping VIRT=%p,REAL=%p,FLAGS=%x,SIZE=%u", virtaddr, physaddr, (unsigned int)flags, size);
+	debug_assert(_physaddr % virtual_storage::page_align == 0 && _virtaddr % virtual_storage::page_align == 0);
+
 	// Align the size to multiples of PAGE_ALIGN
 	if(size % virtual_storage::page_align)
 		size = size + (virtual_storage::page_align - (size % virtual_storage::page_align));
 
-	// Map the entire range
-	for(size_t i = 0; i < size; i += virtual_storage::page_align)
-		this->map_page((void *)(_virtaddr + i), (void *)(_physaddr + i), flags);
+	// Acquire lock for ASPACE
+	const base::scoped_mutex lock1(this->lock);
+	size_t i = 0;
+	while(i < size) {
+		const uintptr_t virt = _virtaddr + i;
+		const uintptr_t phys = _physaddr + i;
+		const uintptr_t segment_virt = virt & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1);
+		auto& segment = this->segtab[(virt >> virtual_storage::segment_shift) & 0x7ff];
+
+#if MACHINE >= M_ZARCH
+		// The segment entries have no room for the private flag
+		if(g_large_segments && size - i >= virtual_storage::segment_size && (flags & S390_PTE_PRIVATE) == 0
+		&& virt % virtual_storage::segment_size == 0 && phys % virtual_storage::segment_size == 0) {
+			// Every page of the segment is replaced, so is the page table
+			virtual_storage::clear_segment(*this, segment, segment_virt);
+			if(virtual_storage::rmap_add(*this, segment_virt, phys, true) < 0)
+				return error::ALLOCATION;
+			segment.entry = phys;
+			segment.large(true);
+			segment.protection((flags & S390_PTE_RDONLY) != 0);
+			i += virtual_storage::segment_size;
+			continue;
+		}
+#endif
+
+		// Fill the entries up to the end of the range or of the segment
+		auto *pagetab = virtual_storage::get_pagetab(*this, segment, segment_virt);
+		if(pagetab == nullptr) return error::ALLOCATION;
+		size_t page_idx = (virt >> virtual_storage::page_shift) & 0xff;
+		for(; page_idx < virtual_storage::max_pages && i < size; page_idx++) {
+			const int r = virtual_storage::set_page(*this, pagetab[page_idx], _virtaddr + i, _physaddr + i, flags);
+			if(r < 0) return r;
+			i += virtual_storage::page_align;
+		}
+	}
+	return 0;
+}
+
+void virtual_storage::address_space::unmap_page(void *virtaddr)
+{
+	this->unmap_range(virtaddr, virtual_storage::page_align);
+}
+
+/// @brief Unmap a range, segments it covers entirely are released with their page table
+void virtual_storage::address_space::unmap_range(void *virtaddr, size_t size)
+{
+	const auto _virtaddr = reinterpret_cast<uintptr_t>(virtaddr);
+	debug_assert(_virtaddr % virtual_storage::page_align == 0);
+
+	// Align the size to multiples of PAGE_ALIGN
+	if(size % virtual_storage::page_align)
+		size = size + (virtual_storage::page_align - (size % virtual_storage::page_align));
+
+	// Acquire lock for ASPACE
+	const base::scoped_mutex lock1(this->lock);
+	size_t i = 0;
+	while(i < size) {
+		const uintptr_t virt = _virtaddr + i;
+		const uintptr_t segment_virt = virt & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1);
+		auto& segment = this->segtab[(virt >> virtual_storage::segment_shift) & 0x7ff];
+
+		if(segment.invalid() || (virt == segment_virt && size - i >= virtual_storage::segment_size)) {
+			virtual_storage::clear_segment(*this, segment, segment_virt);
+			i += (segment_virt + virtual_storage::segment_size) - virt;
+			continue;
+		}
+
+		// Part of a large segment stays mapped, so it's split into pages
+		auto *pagetab = virtual_storage::get_pagetab(*this, segment, segment_virt);
+		if(pagetab == nullptr) {
+			kpanic("Can't split segment %p to unmap %p", segment_virt, virt);
+			return;
+		}
+		size_t page_idx = (virt >> virtual_storage::page_shift) & 0xff;
+		for(; page_idx < virtual_storage::max_pages && i < size; page_idx++) {
+			virtual_storage::clear_page(*this, pagetab[page_idx], _virtaddr + i);
+			i += virtual_storage::page_align;
+		}
+	}
+}
+
+/// @brief Check if a page is mapped, the lock must be held
+static bool virtual_storage::is_mapped(const virtual_storage::address_space& aspace, uintptr_t virtaddr)
+{
+	const auto& segment = aspace.segtab[(virtaddr >> virtual_storage::segment_shift) & 0x7ff];
+	if(segment.invalid()) return false;
+	if(segment.large()) return true;
+	const auto *pagetab = reinterpret_cast<const virtual_storage::page_entry *>(segment.origin());
+	return !pagetab[(virtaddr >> virtual_storage::page_shift) & 0xff].invalid();
+}
+
+/// @brief Find the area overlapping a range, the lock must be held
+static virtual_storage::area *virtual_storage::find_area(virtual_storage::address_space& aspace, uintptr_t virtaddr, size_t size)
+{
+	for(size_t i = 0; i < virtual_storage::max_areas; i++) {
+		auto& area = aspace.areas[i];
+		if(area.used && virtaddr < area.start + area.size && area.start < virtaddr + size)
+			return &area;
+	}
+	return nullptr;
+}
+
+/// @brief Unmap the pages of an area, the ones no other address space shares are given
+/// back by clear_page, the lock must be held
+static void virtual_storage::release_area(virtual_storage::address_space& aspace, virtual_storage::area& area)
+{
+	uintptr_t virt = area.start;
+	while(virt < area.start + area.size) {
+		auto& segment = aspace.segtab[(virt >> virtual_storage::segment_shift) & 0x7ff];
+		// Areas are only ever populated a page at a time
+		if(segment.invalid() || segment.large()) {
+			virt = (virt & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1)) + virtual_storage::segment_size;
+			continue;
+		}
+
+		auto& pte = reinterpret_cast<virtual_storage::page_entry *>(segment.origin())[(virt >> virtual_storage::page_shift) & 0xff];
+		virtual_storage::clear_page(aspace, pte, virt);
+		virt += virtual_storage::page_align;
+	}
+	area.used = false;
+}
+
+/// @brief Reserve a range to be populated on demand by fault
+/// @param virtaddr Start of the range, the area is extended to the page boundaries
+/// @param image Contents of the range, the rest of it reads as zeroes, it must stay
+/// valid until the area is released
+/// @return int error::RESOURCE_BUSY if part of the range is already reserved or mapped
+int virtual_storage::address_space::reserve(void *virtaddr, size_t size, int flags, const void *image, size_t image_size)
+{
+	const auto _virtaddr = reinterpret_cast<uintptr_t>(virtaddr);
+	const auto start = _virtaddr & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+	auto end = _virtaddr + size;
+	if(end % virtual_storage::page_align)
+		end = end + (virtual_storage::page_align - (end % virtual_storage::page_align));
+	if(size == 0 || image_size > size)
+		return error::INVALID_PARAM;
+
+	const base::scoped_mutex lock1(this->lock);
+	if(virtual_storage::find_area(*this, start, end - start) != nullptr)
+		return error::RESOURCE_BUSY;
+	for(uintptr_t virt = start; virt < end; virt += virtual_storage::page_align)
+		if(virtual_storage::is_mapped(*this, virt))
+			return error::RESOURCE_BUSY;
+
+	for(size_t i = 0; i < virtual_storage::max_areas; i++) {
+		auto& area = this->areas[i];
+		if(area.used)
+			continue;
+		area.start = start;
+		area.size = end - start;
+		area.flags = flags;
+		area.image = reinterpret_cast<const uint8_t *>(image);
+		area.image_offset = _virtaddr - start;
+		area.image_size = image_size;
+		area.used = true;
+		debug_printf("Reserved VIRT=%p,SIZE=%u,IMAGE=%p(%u)", virtaddr, size, image, image_size);
+		return 0;
+	}
+	return error::RESOURCE_UNAVAILABLE;
+}
+
+/// @brief Release the area a range was reserved at along with the pages populated on it
+void virtual_storage::address_space::release(void *virtaddr)
+{
+	const base::scoped_mutex lock1(this->lock);
+	auto *area = virtual_storage::find_area(*this, reinterpret_cast<uintptr_t>(virtaddr), 1);
+	if(area != nullptr)
+		virtual_storage::release_area(*this, *area);
+}
+
+/// @brief Populate the page of a reserved area an address is on, called when a
+/// translation exception is recognized on it or the kernel needs it's real address
+/// @return int error::INVALID_PARAM if the address isn't reserved
+int virtual_storage::address_space::fault(void *virtaddr)
+{
+	const auto page = reinterpret_cast<uintptr_t>(virtaddr) & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+
+	const base::scoped_mutex lock1(this->lock);
+	const auto *area = virtual_storage::find_area(*this, page, virtual_storage::page_align);
+	if(area == nullptr)
+		return error::INVALID_PARAM;
+
+	auto& segment = this->segtab[(page >> virtual_storage::segment_shift) & 0x7ff];
+	auto *pagetab = virtual_storage::get_pagetab(*this, segment, page & ~static_cast<uintptr_t>(virtual_storage::segment_size - 1));
+	if(pagetab == nullptr)
+		return error::ALLOCATION;
+	auto& pte = pagetab[(page >> virtual_storage::page_shift) & 0xff];
+	if(!pte.invalid())
+		return 0; // Populated already
+
+	auto *frame = reinterpret_cast<uint8_t *>(real_storage::alloc(virtual_storage::page_align, virtual_storage::page_align));
+	if(frame == nullptr)
+		return error::ALLOCATION;
+	storage::fill(frame, 0, virtual_storage::page_align);
+
+	// Part of the image that falls on this page, if any
+	const size_t offset = page - area->start;
+	const size_t image_start = area->image_offset;
+	const size_t image_end = area->image_offset + area->image_size;
+	const size_t from = offset > image_start ? offset : image_start;
+	const size_t to = offset + virtual_storage::page_align < image_end ? offset + virtual_storage::page_align : image_end;
+	if(from < to)
+		storage::copy(frame + (from - offset), area->image + (from - image_start), to - from);
+
+	const int r = virtual_storage::set_page(*this, pte, page, reinterpret_cast<uintptr_t>(frame), area->flags | S390_PTE_OWNED);
+	if(r < 0) {
+		real_storage::free(frame);
+		return r;
+	}
+	debug_printf("Populated VIRT=%p,REAL=%p", page, frame);
+	return 0;
+}
+
+/// @brief Create an address space with the areas and the mappings of this one, the
+/// frames are shared instead of copied, the writable ones are mapped read-only on both
+/// and copied by copy_on_write once either of them stores on them, the private ones
+/// (thread stacks, channel programs) are left out
+/// @return virtual_storage::address_space* nullptr if out of storage
+virtual_storage::address_space *virtual_storage::address_space::clone()
+{
+	auto *aspace = virtual_storage::address_space::create();
+	if(aspace == nullptr)
+		return nullptr;
+
+	const base::scoped_mutex lock1(this->lock);
+	for(size_t i = 0; i < virtual_storage::max_areas; i++)
+		if(this->areas[i].used)
+			aspace->areas[i] = this->areas[i];
+
+	// Not only the areas, what was mapped by map_range (the heap, the sections that
+	// couldn't be reserved, the PLT and the GOT) is shared too
+	int r = 0;
+	for(size_t seg_idx = 0; seg_idx < virtual_storage::max_segments && r == 0; seg_idx++) {
+		auto& segment = this->segtab[seg_idx];
+		if(segment.invalid())
+			continue;
+		const uintptr_t segment_virt = static_cast<uintptr_t>(seg_idx) << virtual_storage::segment_shift;
+		// Nobody else knows of the new address space, it's lock isn't needed
+		auto& new_segment = aspace->segtab[seg_idx];
+
+		if(segment.large()) {
+			if(segment.protection()) {
+				// Nobody stores on it, the frame is shared as it is
+				const auto frame = reinterpret_cast<uintptr_t>(segment.frame());
+				r = virtual_storage::rmap_add(*aspace, segment_virt, frame, true);
+				if(r < 0)
+					break;
+				new_segment.entry = frame;
+				new_segment.large(true);
+				new_segment.protection(true);
+				continue;
+			}
+			// Copied on write a page at a time
+			if(virtual_storage::get_pagetab(*this, segment, segment_virt) == nullptr) {
+				r = error::ALLOCATION;
+				break;
+			}
+		}
+
+		auto *pagetab = reinterpret_cast<virtual_storage::page_entry *>(segment.origin());
+		virtual_storage::page_entry *new_pagetab = nullptr;
+		for(size_t page_idx = 0; page_idx < virtual_storage::max_pages; page_idx++) {
+			auto& pte = pagetab[page_idx];
+			if(pte.invalid() || (pte.entry & S390_PTE_PRIVATE) != 0)
+				continue;
+			const uintptr_t virt = segment_virt + (page_idx << virtual_storage::page_shift);
+			const auto frame = reinterpret_cast<uintptr_t>(pte.origin());
+			auto flags = static_cast<int>(pte.entry & ~virtual_storage::page_entry::origin_bitmask);
+			if((flags & S390_PTE_RDONLY) == 0) {
+				flags |= S390_PTE_RDONLY | S390_PTE_COW;
+				r = virtual_storage::set_page(*this, pte, virt, frame, flags);
+				if(r < 0)
+					break;
+			}
+
+			if(new_pagetab == nullptr) {
+				new_pagetab = virtual_storage::get_pagetab(*aspace, new_segment, segment_virt);
+				if(new_pagetab == nullptr) {
+					r = error::ALLOCATION;
+					break;
+				}
+			}
+			r = virtual_storage::set_page(*aspace, new_pagetab[page_idx], virt, frame, flags);
+			if(r < 0)
+				break;
+		}
+	}
+
+	if(r < 0) {
+		// The frames are still mapped here so none of them is given back, the pages
+		// left copy-on-write become writable again on the first store
+		virtual_storage::address_space::destroy(aspace);
+		return nullptr;
+	}
+	return aspace;
+}
+
+/// @brief Resolve a store on a copy-on-write page, the page is copied to a frame of
+/// it's own unless no other address space maps the frame anymore
+/// @return int error::INVALID_PARAM if the page isn't copy-on-write
+int virtual_storage::address_space::copy_on_write(void *virtaddr)
+{
+	const auto page = reinterpret_cast<uintptr_t>(virtaddr) & ~static_cast<uintptr_t>(virtual_storage::page_align - 1);
+
+	const base::scoped_mutex lock1(this->lock);
+	auto& segment = this->segtab[(page >> virtual_storage::segment_shift) & 0x7ff];
+	if(segment.invalid() || segment.large())
+		return error::INVALID_PARAM;
+	auto& pte = reinterpret_cast<virtual_storage::page_entry *>(segment.origin())[(page >> virtual_storage::page_shift) & 0xff];
+	if(pte.invalid() || (pte.entry & S390_PTE_COW) == 0)
+		return error::INVALID_PARAM;
+
+	const auto frame = reinterpret_cast<uintptr_t>(pte.origin());
+	const auto flags = static_cast<int>(pte.entry & ~virtual_storage::page_entry::origin_bitmask) & ~(S390_PTE_RDONLY | S390_PTE_COW);
+	size_t n_mappings = 0;
+	{
+		const base::scoped_mutex lock2(g_rmap->lock);
+		for(auto *e = g_rmap->buckets[virtual_storage::rmap_bucket(frame)]; e != nullptr; e = e->next)
+			if(!e->large && e->physaddr == frame)
+				n_mappings++;
+	}
+	// The other address spaces copied it already
+	if(n_mappings == 1)
+		return virtual_storage::set_page(*this, pte, page, frame, flags);
+
+	auto *copy = real_storage::alloc(virtual_storage::page_align, virtual_storage::page_align);
+	if(copy == nullptr)
+		return error::ALLOCATION;
+	storage::copy(copy, reinterpret_cast<const void *>(frame), virtual_storage::page_align);
+	if(virtual_storage::rmap_add(*this, page, reinterpret_cast<uintptr_t>(copy), false) < 0) {
+		real_storage::free(copy);
+		return error::ALLOCATION;
+	}
+	virtual_storage::invalidate_page(pte, page);
+	// They may have copied it meanwhile, whoever drops the last mapping gives it back,
+	// only the frames allocated by an address space are pages of their own, the rest
+	// are part of the storage they were mapped from
+	if(virtual_storage::rmap_remove(*this, page, frame, false) == 0 && (flags & S390_PTE_OWNED) != 0)
+		real_storage::free(reinterpret_cast<void *>(frame));
+	pte.entry = reinterpret_cast<uintptr_t>(copy) | flags | S390_PTE_OWNED;
+	debug_printf("Copied VIRT=%p,REAL=%p->%p", page, frame, copy);
 	return 0;
 }
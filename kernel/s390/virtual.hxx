@@ -4,12 +4,19 @@
 #include <types.hxx>
 #include <s390/asm.hxx>
 #include <mutex.hxx>
+#include <s390/smp.hxx>
 
 #if MACHINE >= M_ZARCH
 /* Pages */
 #   define S390_PTE_ORIGIN(x) ((x) << S390_BIT_MULTI(64, 0, 52))
 #   define S390_PTE_INVALID ((1) << S390_BIT(64, 53))
 #   define S390_PTE_RDONLY ((1) << S390_BIT(64, 54))
+/* Shared copy-on-write, not used by the machine, set along with S390_PTE_RDONLY */
+#   define S390_PTE_COW ((1) << S390_BIT(64, 63))
+/* Kernel storage the kernel stores on by it's real address, left out of clones */
+#   define S390_PTE_PRIVATE ((1) << S390_BIT(64, 62))
+/* Frame allocated by the address space (populated or copied), freed with it's last mapping */
+#   define S390_PTE_OWNED ((1) << S390_BIT(64, 61))
 /* Segments */
 /* Page table origin */
 #   define S390_STE_PT_ORIGIN(x) ((x) << S390_BIT_MULTI(64, 0, 52))
@@ -17,12 +24,21 @@
 #   define S390_STE_COMMON ((1) << S390_BIT(64, 59))
 /* Length of the page entry table (in multiples of 16 entries/64 bytes) */
 #   define S390_STE_PT_LENGTH(x) ((x & 0x03) << S390_BIT_MULTI(64, 62, 2))
+/* Format control, the entry maps a 1 MiB frame instead of a page table (EDAT-1) */
+#   define S390_STE_LARGE ((1) << S390_BIT(64, 53))
+#   define S390_STE_RDONLY ((1) << S390_BIT(64, 54))
 #else
 /* Pages */
 #   define S390_PTE_ORIGIN(x) ((x) << S390_BIT_MULTI(32, 0, 20))
 #   define S390_PTE_ORIGIN_PREFIX(x) ((x) << S390_BIT_MULTI(32, 24, 8))
 #   define S390_PTE_INVALID ((1) << S390_BIT(32, 22))
 #   define S390_PTE_RDONLY ((1) << S390_BIT(32, 23))
+/* Shared copy-on-write, not used by the machine, set along with S390_PTE_RDONLY */
+#   define S390_PTE_COW ((1) << S390_BIT(32, 31))
+/* Kernel storage the kernel stores on by it's real address, left out of clones */
+#   define S390_PTE_PRIVATE ((1) << S390_BIT(32, 30))
+/* Frame allocated by the address space (populated or copied), freed with it's last mapping */
+#   define S390_PTE_OWNED ((1) << S390_BIT(32, 29))
 /* Segments */
 /* Page table origin */
 #   define S390_STE_PT_ORIGIN(x) ((x) << S390_BIT_MULTI(32, 1, 24))
@@ -45,6 +61,11 @@ namespace virtual_storage {
 	constexpr auto regtab1_shift = 31;
 	constexpr auto segment_shift = 20;
 	constexpr auto page_shift = 12;
+	constexpr auto segment_size = 1 << segment_shift; // Mapped by a large segment entry
+	constexpr auto rmap_buckets = 1024; // Buckets of the reverse map, keyed by the frame
+	constexpr auto max_areas = 32; // Ranges that can be reserved on an address space
+	constexpr auto page_rdonly = S390_PTE_RDONLY; // Flags of pages that can't be stored on
+	constexpr auto page_private = S390_PTE_PRIVATE; // Flags of pages not shared with the clones
 
 	struct segment_entry {
 #if (MACHINE > M_S370 && MACHINE <= M_S390)
@@ -55,9 +76,11 @@ namespace virtual_storage {
 		using entry_size = uint16_t;
 #endif
 		entry_size entry = 0;
-		static constexpr entry_size origin_bitmask = ~(0x7FFU);
+		static constexpr entry_size origin_bitmask = ~static_cast<entry_size>(0x7FF);
+		static constexpr entry_size frame_bitmask = ~static_cast<entry_size>(0xFFFFF);
 		static constexpr entry_size invalid_bitmask = 1 << S390_BIT(64, 58);
-		static constexpr entry_size protection_bitmask = 1 << S390_BIT(64, 59);
+		static constexpr entry_size protection_bitmask = 1 << S390_BIT(64, 54);
+		static constexpr entry_size large_bitmask = 1 << S390_BIT(64, 53);
 
 		constexpr segment_entry() = default;
 		~segment_entry() = default;
@@ -73,6 +96,10 @@ namespace virtual_storage {
 		// Protected bit (disallows stores)
 		constexpr void protection(bool val) { this->entry |= val ? protection_bitmask : 0; }
 		constexpr bool protection() const { return (this->entry & protection_bitmask) != 0; }
+		// Large bit (maps a whole segment frame, the origin is the frame itself)
+		constexpr void large(bool val) { this->entry |= val ? large_bitmask : 0; }
+		constexpr bool large() const { return (this->entry & large_bitmask) != 0; }
+		constexpr void *frame() const { return (void *)(this->entry & frame_bitmask); }
 	};
 
 	struct page_entry {
@@ -84,7 +111,7 @@ namespace virtual_storage {
 		using entry_size = uint16_t;
 #endif
 		entry_size entry = 0;
-		static constexpr entry_size origin_bitmask = ~(0xFFFU);
+		static constexpr entry_size origin_bitmask = ~static_cast<entry_size>(0xFFF);
 		static constexpr entry_size invalid_bitmask = 1 << S390_BIT(64, 53);
 		static constexpr entry_size protection_bitmask = 1 << S390_BIT(64, 54);
 
@@ -104,6 +131,36 @@ namespace virtual_storage {
 		constexpr bool protection() const { return (this->entry & protection_bitmask) != 0; }
 	};
 
+	struct address_space;
+
+	/// @brief A range of an address space populated on demand, pages are allocated when
+	/// first touched and filled from the image, or with zeroes past the end of it
+	struct area {
+		uintptr_t start;
+		size_t size;
+		int flags; // Of the page entries
+		const uint8_t *image;
+		size_t image_offset; // Where the image starts within the area
+		size_t image_size;
+		bool used;
+	};
+
+	/// @brief A mapping of a real frame, the reverse map chains them by the frame so
+	/// the virtual addresses a frame is mapped at are found without walking the tables
+	struct rmap_entry {
+		virtual_storage::rmap_entry *next;
+		virtual_storage::address_space *aspace;
+		uintptr_t virtaddr;
+		uintptr_t physaddr; // Start of the page, or of the segment frame when large
+		bool large;
+	};
+
+	struct rmap_table {
+		virtual_storage::rmap_entry *buckets[virtual_storage::rmap_buckets];
+		size_t n_entries;
+		base::mutex lock;
+	};
+
 	struct address_space {
 		constexpr address_space() = default;
 		~address_space() = default;
@@ -112,8 +169,15 @@ namespace virtual_storage {
 
 		static virtual_storage::address_space *create();
 		static void destroy(virtual_storage::address_space* aspace);
+		virtual_storage::address_space *clone();
 		int map_page(void *virtaddr, void *physaddr, int flags);
 		int map_range(void *virtaddr, void *physaddr, int flags, size_t size);
+		void unmap_page(void *virtaddr);
+		void unmap_range(void *virtaddr, size_t size);
+		int reserve(void *virtaddr, size_t size, int flags, const void *image, size_t image_size);
+		void release(void *virtaddr);
+		int fault(void *virtaddr);
+		int copy_on_write(void *virtaddr);
 		void *virtual_to_real(void *virtaddr);
 		void *phys2virt(void *physaddr);
 		
@@ -144,13 +208,16 @@ namespace virtual_storage {
 #endif
 		}
 
+		/// @brief Invalidate the TLB of every CPU, the ones that are running the
+		/// address space may have entries of it
 		inline void flush_tlb() const
 		{
-			asm volatile("PTLB\r\n"); // And don't forget to invalidate the TLB
+			smp::purge_tlb();
 		}
 
 		arch_dep::register_t cr1 = 0;
 		virtual_storage::segment_entry *segtab = nullptr;
+		virtual_storage::area areas[virtual_storage::max_areas] = {};
 		base::mutex lock;
 	};
 
@@ -18,16 +18,7 @@ static inline int enable_term(css::device::id id) {
 	req->ccws[0].length = 0;
 
 	req->send();
-	long long timer = 0;
-	while(!(req->flags & css::request_flags::DONE)) {
-		/** @todo This kludge is a very bad way to do this, we MUST find a way to not do this
-		 * like come on we have an spooler why can't we use it? */
-		/* ... */
-		timer++;
-		if(timer >= 0xffff * 16)
-			css::request_perform();
-	}
-	int r = req->retcode;
+	int r = req->wait();
 	css::request::destroy(req);
 	return r;
 }
@@ -53,21 +44,13 @@ void x3270::init(css::device::id id)
 		req->ccws[0].length = (uint16_t)n;
 
 		req->send();
-		long long timer = 0;
-		while(!(req->flags & css::request_flags::DONE)) {
-			/** @todo This kludge is a very bad way to do this, we MUST find a way to not do this
-			 * like come on we have an spooler why can't we use it? */
-			/* ... */
-			timer++;
-			if(timer >= 0xffff * 16)
-				css::request_perform();
-		}
+		req->wait();
 		
 		int r;
-		if(req->retcode != css::request_flags::DONE) {
+		if(req->retcode < 0) {
 			r = error::EXPLICIT_FAILURE;
 		} else {
-			r = (int)n - (int)css::get_device(data.id)->irb.scsw.count;
+			r = (int)n - (int)req->scsw.count;
 		}
 		css::request::destroy(req);
 		return r;
@@ -85,21 +68,13 @@ void x3270::init(css::device::id id)
 		req->ccws[0].length = (uint16_t)n;
 
 		req->send();
-		long long timer = 0;
-		while(!(req->flags & css::request_flags::DONE)) {
-			/** @todo This kludge is a very bad way to do this, we MUST find a way to not do this
-			 * like come on we have an spooler why can't we use it? */
-			/* ... */
-			timer++;
-			if(timer >= 0xffff * 16)
-				css::request_perform();
-		}
+		req->wait();
 
 		int r;
-		if(req->retcode != css::request_flags::DONE) {
+		if(req->retcode < 0) {
 			r = error::EXPLICIT_FAILURE;
 		} else {
-			r = (int)n - (int)css::get_device(data.id)->irb.scsw.count;
+			r = (int)n - (int)req->scsw.count;
 		}
 		css::request::destroy(req);
 		return r;
@@ -0,0 +1,118 @@
+// semaphr.cxx
+//
+// Semaphores and mutexes that put their waiters to sleep on a wait queue, so a
+// thread holding them across a device request doesn't have others spinning
+
+#include <semaphr.hxx>
+#include <arch/handlers.hxx>
+#include <errcode.hxx>
+
+namespace timeshare {
+	static bool spin_down(timeshare::semaphore& sem, uint64_t deadline);
+}
+
+/// @brief Wait for a unit without giving up the CPU, for the callers that can't sleep,
+/// the kernel is let go meanwhile so the holder can get on with it
+/// @param deadline Clock value to give up at, zero to wait forever
+/// @return bool True if a unit was taken
+static bool timeshare::spin_down(timeshare::semaphore& sem, uint64_t deadline)
+{
+	const unsigned int depth = timeshare::drop_kernel();
+	bool taken;
+	while(!(taken = sem.try_down()) && (deadline == 0 || timeshare::get_clock() < deadline))
+		base::cpu_relax();
+	timeshare::retake_kernel(depth);
+	return taken;
+}
+
+/// @brief Take a unit of the semaphore if one is available
+/// @return bool True if it was taken
+bool timeshare::semaphore::try_down()
+{
+	uint32_t cur = this->count, old;
+	while(cur != 0) {
+		if((old = base::compare_and_swap(&this->count, cur, cur - 1)) == cur)
+			return true;
+		cur = old;
+	}
+	return false;
+}
+
+/// @brief Take a unit of the semaphore, sleeping until one is available
+void timeshare::semaphore::down()
+{
+	if(this->try_down())
+		return;
+
+	this->n_contended++;
+	if(!timeshare::can_yield()) {
+		timeshare::spin_down(*this, 0);
+		return;
+	}
+	while(1) {
+		timeshare::waiter waiter;
+		this->waiters.prepare_wait(waiter);
+		// Checked again after going to sleep so an up in between isn't lost
+		if(this->try_down()) {
+			this->waiters.finish_wait(waiter);
+			return;
+		}
+		io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+		this->waiters.finish_wait(waiter);
+	}
+}
+
+/// @brief Take a unit of the semaphore, sleeping at most for a while
+/// @param timeout_usec Microseconds to wait for, counted from the call so the wakeups
+/// that find no unit left don't make it wait longer
+/// @return int error::TIMEOUT if no unit became available in time
+int timeshare::semaphore::down_timeout(uint64_t timeout_usec)
+{
+	if(this->try_down())
+		return 0;
+
+	this->n_contended++;
+	const uint64_t deadline = timeshare::get_clock() + SCHED_USEC_TO_TOD(timeout_usec);
+	if(!timeshare::can_yield())
+		return timeshare::spin_down(*this, deadline) ? 0 : error::TIMEOUT;
+	while(1) {
+		timeshare::waiter waiter;
+		this->waiters.prepare_wait(waiter, deadline);
+		if(this->try_down()) {
+			this->waiters.finish_wait(waiter);
+			return 0;
+		}
+		io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+		if(this->waiters.finish_wait(waiter) == error::TIMEOUT)
+			// An up may have happened right as the deadline passed
+			return this->try_down() ? 0 : error::TIMEOUT;
+	}
+}
+
+/// @brief Give back a unit of the semaphore, waking up the oldest waiter, safe to
+/// call from interrupt handlers
+void timeshare::semaphore::up()
+{
+	base::release_barrier();
+	base::fetch_add(&this->count, 1);
+	this->waiters.wake_one();
+}
+
+/// @brief Take the mutex if it's free
+/// @return bool True if it was taken
+bool timeshare::sleep_mutex::try_lock()
+{
+	return this->sem.try_down();
+}
+
+/// @brief Take the mutex, sleeping until it's free
+void timeshare::sleep_mutex::lock()
+{
+	this->sem.down();
+}
+
+/// @brief Let go of the mutex, waking up the thread that has been waiting the longest
+void timeshare::sleep_mutex::unlock()
+{
+	this->sem.up();
+}
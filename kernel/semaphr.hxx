@@ -0,0 +1,81 @@
+#ifndef SEMAPHORE_HXX
+#define SEMAPHORE_HXX
+
+#include <types.hxx>
+#include <mutex.hxx>
+#include <timeshr.hxx>
+
+namespace timeshare {
+	/// @brief Counting semaphore whose waiters sleep on a wait queue instead of spinning,
+	/// for critical sections that wait on devices, kernel threads and the supervisor calls
+	/// of the programs sleep, the callers that can't (see timeshare::can_yield) spin with
+	/// the kernel let go instead
+	struct semaphore {
+		semaphore(semaphore& lhs) = delete;
+		semaphore(const semaphore& lhs) = delete;
+		semaphore(semaphore&& lhs) = delete;
+		semaphore(const semaphore&& lhs) = delete;
+
+		constexpr semaphore(uint32_t _count)
+			: count{ _count }
+		{
+
+		}
+		~semaphore() = default;
+
+		bool try_down();
+		void down();
+		int down_timeout(uint64_t timeout_usec);
+		void up();
+
+		base::atomic_word count;
+		timeshare::wait_queue waiters;
+		size_t n_contended = 0; // Times a thread had to sleep to take it
+	};
+
+	/// @brief Mutex whose waiters sleep, same restrictions as timeshare::semaphore
+	struct sleep_mutex {
+		sleep_mutex(sleep_mutex& lhs) = delete;
+		sleep_mutex(const sleep_mutex& lhs) = delete;
+		sleep_mutex(sleep_mutex&& lhs) = delete;
+		sleep_mutex(const sleep_mutex&& lhs) = delete;
+
+		constexpr sleep_mutex() = default;
+		~sleep_mutex() = default;
+
+		bool try_lock();
+		void lock();
+		void unlock();
+
+		inline bool is_locked() const
+		{
+			return this->sem.count == 0;
+		}
+
+		timeshare::semaphore sem{ 1 };
+	};
+
+	/// @brief Holds a sleeping mutex for the lifetime of the object
+	struct scoped_sleep_mutex {
+		scoped_sleep_mutex() = delete;
+		scoped_sleep_mutex(scoped_sleep_mutex& lhs) = delete;
+		scoped_sleep_mutex(const scoped_sleep_mutex& lhs) = delete;
+		scoped_sleep_mutex(scoped_sleep_mutex&& lhs) = delete;
+		scoped_sleep_mutex(const scoped_sleep_mutex&& lhs) = delete;
+
+		scoped_sleep_mutex(timeshare::sleep_mutex& _lock)
+			: lock{ _lock }
+		{
+			this->lock.lock();
+		}
+
+		~scoped_sleep_mutex()
+		{
+			this->lock.unlock();
+		}
+
+		timeshare::sleep_mutex& lock;
+	};
+}
+
+#endif
@@ -2,17 +2,128 @@
 #include <printf.hxx>
 #include <timeshr.hxx>
 #include <vdisk.hxx>
+#include <aio.hxx>
 #include <user.hxx>
 #include <service.hxx>
+#include <errcode.hxx>
 #include <s390/css.hxx>
 
+/// @brief Copy the iovec array of a READV/WRITEV to the kernel, the entries may be
+/// on different pages
+/// @param job The job
+/// @param uiov Virtual address of the iovec array of the job
+/// @param n_iov Entries of the array
+/// @return struct vfs_iovec* Array to free by the caller, nullptr on error
+struct vfs_iovec *service::copy_iovec(const timeshare::job& job, const struct vfs_iovec *uiov, size_t n_iov)
+{
+	if(n_iov > VFS_IOV_MAX)
+		return nullptr;
+	auto *iov = storage::alloc<struct vfs_iovec>(n_iov != 0 ? n_iov : 1);
+	if(iov == nullptr)
+		return nullptr;
+	for(size_t i = 0; i < n_iov; i++) {
+		const auto *base = reinterpret_cast<void *const *>(job.virtual_to_real(const_cast<void **>(&uiov[i].iov_base)));
+		const auto *len = reinterpret_cast<const size_t *>(job.virtual_to_real(const_cast<size_t *>(&uiov[i].iov_len)));
+		if(base == nullptr || len == nullptr) {
+			storage::free(iov);
+			return nullptr;
+		}
+		iov[i].iov_base = *base;
+		iov[i].iov_len = *len;
+	}
+	return iov;
+}
+
+/// @brief Translate buffers of a job to real addresses, faulting in the pages that
+/// aren't there yet and copying the ones shared with another job, a buffer is split
+/// where it crosses onto a page whose frame doesn't follow the one before
+/// @param job The job
+/// @param iov Buffers on the virtual addresses of the job, the array itself is on the kernel
+/// @param n_iov Entries of the array
+/// @param n_kiov Set to the entries of the returned array
+/// @return struct vfs_iovec* Array with real addresses to free by the caller, nullptr on error
+struct vfs_iovec *service::translate_iovec(const timeshare::job& job, const struct vfs_iovec *iov, size_t n_iov, size_t *n_kiov)
+{
+	constexpr auto page_size = static_cast<uintptr_t>(virtual_storage::page_align);
+	size_t n = 0;
+	for(size_t i = 0; i < n_iov; i++) {
+		if(iov[i].iov_len == 0)
+			continue;
+		const auto start = reinterpret_cast<uintptr_t>(iov[i].iov_base);
+		if(start + iov[i].iov_len < start)
+			return nullptr; // Wraps around
+		n += ((start + iov[i].iov_len - 1) / page_size) - (start / page_size) + 1;
+	}
+
+	auto *kiov = storage::alloc<struct vfs_iovec>(n != 0 ? n : 1);
+	if(kiov == nullptr)
+		return nullptr;
+	size_t k = 0;
+	for(size_t i = 0; i < n_iov; i++) {
+		auto start = reinterpret_cast<uintptr_t>(iov[i].iov_base);
+		size_t left = iov[i].iov_len;
+		while(left != 0) {
+			const auto first = left == iov[i].iov_len;
+			size_t len = page_size - (start & (page_size - 1));
+			if(len > left)
+				len = left;
+			auto *paddr = job.virtual_to_real(reinterpret_cast<void *>(start));
+			if(paddr == nullptr) {
+				storage::free(kiov);
+				return nullptr;
+			}
+			// A short read of a piece ends the whole read, so contiguous frames (the
+			// heap) are given to the driver as a single buffer
+			if(!first && reinterpret_cast<uint8_t *>(kiov[k - 1].iov_base) + kiov[k - 1].iov_len == paddr) {
+				kiov[k - 1].iov_len += len;
+			} else {
+				kiov[k].iov_base = paddr;
+				kiov[k].iov_len = len;
+				k++;
+			}
+			start += len;
+			left -= len;
+		}
+	}
+	*n_kiov = k;
+	return kiov;
+}
+
 arch_dep::register_t service::common(const uint16_t code, const arch_dep::register_t arg1, const arch_dep::register_t arg2, const arch_dep::register_t arg3, const arch_dep::register_t arg4) {
 	auto *job = timeshare::get_current_job();
 	auto *user = usersys::user::get_by_id(job->user_id);
 
 	debug_printf("UDOS_SVC_ID=%u", static_cast<size_t>(arg4));
 	if(code == SVC_SCHED_YIELD) {
-		timeshare::schedule();
+		timeshare::yield();
+	} else if(code == SVC_SCHED_PRIORITY) {
+		auto *thread = timeshare::get_current_thread();
+		if(thread == nullptr)
+			return (arch_dep::register_t)error::INVALID_SETUP;
+		const auto priority = static_cast<int>(arg1);
+		if(priority < 0)
+			return (arch_dep::register_t)thread->base_priority;
+		if(priority < job->priority)
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		return (arch_dep::register_t)timeshare::set_priority(*thread, priority);
+	} else if(code == SVC_SCHED_USAGE) {
+		auto *dest = reinterpret_cast<struct sched_usage *>(job->virtual_to_real(reinterpret_cast<void *>(arg2)));
+		if(dest == nullptr)
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		timeshare::usage usage;
+		if(arg1 == SCHED_USAGE_THREAD)
+			usage = timeshare::get_current_thread()->get_usage();
+		else if(arg1 == SCHED_USAGE_TASK)
+			usage = timeshare::get_current_task()->get_usage();
+		else if(arg1 == SCHED_USAGE_JOB)
+			usage = job->get_usage();
+		else
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		dest->su_user_usec = SCHED_TOD_TO_USEC(usage.user_time);
+		dest->su_system_usec = SCHED_TOD_TO_USEC(usage.system_time);
+		dest->su_wait_usec = SCHED_TOD_TO_USEC(usage.wait_time);
+		dest->su_n_voluntary = usage.n_voluntary;
+		dest->su_n_involuntary = usage.n_involuntary;
 	} else if(code == SVC_ABEND) {
 		/// @todo Terminate task
 		debug_printf("todo: terminate tasks");
@@ -22,19 +133,27 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		const auto size = static_cast<size_t>(arg1);
 		auto *p = real_storage::alloc(size, virtual_storage::page_align);
 		if(p != nullptr) {
+			// The kernel stores on the heap by it's real address (rings, buffers),
+			// so it's kept identity mapped and left out of the jobs spawned
 			auto *aligned_p = reinterpret_cast<void *>((uintptr_t)p & (~0xfff));
-			job->map_range(aligned_p, aligned_p, 0, size);
+			job->map_range(aligned_p, aligned_p, virtual_storage::page_private, size);
 		}
 		return (arch_dep::register_t)p;
-	} else if(code == SVC_DROP_STORAGE) {
-		storage::free(job->virtual_to_real((void *)arg1));
-	} else if(code == SVC_RESIZE_STORAGE) {
+	} else if(code == SVC_DROP_STORAGE || code == SVC_RESIZE_STORAGE) {
+		// Only what SVC_GET_STORAGE gave is identity mapped, anything else would be a
+		// frame of the image or one shared with another job
+		void *old_p = (void *)arg1;
+		if(job->aspace != nullptr && job->aspace->virtual_to_real(old_p) != old_p)
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		if(code == SVC_DROP_STORAGE) {
+			storage::free(old_p);
+			return 0;
+		}
 		const auto size = static_cast<size_t>(arg2);
-		void *old_p = (void *)job->virtual_to_real((void *)arg1);
 		void *new_p = real_storage::realloc(old_p, size, virtual_storage::page_align);
 		if(new_p != nullptr) {
 			auto *aligned_p = reinterpret_cast<void *>((uintptr_t)new_p & (~0xfff));
-			job->map_range(aligned_p, aligned_p, 0, size);
+			job->map_range(aligned_p, aligned_p, virtual_storage::page_private, size);
 		}
 		return (arch_dep::register_t)new_p;
 	} else if(code == SVC_VFS_OPEN) {
@@ -53,7 +172,7 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 			list.insert(hdl);
 			return list.size() - 1;
 		})(user->handles));
-	} else if(code == SVC_VFS_CLOSE || code == SVC_VFS_WRITE || code == SVC_VFS_READ || code == SVC_VFS_FLUSH || code == SVC_VFS_IOCTL || code == SVC_VFS_NODE_COUNT || code == SVC_VFS_FILLDIR) {
+	} else if(code == SVC_VFS_CLOSE || code == SVC_VFS_WRITE || code == SVC_VFS_READ || code == SVC_VFS_FLUSH || code == SVC_VFS_IOCTL || code == SVC_VFS_NODE_COUNT || code == SVC_VFS_FILLDIR || code == SVC_VFS_READV || code == SVC_VFS_WRITEV) {
 		const auto hdl_idx = static_cast<size_t>(arg1);
 		if(hdl_idx >= user->handles.size())
 			return static_cast<arch_dep::register_t>(-1);
@@ -63,10 +182,24 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		if(code == SVC_VFS_CLOSE) {
 			storage::fast_remove(user->handles, hdl_idx);
 			r = hdl->close(hdl);
-		} else if(code == SVC_VFS_WRITE) {
-			r = hdl->write((void *)arg2, (size_t)arg3);
-		} else if(code == SVC_VFS_READ) {
-			r = hdl->read((void *)arg2, (size_t)arg3);
+		} else if(code == SVC_VFS_WRITE || code == SVC_VFS_READ || code == SVC_VFS_READV || code == SVC_VFS_WRITEV) {
+			// The drivers place the data on the buffers directly, thru their real addresses
+			struct vfs_iovec one = { (void *)arg2, (size_t)arg3 };
+			const bool vector = code == SVC_VFS_READV || code == SVC_VFS_WRITEV;
+			auto *iov = vector ? service::copy_iovec(*job, reinterpret_cast<const struct vfs_iovec *>(arg2), static_cast<size_t>(arg3)) : &one;
+			size_t n_kiov = 0;
+			auto *kiov = iov != nullptr ? service::translate_iovec(*job, iov, vector ? static_cast<size_t>(arg3) : 1, &n_kiov) : nullptr;
+			if(kiov == nullptr) {
+				r = error::INVALID_PARAM;
+			} else {
+				if(code == SVC_VFS_READ || code == SVC_VFS_READV)
+					r = hdl->readv(kiov, n_kiov);
+				else
+					r = hdl->writev(kiov, n_kiov);
+				storage::free(kiov);
+			}
+			if(vector && iov != nullptr)
+				storage::free(iov);
 		} else if(code == SVC_VFS_FLUSH) {
 			r = hdl->flush();
 		} else if(code == SVC_VFS_IOCTL) {
@@ -78,6 +211,12 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		}
 		debug_printf("ACTION,FILE=%s(%p),RET=%i", hdl->node->name, hdl, r);
 		return (arch_dep::register_t)r;
+	} else if(code == SVC_AIO_SETUP) {
+		return (arch_dep::register_t)async_io::setup(*job, reinterpret_cast<struct aio_ring *>(arg1));
+	} else if(code == SVC_AIO_ENTER) {
+		return (arch_dep::register_t)async_io::enter(*job, *user, (int)arg1, (unsigned int)arg2);
+	} else if(code == SVC_AIO_DESTROY) {
+		return (arch_dep::register_t)async_io::destroy((int)arg1);
 	} else if(code == SVC_VFS_ADD_NODE) {
 		const auto *path = reinterpret_cast<const char *>(job->virtual_to_real((void *)arg1));
 		const auto *name = reinterpret_cast<const char *>(job->virtual_to_real((void *)arg2));
@@ -106,7 +245,8 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		// TODO: Don't expose dev like this to the application!
 		if(dev != nullptr) {
 			auto *aligned_p = reinterpret_cast<void *>((uintptr_t)dev & (~0xfff));
-			job->map_range(aligned_p, aligned_p, 0, 4096);
+			// Owned by the kernel, the jobs spawned from this one don't get it
+			job->map_range(aligned_p, aligned_p, virtual_storage::page_private, 4096);
 		}
 		debug_printf("svc.dev=%p", dev);
 		return (arch_dep::register_t)dev;
@@ -117,7 +257,7 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		// TODO: Don't expose req like this to the application!
 		if(req != nullptr) {
 			auto *aligned_p = reinterpret_cast<void *>((uintptr_t)req & (~0xfff));
-			job->map_range(aligned_p, aligned_p, 0, 4096);
+			job->map_range(aligned_p, aligned_p, virtual_storage::page_private, 4096);
 		}
 		debug_printf("svc.dev=%p,p=%p,id=%i,num=%i", dev, req, (int)req->schid.id, (int)req->schid.num);
 		return (arch_dep::register_t)req;
@@ -158,8 +298,13 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		ccw.length = static_cast<uint16_t>(data->size);
 	} else if(code == SVC_CSS_REQ_AWAIT) {
 		auto *req = reinterpret_cast<css::request *>(arg1);
-		timeshare::schedule(); // Yield to other threads while sleeping
-		return (req->flags & css::request_flags::DONE) ? 1 : 0;
+		if(req->flags & css::request_flags::DONE)
+			return 1;
+		// Returns to the program once the I/O interrupt completes the request, so it
+		// isn't run again just to find it still pending
+		timeshare::prepare_sleep(req);
+		timeshare::yield();
+		return 0;
 	} else if(code == SVC_CSS_REQ_GET_STATUS) {
 		auto *req = (css::request *)arg1;
 		return static_cast<arch_dep::register_t>(req->retcode);
@@ -173,18 +318,37 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 #endif
 	
 	if(code == SVC_EXEC_AT) {
-		auto *entry = job->virtual_to_real((void *)arg1);
+		// Threads of the program run with DAT on, so they start at the virtual address
+		auto *entry = (void *)arg1;
 		auto *name = reinterpret_cast<char *>(job->virtual_to_real((void *)arg2));
 		auto *new_task = timeshare::task::create(*job, *name);
 		auto *new_thread = timeshare::thread::create(*job, *new_task, 8192);
 		new_thread->set_pc(entry, false);
 	} else if(code == SVC_THREAD_AT) {
-		auto *entry = job->virtual_to_real((void *)arg1);
-		auto *new_task = &job->tasks[job->current_task];
+		auto *entry = (void *)arg1;
+		auto *new_task = timeshare::get_current_task();
 		auto *new_thread = timeshare::thread::create(*job, *new_task, 8192);
 		new_thread->set_pc(entry, false);
+	} else if(code == SVC_JOB_SPAWN) {
+		// Costs a copy of the page tables, the image isn't loaded again
+		auto *entry = (void *)arg1;
+		auto *name = reinterpret_cast<char *>(job->virtual_to_real((void *)arg2));
+		if(name == nullptr)
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		auto *new_job = timeshare::job::spawn(*job, *name);
+		if(new_job == nullptr)
+			return (arch_dep::register_t)error::ALLOCATION;
+		// The current job may have moved, only the new one is used from here on
+		auto *new_task = timeshare::task::create(*new_job, *name);
+		if(new_task == nullptr)
+			return (arch_dep::register_t)error::ALLOCATION;
+		auto *new_thread = timeshare::thread::create(*new_job, *new_task, 8192);
+		if(new_thread == nullptr)
+			return (arch_dep::register_t)error::ALLOCATION;
+		new_thread->set_pc(entry, false);
+		new_job->flags = static_cast<timeshare::job::flag>(new_job->flags & (~timeshare::job::SLEEP));
 	} else if(code == SVC_GET_PDB) {
-		auto *task = &job->tasks[job->current_task];
+		auto *task = timeshare::get_current_task();
 
 		// Query the real storage
 		/// @todo partition storage for tasks!
@@ -193,8 +357,18 @@ arch_dep::register_t service::common(const uint16_t code, const arch_dep::regist
 		task->pdb.pdb_free_bytes = rs_stats.free_size;
 		task->pdb.pdb_used_bytes = rs_stats.used_size;
 
-		auto *dest_area = (void *)arg1; // Final area to place PDB at
-		storage::copy(dest_area, &task->pdb, sizeof(task->pdb));
+		// Final area to place PDB at, it may cross a page
+		struct vfs_iovec dest = { (void *)arg1, sizeof(task->pdb) };
+		size_t n_kiov = 0;
+		auto *kiov = service::translate_iovec(*job, &dest, 1, &n_kiov);
+		if(kiov == nullptr)
+			return (arch_dep::register_t)error::INVALID_PARAM;
+		const auto *src = reinterpret_cast<const uint8_t *>(&task->pdb);
+		for(size_t i = 0; i < n_kiov; i++) {
+			storage::copy(kiov[i].iov_base, src, kiov[i].iov_len);
+			src += kiov[i].iov_len;
+		}
+		storage::free(kiov);
 	} else {
 		kpanic("Invalid syscall=%u", (size_t)code);
 	}
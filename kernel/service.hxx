@@ -2,9 +2,13 @@
 #define SERVICE_HXX
 
 #include <arch/asm.hxx>
+#include <abi_bits.h>
+#include <timeshr.hxx>
 
 namespace service {
 	arch_dep::register_t common(const uint16_t code, const arch_dep::register_t arg1, const arch_dep::register_t arg2, const arch_dep::register_t arg3, const arch_dep::register_t arg4);
+	struct vfs_iovec *copy_iovec(const timeshare::job& job, const struct vfs_iovec *uiov, size_t n_iov);
+	struct vfs_iovec *translate_iovec(const timeshare::job& job, const struct vfs_iovec *iov, size_t n_iov, size_t *n_kiov);
 }
 
 #endif
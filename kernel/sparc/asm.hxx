@@ -15,6 +15,8 @@
 #   error Define your macros here
 #endif
 
+#define MAX_CPUS 1 // Only the boot processor is run
+
 namespace arch_dep {
 	typedef uintptr_t register_t;
 
@@ -47,3 +47,32 @@ int virtual_storage::address_space::map_range(void *virtaddr, void *physaddr, in
 	kpanic("Not implemented!");
 	return 0;
 }
+
+int virtual_storage::address_space::reserve(void *virtaddr, size_t size, int flags, const void *image, size_t image_size)
+{
+	kpanic("Not implemented!");
+	return 0;
+}
+
+void virtual_storage::address_space::release(void *virtaddr)
+{
+	kpanic("Not implemented!");
+}
+
+int virtual_storage::address_space::fault(void *virtaddr)
+{
+	kpanic("Not implemented!");
+	return 0;
+}
+
+virtual_storage::address_space *virtual_storage::address_space::clone()
+{
+	kpanic("Not implemented!");
+	return nullptr;
+}
+
+int virtual_storage::address_space::copy_on_write(void *virtaddr)
+{
+	kpanic("Not implemented!");
+	return 0;
+}
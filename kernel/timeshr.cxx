@@ -8,15 +8,53 @@
 #include <arch/asm.hxx>
 #include <arch/handlers.hxx>
 #include <errcode.hxx>
+#include <vdisk.hxx>
+#include <aio.hxx>
+#ifdef TARGET_S390
+#	include <s390/smp.hxx>
+#endif
 
 static storage::global_wrapper<timeshare::table> g_scheduler;
 
+namespace timeshare {
+	static size_t this_cpu();
+	static uint8_t slice_ticks(uint8_t level);
+	static timeshare::thread *get_thread(const timeshare::thread_id& id);
+	static bool can_migrate(const timeshare::job& job);
+	static void enqueue(const timeshare::thread_id& id, timeshare::thread& thread);
+	static timeshare::thread_id dequeue(timeshare::cpu& cpu, size_t level);
+	static timeshare::thread_id unqueue(timeshare::thread& thread);
+	static bool renumber(timeshare::thread_id& id, size_t job, size_t task, size_t thread);
+	static void renumber_queues(size_t job, size_t task, size_t thread);
+	static void unlink_waiter(timeshare::waiter& waiter);
+	static void boost_threads();
+	static bool higher_waiting(const timeshare::cpu& cpu, size_t level);
+	static size_t least_loaded_cpu(size_t preferred);
+	static void kick(size_t cpu, uint8_t level);
+	static void fixup_current(size_t job, size_t task, size_t thread);
+	static uint64_t next_deadline(size_t cpu);
+	static void arm_timer();
+	static void charge(timeshare::thread& thread, uint64_t now);
+	static void account(timeshare::cpu& cpu, timeshare::thread *old_thread, timeshare::thread *new_thread, bool voluntary);
+	static void job_exited(timeshare::job& job);
+	static void free_kstack(timeshare::thread& thread);
+}
+
 void timeshare::init()
 {
+	// The table isn't constructed, so the run queues wouldn't start empty
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++)
+		g_scheduler->cpus[i] = timeshare::cpu{};
+	// The other CPUs come online once they're started
+	g_scheduler->cpus[0].online = true;
+
 	auto *sys_job = timeshare::job::create(*"SYSMAIN", 1, static_cast<timeshare::job::flag>(timeshare::job::REAL | timeshare::job::BITS_64), 65535);
 	auto *kern_task = timeshare::task::create(*sys_job, *"KERNEL");
 	auto *kern_thread = timeshare::thread::create(*sys_job, *kern_task, 8192);
 	kern_thread->set_pc(nullptr, true);
+	// We become the kernel thread, the yield saves where we are onto it
+	g_scheduler->cpus[0].current = timeshare::thread_id{ 0, 0, 0 };
+	kern_thread->running = true;
 	// Allow scheduling and un-sleep
 	sys_job->flags = static_cast<timeshare::job::flag>(sys_job->flags & (~timeshare::job::SLEEP));
 	io_svc(SVC_SCHED_YIELD, 0, 0, 0);
@@ -49,13 +87,89 @@ timeshare::job *timeshare::job::create(const char& name, signed char priority, t
 	return job;
 }
 
+/// @brief Create a job running the same program as another, it's address space is a
+/// clone of the one of the parent so the pages of the program are shared with it
+/// @return timeshare::job* nullptr if the parent has no address space or out of storage,
+/// the parent may be moved by the insertion of the new job
+timeshare::job *timeshare::job::spawn(timeshare::job& parent, const char& name)
+{
+	if(parent.aspace == nullptr)
+		return nullptr;
+	auto *aspace = parent.aspace->clone();
+	if(aspace == nullptr)
+		return nullptr;
+	const auto _flags = parent.flags;
+	const auto priority = parent.priority;
+	const auto max_mem = parent.max_mem;
+	auto *image = parent.image;
+
+	// Created without an address space of it's own, the clone is given instead
+	auto *job = timeshare::job::create(name, priority, static_cast<timeshare::job::flag>(_flags & ~timeshare::job::VIRTUAL), max_mem);
+	if(job == nullptr) {
+		virtual_storage::address_space::destroy(aspace);
+		return nullptr;
+	}
+	job->flags = static_cast<timeshare::job::flag>(job->flags | (_flags & timeshare::job::VIRTUAL));
+	job->aspace = aspace;
+	job->image = image;
+	return job;
+}
+
+/// @brief Release the kernel save area of a thread being removed, one that sleeps inside
+/// a supervisor call keeps it since the request it waits on may still be using it
+/// @todo What the call holds (mutexes, requests) isn't given back either
+static void timeshare::free_kstack(timeshare::thread& thread)
+{
+	if(thread.kstack != nullptr && !thread.in_service)
+		storage::free(thread.kstack);
+	thread.kstack = nullptr;
+}
+
+/// @brief Release what a job holds once it's last task is gone
+static void timeshare::job_exited(timeshare::job& job)
+{
+	const auto job_id = static_cast<timeshare::job::job_t>(&job - &g_scheduler->jobs[0]);
+	// Populated pages and the copies made on write are given back, the storage it was
+	// mapped from (heap, image, stacks) is released by it's owner
+	if(!async_io::exit_job(job_id, job.aspace) && job.aspace != nullptr)
+		virtual_storage::address_space::destroy(job.aspace);
+	job.aspace = nullptr;
+
+	// The image is shared with the jobs spawned from this one (and the one this was
+	// spawned from), it goes once none of them have tasks left
+	auto *image = job.image;
+	if(image == nullptr)
+		return;
+	for(size_t i = 0; i < g_scheduler->jobs.size(); i++) {
+		const auto& other = g_scheduler->jobs[i];
+		if(other.image == image && other.tasks.size() != 0)
+			return;
+	}
+	for(size_t i = 0; i < g_scheduler->jobs.size(); i++)
+		if(g_scheduler->jobs[i].image == image)
+			g_scheduler->jobs[i].image = nullptr;
+	storage::free(image);
+}
+
 int timeshare::job::remove(const timeshare::task& task)
 {
 	for(size_t i = 0; i < this->tasks.size(); i++) {
 		if(&this->tasks[i] == &task) {
+			this->exited.add(task.get_usage());
+			for(size_t j = 0; j < this->tasks[i].threads.size(); j++) {
+				auto& thread = this->tasks[i].threads[j];
+				if(thread.waiter != nullptr)
+					timeshare::unlink_waiter(*thread.waiter);
+				timeshare::free_kstack(thread);
+				timeshare::unqueue(thread);
+			}
 			this->tasks.remove(i);
-			if(this->current_task >= this->tasks.size())
-				this->current_task = 0;
+			// The threads of the tasks after it moved
+			const auto job_idx = static_cast<size_t>(this - &g_scheduler->jobs[0]);
+			timeshare::fixup_current(job_idx, i, timeshare::thread_id::none);
+			timeshare::renumber_queues(job_idx, i, timeshare::thread_id::none);
+			if(this->tasks.size() == 0)
+				timeshare::job_exited(*this);
 			return 0;
 		}
 	}
@@ -65,10 +179,16 @@ int timeshare::job::remove(const timeshare::task& task)
 
 timeshare::task *timeshare::task::create(timeshare::job& job, const char& name)
 {
+	// The other CPUs walk the lists when scheduling
+	timeshare::disable();
 	auto *task = job.tasks.insert();
-	if(task == nullptr) return nullptr;
+	if(task == nullptr) {
+		timeshare::enable();
+		return nullptr;
+	}
 	*task = timeshare::task{};
 	storage_string::copy(task->name, &name);
+	timeshare::enable();
 	return task;
 }
 
@@ -76,11 +196,25 @@ int timeshare::task::remove(timeshare::thread& thread)
 {
 	for(size_t i = 0; i < this->threads.size(); i++) {
 		if(&this->threads[i] == &thread) {
+			this->exited.add(thread.get_usage());
+			// The waiter lives on the stack
+			if(thread.waiter != nullptr)
+				timeshare::unlink_waiter(*thread.waiter);
 			if(thread.stack != nullptr)
 				storage::free(thread.stack);
+			timeshare::free_kstack(thread);
+			timeshare::unqueue(thread);
 			this->threads.remove(i);
-			if(this->current_thread >= this->threads.size())
-				this->current_thread = 0;
+			// The task doesn't know which job it belongs to
+			for(size_t j = 0; j < g_scheduler->jobs.size(); j++) {
+				auto& job = g_scheduler->jobs[j];
+				for(size_t k = 0; k < job.tasks.size(); k++) {
+					if(&job.tasks[k] == this) {
+						timeshare::fixup_current(j, k, i);
+						timeshare::renumber_queues(j, k, i);
+					}
+				}
+			}
 			return 0;
 		}
 	}
@@ -90,14 +224,22 @@ int timeshare::task::remove(timeshare::thread& thread)
 
 timeshare::thread *timeshare::thread::create(timeshare::job& job, timeshare::task& task, size_t stack_size)
 {
+	// The other CPUs walk the lists when scheduling
+	timeshare::disable();
 	auto *thread = task.threads.insert();
-	if(thread == nullptr) return nullptr;
+	if(thread == nullptr) {
+		timeshare::enable();
+		return nullptr;
+	}
 	*thread = timeshare::thread{};
 
 	if(stack_size) {
 		// Allocate stack for this thread (the stack is local to each thread)
 		thread->stack = storage::allocz(stack_size, virtual_storage::page_align);
-		if(thread->stack == nullptr) return nullptr;
+		if(thread->stack == nullptr) {
+			timeshare::enable();
+			return nullptr;
+		}
 
 		// R15 is used as a stack pointer, now we have to setup a few things up
 #if defined TARGET_S390
@@ -122,11 +264,30 @@ timeshare::thread *timeshare::thread::create(timeshare::job& job, timeshare::tas
 #endif
 		if(job.aspace != nullptr) {
 			/// @todo Make sure the mapping does not clash with the job ASPACE
-			job.map_range(thread->stack, thread->stack, 0, stack_size);
+			// The kernel stores on the stack by it's real address, it can't be copied on
+			// write so the jobs spawned from this one don't get it
+			job.map_range(thread->stack, thread->stack, virtual_storage::page_private, stack_size);
 		}
 	} else {
 		// Kernel will manage the stack, so we will do nothing!
 	}
+
+	// Threads start at the priority of their job
+	auto priority = job.priority < 0 ? 0 : job.priority;
+	if(priority >= SCHED_LEVELS)
+		priority = SCHED_LEVELS - 1;
+	thread->base_priority = thread->level = static_cast<uint8_t>(priority);
+	thread->slice = timeshare::slice_ticks(thread->level);
+	timeshare::thread_id id;
+	id.job = static_cast<uint16_t>(&job - &g_scheduler->jobs[0]);
+	id.task = static_cast<uint16_t>(&task - &job.tasks[0]);
+	id.thread = static_cast<uint16_t>(task.threads.size() - 1);
+	// Programs are spread across the CPUs, the kernel threads run on the boot CPU
+	thread->cpu = timeshare::can_migrate(job) ? static_cast<uint8_t>(timeshare::least_loaded_cpu(timeshare::this_cpu())) : 0;
+	thread->stamp = timeshare::get_clock();
+	timeshare::enqueue(id, *thread);
+	timeshare::kick(thread->cpu, thread->level);
+	timeshare::enable();
 	return thread;
 }
 
@@ -136,102 +297,788 @@ void timeshare::thread::set_pc(void *pc, bool privileged)
 	unsigned int flags = PSW_DEFAULT_ARCHMODE | PSW_ENABLE_MCI | PSW_IO_INT | PSW_EXTERNAL_INT;
 	if(!privileged)
 		flags |= PSW_DAT | PSW_PROBLEM_STATE;
+	this->privileged = this->supervisor = privileged;
 
 	this->context.psw = s390_default_psw(flags, pc);
 	debug_printf("Thread.Psw.Address=%p", (uintptr_t)this->context.psw.address);
 #else
 	this->context.pc = reinterpret_cast<uintptr_t>(pc);
+	this->privileged = this->supervisor = privileged;
 #endif
+	// The supervisor calls of the program run on a save area of their own so they can
+	// sleep, without one they run on the stack of the CPU and wait in place
+	if(!privileged && this->kstack == nullptr)
+		this->kstack = storage::allocz(SCHED_KSTACK_SIZE, virtual_storage::page_align);
+}
+
+/// @brief CPU used by the thread, with the time since it was last charged
+timeshare::usage timeshare::thread::get_usage() const
+{
+	auto total = this->usage;
+	const auto elapsed = timeshare::get_clock() - this->stamp;
+	if(this->running && this->supervisor)
+		total.system_time += elapsed;
+	else if(this->running)
+		total.user_time += elapsed;
+	else if(this->queued && !(this->status & timeshare::SLEEP))
+		total.wait_time += elapsed;
+	return total;
+}
+
+/// @brief CPU used by the threads of the task, the removed ones included
+timeshare::usage timeshare::task::get_usage() const
+{
+	auto usage = this->exited;
+	for(size_t i = 0; i < this->threads.size(); i++)
+		usage.add(this->threads[i].get_usage());
+	return usage;
 }
 
+/// @brief CPU used by the tasks of the job, the removed ones included
+timeshare::usage timeshare::job::get_usage() const
+{
+	auto usage = this->exited;
+	for(size_t i = 0; i < this->tasks.size(); i++)
+		usage.add(this->tasks[i].get_usage());
+	return usage;
+}
+
+/// @brief Job of the thread running on this CPU
+/// @return timeshare::job* nullptr if the CPU is idle
 timeshare::job *timeshare::get_current_job()
 {
-	return &g_scheduler->jobs[g_scheduler->current_job];
+	const auto& id = g_scheduler->cpus[timeshare::this_cpu()].current;
+	if(!id.valid() || id.job >= g_scheduler->jobs.size())
+		return nullptr;
+	return &g_scheduler->jobs[id.job];
 }
 
 timeshare::job::job_t timeshare::get_current_jobid()
 {
-	return static_cast<timeshare::job::job_t>(g_scheduler->current_job);
+	return static_cast<timeshare::job::job_t>(g_scheduler->cpus[timeshare::this_cpu()].current.job);
 }
 
-void timeshare::next(timeshare::job **_job, timeshare::task **_task, timeshare::thread **_old_thread, timeshare::thread **_new_thread)
+/// @brief Task of the thread running on this CPU
+/// @return timeshare::task* nullptr if the CPU is idle
+timeshare::task *timeshare::get_current_task()
+{
+	const auto& id = g_scheduler->cpus[timeshare::this_cpu()].current;
+	auto *job = timeshare::get_current_job();
+	if(job == nullptr || id.task >= job->tasks.size())
+		return nullptr;
+	return &job->tasks[id.task];
+}
+
+timeshare::thread *timeshare::get_current_thread()
+{
+	return timeshare::get_thread(g_scheduler->cpus[timeshare::this_cpu()].current);
+}
+
+/// @brief Index of the CPU we're running on
+static size_t timeshare::this_cpu()
 {
-	// Obtain the old thread
-	auto *job = &g_scheduler->jobs[g_scheduler->current_job];
-	auto *task = &job->tasks[job->current_task];
-	debug_assert(!(task->current_thread > task->threads.size()));
-	auto *old_thread = &task->threads[task->current_thread];
-	debug_printf("OLD:JId=%i,TId=%i,ThId=%i,NThreads=%u", (int)g_scheduler->current_job, (int)job->current_task, (int)task->current_thread, task->threads.size());
-	
-	// Job - Now obtain a new thread
+#ifdef TARGET_S390
+	return smp::cpu_index();
+#else
+	return 0;
+#endif
+}
+
+/// @brief Let the scheduler give threads to a CPU, called by the CPU itself once it's
+/// ready to take interrupts
+void timeshare::cpu_online(size_t cpu)
+{
+	debug_assert(cpu < SCHED_MAX_CPUS);
+	timeshare::lock_kernel();
+	g_scheduler->cpus[cpu].online = true;
+	// Idle until given a thread
+	g_scheduler->cpus[cpu].idle_since = timeshare::get_clock();
+	timeshare::arm_timer();
+	timeshare::unlock_kernel();
+}
+
+/// @brief Take the kernel lock, the CPU that owns it may take it again
+void timeshare::lock_kernel()
+{
+	const uint32_t owner = static_cast<uint32_t>(timeshare::this_cpu() + 1) << 16;
+	base::backoff backoff;
 	while(1) {
-		debug_assert(!(g_scheduler->current_job > g_scheduler->jobs.size()));
-		g_scheduler->current_job++;
-		if(g_scheduler->current_job >= g_scheduler->jobs.size())
-			g_scheduler->current_job = 0;
-		job = &g_scheduler->jobs[g_scheduler->current_job];
-		if(job->flags & timeshare::job::SLEEP) {
-			debug_printf("Skipping sleeping job");
-			continue;
+		const uint32_t word = g_scheduler->kernel_lock;
+		if((word & 0xffff0000) == owner) {
+			// Only the owner changes the word while it's taken
+			g_scheduler->kernel_lock = word + 1;
+			return;
+		}
+		if(word == 0 && base::compare_and_swap(&g_scheduler->kernel_lock, 0, owner | 1) == 0)
+			return;
+#ifdef TARGET_S390
+		// The owner may be waiting for us to purge our TLB
+		smp::poll_ipis();
+#endif
+		backoff.wait();
+	}
+}
+
+/// @brief Give back the kernel lock once
+/// @return unsigned int Times the CPU still holds it
+unsigned int timeshare::unlock_kernel()
+{
+	const uint32_t word = g_scheduler->kernel_lock;
+	debug_assert((word >> 16) == timeshare::this_cpu() + 1 && (word & 0xffff) != 0);
+	base::release_barrier();
+	g_scheduler->kernel_lock = (word & 0xffff) == 1 ? 0 : word - 1;
+	return (word & 0xffff) - 1;
+}
+
+/// @brief Give back the kernel lock entirely so the other CPUs (and the I/O interrupts
+/// they take) can go on while this one waits without giving up the CPU
+/// @return unsigned int Times the CPU held it, zero if it didn't
+unsigned int timeshare::drop_kernel()
+{
+	const uint32_t word = g_scheduler->kernel_lock;
+	if((word >> 16) != timeshare::this_cpu() + 1)
+		return 0;
+	base::release_barrier();
+	g_scheduler->kernel_lock = 0;
+	return word & 0xffff;
+}
+
+/// @brief Take the kernel lock back after timeshare::drop_kernel
+/// @param depth Times the CPU held it
+void timeshare::retake_kernel(unsigned int depth)
+{
+	if(depth == 0)
+		return;
+	timeshare::lock_kernel();
+	// Only the owner changes the word while it's taken
+	g_scheduler->kernel_lock = g_scheduler->kernel_lock + depth - 1;
+}
+
+/// @brief Ticks of the slice of a level, the lower levels run longer at once since
+/// they only run when nothing else wants to
+static uint8_t timeshare::slice_ticks(uint8_t level)
+{
+	return static_cast<uint8_t>(level + 1);
+}
+
+static timeshare::thread *timeshare::get_thread(const timeshare::thread_id& id)
+{
+	if(!id.valid() || id.job >= g_scheduler->jobs.size())
+		return nullptr;
+	auto& job = g_scheduler->jobs[id.job];
+	if(id.task >= job.tasks.size())
+		return nullptr;
+	auto& task = job.tasks[id.task];
+	if(id.thread >= task.threads.size())
+		return nullptr;
+	return &task.threads[id.thread];
+}
+
+/// @brief Threads of the jobs without an address space run on the boot CPU, they
+/// share the storage of the kernel and take the I/O interrupts
+static bool timeshare::can_migrate(const timeshare::job& job)
+{
+	return job.aspace != nullptr;
+}
+
+/// @brief Place a thread at the end of the run queue of it's level on it's CPU, unless
+/// it's on a run queue already or being run
+static void timeshare::enqueue(const timeshare::thread_id& id, timeshare::thread& thread)
+{
+	if(thread.queued || thread.running)
+		return;
+	auto& cpu = g_scheduler->cpus[thread.cpu];
+	auto& queue = cpu.queues[thread.level];
+	auto *tail = timeshare::get_thread(queue.tail);
+	if(tail != nullptr)
+		tail->rq_next = id;
+	else
+		queue.head = id;
+	queue.tail = id;
+	thread.rq_next = timeshare::thread_id{};
+	thread.queued = true;
+	queue.n_threads++;
+	cpu.n_queued++;
+}
+
+/// @brief Take the thread at the head of the run queue of a level
+/// @return timeshare::thread_id Invalid if the queue is empty
+static timeshare::thread_id timeshare::dequeue(timeshare::cpu& cpu, size_t level)
+{
+	auto& queue = cpu.queues[level];
+	const auto id = queue.head;
+	auto *thread = timeshare::get_thread(id);
+	if(thread == nullptr)
+		return timeshare::thread_id{};
+	queue.head = thread->rq_next;
+	if(!queue.head.valid())
+		queue.tail = timeshare::thread_id{};
+	thread->rq_next = timeshare::thread_id{};
+	thread->queued = false;
+	queue.n_threads--;
+	cpu.n_queued--;
+	return id;
+}
+
+/// @brief Take a thread off the run queue it's on, wherever it is on it, only that
+/// queue is walked
+/// @return timeshare::thread_id Id of the thread, invalid if it wasn't queued
+static timeshare::thread_id timeshare::unqueue(timeshare::thread& thread)
+{
+	if(!thread.queued)
+		return timeshare::thread_id{};
+	auto& cpu = g_scheduler->cpus[thread.cpu];
+	auto& queue = cpu.queues[thread.level];
+	timeshare::thread_id prev_id;
+	timeshare::thread *prev = nullptr;
+	for(auto id = queue.head; id.valid(); ) {
+		auto *cur = timeshare::get_thread(id);
+		if(cur == nullptr)
+			break;
+		if(cur == &thread) {
+			if(prev != nullptr)
+				prev->rq_next = thread.rq_next;
+			else
+				queue.head = thread.rq_next;
+			if(!thread.rq_next.valid())
+				queue.tail = prev_id;
+			thread.rq_next = timeshare::thread_id{};
+			thread.queued = false;
+			queue.n_threads--;
+			cpu.n_queued--;
+			return id;
+		}
+		prev_id = id;
+		prev = cur;
+		id = cur->rq_next;
+	}
+	debug_assertm(0, "Queued thread not on it's run queue");
+	return timeshare::thread_id{};
+}
+
+/// @brief Correct a thread id after a thread or a whole task was removed from the lists,
+/// the ones after it moved down by one
+/// @param thread The removed thread, timeshare::thread_id::none if the whole task was removed
+/// @return bool True if the id was of the removed thread, it's made invalid
+static bool timeshare::renumber(timeshare::thread_id& id, size_t job, size_t task, size_t thread)
+{
+	if(!id.valid() || id.job != job)
+		return false;
+	if(thread == timeshare::thread_id::none) {
+		if(id.task == task) {
+			id = timeshare::thread_id{};
+			return true;
+		} else if(id.task > task)
+			id.task--;
+	} else if(id.task == task) {
+		if(id.thread == thread) {
+			id = timeshare::thread_id{};
+			return true;
+		} else if(id.thread > thread)
+			id.thread--;
+	}
+	return false;
+}
+
+/// @brief Correct the links of the run queues and the waiters of the threads of the job
+/// after removing from the lists, the removed threads must have been taken off the queues
+/// already, only the queued threads and the ones of the job are seen
+static void timeshare::renumber_queues(size_t job, size_t task, size_t thread)
+{
+	auto& _job = g_scheduler->jobs[job];
+	for(size_t i = 0; i < _job.tasks.size(); i++) {
+		auto& _task = _job.tasks[i];
+		for(size_t j = 0; j < _task.threads.size(); j++)
+			if(_task.threads[j].waiter != nullptr)
+				timeshare::renumber(_task.threads[j].waiter->id, job, task, thread);
+	}
+
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		auto& cpu = g_scheduler->cpus[i];
+		for(size_t j = 0; j < SCHED_LEVELS; j++) {
+			auto& queue = cpu.queues[j];
+			timeshare::renumber(queue.head, job, task, thread);
+			timeshare::renumber(queue.tail, job, task, thread);
+			// The links are corrected before they're followed
+			for(auto *cur = timeshare::get_thread(queue.head); cur != nullptr; cur = timeshare::get_thread(cur->rq_next))
+				timeshare::renumber(cur->rq_next, job, task, thread);
 		}
+	}
+}
 
-		// Task
-		if(job->tasks.empty()) {
-			debug_printf("Skipping empty tasklist");
-			continue;
+/// @brief Give every thread back it's base priority, the sleeping ones get it when
+/// they're woken up so only the queued and running ones are looked at
+static void timeshare::boost_threads()
+{
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		auto& cpu = g_scheduler->cpus[i];
+		auto *current = timeshare::get_thread(cpu.current);
+		if(current != nullptr) {
+			current->level = current->base_priority;
+			current->slice = timeshare::slice_ticks(current->level);
 		}
-		debug_assert(!(job->current_task > job->tasks.size()));
-		job->current_task++;
-		if(job->current_task >= job->tasks.size())
-			job->current_task = 0;
-		task = &job->tasks[job->current_task];
-
-		// Thread
-		if(task->threads.empty()) {
-			debug_printf("Skipping empty threadlist");
-			continue;
+		// A thread never goes to a lower level than the one it's on, so each is moved once
+		for(size_t level = 0; level < SCHED_LEVELS; level++) {
+			size_t n = cpu.queues[level].n_threads;
+			while(n--) {
+				const auto id = timeshare::dequeue(cpu, level);
+				auto *thread = timeshare::get_thread(id);
+				if(thread == nullptr)
+					continue;
+				thread->level = thread->base_priority;
+				thread->slice = timeshare::slice_ticks(thread->level);
+				timeshare::enqueue(id, *thread);
+			}
 		}
-		auto starting_thread = task->current_thread;
-		bool tl_wrapped = false;
-		while(1) {
-			task->current_thread++;
-			if(task->current_thread >= task->threads.size())
-				task->current_thread = 0;
-			// Once we have passed thru were we started, break, no available threads are for us
-			if(starting_thread == task->current_thread) {
-				if(tl_wrapped) break;
-				tl_wrapped = true;
+	}
+}
+
+/// @brief Check if a thread of a higher priority than the level is waiting to run on the CPU
+static bool timeshare::higher_waiting(const timeshare::cpu& cpu, size_t level)
+{
+	for(size_t i = 0; i < level; i++)
+		if(cpu.queues[i].n_threads)
+			return true;
+	return false;
+}
+
+/// @brief Find the online CPU with the least threads to run
+/// @param preferred CPU kept on a tie, so a thread stays where it's storage is cached
+static size_t timeshare::least_loaded_cpu(size_t preferred)
+{
+	const auto load = [](const timeshare::cpu& cpu) {
+		return cpu.n_queued + (cpu.current.valid() ? 1 : 0);
+	};
+	if(preferred >= SCHED_MAX_CPUS || !g_scheduler->cpus[preferred].online)
+		preferred = 0;
+	size_t best = preferred;
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		const auto& cpu = g_scheduler->cpus[i];
+		if(cpu.online && load(cpu) < load(g_scheduler->cpus[best]))
+			best = i;
+	}
+	return best;
+}
+
+/// @brief Make a CPU look at it's run queues if it's idle or running a thread of a lower
+/// priority, instead of waiting for it's timer which may not come for a while
+/// @param level Level of the thread given to the CPU
+static void timeshare::kick([[maybe_unused]] size_t cpu, [[maybe_unused]] uint8_t level)
+{
+#ifdef TARGET_S390
+	const auto& target = g_scheduler->cpus[cpu];
+	if(!target.online)
+		return;
+	const auto *current = timeshare::get_thread(target.current);
+	if(current == nullptr || level < current->level)
+		smp::send_ipi(cpu, smp::IPI_RESCHEDULE);
+#endif
+}
+
+/// @brief Keep the CPUs running the same threads after removing from the lists moved
+/// the ones after the removed entry, a CPU running the removed thread goes idle
+/// @param thread The removed thread, timeshare::thread_id::none if the whole task was removed
+static void timeshare::fixup_current(size_t job, size_t task, size_t thread)
+{
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		// Stop running what is left of it
+		if(timeshare::renumber(g_scheduler->cpus[i].current, job, task, thread))
+			timeshare::kick(i, 0);
+	}
+}
+
+namespace timeshare {
+	static void wake_thread(const timeshare::thread_id& id, timeshare::thread& thread);
+	static void wake_threads(const void *channel, bool all);
+	static void wake_waiter(timeshare::waiter& waiter);
+	static void wake_queue(timeshare::wait_queue& queue, bool all);
+	static void expire_waits();
+	static void post_wakeup(const void *channel, timeshare::wake_mode mode);
+	static void apply_wakeups();
+}
+/// @brief Clock the deadlines of the timed waits are on
+uint64_t timeshare::get_clock()
+{
+#ifdef TARGET_S390
+	return s390_intrin::get_tod();
+#else
+	kpanic("Not implemented!");
+	return 0;
+#endif
+}
+
+/// @brief Mark a sleeping thread as active, it runs at it's base priority since it
+/// gave up the CPU before using up it's slice
+static void timeshare::wake_thread(const timeshare::thread_id& id, timeshare::thread& thread)
+{
+	thread.status &= ~timeshare::SLEEP;
+	if(!thread.queued) {
+		thread.level = thread.base_priority;
+		thread.slice = timeshare::slice_ticks(thread.level);
+		// Goes where it runs the soonest
+		if(!thread.running && timeshare::can_migrate(g_scheduler->jobs[id.job]))
+			thread.cpu = static_cast<uint8_t>(timeshare::least_loaded_cpu(thread.cpu));
+		// Waits on the run queue from now on
+		if(!thread.running)
+			thread.stamp = timeshare::get_clock();
+	}
+	timeshare::enqueue(id, thread);
+	timeshare::kick(thread.cpu, thread.level);
+}
+
+/// @brief Wake up the threads sleeping on a channel
+/// @param channel The channel
+/// @param all Wake every sleeping thread regardless of the channel
+static void timeshare::wake_threads(const void *channel, bool all)
+{
+	for(size_t i = 0; i < g_scheduler->jobs.size(); i++) {
+		auto& job = g_scheduler->jobs[i];
+		for(size_t j = 0; j < job.tasks.size(); j++) {
+			auto& task = job.tasks[j];
+			for(size_t k = 0; k < task.threads.size(); k++) {
+				auto& thread = task.threads[k];
+				if(!(thread.status & timeshare::SLEEP) || !(all || thread.wait_channel == channel))
+					continue;
+				timeshare::thread_id id;
+				id.job = static_cast<uint16_t>(i);
+				id.task = static_cast<uint16_t>(j);
+				id.thread = static_cast<uint16_t>(k);
+				timeshare::wake_thread(id, thread);
 			}
-			/// @todo: Add conditions for threads
-			if(0) continue;
-			debug_assert(!(task->current_thread > task->threads.size()));
-			auto *new_thread = &task->threads[task->current_thread];
-			debug_printf("NEW:JId=%i,TId=%i,ThId=%i,NThreads=%u", (int)g_scheduler->current_job, (int)job->current_task, (int)task->current_thread, task->threads.size());
-			*_new_thread = new_thread;
-			goto end;
 		}
-		debug_printf("\x01\x22 find active thread %u(%u)", task->threads.size(), task->current_thread);
 	}
-end:
-	*_job = job;
-	*_task = task;
+}
+
+/// @brief Take a waiter off it's wait queue and the timed waits of it's CPU, only the
+/// waiters of the queue and the timed waits of the CPU are walked
+static void timeshare::unlink_waiter(timeshare::waiter& waiter)
+{
+	if(waiter.queue != nullptr) {
+		auto& queue = *waiter.queue;
+		timeshare::waiter *prev = nullptr;
+		auto **link = &queue.head;
+		while(*link != nullptr && *link != &waiter) {
+			prev = *link;
+			link = &(*link)->next;
+		}
+		if(*link != nullptr) {
+			*link = waiter.next;
+			if(queue.tail == &waiter)
+				queue.tail = prev;
+		}
+		waiter.queue = nullptr;
+		waiter.next = nullptr;
+	}
+	if(waiter.timed) {
+		auto **link = &g_scheduler->cpus[waiter.cpu].timed_waits;
+		while(*link != nullptr && *link != &waiter)
+			link = &(*link)->timed_next;
+		if(*link != nullptr)
+			*link = waiter.timed_next;
+		waiter.timed = false;
+		waiter.timed_next = nullptr;
+	}
+}
+
+/// @brief Take a waiter off it's wait queue and wake up it's thread, it may be awake
+/// already if it was woken up thru it's channel
+static void timeshare::wake_waiter(timeshare::waiter& waiter)
+{
+	timeshare::unlink_waiter(waiter);
+	auto *thread = timeshare::get_thread(waiter.id);
+	if(thread != nullptr && (thread->status & timeshare::SLEEP))
+		timeshare::wake_thread(waiter.id, *thread);
+}
+
+/// @brief Wake up the waiters of a wait queue
+/// @param all Every waiter instead of the one waiting the longest
+static void timeshare::wake_queue(timeshare::wait_queue& queue, bool all)
+{
+	while(queue.head != nullptr) {
+		timeshare::wake_waiter(*queue.head);
+		if(!all)
+			break;
+	}
+}
+
+/// @brief Wake up the waiters of this CPU whose deadline has passed, they see
+/// error::TIMEOUT from timeshare::wait_queue::finish_wait
+static void timeshare::expire_waits()
+{
+	auto& cpu = g_scheduler->cpus[timeshare::this_cpu()];
+	if(cpu.timed_waits == nullptr)
+		return;
+
+	const auto now = timeshare::get_clock();
+	while(cpu.timed_waits != nullptr && cpu.timed_waits->deadline <= now) {
+		auto& waiter = *cpu.timed_waits;
+		waiter.timed_out = true;
+		timeshare::wake_waiter(waiter);
+	}
+}
+
+/// @brief Nearest deadline of the timed waits of the threads of a CPU
+/// @return uint64_t Zero if none of them has a deadline
+static uint64_t timeshare::next_deadline(size_t cpu)
+{
+	const auto *waiter = g_scheduler->cpus[cpu].timed_waits;
+	return waiter != nullptr ? waiter->deadline : 0;
+}
+
+/// @brief Program the timer of this CPU for the next thing it has to do, the end of the
+/// slice of it's thread or the nearest timed wait of it's threads, an idle CPU with
+/// neither isn't interrupted until another CPU or a device wants it
+static void timeshare::arm_timer()
+{
+	const auto self = timeshare::this_cpu();
+	uint64_t deadline = g_scheduler->cpus[self].slice_end;
+	const uint64_t wait_deadline = timeshare::next_deadline(self);
+	if(wait_deadline != 0 && (deadline == 0 || wait_deadline < deadline))
+		deadline = wait_deadline;
+#ifdef TARGET_S390
+	// The CPU timer keeps running while the CPU waits, so it's used like the clock
+	if(deadline == 0) {
+		s390_intrin::set_timer_delta(static_cast<intptr_t>(~static_cast<uintptr_t>(0) >> 1));
+		return;
+	}
+	const auto now = timeshare::get_clock();
+	s390_intrin::set_timer_delta(deadline > now ? static_cast<intptr_t>(deadline - now) : 0);
+#endif
+}
+
+/// @brief Post a wakeup for the scheduler to apply
+static void timeshare::post_wakeup(const void *channel, timeshare::wake_mode mode)
+{
+	const uint32_t slot = base::fetch_add(&g_scheduler->n_pending_wakeups, 1);
+	if(slot < MAX_PENDING_WAKEUPS) {
+		// The channel marks the slot as filled in, so it goes last
+		g_scheduler->pending_modes[slot] = static_cast<uint8_t>(mode);
+		base::release_barrier();
+		g_scheduler->pending_wakeups[slot] = channel;
+	}
+#ifdef TARGET_S390
+	// The timer isn't periodic, so we signal ourselves to apply it as soon as the
+	// interrupts are enabled again
+	smp::send_ipi(timeshare::this_cpu(), smp::IPI_RESCHEDULE);
+#endif
+}
+
+/// @brief Apply the wakeups posted by timeshare::wakeup
+static void timeshare::apply_wakeups()
+{
+	uint32_t n;
+	// The slots taken on an earlier pass are cleared already, a new post only adds
+	// the ones after them
+	uint32_t done = 0;
+	while((n = g_scheduler->n_pending_wakeups) != 0) {
+		for(uint32_t i = done; i < n && i < MAX_PENDING_WAKEUPS; i++) {
+			const void *channel = g_scheduler->pending_wakeups[i];
+			const auto mode = g_scheduler->pending_modes[i];
+			g_scheduler->pending_wakeups[i] = nullptr;
+			// The poster may have been interrupted before storing the channel on it's
+			// slot, we can't know who to wake up so wake everyone
+			if(channel == nullptr)
+				g_scheduler->wakeup_all = true;
+			else if(mode == timeshare::WAKE_ONE || mode == timeshare::WAKE_QUEUE)
+				// Posted by the queue itself, which outlives it's waiters
+				timeshare::wake_queue(*const_cast<timeshare::wait_queue *>(static_cast<const timeshare::wait_queue *>(channel)), mode == timeshare::WAKE_QUEUE);
+			else
+				timeshare::wake_threads(channel, false);
+		}
+		if(n > MAX_PENDING_WAKEUPS)
+			g_scheduler->wakeup_all = true;
+		if(base::compare_and_swap(&g_scheduler->n_pending_wakeups, n, 0) == n)
+			break;
+		done = n;
+	}
+
+	if(g_scheduler->wakeup_all) {
+		g_scheduler->wakeup_all = false;
+		timeshare::wake_threads(nullptr, true);
+	}
+}
+
+namespace timeshare {
+	static timeshare::thread_id pick(timeshare::cpu& cpu);
+	static timeshare::thread_id steal(size_t self);
+}
+/// @brief Take the first runnable thread on the highest priority run queue of a CPU
+/// @return timeshare::thread_id Invalid if there is none
+static timeshare::thread_id timeshare::pick(timeshare::cpu& cpu)
+{
+	for(size_t level = 0; level < SCHED_LEVELS; level++) {
+		// Each thread on the queue is looked at once at most
+		size_t n = cpu.queues[level].n_threads;
+		while(n--) {
+			const auto id = timeshare::dequeue(cpu, level);
+			auto *thread = timeshare::get_thread(id);
+			// Sleepers are queued again when woken up
+			if(thread == nullptr || (thread->status & timeshare::SLEEP) || thread->running)
+				continue;
+			if(g_scheduler->jobs[id.job].flags & timeshare::job::SLEEP) {
+				debug_printf("Skipping sleeping job");
+				timeshare::enqueue(id, *thread);
+				continue;
+			}
+			debug_printf("NEW:JId=%i,TId=%i,ThId=%i,Level=%u", (int)id.job, (int)id.task, (int)id.thread, (size_t)level);
+			return id;
+		}
+	}
+	return timeshare::thread_id{};
+}
+
+/// @brief Take a runnable thread from the CPU with the most queued, so an idle CPU
+/// helps a busy one, the thread stays on the new CPU from then on
+/// @return timeshare::thread_id Invalid if there is nothing to take
+static timeshare::thread_id timeshare::steal(size_t self)
+{
+	size_t victim = self;
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		const auto& cpu = g_scheduler->cpus[i];
+		if(i != self && cpu.online && cpu.n_queued > (victim == self ? 0 : g_scheduler->cpus[victim].n_queued))
+			victim = i;
+	}
+	if(victim == self)
+		return timeshare::thread_id{};
+
+	auto& from = g_scheduler->cpus[victim];
+	for(size_t level = 0; level < SCHED_LEVELS; level++) {
+		size_t n = from.queues[level].n_threads;
+		while(n--) {
+			const auto id = timeshare::dequeue(from, level);
+			auto *thread = timeshare::get_thread(id);
+			if(thread == nullptr || (thread->status & timeshare::SLEEP) || thread->running)
+				continue;
+			const auto& job = g_scheduler->jobs[id.job];
+			if(!timeshare::can_migrate(job) || (job.flags & timeshare::job::SLEEP)) {
+				timeshare::enqueue(id, *thread);
+				continue;
+			}
+			debug_printf("CPU#%u stole JId=%i,TId=%i,ThId=%i from CPU#%u", self, (int)id.job, (int)id.task, (int)id.thread, victim);
+			thread->cpu = static_cast<uint8_t>(self);
+			g_scheduler->cpus[self].n_stolen++;
+			return id;
+		}
+	}
+	return timeshare::thread_id{};
+}
+
+/// @brief Pick the thread this CPU runs next, the first one on the highest priority
+/// run queue that has any, the current one goes behind the others of it's level if it's
+/// runnable, when the run queues are empty threads are stolen from the other CPUs
+/// @param _new_thread nullptr when the CPU has nothing to run and goes idle
+void timeshare::next(timeshare::job **_job, timeshare::task **_task, timeshare::thread **_old_thread, timeshare::thread **_new_thread)
+{
+	timeshare::apply_wakeups();
+
+	// Obtain the old thread, there is none if the CPU was idle or it was removed
+	const auto self = timeshare::this_cpu();
+	auto& cpu = g_scheduler->cpus[self];
+	const auto old_id = cpu.current;
+	auto *old_thread = timeshare::get_thread(old_id);
+	debug_printf("OLD:CPU#%u,JId=%i,TId=%i,ThId=%i", self, (int)old_id.job, (int)old_id.task, (int)old_id.thread);
+	if(old_thread != nullptr) {
+		old_thread->running = false;
+		// It keeps what is left of it's slice for the next time it runs
+		const auto now = timeshare::get_clock();
+		if(cpu.slice_end > now) {
+			const uint64_t tick = SCHED_USEC_TO_TOD(SCHED_TICK_USEC);
+			const uint64_t left = (cpu.slice_end - now + tick - 1) / tick;
+			old_thread->slice = static_cast<uint8_t>(left < old_thread->slice ? left : old_thread->slice);
+		}
+		if(!(old_thread->status & timeshare::SLEEP))
+			timeshare::enqueue(old_id, *old_thread);
+	}
+
+	auto id = timeshare::pick(cpu);
+	if(!id.valid())
+		id = timeshare::steal(self);
+
 	*_old_thread = old_thread;
+	cpu.current = id;
+	auto *new_thread = timeshare::get_thread(id);
+	if(new_thread == nullptr) {
+		// Everyone is sleeping, the CPU waits for a wakeup
+		debug_printf("No runnable threads");
+		cpu.n_idle++;
+		*_job = nullptr;
+		*_task = nullptr;
+		*_new_thread = nullptr;
+		return;
+	}
+	new_thread->running = true;
+	*_job = &g_scheduler->jobs[id.job];
+	*_task = &(*_job)->tasks[id.task];
+	*_new_thread = new_thread;
+}
+
+/// @brief Add the time since a thread was last charged to the system or user time,
+/// depending on what it was running
+static void timeshare::charge(timeshare::thread& thread, uint64_t now)
+{
+	if(thread.supervisor)
+		thread.usage.system_time += now - thread.stamp;
+	else
+		thread.usage.user_time += now - thread.stamp;
+	thread.stamp = now;
+}
+
+/// @brief Charge the thread giving up the CPU for the time it ran, and the thread
+/// taking it for the time it waited on the run queue
+/// @param voluntary The thread gave up the CPU on it's own, it's also the case when
+/// it goes to sleep
+static void timeshare::account(timeshare::cpu& cpu, timeshare::thread *old_thread, timeshare::thread *new_thread, bool voluntary)
+{
+	const auto now = timeshare::get_clock();
+	if(old_thread != nullptr) {
+		timeshare::charge(*old_thread, now);
+		if(voluntary || (old_thread->status & timeshare::SLEEP))
+			old_thread->usage.n_voluntary++;
+		else
+			old_thread->usage.n_involuntary++;
+	} else if(cpu.idle_since != 0) {
+		cpu.idle_time += now - cpu.idle_since;
+		cpu.idle_since = 0;
+	}
+
+	if(new_thread != nullptr) {
+		new_thread->usage.wait_time += now - new_thread->stamp;
+		new_thread->stamp = now;
+		// It carries on where it was stopped, the kernel threads and the calls that slept
+		// were running the kernel
+		new_thread->supervisor = new_thread->privileged || new_thread->in_service;
+	} else {
+		cpu.idle_since = now;
+	}
 }
 
 #ifdef TARGET_S390
 namespace timeshare {
 	static inline void switch_context(void *_old_thread, void *_new_thread, s390_default_psw *old_psw);
 }
+/// @param _old_thread nullptr if the CPU was idle or the thread was removed
+/// @param _new_thread nullptr if the CPU goes idle
 static inline void timeshare::switch_context(void *_old_thread, void *_new_thread, s390_default_psw *old_psw)
 {
 	auto *old_thread = reinterpret_cast<timeshare::thread *>(_old_thread);
-	old_thread->context.load_scratch_local();
-	// Save the OLD PSW into the older thread
-	debug_printf("OldOld address %p", old_thread->context.psw.address);
-	old_thread->context.psw = *old_psw;
-	debug_printf("NewOld address %p", old_thread->context.psw.address);
+	if(old_thread != nullptr) {
+		old_thread->context.load_scratch_local();
+		// Save the OLD PSW into the older thread
+		debug_printf("OldOld address %p", old_thread->context.psw.address);
+		old_thread->context.psw = *old_psw;
+		debug_printf("NewOld address %p", old_thread->context.psw.address);
+	}
 
 	auto *new_thread = reinterpret_cast<timeshare::thread *>(_new_thread);
+	auto *kstack = reinterpret_cast<volatile uintptr_t *>(PSA_FLCSVCSTK);
+	if(new_thread == nullptr) {
+		// Wait for someone to give us work
+		*old_psw = smp::idle_psw();
+		*kstack = 0;
+		return;
+	}
+	// The supervisor calls of the program are handled on it's kernel save area
+	*kstack = new_thread->kstack != nullptr ? reinterpret_cast<uintptr_t>(new_thread->kstack) + (SCHED_KSTACK_SIZE - STACK_FRAME_SIZE) : 0;
 	// Set the new reload address
 	debug_printf("OldNew address %p", new_thread->context.psw.address);
 	*old_psw = new_thread->context.psw;
@@ -240,20 +1087,561 @@ static inline void timeshare::switch_context(void *_old_thread, void *_new_threa
 }
 #endif
 
-void timeshare::schedule()
+/// @brief Switch to the next runnable thread
+/// @param old_psw Where the interrupt handler that called us saved the PSW of
+/// the current thread, it is replaced with the PSW of the new one
+/// @param voluntary The current thread gives up the CPU, instead of being preempted
+void timeshare::reschedule([[maybe_unused]] void *old_psw, bool voluntary)
 {
 	timeshare::job *job;
 	timeshare::task *task;
 	timeshare::thread *old_thread, *new_thread;
 
 	timeshare::next(&job, &task, &old_thread, &new_thread);
+	// The slice starts over, a thread that keeps running starts what was left of it
+	auto& cpu = g_scheduler->cpus[timeshare::this_cpu()];
+	cpu.slice_end = new_thread != nullptr ? timeshare::get_clock() + SCHED_USEC_TO_TOD(static_cast<uint64_t>(new_thread->slice) * SCHED_TICK_USEC) : 0;
+	timeshare::arm_timer();
+	if(old_thread == new_thread)
+		return;
+	timeshare::account(cpu, old_thread, new_thread, voluntary);
+
+	// The interrupt handler that called us holds the kernel lock once, the rest belongs
+	// to the thread giving up the CPU, a kernel thread that sleeps inside
+	// timeshare::disable gets it back when it runs again
+	const uint32_t word = g_scheduler->kernel_lock;
+	debug_assert((word >> 16) == timeshare::this_cpu() + 1 && (word & 0xffff) != 0);
+	if(old_thread != nullptr)
+		old_thread->lock_depth = static_cast<uint8_t>((word & 0xffff) - 1);
+	const unsigned int depth = new_thread != nullptr ? new_thread->lock_depth : 0;
+	g_scheduler->kernel_lock = (word & 0xffff0000) | (depth + 1);
 #ifdef TARGET_S390
-	timeshare::switch_context(old_thread, new_thread, &g_psa.external_old_psw);
+	timeshare::switch_context(old_thread, new_thread, reinterpret_cast<s390_default_psw *>(old_psw));
+	// The timer stays masked for as long as the thread holds the lock
+	if(depth != 0)
+		s390_intrin::disable_int();
+	else
+		s390_intrin::enable_int();
 #endif
-	if(job->aspace != nullptr) {
-		// Set the new ASPACE on CR1 of the current job
-		// s390_intrin::lcreg0(0x00800000 | 0x00100000);
+	if(job != nullptr && job->aspace != nullptr && job->aspace->cr1 != cpu.primary_cr1) {
+		// Set the new ASPACE on CR1 of the current job, entries of the tables are
+		// invalidated with IPTE/IDTE when unmapped so no purge is needed
 		job->aspace->set_primary();
-		job->aspace->flush_tlb();
+		cpu.primary_cr1 = job->aspace->cr1;
+	}
+}
+
+/// @brief Switch to the next runnable thread right away
+void timeshare::schedule()
+{
+#ifdef TARGET_S390
+	timeshare::reschedule(&g_psa.external_old_psw, false);
+#else
+	timeshare::reschedule(nullptr, false);
+#endif
+}
+
+/// @brief Called from the timer interrupt, which comes when the slice of the current
+/// thread ends or a timed wait is due, the current thread keeps the CPU until it
+/// uses up it's slice, or a thread of a higher priority is woken up, a thread that
+/// uses up it's slice is demoted a level
+void timeshare::tick()
+{
+	auto& cpu = g_scheduler->cpus[timeshare::this_cpu()];
+	cpu.ticks++;
+	if(&cpu == &g_scheduler->cpus[0])
+		g_scheduler->ticks++;
+	// The threads of every CPU are boosted at once, by whoever gets here first
+	const auto now = timeshare::get_clock();
+	if(now >= g_scheduler->next_boost) {
+		g_scheduler->next_boost = now + SCHED_USEC_TO_TOD(static_cast<uint64_t>(SCHED_TICK_USEC) * SCHED_BOOST_TICKS);
+		timeshare::boost_threads();
+	}
+	timeshare::apply_wakeups();
+	timeshare::expire_waits();
+
+	auto *thread = timeshare::get_current_thread();
+	if(thread != nullptr && !(thread->status & timeshare::SLEEP)) {
+		if(now < cpu.slice_end) {
+			// Interrupted for a timed wait, the thread keeps the rest of it's slice
+			if(!timeshare::higher_waiting(cpu, thread->level)) {
+				timeshare::arm_timer();
+				return;
+			}
+		} else {
+			if(thread->level < SCHED_LEVELS - 1)
+				thread->level++;
+			thread->slice = timeshare::slice_ticks(thread->level);
+		}
+	}
+	timeshare::schedule();
+}
+
+/// @brief Called when we're signalled to reschedule, because a thread was given to us
+/// while idle or running one of a lower priority, a wakeup was posted or the thread we
+/// were running was removed
+void timeshare::preempt()
+{
+	timeshare::apply_wakeups();
+	const auto& cpu = g_scheduler->cpus[timeshare::this_cpu()];
+	auto *thread = timeshare::get_current_thread();
+	if(thread != nullptr && !(thread->status & timeshare::SLEEP) && !timeshare::higher_waiting(cpu, thread->level)) {
+		// The wakeups may have given us a timed wait to watch
+		timeshare::arm_timer();
+		return;
+	}
+	timeshare::schedule();
+}
+
+/// @brief Set the base priority of a thread, it runs at it right away
+/// @return int The previous base priority, error::INVALID_PARAM if out of range
+int timeshare::set_priority(timeshare::thread& thread, int priority)
+{
+	if(priority < 0 || priority >= SCHED_LEVELS)
+		return error::INVALID_PARAM;
+	const int old_priority = thread.base_priority;
+	// It's on the run queue of the level it had, it's moved to the one of the new level
+	const auto id = timeshare::unqueue(thread);
+	thread.base_priority = thread.level = static_cast<uint8_t>(priority);
+	thread.slice = timeshare::slice_ticks(thread.level);
+	if(id.valid())
+		timeshare::enqueue(id, thread);
+	return old_priority;
+}
+
+/// @brief Called from the supervisor call handler, gives up the CPU voluntarily, a call
+/// on the kernel save area of the thread does it with a call of it's own so the thread
+/// is resumed right here, with the call still going on
+void timeshare::yield()
+{
+#ifdef TARGET_S390
+	if(!timeshare::in_service()) {
+		io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+		return;
+	}
+	timeshare::reschedule(&g_psa.svc_old_psw, true);
+#else
+	timeshare::reschedule(nullptr, true);
+#endif
+}
+
+/// @brief Called by the supervisor call handler on entry, the current thread was
+/// running the program until now and runs the kernel from here on
+/// @return bool True if the call runs on the kernel save area of the thread, the calls
+/// of the kernel threads and the ones made from inside another call (to give up the
+/// CPU) run on the stack of the CPU instead
+bool timeshare::enter_service()
+{
+	auto *thread = timeshare::get_current_thread();
+	const bool own_stack = thread != nullptr && thread->kstack != nullptr && !thread->in_service;
+	if(own_stack)
+		thread->in_service = true;
+	else
+		g_scheduler->cpus[timeshare::this_cpu()].in_service = true;
+	if(thread == nullptr)
+		return false;
+	timeshare::charge(*thread, timeshare::get_clock());
+	thread->supervisor = true;
+	return own_stack;
+}
+
+/// @brief Called by the supervisor call handler when it returns, the time since
+/// timeshare::enter_service was spent on the kernel if it returns to the thread that
+/// called it
+/// @param caller Thread that issued the call
+void timeshare::leave_service(timeshare::thread *caller)
+{
+	auto& cpu = g_scheduler->cpus[timeshare::this_cpu()];
+	if(cpu.in_service)
+		cpu.in_service = false;
+	else if(caller != nullptr)
+		caller->in_service = false;
+	auto *thread = timeshare::get_current_thread();
+	if(thread == nullptr || thread != caller)
+		return;
+	timeshare::charge(*thread, timeshare::get_clock());
+	thread->supervisor = thread->privileged;
+}
+
+/// @brief Whether the CPU is running a supervisor call on it's own stack, the handler
+/// uses the low storage save areas and the interrupt stack of the CPU so it can't be
+/// entered again until it returns, the code under it can't sleep and has to wait for
+/// things in place, the calls on the kernel save area of a thread don't count
+/// @return bool True if inside such a supervisor call
+bool timeshare::in_service()
+{
+	return g_scheduler->cpus[timeshare::this_cpu()].in_service;
+}
+
+/// @brief Whether the current thread can give up the CPU to wait for something, it can't
+/// inside a supervisor call on the stack of the CPU
+/// @return bool False if it has to wait in place
+bool timeshare::can_yield()
+{
+	return !timeshare::in_service();
+}
+
+/// @brief Mark the current thread as sleeping on the channel, the caller must
+/// check it's wait condition after this and yield only if it still has to wait,
+/// so a wakeup happening in between is never lost
+/// @param channel Address identifying what is being waited for
+void timeshare::prepare_sleep(const void *channel)
+{
+	auto *thread = timeshare::get_current_thread();
+	if(thread == nullptr)
+		return;
+	thread->wait_channel = channel;
+	thread->status |= timeshare::SLEEP;
+}
+
+/// @brief Mark the current thread as runnable again
+void timeshare::finish_sleep()
+{
+	auto *thread = timeshare::get_current_thread();
+	if(thread == nullptr)
+		return;
+	thread->status &= ~timeshare::SLEEP;
+	thread->wait_channel = nullptr;
+}
+
+/// @brief Wake up all threads sleeping on the channel, safe to call from
+/// interrupt handlers since it only posts the wakeup for the scheduler
+/// @param channel Address identifying what was waited for
+void timeshare::wakeup(const void *channel)
+{
+	timeshare::post_wakeup(channel, timeshare::WAKE_CHANNEL);
+}
+
+/// @brief Place the current thread at the end of the wait queue and mark it as sleeping,
+/// like with timeshare::prepare_sleep the caller checks it's wait condition after this
+/// and yields only if it still has to wait, then calls finish_wait
+/// @param waiter Kept on the stack of the caller until finish_wait
+/// @param deadline Clock value after which the thread is woken up even if nobody wakes
+/// the queue, zero to wait forever, the timer of the CPU is programmed for it
+void timeshare::wait_queue::prepare_wait(timeshare::waiter& waiter, uint64_t deadline)
+{
+	waiter = timeshare::waiter{};
+	auto *thread = timeshare::get_current_thread();
+	if(thread == nullptr)
+		return;
+	base::fetch_add(&this->n_waiters, 1);
+
+	// The queues are changed by the scheduler of every CPU
+	timeshare::disable();
+	const auto self = timeshare::this_cpu();
+	waiter.id = g_scheduler->cpus[self].current;
+	waiter.queue = this;
+	if(this->tail != nullptr)
+		this->tail->next = &waiter;
+	else
+		this->head = &waiter;
+	this->tail = &waiter;
+	if(deadline != 0) {
+		waiter.deadline = deadline;
+		waiter.cpu = static_cast<uint8_t>(self);
+		waiter.timed = true;
+		auto **link = &g_scheduler->cpus[self].timed_waits;
+		while(*link != nullptr && (*link)->deadline <= deadline)
+			link = &(*link)->timed_next;
+		waiter.timed_next = *link;
+		*link = &waiter;
+	}
+	thread->waiter = &waiter;
+	timeshare::prepare_sleep(this);
+	timeshare::enable();
+}
+
+/// @brief Mark the current thread as runnable again and take it off the wait queue if
+/// it's still on it
+/// @return int error::TIMEOUT if the wait ended because the deadline passed
+int timeshare::wait_queue::finish_wait(timeshare::waiter& waiter)
+{
+	auto *thread = timeshare::get_current_thread();
+	if(thread == nullptr)
+		return 0;
+	timeshare::disable();
+	timeshare::unlink_waiter(waiter);
+	thread->waiter = nullptr;
+	timeshare::finish_sleep();
+	timeshare::enable();
+	base::fetch_add(&this->n_waiters, (uint32_t)-1);
+	return waiter.timed_out ? error::TIMEOUT : 0;
+}
+
+/// @brief Wake up the thread that has been waiting the longest, safe to call from
+/// interrupt handlers, the wait condition must be updated with an interlocked
+/// operation first so a thread preparing to wait either sees it or is counted
+void timeshare::wait_queue::wake_one()
+{
+	if(this->n_waiters == 0)
+		return;
+	timeshare::post_wakeup(this, timeshare::WAKE_ONE);
+}
+
+/// @brief Wake up every thread waiting on the queue, same rules as wake_one
+void timeshare::wait_queue::wake_all()
+{
+	if(this->n_waiters == 0)
+		return;
+	timeshare::post_wakeup(this, timeshare::WAKE_QUEUE);
+}
+
+namespace timeshare {
+	/// @brief What a node under /SYSTEM/SCHED reports, stored as it's driver data
+	enum report_kind {
+		REPORT_CPUS = 0,
+		REPORT_JOBS = 1,
+		REPORT_THREADS = 2,
+	};
+
+	static timeshare::report *make_report(timeshare::report_kind kind);
+	static void report_cpus(timeshare::report& report);
+	static void report_jobs(timeshare::report& report);
+	static void report_threads(timeshare::report& report);
+	static int node_open(virtual_disk::handle& hdl);
+	static int node_read(virtual_disk::handle& hdl, void *buf, size_t n);
+	static int node_close(virtual_disk::handle& hdl);
+}
+/// @brief Add a column, truncated or padded with blanks to the width
+/// @param left Align it to the left, numbers and their headings go to the right
+void timeshare::report::put_text(const char *str, size_t width, bool left)
+{
+	size_t len = storage_string::length(str);
+	if(len > width)
+		len = width;
+	if(this->size + width + 1 > this->capacity)
+		return;
+	auto *p = this->text() + this->size;
+	storage::fill(p, ' ', width + 1);
+	storage::copy(left ? p + 1 : p + 1 + (width - len), str, len);
+	this->size += width + 1;
+}
+
+void timeshare::report::put_number(uint64_t val, size_t width)
+{
+	char numbuf[24];
+	size_t i = sizeof(numbuf) - 1;
+	numbuf[i] = '\0';
+	do {
+		numbuf[--i] = static_cast<char>('0' + (val % 10));
+		val /= 10;
+	} while(val != 0 && i > 0);
+	this->put_text(&numbuf[i], width, false);
+}
+
+void timeshare::report::put_line()
+{
+	if(this->size + 1 > this->capacity)
+		return;
+	this->text()[this->size++] = '\n';
+}
+
+/// @brief Write the report of a node, the kernel lock must be held so the lists don't
+/// change while they're walked
+/// @return timeshare::report* nullptr if out of storage
+static timeshare::report *timeshare::make_report(timeshare::report_kind kind)
+{
+	// A line per CPU, job or thread below the headings
+	size_t n_lines = SCHED_MAX_CPUS;
+	if(kind == timeshare::REPORT_JOBS) {
+		n_lines = g_scheduler->jobs.size();
+	} else if(kind == timeshare::REPORT_THREADS) {
+		n_lines = 0;
+		for(size_t i = 0; i < g_scheduler->jobs.size(); i++) {
+			const auto& job = g_scheduler->jobs[i];
+			for(size_t j = 0; j < job.tasks.size(); j++)
+				n_lines += job.tasks[j].threads.size();
+		}
+	}
+	const size_t capacity = (n_lines + 1) * SCHED_REPORT_LINE;
+	auto *report = reinterpret_cast<timeshare::report *>(storage::alloc(sizeof(timeshare::report) + capacity));
+	if(report == nullptr)
+		return nullptr;
+	report->capacity = capacity;
+	report->size = 0;
+
+	if(kind == timeshare::REPORT_CPUS)
+		timeshare::report_cpus(*report);
+	else if(kind == timeshare::REPORT_JOBS)
+		timeshare::report_jobs(*report);
+	else
+		timeshare::report_threads(*report);
+	return report;
+}
+
+static void timeshare::report_cpus(timeshare::report& report)
+{
+	report.put_text("CPU", 3, false);
+	report.put_text("ONLINE", 6);
+	report.put_text("IDLE_MS", 12, false);
+	report.put_text("TICKS", 10, false);
+	report.put_text("IDLES", 10, false);
+	report.put_text("STOLEN", 10, false);
+	report.put_text("QUEUED", 6, false);
+#ifdef TARGET_S390
+	report.put_text("IPIS", 10, false);
+	report.put_text("PURGES", 10, false);
+#endif
+	report.put_line();
+
+	const auto now = timeshare::get_clock();
+	for(size_t i = 0; i < SCHED_MAX_CPUS; i++) {
+		const auto& cpu = g_scheduler->cpus[i];
+		const uint64_t idle_time = cpu.idle_time + (cpu.idle_since != 0 ? now - cpu.idle_since : 0);
+		report.put_number(i, 3);
+		report.put_text(cpu.online ? "YES" : "NO", 6);
+		report.put_number(SCHED_TOD_TO_USEC(idle_time) / 1000, 12);
+		report.put_number(cpu.ticks, 10);
+		report.put_number(cpu.n_idle, 10);
+		report.put_number(cpu.n_stolen, 10);
+		report.put_number(cpu.n_queued, 6);
+#ifdef TARGET_S390
+		// Signals taken by the CPU and TLB purges it made all the others do
+		const auto *data = smp::get_cpu(i);
+		report.put_number(data != nullptr ? data->n_ipis : 0, 10);
+		report.put_number(data != nullptr ? data->n_purges : 0, 10);
+#endif
+		report.put_line();
+	}
+}
+
+static void timeshare::report_jobs(timeshare::report& report)
+{
+	report.put_text("JOB", 8);
+	report.put_text("ID", 5, false);
+	report.put_text("PRI", 3, false);
+	report.put_text("THREADS", 7, false);
+	report.put_text("USER_MS", 12, false);
+	report.put_text("SYSTEM_MS", 12, false);
+	report.put_text("WAIT_MS", 12, false);
+	report.put_text("VOLUNTARY", 10, false);
+	report.put_text("INVOLUNTARY", 11, false);
+	report.put_line();
+
+	for(size_t i = 0; i < g_scheduler->jobs.size(); i++) {
+		const auto& job = g_scheduler->jobs[i];
+		const auto usage = job.get_usage();
+		size_t n_threads = 0;
+		for(size_t j = 0; j < job.tasks.size(); j++)
+			n_threads += job.tasks[j].threads.size();
+		report.put_text(job.name, 8);
+		report.put_number(i, 5);
+		report.put_number(job.priority < 0 ? 0 : static_cast<uint64_t>(job.priority), 3);
+		report.put_number(n_threads, 7);
+		report.put_number(SCHED_TOD_TO_USEC(usage.user_time) / 1000, 12);
+		report.put_number(SCHED_TOD_TO_USEC(usage.system_time) / 1000, 12);
+		report.put_number(SCHED_TOD_TO_USEC(usage.wait_time) / 1000, 12);
+		report.put_number(usage.n_voluntary, 10);
+		report.put_number(usage.n_involuntary, 11);
+		report.put_line();
+	}
+}
+
+static void timeshare::report_threads(timeshare::report& report)
+{
+	report.put_text("JOB", 8);
+	report.put_text("TASK", 8);
+	report.put_text("ID", 5, false);
+	report.put_text("CPU", 3, false);
+	report.put_text("LVL", 3, false);
+	report.put_text("STATE", 5);
+	report.put_text("USER_MS", 12, false);
+	report.put_text("SYSTEM_MS", 12, false);
+	report.put_text("WAIT_MS", 12, false);
+	report.put_text("VOLUNTARY", 10, false);
+	report.put_text("INVOLUNTARY", 11, false);
+	report.put_line();
+
+	for(size_t i = 0; i < g_scheduler->jobs.size(); i++) {
+		const auto& job = g_scheduler->jobs[i];
+		for(size_t j = 0; j < job.tasks.size(); j++) {
+			const auto& task = job.tasks[j];
+			for(size_t k = 0; k < task.threads.size(); k++) {
+				const auto& thread = task.threads[k];
+				const auto usage = thread.get_usage();
+				const char *state = "READY";
+				if(thread.running)
+					state = "RUN";
+				else if(thread.status & timeshare::SLEEP)
+					state = "SLEEP";
+				report.put_text(job.name, 8);
+				report.put_text(task.name, 8);
+				report.put_number(k, 5);
+				report.put_number(thread.cpu, 3);
+				report.put_number(thread.level, 3);
+				report.put_text(state, 5);
+				report.put_number(SCHED_TOD_TO_USEC(usage.user_time) / 1000, 12);
+				report.put_number(SCHED_TOD_TO_USEC(usage.system_time) / 1000, 12);
+				report.put_number(SCHED_TOD_TO_USEC(usage.wait_time) / 1000, 12);
+				report.put_number(usage.n_voluntary, 10);
+				report.put_number(usage.n_involuntary, 11);
+				report.put_line();
+			}
+		}
+	}
+}
+
+static int timeshare::node_open(virtual_disk::handle& hdl)
+{
+	const auto kind = static_cast<timeshare::report_kind>(reinterpret_cast<uintptr_t>(hdl.node->driver_data));
+	timeshare::disable();
+	auto *report = timeshare::make_report(kind);
+	timeshare::enable();
+	if(report == nullptr)
+		return error::ALLOCATION;
+	hdl.driver_data = report;
+	hdl.offset = 0;
+	return 0;
+}
+
+/// @brief Read the report taken when the handle was opened
+/// @return int Bytes read, zero once the whole report was read
+static int timeshare::node_read(virtual_disk::handle& hdl, void *buf, size_t n)
+{
+	auto *report = reinterpret_cast<timeshare::report *>(hdl.driver_data);
+	if(report == nullptr)
+		return error::INVALID_SETUP;
+	if(hdl.offset >= report->size)
+		return 0;
+	if(n > report->size - hdl.offset)
+		n = report->size - hdl.offset;
+	storage::copy(buf, report->text() + hdl.offset, n);
+	hdl.offset += n;
+	return static_cast<int>(n);
+}
+
+static int timeshare::node_close(virtual_disk::handle& hdl)
+{
+	if(hdl.driver_data != nullptr)
+		storage::free(hdl.driver_data);
+	hdl.driver_data = nullptr;
+	return 0;
+}
+
+/// @brief Add the nodes reporting what the scheduler did under /SYSTEM/SCHED, CPUS has
+/// a line per CPU, JOBS the CPU used by each job and THREADS the one of each thread
+int timeshare::create_nodes()
+{
+	auto *driver = virtual_disk::driver::create();
+	if(driver == nullptr)
+		return error::ALLOCATION;
+	driver->open = &timeshare::node_open;
+	driver->read = &timeshare::node_read;
+	driver->close = &timeshare::node_close;
+
+	auto *dir = virtual_disk::node::create("/SYSTEM", "SCHED");
+	if(dir == nullptr)
+		return error::ALLOCATION;
+	static const char *const names[] = { "CPUS", "JOBS", "THREADS" };
+	for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		auto *node = virtual_disk::node::create(*dir, names[i]);
+		if(node == nullptr)
+			return error::ALLOCATION;
+		node->driver_data = reinterpret_cast<void *>(i);
+		node->user_flags = node->group_flags = node->sys_flags = virtual_disk::node_flags::READ | virtual_disk::node_flags::PRESCENCE;
+		const int r = driver->add_node(*node);
+		if(r < 0)
+			return r;
 	}
+	return 0;
 }
@@ -10,36 +10,102 @@
 #include <user.hxx>
 #include <abi_bits.h>
 
+#define MAX_PENDING_WAKEUPS 32 // Wakeups that can be posted between two scheduler runs
+#define SCHED_LEVELS SCHED_PRIORITY_LEVELS // Run queues, one per priority
+#define SCHED_BOOST_TICKS 32 // Every thread gets back to it's base priority this often, so the demoted ones don't starve
+#define SCHED_TICK_USEC 62496 // Length of a tick, the slices are counted in them
+#define SCHED_MAX_CPUS 8 // CPUs the threads are run on
+#define SCHED_KSTACK_SIZE 8192 // Kernel save area of the threads of the programs, their supervisor calls run on it
+#define SCHED_USEC_TO_TOD(x) ((uint64_t)(x) << 12) // Bit 51 of the TOD clock is a microsecond
+#define SCHED_TOD_TO_USEC(x) ((uint64_t)(x) >> 12)
+#define SCHED_REPORT_LINE 128 // Room for a line of the reports read from /SYSTEM/SCHED
+
 namespace timeshare {
 	class job;
 	class task;
 	class thread;
 	class table;
+	class waiter;
+	class wait_queue;
 
 	enum thread_flags {
 		ACTIVE = 0x00,
 		SLEEP = 0x01,
 	};
 
+	/// @brief How a posted wakeup picks the threads it wakes
+	enum wake_mode {
+		WAKE_CHANNEL = 0, // Every thread sleeping on the channel
+		WAKE_ONE = 1, // The thread that has been waiting the longest on the wait queue
+		WAKE_QUEUE = 2, // Every thread waiting on the wait queue
+	};
+
+	/// @brief Indexes of a thread on the job, task and thread lists, unlike a pointer it
+	/// stays valid when the lists grow
+	struct thread_id {
+		static constexpr uint16_t none = 0xffff;
+		constexpr bool valid() const { return this->job != none; }
+
+		uint16_t job = none;
+		uint16_t task = none;
+		uint16_t thread = none;
+	};
+
+	/// @brief CPU time used by a thread, in units of the TOD clock, the tasks and jobs
+	/// keep the one of the threads they lost so their totals never go down
+	struct usage {
+		inline void add(const timeshare::usage& other) {
+			this->user_time += other.user_time;
+			this->system_time += other.system_time;
+			this->wait_time += other.wait_time;
+			this->n_voluntary += other.n_voluntary;
+			this->n_involuntary += other.n_involuntary;
+		}
+
+		uint64_t user_time = 0; // Running the program
+		uint64_t system_time = 0; // Running the kernel, for the program or as a kernel thread
+		uint64_t wait_time = 0; // Runnable on a run queue
+		size_t n_voluntary = 0; // Gave up the CPU to sleep or yield
+		size_t n_involuntary = 0; // Preempted, used up it's slice or a higher priority thread came
+	};
+
 	struct thread {
 		using thread_t = unsigned short;
 		static timeshare::thread *create(timeshare::job& job, timeshare::task& task, size_t stack_size);
 		void set_pc(void *pc, bool privileged);
+		timeshare::usage get_usage() const;
 
 		void *stack;
+		void *kstack; // Kernel save area, nullptr for kernel threads which run the kernel on their stack
 		arch_dep::processor_context context;
 		int status;
+		const void *wait_channel; // What the thread is sleeping on, only valid with timeshare::SLEEP
+		timeshare::waiter *waiter; // Of the wait queue it waits on, nullptr if it isn't waiting on one
+		timeshare::thread_id rq_next; // Next thread on the run queue
+		uint8_t base_priority; // Level the thread is given back when it blocks
+		uint8_t level; // Run queue of the thread, lowered each time it uses up it's slice
+		uint8_t slice; // Ticks left before it's demoted
+		uint8_t cpu; // CPU whose run queue it goes on, changed when another CPU steals it
+		uint8_t lock_depth; // Times it took the kernel lock, it's given back while it sleeps
+		bool queued; // On a run queue
+		bool running; // Being run by a CPU
+		bool privileged; // Runs the kernel, all of it's time is system time
+		bool supervisor; // Running the kernel right now, on a supervisor call of the program
+		bool in_service; // Inside a supervisor call on it's kernel save area, it may sleep there
+		timeshare::usage usage;
+		uint64_t stamp; // Time is charged up to here, when it was switched, woken up or called the kernel
 	};
 
 	struct task {
 		using task_t = unsigned short;
 		static timeshare::task *create(timeshare::job& job, const char& name);
 		int remove(timeshare::thread& thread);
+		timeshare::usage get_usage() const;
 
 		storage::dynamic_list<timeshare::thread> threads;
-		size_t current_thread;
 		char name[8];
 		program_data_block pdb;
+		timeshare::usage exited; // Of the threads that were removed
 	};
 
 	struct job {
@@ -57,11 +123,22 @@ namespace timeshare {
 		};
 
 		static timeshare::job *create(const char& name, signed char priority, timeshare::job::flag flags, size_t max_mem);
+		static timeshare::job *spawn(timeshare::job& parent, const char& name);
 		int remove(const timeshare::task& task);
+		timeshare::usage get_usage() const;
 
 		inline void *virtual_to_real(void *vaddr) const {
-			if(this->aspace != nullptr)
-				return this->aspace->virtual_to_real(reinterpret_cast<void *>(vaddr));
+			if(this->aspace != nullptr) {
+				auto *paddr = this->aspace->virtual_to_real(reinterpret_cast<void *>(vaddr));
+				// Reserved pages are populated when the kernel first needs them too
+				if(paddr == nullptr && this->aspace->fault(vaddr) == 0)
+					paddr = this->aspace->virtual_to_real(reinterpret_cast<void *>(vaddr));
+				// The kernel may store on the real address, which isn't protected, so a
+				// page shared with another job gets it's own frame first
+				else if(paddr != nullptr && this->aspace->copy_on_write(vaddr) == 0)
+					paddr = this->aspace->virtual_to_real(reinterpret_cast<void *>(vaddr));
+				return paddr;
+			}
 			return reinterpret_cast<void *>(vaddr);
 		}
 
@@ -82,15 +159,92 @@ namespace timeshare {
 
 		timeshare::job::flag flags = timeshare::job::SLEEP;
 		storage::dynamic_list<timeshare::task> tasks;
-		size_t current_task;
 		signed char priority; // Priority of the job
 		size_t max_mem; // Max memory to be used by job
 		// Address space of job
 		/// @todo Make it so the aspace is not a pointer but embedded directly onto the job struct
 		virtual_storage::address_space *aspace;
+		void *image = nullptr; // Program image the reserved areas of the ASPACE are populated from
 		char name[8];
 		storage::dynamic_list<storage::symbol> symbols;
 		usersys::user::id user_id;
+		timeshare::usage exited; // Of the tasks that were removed
+	};
+
+	/// @brief A thread waiting on a wait queue, it lives on the stack of the thread while
+	/// it waits so the queues don't need storage of their own
+	struct waiter {
+		timeshare::thread_id id;
+		timeshare::wait_queue *queue; // nullptr once it's taken off the queue
+		timeshare::waiter *next; // Next waiter of the queue, in the order they arrived
+		timeshare::waiter *timed_next; // Next timed wait of the CPU, nearest deadline first
+		uint64_t deadline; // When the wait ends, zero if it has no timeout
+		uint8_t cpu; // CPU whose timer is programmed for the deadline
+		bool timed; // On the timed waits of the CPU
+		bool timed_out; // Woken up because the deadline passed
+	};
+
+	/// @brief Threads waiting for an event, the address of the queue is the channel they
+	/// sleep on, so like the channels a wakeup can be posted from interrupt handlers
+	struct wait_queue {
+		wait_queue(wait_queue& lhs) = delete;
+		wait_queue(const wait_queue& lhs) = delete;
+		wait_queue(wait_queue&& lhs) = delete;
+		wait_queue(const wait_queue&& lhs) = delete;
+
+		constexpr wait_queue() = default;
+		~wait_queue() = default;
+
+		void prepare_wait(timeshare::waiter& waiter, uint64_t deadline = 0);
+		int finish_wait(timeshare::waiter& waiter);
+		void wake_one();
+		void wake_all();
+
+		timeshare::waiter *head = nullptr; // Waiting the longest
+		timeshare::waiter *tail = nullptr;
+		base::atomic_word n_waiters = 0; // Wakeups aren't posted when nobody waits
+	};
+
+	/// @brief Runnable threads of a level, in the order they run
+	struct run_queue {
+		timeshare::thread_id head;
+		timeshare::thread_id tail;
+		size_t n_threads = 0;
+	};
+
+	/// @brief A processor the threads are run on, each has it's own run queues so they
+	/// aren't all fighting over the same ones
+	struct cpu {
+		timeshare::thread_id current; // Invalid while the CPU is idle
+		timeshare::run_queue queues[SCHED_LEVELS] = {};
+		size_t n_queued = 0; // Threads on the run queues
+		size_t n_stolen = 0; // Threads taken from the run queues of other CPUs
+		size_t n_idle = 0; // Times it ran out of threads and waited
+		size_t ticks = 0; // Timer interrupts taken, only when a slice ends or a timed wait is due
+		uint64_t slice_end = 0; // When the current thread used up it's slice, zero while idle
+		uint64_t idle_time = 0; // Time spent waiting with nothing to run
+		uint64_t idle_since = 0; // When it last went idle, zero while running a thread
+		timeshare::waiter *timed_waits = nullptr; // Of it's threads, nearest deadline first
+		bool in_service = false; // Running a supervisor call on it's own stack, it can't give up the CPU meanwhile
+		// Loaded on CR1, the TLB entries are tagged by the address space they were formed
+		// on so they stay valid when switching between jobs
+		arch_dep::register_t primary_cr1 = 0;
+		bool online = false;
+	};
+
+	/// @brief Text read from a node under /SYSTEM/SCHED, it's made when the node is opened
+	/// so every read of the handle sees the same one, the text follows this header
+	struct report {
+		report& operator=(report&) = delete;
+		const report& operator=(const report&) = delete;
+
+		inline char *text() { return reinterpret_cast<char *>(this + 1); }
+		void put_text(const char *str, size_t width, bool left = true);
+		void put_number(uint64_t val, size_t width);
+		void put_line();
+
+		size_t capacity; // Bytes that fit after the header
+		size_t size; // Bytes of text
 	};
 
 	struct table {
@@ -98,28 +252,87 @@ namespace timeshare {
 		~table() = default;
 
 		storage::dynamic_list<timeshare::job> jobs;
-		size_t current_job = 0;
+		timeshare::cpu cpus[SCHED_MAX_CPUS] = {};
+		// Taken by the interrupt handlers and timeshare::disable, it serializes the kernel
+		// across the CPUs while the programs run in parallel, the owner CPU plus one is
+		// on the upper half and the times it was taken on the lower half
+		base::atomic_word kernel_lock = 0;
+		size_t ticks = 0; // Timer interrupts taken by the boot CPU
+		uint64_t next_boost = 0; // When the threads are given back their base priority
+		// Wakeups are posted here (possibly from interrupt handlers) and applied to the
+		// threads the next time the scheduler runs
+		const void *volatile pending_wakeups[MAX_PENDING_WAKEUPS] = {};
+		volatile uint8_t pending_modes[MAX_PENDING_WAKEUPS] = {}; // timeshare::wake_mode of each wakeup
+		base::atomic_word n_pending_wakeups = 0;
+		volatile bool wakeup_all = false;
 	};
 
 	void init();
 	timeshare::job *get_current_job();
 	timeshare::job::job_t get_current_jobid();
+	timeshare::task *get_current_task();
+	timeshare::thread *get_current_thread();
+	void cpu_online(size_t cpu);
+	void lock_kernel();
+	unsigned int unlock_kernel();
+	unsigned int drop_kernel();
+	void retake_kernel(unsigned int depth);
 	void next(timeshare::job **_job, timeshare::task **_task, timeshare::thread **_old_thread, timeshare::thread **_new_thread);
+	void reschedule(void *old_psw, bool voluntary);
 	void schedule();
+	void tick();
+	void preempt();
+	void yield();
+	int set_priority(timeshare::thread& thread, int priority);
+	void prepare_sleep(const void *channel);
+	void finish_sleep();
+	void wakeup(const void *channel);
+	bool enter_service();
+	void leave_service(timeshare::thread *caller);
+	bool in_service();
+	bool can_yield();
+	uint64_t get_clock();
+	int create_nodes();
 
+	/// @brief Allow preemption again and let the other CPUs into the kernel, nested
+	/// calls keep it disabled until the outermost one
 	inline void enable()
 	{
+		if(timeshare::unlock_kernel() != 0)
+			return;
 #ifdef TARGET_S390
 		s390_intrin::enable_int();
 #endif
 	}
 
+	/// @brief Keep the CPU until timeshare::enable, the other CPUs stay out of the kernel
+	/// meanwhile, like the interrupt handlers do
 	inline void disable()
 	{
 #ifdef TARGET_S390
 		s390_intrin::disable_int();
 #endif
+		timeshare::lock_kernel();
 	}
+
+	/// @brief Holds the kernel lock for the lifetime of the object, used by the interrupt
+	/// handlers which already run with the interrupts masked
+	struct scoped_kernel_lock {
+		scoped_kernel_lock(scoped_kernel_lock& lhs) = delete;
+		scoped_kernel_lock(const scoped_kernel_lock& lhs) = delete;
+		scoped_kernel_lock(scoped_kernel_lock&& lhs) = delete;
+		scoped_kernel_lock(const scoped_kernel_lock&& lhs) = delete;
+
+		scoped_kernel_lock()
+		{
+			timeshare::lock_kernel();
+		}
+
+		~scoped_kernel_lock()
+		{
+			timeshare::unlock_kernel();
+		}
+	};
 }
 
 #endif
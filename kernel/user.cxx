@@ -10,8 +10,8 @@
 #include <storage.hxx>
 #include <printf.hxx>
 
-constinit static storage::global_wrapper<storage::concurrent_dynamic_list<usersys::user>> g_users;
-constinit static storage::global_wrapper<storage::concurrent_dynamic_list<usersys::group>> g_groups;
+constinit static storage::global_wrapper<storage::concurrent_dynamic_list<usersys::user, base::rw_mutex>> g_users;
+constinit static storage::global_wrapper<storage::concurrent_dynamic_list<usersys::group, base::rw_mutex>> g_groups;
 constinit static usersys::user::id g_current_user = 0;
 
 void usersys::init() {
@@ -23,7 +23,7 @@ void usersys::init() {
 usersys::group::id usersys::group::create(const char& name)
 {
 	auto& groups = *(g_groups.operator->());
-	const base::scoped_mutex lock(groups.lock);
+	const base::scoped_write_mutex lock(groups.lock);
 	auto *group = groups.insert();
 	if(group == nullptr)
 		return (usersys::group::id)-1;
@@ -34,7 +34,7 @@ usersys::group::id usersys::group::create(const char& name)
 usersys::group::id usersys::group::get_by_name(const char& name)
 {
 	auto& groups = *(g_groups.operator->());
-	const base::scoped_mutex lock(groups.lock);
+	const base::scoped_read_mutex lock(groups.lock);
 	for(size_t i = 0; i < groups.size(); i++) {
 		if(!storage_string::compare(groups[i].name, &name))
 			return (usersys::group::id)i;
@@ -51,7 +51,7 @@ usersys::group *usersys::group::get_by_id(usersys::group::id gid)
 usersys::user::id usersys::user::create(const char& name, int flags)
 {
 	auto& users_list = *(g_users.operator->());
-	const base::scoped_mutex lock(users_list.lock);
+	const base::scoped_write_mutex lock(users_list.lock);
 	auto *user = users_list.insert();
 	if(user == nullptr)
 		return (usersys::user::id)-1;
@@ -63,7 +63,7 @@ usersys::user::id usersys::user::create(const char& name, int flags)
 usersys::user::id usersys::user::get_by_name(const char& name)
 {
 	auto& users_list = *(g_users.operator->());
-	const base::scoped_mutex lock(users_list.lock);
+	const base::scoped_read_mutex lock(users_list.lock);
 	for(size_t i = 0; i < users_list.size(); i++) {
 		if(!storage_string::compare(users_list[i].name, &name))
 			return (usersys::user::id)i;
@@ -7,8 +7,25 @@
 #include <vdisk.hxx>
 #include <locale.hxx>
 #include <errcode.hxx>
+#include <dskcache.hxx>
+#include <pgcache.hxx>
 
 constinit static storage::global_wrapper<virtual_disk::node> g_root_node;
+// Lookups are far more common than changes to the tree, so they only take it as readers
+constinit static base::rw_mutex g_tree_lock;
+// Readers of the tree fill the dentry cache concurrently, so it has it's own lock
+constinit static virtual_disk::dentry g_dentries[VDISK_DENTRY_CACHE_SIZE];
+constinit static base::mutex g_dentry_lock;
+
+namespace virtual_disk {
+	static inline uint32_t hash_name(const char *name, size_t len);
+	static inline size_t dentry_slot(const virtual_disk::node& parent, uint32_t hash);
+	static bool rehash_children(virtual_disk::node& node, size_t n_buckets);
+	static void unlink_child(virtual_disk::node& node, virtual_disk::node& child);
+	static int driver_read(virtual_disk::handle& hdl, void *buf, size_t n);
+	static int driver_write(virtual_disk::handle& hdl, const void *buf, size_t n);
+	static void drop_read_ahead(virtual_disk::handle& hdl);
+}
 
 int virtual_disk::init()
 {
@@ -41,7 +58,110 @@ int virtual_disk::init()
 	// Base filesystem datasets
 	auto *system_node = virtual_disk::node::create("/", "SYSTEM");
 	auto *devices_node = virtual_disk::node::create("/SYSTEM", "DEVICES");
-	return 0;
+	int r = page_cache::init();
+	if(r < 0)
+		return r;
+	return disk_cache::init();
+}
+
+/// @brief FNV-1a hash of a node name
+static inline uint32_t virtual_disk::hash_name(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261;
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ (uint8_t)name[i]) * 16777619;
+	return hash;
+}
+
+static inline size_t virtual_disk::dentry_slot(const virtual_disk::node& parent, uint32_t hash)
+{
+	return (hash ^ (uint32_t)(reinterpret_cast<uintptr_t>(&parent) >> 4)) % VDISK_DENTRY_CACHE_SIZE;
+}
+
+/// @brief Rebuild the hash table of the children of a node, the tree lock must be
+/// held as a writer
+static bool virtual_disk::rehash_children(virtual_disk::node& node, size_t n_buckets)
+{
+	auto **buckets = storage::allocza<virtual_disk::node *>(n_buckets, sizeof(virtual_disk::node *));
+	if(buckets == nullptr)
+		return false;
+
+	// Walk backwards so the chains keep the order the children were added in, the
+	// first of the children sharing a name is the one found
+	for(size_t i = node.children.size(); i-- > 0; ) {
+		auto *child = node.children[i];
+		auto& bucket = buckets[virtual_disk::hash_name(child->name, storage_string::length(child->name)) % n_buckets];
+		child->hash_next = bucket;
+		bucket = child;
+	}
+	if(node.child_buckets != nullptr)
+		storage::free(node.child_buckets);
+	node.child_buckets = buckets;
+	node.n_child_buckets = n_buckets;
+	return true;
+}
+
+/// @brief Take a child out of the hash table of a node, the tree lock must be held
+/// as a writer
+static void virtual_disk::unlink_child(virtual_disk::node& node, virtual_disk::node& child)
+{
+	if(node.child_buckets == nullptr)
+		return;
+	auto **link = &node.child_buckets[virtual_disk::hash_name(child.name, storage_string::length(child.name)) % node.n_child_buckets];
+	while(*link != nullptr) {
+		if(*link == &child) {
+			*link = child.hash_next;
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+	child.hash_next = nullptr;
+}
+
+/// @brief Find a child by name, the tree lock must be held
+/// @param child_name Name of the child, doesn't need to be terminated
+/// @param len Length of the name
+/// @return virtual_disk::node* The child, nullptr if not found
+virtual_disk::node *virtual_disk::node::find_child(const char *child_name, size_t len)
+{
+	const uint32_t hash = virtual_disk::hash_name(child_name, len);
+	const size_t slot = virtual_disk::dentry_slot(*this, hash);
+	g_dentry_lock.lock();
+	const auto dentry = g_dentries[slot];
+	g_dentry_lock.unlock();
+	if(dentry.parent == this && dentry.hash == hash) {
+		// Entries of removed nodes are dropped, so the node is still our child
+		if(storage_string::length(dentry.node->name) == len && !storage::compare(child_name, dentry.node->name, len))
+			return dentry.node;
+	}
+
+	virtual_disk::node *child = nullptr;
+	if(this->child_buckets != nullptr) {
+		child = this->child_buckets[hash % this->n_child_buckets];
+		while(child != nullptr) {
+			if(storage_string::length(child->name) == len && !storage::compare(child_name, child->name, len))
+				break;
+			child = child->hash_next;
+		}
+	} else {
+		// The table couldn't be allocated
+		for(size_t i = 0; i < this->children.size(); i++) {
+			auto *candidate = this->children[i];
+			if(storage_string::length(candidate->name) == len && !storage::compare(child_name, candidate->name, len)) {
+				child = candidate;
+				break;
+			}
+		}
+	}
+
+	if(child != nullptr) {
+		g_dentry_lock.lock();
+		g_dentries[slot].parent = this;
+		g_dentries[slot].node = child;
+		g_dentries[slot].hash = hash;
+		g_dentry_lock.unlock();
+	}
+	return child;
 }
 
 int virtual_disk::node::add_child(virtual_disk::node& child)
@@ -52,9 +172,34 @@ int virtual_disk::node::add_child(virtual_disk::node& child)
 	child.user_flags = this->user_flags;
 	child.group_flags = this->group_flags;
 	child.sys_flags = this->sys_flags;
-	if(this->children.insert(&child) == nullptr)
+	g_tree_lock.lock();
+	const auto *inserted = this->children.insert(&child);
+	if(inserted == nullptr) {
+		g_tree_lock.unlock();
 		return error::ALLOCATION; // Insertion failure
+	}
+	const bool grow = this->children.size() > this->n_child_buckets * 2;
+	if(!grow || !virtual_disk::rehash_children(*this, this->n_child_buckets == 0 ? VDISK_CHILD_BUCKETS : this->n_child_buckets * 2)) {
+		// Keep using the old table if it couldn't grow, the chains just get longer
+		if(this->child_buckets != nullptr) {
+			auto **link = &this->child_buckets[virtual_disk::hash_name(child.name, storage_string::length(child.name)) % this->n_child_buckets];
+			while(*link != nullptr)
+				link = &(*link)->hash_next;
+			child.hash_next = nullptr;
+			*link = &child;
+		}
+	}
+
+	// Drop the cached lookup of the name, just in case
+	const uint32_t hash = virtual_disk::hash_name(child.name, storage_string::length(child.name));
+	g_dentry_lock.lock();
+	auto& dentry = g_dentries[virtual_disk::dentry_slot(*this, hash)];
+	if(dentry.parent == this && dentry.hash == hash)
+		dentry = virtual_disk::dentry{};
+	g_dentry_lock.unlock();
+	g_tree_lock.unlock();
 	
+	// Drivers may look up the tree, so they're called without holding the lock
 	if(this->driver != nullptr) {
 		if(this->driver->_add_node != nullptr)
 			this->driver->_add_node(*this, child);
@@ -64,7 +209,23 @@ int virtual_disk::node::add_child(virtual_disk::node& child)
 
 int virtual_disk::node::remove_child(virtual_disk::node& child)
 {
-	this->children.remove(&child);
+	g_tree_lock.lock();
+	for(size_t i = 0; i < this->children.size(); i++) {
+		if(this->children[i] == &child) {
+			this->children.remove(i);
+			break;
+		}
+	}
+	virtual_disk::unlink_child(*this, child);
+
+	// Drop the lookups that lead to or thru the node
+	g_dentry_lock.lock();
+	for(size_t i = 0; i < VDISK_DENTRY_CACHE_SIZE; i++) {
+		if(g_dentries[i].node == &child || g_dentries[i].parent == &child)
+			g_dentries[i] = virtual_disk::dentry{};
+	}
+	g_dentry_lock.unlock();
+	g_tree_lock.unlock();
 
 	// Please do not deallocate the node in a remove_node call
 	if(this->driver != nullptr) {
@@ -78,6 +239,7 @@ int virtual_disk::node::remove_child(virtual_disk::node& child)
 
 virtual_disk::node *virtual_disk::resolve_path_relative(virtual_disk::node& base_node, const char *path)
 {
+	const base::scoped_read_mutex lock(g_tree_lock);
 	auto *root = &base_node;
 	const char *tmpbuf = path; // The pointer based off buffer for name comparasions
 	// An starting path separator means this is a path that does not employ
@@ -110,6 +272,7 @@ virtual_disk::node *virtual_disk::resolve_path_relative(virtual_disk::node& base
 
 	const char *filename_end;
 	size_t filename_len;
+	virtual_disk::node *child;
 find_file:
 	if(*tmpbuf == '\0') goto found_file; // File found
 
@@ -118,35 +281,27 @@ find_file:
 	
 	/// @todo Allow multiple asterisk nodes
 	debug_printf("\x01\x12,CHILD=%u,NAME=%s", root->children.size(), root->name);
-	for(size_t i = 0; i < root->children.size(); i++) {
-		auto& child = *root->children[i];
-
-		// Retarget-control mode, ask the driver for the node instead
-		if(child.driver != nullptr && child.driver->request_node != nullptr) {
-			// Make path be relative to the current node :-)
-			tmpbuf += filename_len;
-			if(*tmpbuf == '/' || *tmpbuf == '\\' || *tmpbuf == '.') tmpbuf++;
-			/*return child->driver->request_node(child, tmpbuf);*/
-			kpanic("return child->driver->request_node(child, tmpbuf);");
-		}
-
-		// Must be same length
-		if(storage_string::length(child.name) != filename_len) continue;
-
-		/// @todo Case insensitive node search
-		if(!storage::compare(tmpbuf, child.name, filename_len)) {
-			root = &child;
+	/// @todo Case insensitive node search
+	child = root->find_child(tmpbuf, filename_len);
+	// If none of the children matches then the file wasn't found
+	if(child == nullptr)
+		return nullptr;
 
-			// If this is not the end of the filepath then we just advance
-			// past the path separator
-			tmpbuf += filename_len;
-			if(*tmpbuf == '/' || *tmpbuf == '\\' || *tmpbuf == '.') tmpbuf++;
-			goto find_file;
-		}
+	// Retarget-control mode, ask the driver for the node instead
+	if(child->driver != nullptr && child->driver->request_node != nullptr) {
+		// Make path be relative to the current node :-)
+		tmpbuf += filename_len;
+		if(*tmpbuf == '/' || *tmpbuf == '\\' || *tmpbuf == '.') tmpbuf++;
+		/*return child->driver->request_node(child, tmpbuf);*/
+		kpanic("return child->driver->request_node(child, tmpbuf);");
 	}
+	root = child;
 
-	// If none of the children matches then the file wasn't found
-	return nullptr;
+	// If this is not the end of the filepath then we just advance
+	// past the path separator
+	tmpbuf += filename_len;
+	if(*tmpbuf == '/' || *tmpbuf == '\\' || *tmpbuf == '.') tmpbuf++;
+	goto find_file;
 found_file:
 	return root;
 }
@@ -197,6 +352,9 @@ virtual_disk::node *virtual_disk::node::create(virtual_disk::node& root, const c
 
 void virtual_disk::node::destroy(virtual_disk::node& node)
 {
+	page_cache::invalidate(node);
+	if(node.child_buckets != nullptr)
+		storage::free(node.child_buckets);
 	storage::free(&node);
 }
 
@@ -251,6 +409,8 @@ virtual_disk::handle *virtual_disk::handle::open(virtual_disk::node& node, int f
 		}
 	}
 	hdl->flags = flags;
+	hdl->high_water = HDLBUF_DEFAULT_HIGH_WATER;
+	hdl->n_refs = 1;
 	return hdl;
 }
 
@@ -265,15 +425,32 @@ virtual_disk::handle *virtual_disk::handle::open_path(const char *path, int flag
 	return hdl;
 }
 
+/// @brief Keep the handle open until a matching close, so requests in flight can
+/// still use it after the opener closes it
+void virtual_disk::handle::hold()
+{
+	base::fetch_add(&this->n_refs, 1);
+}
+
 int virtual_disk::handle::close(virtual_disk::handle *hdl)
 {
 	if(hdl == nullptr)
 		return 0;
+	// Someone still holds the handle, the last of them closes it
+	if(base::fetch_add(&hdl->n_refs, static_cast<uint32_t>(-1)) != 1)
+		return 0;
 	
 	int r = 0;
 	if(hdl->node == nullptr || hdl->node->driver == nullptr)
 		return error::INVALID_SETUP;
 	
+	// Data written thru this handle must reach the disk before the driver drops it's data
+	r = hdl->flush();
+	hdl->read_buf.clear();
+	hdl->write_buf.clear();
+	const int cr = disk_cache::flush(hdl->node);
+	if(r >= 0)
+		r = cr;
 	if(hdl->node->driver->close != nullptr) {
 		r = hdl->node->driver->close(*hdl);
 		/// @todo Check hdl->driver_data is deallocated
@@ -283,27 +460,85 @@ int virtual_disk::handle::close(virtual_disk::handle *hdl)
 	return r;
 }
 
+/// @brief Read at the position of the handle, thru the page cache if the driver
+/// can read at any offset
+static int virtual_disk::driver_read(virtual_disk::handle& hdl, void *buf, size_t n)
+{
+	if(hdl.node->driver->read_at == nullptr)
+		return hdl.node->driver->read(hdl, buf, n);
+	const int r = page_cache::read(*hdl.node, hdl.offset, buf, n);
+	if(r > 0)
+		hdl.offset += static_cast<size_t>(r);
+	return r;
+}
+
+/// @brief Write at the position of the handle, thru the page cache if the driver
+/// can write at any offset
+static int virtual_disk::driver_write(virtual_disk::handle& hdl, const void *buf, size_t n)
+{
+	if(hdl.node->driver->write_at == nullptr)
+		return hdl.node->driver->write(hdl, buf, n);
+	const int r = page_cache::write(*hdl.node, hdl.offset, buf, n);
+	if(r > 0)
+		hdl.offset += static_cast<size_t>(r);
+	return r;
+}
+
+/// @brief Forget the data read ahead by a buffered handle, so the next write lands
+/// where the caller stopped reading instead of after the read-ahead
+static void virtual_disk::drop_read_ahead(virtual_disk::handle& hdl)
+{
+	if(hdl.read_buf.size == 0)
+		return;
+	// Only the handles reading thru the page cache keep a position that can be
+	// moved back, the other drivers have already moved past the data
+	if(hdl.node->driver->read_at != nullptr)
+		hdl.offset -= hdl.read_buf.size;
+	hdl.read_buf.consume(nullptr, hdl.read_buf.size);
+}
+
 int virtual_disk::handle::write(const void *buf, size_t n)
 {
 	debug_printf("\x01\x12\x01\x20,hdl=%p,buf=%p,n=%u", this, buf, n);
 	if(n == 0) return 0; // Nothing to write
-	if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->write == nullptr)
+	if(this->node == nullptr || this->node->driver == nullptr || (this->node->driver->write == nullptr && this->node->driver->write_at == nullptr))
 		return error::INVALID_SETUP; // No write driver function
 	if(this->node->check_perms(virtual_disk::node_flags::WRITE) == false)
 		return error::UNPRIVILEGED; // No permission
+	virtual_disk::drop_read_ahead(*this);
 
 	// Concat the buffer to our write buffer when we later flush it
 	if(this->flags & virtual_disk::mode::BUFFERED) {
-		this->write_buf = storage::realloc(this->write_buf, this->write_buf_size + n);
-		if(this->write_buf == nullptr) return error::ALLOCATION;
-		storage::copy(&reinterpret_cast<char *>(this->write_buf)[this->write_buf_size], buf, n);
-		this->write_buf_size += n;
-		return static_cast<int>(n);
+		// Big writes gain nothing from being buffered, write them directly once
+		// what's pending has been written
+		if(n >= this->high_water) {
+			int r = this->flush();
+			if(r < 0)
+				return r;
+			return virtual_disk::driver_write(*this, buf, n);
+		}
+
+		size_t done = this->write_buf.append(buf, n);
+		if(done < n) {
+			// Out of storage, make room by writing what is buffered
+			int r = this->flush();
+			if(r < 0)
+				return done != 0 ? static_cast<int>(done) : r;
+			done += this->write_buf.append(reinterpret_cast<const uint8_t *>(buf) + done, n - done);
+			if(done == 0)
+				return error::ALLOCATION;
+		}
+		if(this->write_buf.size >= this->high_water) {
+			int r = this->flush();
+			if(r < 0)
+				return r;
+		}
+		return static_cast<int>(done);
 	}
 	// On no-buffer mode the data is directly written instead of being buffered
 	// by the handler buffer holders
 	else {
-		return this->node->driver->write(*this, buf, n);
+		return virtual_disk::driver_write(*this, buf, n);
 	}
 }
 
@@ -311,19 +546,97 @@ int virtual_disk::handle::read(void *buf, size_t n)
 {
 	debug_assert(buf != nullptr);
 	if(n == 0) return 0; // Nothing to write
-	if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->read == nullptr)
+	if(this->node == nullptr || this->node->driver == nullptr || (this->node->driver->read == nullptr && this->node->driver->read_at == nullptr))
 		return error::INVALID_SETUP; // No read function
 	if(this->node->check_perms(virtual_disk::node_flags::READ) == false)
 		return error::UNPRIVILEGED; // No permission
 	
-	auto r = this->node->driver->read(*this, buf, n);
+	int r;
+	if(this->flags & virtual_disk::mode::BUFFERED) {
+		// Reads must see what was written before them
+		if(this->write_buf.size != 0) {
+			r = this->flush();
+			if(r < 0)
+				return r;
+		}
+
+		size_t done = this->read_buf.consume(buf, n);
+		r = 0;
+		if(done < n) {
+			auto *dest = reinterpret_cast<uint8_t *>(buf) + done;
+			size_t avail;
+			uint8_t *p;
+			// Big reads go directly to the caller, small ones read a whole chunk ahead
+			if(n - done >= HDLBUF_CHUNK_SIZE || (p = this->read_buf.fill_chunk(&avail)) == nullptr) {
+				r = virtual_disk::driver_read(*this, dest, n - done);
+				if(r > 0)
+					done += static_cast<size_t>(r);
+			} else {
+				r = virtual_disk::driver_read(*this, p, avail);
+				if(r > 0) {
+					this->read_buf.commit_fill(static_cast<size_t>(r));
+					done += this->read_buf.consume(dest, n - done);
+				}
+			}
+		}
+		// Errors are only reported when nothing could be read
+		if(done != 0 || r >= 0)
+			r = static_cast<int>(done);
+	} else {
+		r = virtual_disk::driver_read(*this, buf, n);
+	}
 
 	// TODO: Use charset
-	if((this->flags & virtual_disk::node_flags::TEXT) != 0) // Text translation
-		locale::convert<char, locale::charset::ASCII, locale::charset::NATIVE>(reinterpret_cast<char *>(buf));
+	// Binary handles are left untouched, text ones only have what was read translated
+	if((this->flags & virtual_disk::node_flags::TEXT) != 0 && r > 0) {
+		auto *str = reinterpret_cast<char *>(buf);
+		for(int i = 0; i < r; i++)
+			str[i] = locale::convert<char, locale::charset::ASCII, locale::charset::NATIVE>(str[i]);
+	}
 	return r;
 }
 
+/// @brief Write a list of buffers in order
+/// @param iov The buffers
+/// @param n_iov Number of buffers
+/// @return int Bytes written, stops at the first short write, negative is error
+int virtual_disk::handle::writev(const struct vfs_iovec *iov, size_t n_iov)
+{
+	size_t total = 0;
+	for(size_t i = 0; i < n_iov; i++) {
+		if(iov[i].iov_len == 0)
+			continue;
+		int r = this->write(iov[i].iov_base, iov[i].iov_len);
+		if(r < 0)
+			return total != 0 ? static_cast<int>(total) : r;
+		total += static_cast<size_t>(r);
+		if(static_cast<size_t>(r) < iov[i].iov_len)
+			break;
+	}
+	return static_cast<int>(total);
+}
+
+/// @brief Read into a list of buffers in order, each buffer is given to the driver
+/// as is so it can place the data on it directly
+/// @param iov The buffers
+/// @param n_iov Number of buffers
+/// @return int Bytes read, stops at the first short read, negative is error
+int virtual_disk::handle::readv(const struct vfs_iovec *iov, size_t n_iov)
+{
+	size_t total = 0;
+	for(size_t i = 0; i < n_iov; i++) {
+		if(iov[i].iov_len == 0)
+			continue;
+		int r = this->read(iov[i].iov_base, iov[i].iov_len);
+		if(r < 0)
+			return total != 0 ? static_cast<int>(total) : r;
+		total += static_cast<size_t>(r);
+		if(static_cast<size_t>(r) < iov[i].iov_len)
+			break;
+	}
+	return static_cast<int>(total);
+}
+
 int virtual_disk::handle::write_disk(const virtual_disk::disk_loc& loc, const void *buf, size_t n)
 {
 	if(n == 0) return 0; // Nothing to write
@@ -332,19 +645,9 @@ int virtual_disk::handle::write_disk(const virtual_disk::disk_loc& loc, const vo
 	if(this->node->check_perms(virtual_disk::node_flags::WRITE) == false)
 		return error::UNPRIVILEGED; // No permission
 
-	// Concat the buffer to our write buffer when we later flush it
-	if(this->flags & virtual_disk::mode::BUFFERED) {
-		this->write_buf = storage::realloc(this->write_buf, this->write_buf_size + n);
-		if(this->write_buf == nullptr) return error::ALLOCATION;
-		storage::copy(&((unsigned char *)this->write_buf)[this->write_buf_size], buf, n);
-		this->write_buf_size += n;
-		return (int)n;
-	}
-	// On no-buffer mode the data is directly written instead of being buffered
-	// by the handler buffer holders
-	else {
-		return this->node->driver->write_disk(*this, loc, buf, n);
-	}
+	// Records aren't buffered by the handle, the disk cache holds them back
+	// when it's on write-back mode
+	return disk_cache::write(*this, loc, buf, n);
 }
 
 int virtual_disk::handle::read_disk(const virtual_disk::disk_loc& loc, void *buf, size_t n)
@@ -355,7 +658,48 @@ int virtual_disk::handle::read_disk(const virtual_disk::disk_loc& loc, void *buf
 		return error::INVALID_SETUP; // No read function
 	if(this->node->check_perms(virtual_disk::node_flags::READ) == false)
 		return error::UNPRIVILEGED; // No permission
-	return this->node->driver->read_disk(*this, loc, buf, n);
+	return disk_cache::read(*this, loc, buf, n);
+}
+
+int virtual_disk::handle::read_disk_extent(const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& end, void *buf, size_t n, size_t record_size, virtual_disk::disk_record *records, size_t *n_records)
+{
+	debug_assert(buf != nullptr);
+	if(n == 0) return 0; // Nothing to read
+	if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->read_disk_extent == nullptr)
+		return error::INVALID_SETUP; // No read function
+	if(this->node->check_perms(virtual_disk::node_flags::READ) == false)
+		return error::UNPRIVILEGED; // No permission
+	// The disk must be up to date before reading around the cache
+	int r = disk_cache::flush(this->node);
+	if(r < 0)
+		return r;
+	r = this->node->driver->read_disk_extent(*this, loc, end, buf, n, record_size, records, n_records);
+	if(r >= 0 && this->node->driver->get_last_disk_loc != nullptr)
+		this->last_loc = this->node->driver->get_last_disk_loc(*this);
+	return r;
+}
+
+int virtual_disk::handle::read_disk_records(const virtual_disk::disk_record *records, size_t n_records, void *buf)
+{
+	debug_assert(buf != nullptr && records != nullptr);
+	if(n_records == 0) return 0; // Nothing to read
+	if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->read_disk_records == nullptr)
+		return error::INVALID_SETUP; // No read function
+	if(this->node->check_perms(virtual_disk::node_flags::READ) == false)
+		return error::UNPRIVILEGED; // No permission
+	// The disk must be up to date before reading around the cache
+	int r = disk_cache::flush(this->node);
+	if(r < 0)
+		return r;
+	r = this->node->driver->read_disk_records(*this, records, n_records, buf);
+	if(r >= 0 && this->node->driver->get_last_disk_loc != nullptr)
+		this->last_loc = this->node->driver->get_last_disk_loc(*this);
+	return r;
+}
+
+virtual_disk::disk_loc virtual_disk::handle::get_last_disk_loc()
+{
+	return this->last_loc;
 }
 
 int virtual_disk::handle::ioctl(int cmd, ...)
@@ -369,8 +713,65 @@ int virtual_disk::handle::ioctl(int cmd, ...)
 
 int virtual_disk::handle::vioctl(int cmd, va_list args)
 {
+	// The disk cache sits on top of every disk driver
+	const bool disk_cache_cmd = cmd >= VDISK_IOCTL_CACHE_STATS && cmd <= VDISK_IOCTL_CACHE_FLUSH;
+	const bool page_cache_cmd = cmd == VDISK_IOCTL_PAGE_CACHE_STATS || cmd == VDISK_IOCTL_PAGE_CACHE_SET_BUDGET;
+	if(disk_cache_cmd || page_cache_cmd) {
+		if(this->node == nullptr)
+			return error::INVALID_SETUP;
+		// Reading the statistics is allowed to the readers of the disk, the rest
+		// changes what the disk holds
+		const bool query = cmd == VDISK_IOCTL_CACHE_STATS || cmd == VDISK_IOCTL_PAGE_CACHE_STATS;
+		if(this->node->check_perms(query ? virtual_disk::node_flags::READ : virtual_disk::node_flags::WRITE) == false)
+			return error::UNPRIVILEGED; // No permission
+		// The budgets and the policy are shared by every disk
+		if(cmd == VDISK_IOCTL_CACHE_SET_BUDGET || cmd == VDISK_IOCTL_CACHE_SET_POLICY || cmd == VDISK_IOCTL_PAGE_CACHE_SET_BUDGET) {
+			const auto *user = usersys::user::get_by_id(usersys::user::get_current());
+			if(!(user->flags & usersys::user_flags::OVERRIDE_PERMS))
+				return error::UNPRIVILEGED; // Only privileged users
+		}
+		if(disk_cache_cmd)
+			return disk_cache::ioctl(*this, cmd, args);
+		return page_cache::ioctl(*this, cmd, args);
+	} else if(cmd == VDISK_IOCTL_STAT) {
+		if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->get_size == nullptr)
+			return error::INVALID_SETUP;
+		if(this->node->check_perms(virtual_disk::node_flags::READ) == false)
+			return error::UNPRIVILEGED; // No permission
+		// The size has to include what is still buffered
+		if(this->write_buf.size != 0) {
+			int r = this->flush();
+			if(r < 0)
+				return r;
+		}
+		auto *st = va_arg(args, virtual_disk::node_stat *);
+		if(st == nullptr)
+			return error::INVALID_PARAM;
+		int r = this->node->driver->get_size(*this->node, st->size);
+		if(r < 0)
+			return r;
+		st->owner_id = this->node->owner_id;
+		st->user_flags = this->node->user_flags;
+		st->group_flags = this->node->group_flags;
+		st->sys_flags = this->node->sys_flags;
+		return 0;
+	} else if(cmd == VDISK_IOCTL_BUFFER_HIGH_WATER) {
+		const auto mark = va_arg(args, size_t);
+		if(mark == 0)
+			return error::INVALID_PARAM;
+		this->high_water = mark;
+		if(this->write_buf.size >= this->high_water)
+			return this->flush();
+		return 0;
+	}
 	if(this->node == nullptr || this->node->driver == nullptr || this->node->driver->ioctl == nullptr)
 		return error::INVALID_SETUP; // No IOCTL function
+	// The driver must see the writes done before the request
+	if(this->write_buf.size != 0) {
+		int r = this->flush();
+		if(r < 0)
+			return r;
+	}
 	if(this->node->check_perms(virtual_disk::node_flags::WRITE) == false)
 		return error::UNPRIVILEGED; // No permission
 	return this->node->driver->ioctl(*this, cmd, args);
@@ -378,22 +779,38 @@ int virtual_disk::handle::vioctl(int cmd, va_list args)
 
 int virtual_disk::handle::flush()
 {
-	int r = 0;
+	if(this->write_buf.size == 0 && (this->node == nullptr || this->node->driver == nullptr || this->node->driver->write_at == nullptr))
+		return 0;
+	// There must be a write callback
+	if(this->node == nullptr || this->node->driver == nullptr || (this->node->driver->write == nullptr && this->node->driver->write_at == nullptr))
+		return error::INVALID_SETUP;
 
-	// Only flush when there is a write buffer and the mode is buffered
-	if(this->flags & virtual_disk::mode::BUFFERED) {
-		if(this->write_buf_size == 0 || this->write_buf == nullptr)
-			return 0;
-		// There must be a write callback
-		if(this->node->driver->write == nullptr)
-			return error::INVALID_SETUP;
-		// Write it all at once in a single call
-		r = this->write(this->write_buf, this->write_buf_size);
-		storage::free(this->write_buf); // Free up buffer
-		this->write_buf = nullptr;
-		this->write_buf_size = 0;
+	// Hand the chunks to the driver in order, what the driver fails to take is
+	// kept for the next flush
+	size_t total = 0;
+	while(this->write_buf.size != 0) {
+		auto *chunk = this->write_buf.head;
+		const size_t len = chunk->end - chunk->start;
+		int r = virtual_disk::driver_write(*this, &chunk->data()[chunk->start], len);
+		if(r < 0)
+			return r;
+		total += static_cast<size_t>(r);
+		this->write_buf.consume(nullptr, static_cast<size_t>(r));
+		if(static_cast<size_t>(r) < len)
+			break; // The driver is full, keep the rest
 	}
-	return r;
+	// The written pages must reach the driver too
+	if(this->node->driver->write_at != nullptr) {
+		int r = page_cache::flush(this->node);
+		if(r < 0)
+			return r;
+	}
+	if(this->node->driver->flush != nullptr) {
+		int r = this->node->driver->flush(*this);
+		if(r < 0)
+			return r;
+	}
+	return static_cast<int>(total);
 }
 
 virtual_disk::driver *virtual_disk::driver::create()
@@ -434,4 +851,11 @@ void virtual_disk::dump()
 {
 	g_root_node->dump(0);
 }
+
+/// @brief Print how contended the locks of the tree and the dentry cache were
+void virtual_disk::dump_locks()
+{
+	g_tree_lock.dump("vfs tree");
+	g_dentry_lock.dump("vfs dentries");
+}
 #endif
@@ -4,8 +4,23 @@
 #include <stdarg.h>
 #include <types.hxx>
 #include <storage.hxx>
+#include <mutex.hxx>
 #include <user.hxx>
 #include <locale.hxx>
+#include <hdlbuf.hxx>
+#include <abi_bits.h>
+
+#define VDISK_IOCTL_CACHE_STATS 0x100 // Obtain the disk_cache::stats
+#define VDISK_IOCTL_CACHE_SET_BUDGET 0x101 // Set the storage the disk cache may use
+#define VDISK_IOCTL_CACHE_SET_POLICY 0x102 // Select write-through or write-back
+#define VDISK_IOCTL_CACHE_FLUSH 0x103 // Write the dirty records of the disk
+#define VDISK_IOCTL_BUFFER_HIGH_WATER 0x104 // Set the buffered bytes that trigger a flush on buffered handles
+#define VDISK_IOCTL_PAGE_CACHE_STATS 0x105 // Obtain the page_cache::stats, with the hits and misses of the node
+#define VDISK_IOCTL_PAGE_CACHE_SET_BUDGET 0x106 // Set the storage the page cache may use
+#define VDISK_IOCTL_STAT 0x107 // Obtain the virtual_disk::node_stat of the node, allowed to it's readers
+
+#define VDISK_CHILD_BUCKETS 8 // Initial buckets of the children of a node, doubled as it grows
+#define VDISK_DENTRY_CACHE_SIZE 256 // Recent (parent, name) lookups remembered
 
 namespace virtual_disk {
 	struct fdscb;
@@ -18,6 +33,21 @@ namespace virtual_disk {
 		unsigned short track;
 		unsigned short record;
 	};
+
+	/// @brief Where a record was found and how much of it was read
+	struct disk_record {
+		virtual_disk::disk_loc loc;
+		size_t size;
+	};
+
+	/// @brief Information about a node, obtained with VDISK_IOCTL_STAT
+	struct node_stat {
+		size_t size; // Bytes of the node
+		usersys::user::id owner_id;
+		uint8_t user_flags;
+		uint8_t group_flags;
+		uint8_t sys_flags;
+	};
 	
 	struct video_mode {
 		unsigned int max_width;
@@ -64,14 +94,22 @@ namespace virtual_disk {
 		static void destroy(virtual_disk::node& node);
 		int add_child(virtual_disk::node& child);
 		int remove_child(virtual_disk::node& child);
+		virtual_disk::node *find_child(const char *child_name, size_t len);
 		bool check_perms(const uint8_t req_bits);
 #if defined DEBUG
 		void dump(int level);
 #endif
 		unsigned char flags = 0;
 		storage::dynamic_list<virtual_disk::node *> children;
+		// Hash table of the children by name, the list above keeps the order they
+		// were added in for drive letter indexing
+		virtual_disk::node **child_buckets = nullptr;
+		size_t n_child_buckets = 0;
+		virtual_disk::node *hash_next = nullptr; // Next node on the bucket of the parent
 		virtual_disk::driver *driver = nullptr;
 		void *driver_data = nullptr;
+		size_t n_page_hits = 0; // Reads served by the page cache
+		size_t n_page_misses = 0; // Pages the page cache had to read from the driver
 		usersys::user::id owner_id = 0;
 		uint8_t user_flags = 0; // Owner's flags
 		uint8_t group_flags = 0; // Group-relative flags
@@ -79,6 +117,13 @@ namespace virtual_disk {
 		char name[24] = { '\0' };
 	};
 
+	/// @brief A recently resolved path component
+	struct dentry {
+		virtual_disk::node *parent = nullptr;
+		virtual_disk::node *node = nullptr;
+		uint32_t hash = 0; // Hash of the name
+	};
+
 	// Handle for opening a node, not viewed by the caller and only used internally
 	// by the functions below
 	class handle {
@@ -91,24 +136,36 @@ namespace virtual_disk {
 		static struct virtual_disk::handle *open(virtual_disk::node& node, int flags);
 		static struct virtual_disk::handle *open_path(const char *path, int flags);
 		static int close(struct virtual_disk::handle *hdl);
+		void hold();
 		int write(const void *buf, size_t n);
 		int read(void *buf, size_t n);
+		int writev(const struct vfs_iovec *iov, size_t n_iov);
+		int readv(const struct vfs_iovec *iov, size_t n_iov);
 		int write_disk(const virtual_disk::disk_loc& loc, const void *buf, size_t n);
 		int read_disk(const virtual_disk::disk_loc& loc, void *buf, size_t n);
+		int read_disk_extent(const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& end, void *buf, size_t n, size_t record_size, virtual_disk::disk_record *records = nullptr, size_t *n_records = nullptr);
+		int read_disk_records(const virtual_disk::disk_record *records, size_t n_records, void *buf);
+		virtual_disk::disk_loc get_last_disk_loc();
 		int ioctl(int cmd, ...);
 		int vioctl(int cmd, va_list args);
 		int flush();
 
 		virtual_disk::node *node = nullptr;
 		int mode = 0;
-		void *read_buf = nullptr;
-		size_t read_buf_size = 0;
-		void *write_buf = nullptr;
-		size_t write_buf_size = 0;
+		// Used on buffered mode, data read ahead from the driver and data waiting
+		// to be written to it
+		handle_buffer::chain read_buf;
+		handle_buffer::chain write_buf;
+		size_t high_water = HDLBUF_DEFAULT_HIGH_WATER; // Buffered bytes that trigger a flush
 		locale::charset cset = locale::charset::NATIVE;
 		int flags = 0;
+		size_t offset = 0; // Position of the handle on nodes read thru the page cache
 		// If used, driver is responsible for allocation/deallocation
 		void *driver_data = 0;
+		virtual_disk::disk_loc last_loc = {}; // Location following the last record read or written
+		unsigned int n_sequential = 0; // Reads in a row that started where the previous one ended
+		// The opener plus whoever holds the handle, the last one to close it closes it for real
+		base::atomic_word n_refs = 0;
 	};
 
 	// Manage nodes via ownership - This is used so drivers can register nodes and
@@ -132,6 +189,25 @@ namespace virtual_disk {
 		int (*read)(virtual_disk::handle& hdl, void *buf, size_t n) = nullptr;
 		int (*flush)(virtual_disk::handle& hdl) = nullptr;
 		int (*ioctl)(virtual_disk::handle& hdl, int cmd, va_list args) = nullptr;
+
+		/// @brief Callback to read from any offset of a node, when present the handles
+		/// read thru the page cache instead of calling read, so the pages are shared by
+		/// every handle of the node
+		/// @param node The node
+		/// @param offset Offset to read from
+		/// @param buf Buffer
+		/// @param size Size of the buffer
+		/// @return int Bytes read, less than size at the end of the node, negative on failure
+		int (*read_at)(virtual_disk::node& node, size_t offset, void *buf, size_t size) = nullptr;
+		/// @brief Callback to write at any offset of a node, used by the page cache to write
+		/// back dirty pages, handles write thru the page cache when present so read_at is
+		/// needed as well
+		int (*write_at)(virtual_disk::node& node, size_t offset, const void *buf, size_t size) = nullptr;
+		/// @brief Callback to obtain the size of a node without moving any handle
+		/// @param node The node
+		/// @param size Set to the bytes of the node
+		/// @return int Return code, negative on failure
+		int (*get_size)(virtual_disk::node& node, size_t& size) = nullptr;
 		
 		// Device dependant options
 		
@@ -147,6 +223,26 @@ namespace virtual_disk {
 		/// @param size Size of read
 		/// @return int Return code, negative on failure
 		int (*read_disk)(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, void *buf, size_t size) = nullptr;
+		/// @brief Callback to read all the records from a location up to the end of a track in as few
+		/// operations as the device allows, the records are placed one after the other
+		/// @param hdl Handle
+		/// @param loc Location of the first record
+		/// @param end Last track to read (the record is ignored)
+		/// @param buf Buffer
+		/// @param size Size of the buffer
+		/// @param record_size Size of the biggest record
+		/// @param records Optional, filled with where each record was found
+		/// @param n_records Capacity of records, set to the number of records read
+		/// @return int Bytes read, 0 at the end of the range, negative on failure
+		int (*read_disk_extent)(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc, const virtual_disk::disk_loc& end, void *buf, size_t size, size_t record_size, virtual_disk::disk_record *records, size_t *n_records) = nullptr;
+		/// @brief Callback to read records whose location and size are already known
+		/// straight into the buffer, without going thru an intermediate one
+		/// @param hdl Handle
+		/// @param records The records, in the order they are on the disk
+		/// @param n_records Number of records
+		/// @param buf Buffer, the records are placed one after the other
+		/// @return int Bytes read, short if a record wasn't where or as big as expected
+		int (*read_disk_records)(virtual_disk::handle& hdl, const virtual_disk::disk_record *records, size_t n_records, void *buf) = nullptr;
 		int (*seek_disk)(virtual_disk::handle& hdl, const virtual_disk::disk_loc& loc) = nullptr;
 		virtual_disk::disk_loc (*get_last_disk_loc)(virtual_disk::handle& hdl) = nullptr;
 
@@ -177,6 +273,7 @@ namespace virtual_disk {
 	char get_drive(const char *path);
 #ifdef DEBUG
 	void dump();
+	void dump_locks();
 #endif
 }
 
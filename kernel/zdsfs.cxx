@@ -18,10 +18,17 @@ constinit static storage::dynamic_list<zdsfs::driver_data> g_disks;
 namespace zdsfs {
 	static inline int get_vtoc_chain_fdscb(virtual_disk::handle& dev, zdsfs::fdscb& fdscb);
 	static inline int next_dscb(virtual_disk::handle& dev, zdsfs::fdscb& fdscb, zdsfs::dscb_fmt1& dscb);
-	static inline int get_fdscb(virtual_disk::handle& dev, zdsfs::dscb_fmt1& out_fdscb, const char *name);
-	static inline int read_file(virtual_disk::handle& dev, zdsfs::dscb_fmt1& zds_fdscb, void *buf, size_t *size);
-	static inline int find_free_space(virtual_disk::handle& dev, zdsfs::fdscb& fdscb, int *lastcyl, int *lasthead);
-	static inline int new_file(virtual_disk::handle& dev, const char *name);
+	static inline size_t hash_name(const uint8_t *name);
+	static int index_add(zdsfs::driver_data& disk, const zdsfs::dscb_fmt1& dscb, const virtual_disk::disk_loc& loc);
+	static int build_index(zdsfs::driver_data& disk);
+	static inline int get_fdscb(zdsfs::driver_data& disk, zdsfs::dscb_fmt1& out_fdscb, const char *name);
+	static size_t find_block(const zdsfs::node_data& data, size_t pos);
+	static int read_at(zdsfs::node_data& data, size_t pos, void *buf, size_t n);
+	static int map_dataset(zdsfs::node_data& data);
+	static int write_at(zdsfs::node_data& data, size_t pos, const void *buf, size_t n);
+	static inline int find_free_space(zdsfs::driver_data& disk, zdsfs::fdscb& fdscb, int *lastcyl, int *lasthead);
+	static int next_chain_end(zdsfs::driver_data& disk, virtual_disk::disk_loc& next);
+	static inline int new_file(zdsfs::driver_data& disk, const char *name);
 }
 
 /// @brief Fill the FDSCB with the position of the VTOC
@@ -71,7 +78,7 @@ static inline int zdsfs::next_dscb(virtual_disk::handle& dev, zdsfs::fdscb& fdsc
 		debug_printf("Unable to read any further");
 		return error::RESOURCE_UNAVAILABLE;
 	}
-	loc = dev.node->driver->get_last_disk_loc(dev);
+	loc = dev.get_last_disk_loc();
 	fdscb.cyl = loc.cylinder;
 	fdscb.head = loc.track;
 	fdscb.rec = loc.record;
@@ -88,128 +95,384 @@ static inline int zdsfs::next_dscb(virtual_disk::handle& dev, zdsfs::fdscb& fdsc
 	return 0;
 }
 
-static inline int zdsfs::get_fdscb(virtual_disk::handle& dev, zdsfs::dscb_fmt1& dscb, const char *name)
+/// @brief Hash a DSCB name, names are padded with blanks so all 44 bytes are used
+static inline size_t zdsfs::hash_name(const uint8_t *name)
+{
+	size_t hash = 0;
+	for(size_t i = 0; i < sizeof(zdsfs::dscb_fmt1::name); i++)
+		hash = hash * 31 + name[i];
+	return hash % ZDSFS_INDEX_BUCKETS;
+}
+
+/// @brief Add a dataset to the VTOC index of a disk
+/// @param disk Disk the dataset is on
+/// @param dscb Format 1 DSCB of the dataset
+/// @param loc Location of the DSCB on the VTOC
+/// @return int Nonzero on error
+static int zdsfs::index_add(zdsfs::driver_data& disk, const zdsfs::dscb_fmt1& dscb, const virtual_disk::disk_loc& loc)
+{
+	auto *entry = disk.entries.insert();
+	if(entry == nullptr)
+		return error::ALLOCATION;
+	entry->dscb = dscb;
+	entry->loc = loc;
+	const size_t bucket = zdsfs::hash_name(dscb.name);
+	entry->next = disk.buckets[bucket];
+	disk.buckets[bucket] = disk.entries.size();
+
+	// Keep the extents sorted by where they start so free space is found on a single pass
+	const zdsfs::extent ext = {
+		.start_cc = dscb.start_cc,
+		.start_hh = dscb.start_hh,
+		.end_cc = dscb.end_cc,
+		.end_hh = dscb.end_hh,
+	};
+	const uint32_t key = ((uint32_t)ext.start_cc << 16) | ext.start_hh;
+	size_t lo = 0, hi = disk.extents.size();
+	while(lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+		if((((uint32_t)disk.extents[mid].start_cc << 16) | disk.extents[mid].start_hh) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(disk.extents.insert() == nullptr)
+		return error::ALLOCATION;
+	const size_t n_after = disk.extents.size() - 1 - lo;
+	if(n_after > 0)
+		storage::move(&disk.extents[lo + 1], &disk.extents[lo], n_after * sizeof(zdsfs::extent));
+	disk.extents[lo] = ext;
+	return 0;
+}
+
+/// @brief Walk the VTOC chain once and index all the datasets of the disk
+/// @param disk Disk to index
+/// @return int Nonzero on error
+static int zdsfs::build_index(zdsfs::driver_data& disk)
 {
 	zdsfs::fdscb fdscb;
-	int r = zdsfs::get_vtoc_chain_fdscb(dev, fdscb);
+	int r = zdsfs::get_vtoc_chain_fdscb(*disk.dev, fdscb);
 	if(r < 0) {
 		debug_printf("Can't obtain VTOC chain");
 		return error::RESOURCE_UNAVAILABLE;
 	}
 
-	virtual_disk::disk_loc loc = {
-		.cylinder = fdscb.cyl,
-		.track = fdscb.head,
-		.record = fdscb.rec,
-	};
 	while(1) {
-		r = dev.read_disk(loc, &dscb, sizeof(dscb));
-		if(r < 0)
-			return error::RESOURCE_UNAVAILABLE;
-		loc = dev.node->driver->get_last_disk_loc(dev);
-		fdscb.cyl = loc.cylinder;
-		fdscb.head = loc.track;
-		fdscb.rec = loc.record;
-
-		if(r >= (int)sizeof(dscb)) {
-			debug_printf("Dataset %s", dscb.name);
-			if(dscb.format_id == '1') {
-				dscb.format_id = ' ';
-				if(storage::compare(dscb.name, name, storage_string::length(name)) == 0) {
-					debug_printf("Dataset %s @ CYL=%i-%i,HEAD=%i-%i", name, (int)dscb.start_cc, (int)dscb.end_cc, (int)dscb.start_hh, (int)dscb.end_hh);
-					break;
-				}
-			} else if(dscb.name[0] == '\0') {
-				return error::RESOURCE_EXPECTED;
-			}
+		// next_dscb advances the FDSCB, so remember where this DSCB is
+		const virtual_disk::disk_loc loc = {
+			.cylinder = fdscb.cyl,
+			.track = fdscb.head,
+			.record = fdscb.rec,
+		};
+		zdsfs::dscb_fmt1 dscb;
+		r = zdsfs::next_dscb(*disk.dev, fdscb, dscb);
+		if(r == error::RESOURCE_EXPECTED) {
+			disk.chain_end = loc;
+			break;
+		} else if(r < 0) {
+			return r;
+		}
+
+		if(dscb.format_id == '1') {
+			r = zdsfs::index_add(disk, dscb, loc);
+			if(r < 0)
+				return r;
+		}
+	}
+	debug_printf("zdsfs: Indexed %u datasets, chain ends @ CYL=%i,HEAD=%i,REC=%i", disk.entries.size(), (int)disk.chain_end.cylinder, (int)disk.chain_end.track, (int)disk.chain_end.record);
+	return 0;
+}
+
+/// @brief Find the DSCB of a dataset on the VTOC index
+/// @param disk Disk to search on
+/// @param dscb The output DSCB
+/// @param name Name of the dataset
+/// @return int Nonzero if not found
+static inline int zdsfs::get_fdscb(zdsfs::driver_data& disk, zdsfs::dscb_fmt1& dscb, const char *name)
+{
+	const size_t len = storage_string::length(name);
+	if(len > sizeof(dscb.name))
+		return error::INVALID_PARAM;
+
+	uint8_t key[sizeof(dscb.name)];
+	storage::fill(key, ' ', sizeof(key));
+	storage::copy(key, name, len);
+	for(size_t i = disk.buckets[zdsfs::hash_name(key)]; i != 0; i = disk.entries[i - 1].next) {
+		const auto& entry = disk.entries[i - 1];
+		if(storage::compare(entry.dscb.name, key, sizeof(key)) == 0) {
+			dscb = entry.dscb;
+			debug_printf("Dataset %s @ CYL=%i-%i,HEAD=%i-%i", name, (int)dscb.start_cc, (int)dscb.end_cc, (int)dscb.start_hh, (int)dscb.end_hh);
+			return 0;
 		}
 	}
 	return error::RESOURCE_EXPECTED;
 }
 
-static inline int zdsfs::read_file(virtual_disk::handle& dev, zdsfs::dscb_fmt1& zds_fdscb, void *buf, size_t *size)
+/// @brief Find the mapped record holding a byte of a dataset
+/// @param data Node of the dataset
+/// @param pos Offset of the byte
+/// @return size_t Index of the block, the number of blocks if the byte isn't mapped yet
+static size_t zdsfs::find_block(const zdsfs::node_data& data, size_t pos)
 {
-	const zdsfs::fdscb fdscb = {
-		.cyl = zds_fdscb.start_cc,
-		.head = zds_fdscb.start_hh,
-		.rec = 1,
-	};
-	debug_printf("zdsfs: Reading dataset @ CYL=%i,HEAD=%i,REC=%i", (int)fdscb.cyl, (int)fdscb.head, (int)fdscb.rec);
-	
-	// Support multi-track files
-	virtual_disk::disk_loc loc = {
-		.cylinder = zds_fdscb.start_cc,
-		.track = zds_fdscb.start_hh,
-		.record = 1,
+	if(pos >= data.mapped_size)
+		return data.blocks.size();
+	size_t lo = 0, hi = data.blocks.size();
+	while(hi - lo > 1) {
+		const size_t mid = (lo + hi) / 2;
+		if(data.blocks[mid].offset <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/// @brief Read a range of a dataset, only the records covering the range are read and
+/// records not seen before are added to the map of the dataset
+/// @param data Node of the dataset
+/// @param pos Offset to read from
+/// @param buf Buffer to read into, nullptr to only map the records
+/// @param n Bytes to read
+/// @return int Bytes read, less than n at the end of the dataset, negative is error
+static int zdsfs::read_at(zdsfs::node_data& data, size_t pos, void *buf, size_t n)
+{
+	auto& dev = *data.driver_data->dev;
+	if(dev.node->driver->read_disk_extent == nullptr)
+		return error::UNIMPLEMENTED;
+
+	const virtual_disk::disk_loc end = {
+		.cylinder = data.dscb1.end_cc,
+		.track = data.dscb1.end_hh,
+		.record = 0,
 	};
-	*size = 0;
-	while(1) {
-		int r = dev.read_disk(loc, buf, 3450);
-		debug_printf("zdsfs: Read ret=%i", r);
+	// The scratch buffer of the disk is only needed for the records whose size isn't
+	// known or that are partially read
+	auto& disk = *data.driver_data;
+	const timeshare::scoped_sleep_mutex lock(disk.read_lock);
+	size_t done = 0;
+	while(done < n) {
+		const size_t cur = pos + done;
+		virtual_disk::disk_loc loc;
+		size_t offset, want = ZDSFS_MAP_RECORDS;
+		const size_t idx = zdsfs::find_block(data, cur);
+
+		// Whole mapped records are read straight into the caller's buffer
+		if(idx < data.blocks.size() && buf != nullptr && cur == data.blocks[idx].offset && data.dscb1.keylen == 0 && dev.node->driver->read_disk_records != nullptr) {
+			virtual_disk::disk_record records[ZDSFS_MAP_RECORDS];
+			size_t n_records = 0;
+			while(idx + n_records < data.blocks.size() && n_records < ZDSFS_MAP_RECORDS) {
+				const auto& block = data.blocks[idx + n_records];
+				// A single program can't move to another cylinder
+				if(block.offset + block.size > pos + n || block.loc.cylinder != data.blocks[idx].loc.cylinder)
+					break;
+				records[n_records].loc = block.loc;
+				records[n_records].size = block.size;
+				n_records++;
+			}
+			if(n_records != 0) {
+				const int r = dev.read_disk_records(records, n_records, reinterpret_cast<uint8_t *>(buf) + done);
+				if(r < 0) {
+					return error::RESOURCE_UNAVAILABLE;
+				} else if(r > 0) {
+					done += (size_t)r;
+					continue;
+				}
+				// The records weren't as mapped, read them the slow way
+			}
+		}
+
+		if(disk.scratch == nullptr) {
+			disk.scratch = storage::alloc<uint8_t>(ZDSFS_MAP_RECORDS * ZDSFS_RECORD_SIZE);
+			if(disk.scratch == nullptr)
+				return error::ALLOCATION;
+		}
+		uint8_t *scratch = disk.scratch;
+		if(idx < data.blocks.size()) {
+			loc = data.blocks[idx].loc;
+			offset = data.blocks[idx].offset;
+			// Don't read records past the range if we know where it ends
+			size_t last = idx;
+			while(last < data.blocks.size() && data.blocks[last].offset < pos + n && last - idx < ZDSFS_MAP_RECORDS)
+				last++;
+			if(last < data.blocks.size())
+				want = last - idx;
+		} else {
+			if(data.mapped_eof)
+				break;
+			// Continue after the last mapped record, the driver moves to the next track
+			// when there are no more records on this one
+			if(data.blocks.size() == 0) {
+				loc.cylinder = data.dscb1.start_cc;
+				loc.track = data.dscb1.start_hh;
+				loc.record = 1;
+			} else {
+				loc = data.blocks[data.blocks.size() - 1].loc;
+				loc.record++;
+			}
+			offset = data.mapped_size;
+		}
+
+		virtual_disk::disk_record records[ZDSFS_MAP_RECORDS];
+		size_t n_records = want;
+		const int r = dev.read_disk_extent(loc, end, scratch, want * ZDSFS_RECORD_SIZE, ZDSFS_RECORD_SIZE, records, &n_records);
+		debug_printf("zdsfs: Extent read ret=%i,records=%u", r, n_records);
 		if(r < 0) {
 			return error::RESOURCE_UNAVAILABLE;
+		} else if(r == 0 || n_records == 0) {
+			// Nothing after the last mapped record, either the end of file record or the
+			// end of the extent was reached
+			if(idx >= data.blocks.size())
+				data.mapped_eof = true;
+			break;
 		}
-		// No elements read = end of the dataset
-		else if(r == 0) break;
-		loc = dev.node->driver->get_last_disk_loc(dev);
-
-		buf = reinterpret_cast<void *>((uintptr_t)buf + (size_t)r);
-		*size += (size_t)r;
 
-		// Check if we're finished reading
-		if(loc.track > zds_fdscb.end_hh) {
-			if(loc.cylinder >= zds_fdscb.end_cc)
-				break;
+		// Map the records that extend the mapped part of the dataset
+		size_t rec_offset = offset;
+		for(size_t i = 0; i < n_records; i++) {
+			if(rec_offset == data.mapped_size) {
+				auto *block = data.blocks.insert();
+				if(block == nullptr)
+					return error::ALLOCATION;
+				block->loc = records[i].loc;
+				block->offset = rec_offset;
+				block->size = records[i].size;
+				data.mapped_size += records[i].size;
+			}
+			rec_offset += records[i].size;
 		}
+
+		if(offset + (size_t)r <= cur)
+			break; // The records moved under us, don't loop forever
+		size_t len = offset + (size_t)r - cur;
+		if(len > n - done)
+			len = n - done;
+		if(buf != nullptr)
+			storage::copy(reinterpret_cast<uint8_t *>(buf) + done, &scratch[cur - offset], len);
+		done += len;
 	}
-	return 0;
+	return (int)done;
 }
 
-/// @brief Finds free space
-/// @param dev Disk device containing a zdsfs filesystem
-/// @param fdscb FDSCB of the new entry
-/// @param lastcyl Upper bound of data cylinder
-/// @param lasthead Upper bound of data head
-/// @return int Return code
-static inline int zdsfs::find_free_space(virtual_disk::handle& dev, zdsfs::fdscb& fdscb, int *lastcyl, int *lasthead)
+/// @brief Map every record of a dataset, needed to know it's size
+/// @param data Node of the dataset
+/// @return int Nonzero on error
+static int zdsfs::map_dataset(zdsfs::node_data& data)
 {
-	int r = zdsfs::get_vtoc_chain_fdscb(dev, fdscb);
-	if(r < 0) {
-		debug_printf("Can't obtain VTOC chain");
-		return error::RESOURCE_UNAVAILABLE;
+	while(!data.mapped_eof) {
+		const int r = zdsfs::read_at(data, data.mapped_size, nullptr, ZDSFS_MAP_RECORDS * ZDSFS_RECORD_SIZE);
+		if(r < 0)
+			return r;
+		else if(r == 0 && !data.mapped_eof)
+			return error::RESOURCE_EXPECTED;
 	}
+	return 0;
+}
 
-	virtual_disk::disk_loc loc = {
-		.cylinder = fdscb.cyl,
-		.track = fdscb.head,
-		.record = fdscb.rec,
-	};
+/// @brief Write over a range of a dataset, the records are updated in place so only the
+/// bytes the dataset already holds can be written
+/// @param data Node of the dataset
+/// @param pos Offset to write to
+/// @param buf Data to write
+/// @param n Bytes to write
+/// @return int Bytes written, less than n at the end of the dataset, negative is error
+static int zdsfs::write_at(zdsfs::node_data& data, size_t pos, const void *buf, size_t n)
+{
+	auto& dev = *data.driver_data->dev;
+	if(dev.node->driver->write_disk == nullptr || dev.node->driver->read_disk == nullptr || data.dscb1.keylen != 0)
+		return error::UNIMPLEMENTED;
 
-	*lastcyl = 0;
-	*lasthead = 0;
-	while(1) {
-		zdsfs::dscb_fmt1 dscb;
-		r = dev.read_disk(loc, &dscb, sizeof(dscb));
+	// The records covering the range must be mapped to know where they are
+	if(pos + n > data.mapped_size && !data.mapped_eof) {
+		int r = zdsfs::read_at(data, data.mapped_size, nullptr, pos + n - data.mapped_size);
 		if(r < 0)
-			return error::RESOURCE_UNAVAILABLE;
-		loc = dev.node->driver->get_last_disk_loc(dev);
-
-		if(r >= (int)sizeof(dscb)) {
-			debug_printf("Dataset %s", &dscb.name);
-			// Update lastcyl to upper bound
-			if(dscb.end_cc > *lastcyl) {
-				*lastcyl = dscb.end_cc + 1;
-				*lasthead = 0;
-			}
-			if(dscb.end_hh > *lasthead) {
-				*lasthead = dscb.end_hh + 1;
+			return r;
+	}
+
+	auto& disk = *data.driver_data;
+	const timeshare::scoped_sleep_mutex lock(disk.read_lock);
+	size_t done = 0;
+	while(done < n) {
+		const size_t cur = pos + done;
+		const size_t idx = zdsfs::find_block(data, cur);
+		if(idx >= data.blocks.size())
+			break; // The dataset can't grow
+		const auto block = data.blocks[idx];
+		const size_t in_record = cur - block.offset;
+		size_t len = block.size - in_record;
+		if(len > n - done)
+			len = n - done;
+
+		// The device writes whole records, the rest of a partially written one is
+		// read first
+		const void *src = reinterpret_cast<const uint8_t *>(buf) + done;
+		if(len != block.size) {
+			if(disk.scratch == nullptr) {
+				disk.scratch = storage::alloc<uint8_t>(ZDSFS_MAP_RECORDS * ZDSFS_RECORD_SIZE);
+				if(disk.scratch == nullptr)
+					return done != 0 ? (int)done : error::ALLOCATION;
 			}
-			// Break on end of chain
-			if(dscb.name[0] == '\0') return 0;
+			const int r = dev.read_disk(block.loc, disk.scratch, block.size);
+			if(r < 0 || (size_t)r != block.size)
+				return done != 0 ? (int)done : error::RESOURCE_UNAVAILABLE;
+			storage::copy(&disk.scratch[in_record], src, len);
+			src = disk.scratch;
 		}
+		const int r = dev.write_disk(block.loc, src, block.size);
+		if(r < 0)
+			return done != 0 ? (int)done : error::RESOURCE_UNAVAILABLE;
+		done += len;
 	}
-	// Couldn't find the end of the chain - VTOC probably corrupt
-	return error::RESOURCE_EXPECTED;
+	return (int)done;
+}
+
+/// @brief Finds free space
+/// @param disk Disk containing a zdsfs filesystem
+/// @param fdscb FDSCB of the new entry
+/// @param lastcyl Cylinder where the data of the new entry can start
+/// @param lasthead Head where the data of the new entry can start
+/// @return int Return code
+static inline int zdsfs::find_free_space(zdsfs::driver_data& disk, zdsfs::fdscb& fdscb, int *lastcyl, int *lasthead)
+{
+	fdscb.cyl = disk.chain_end.cylinder;
+	fdscb.head = disk.chain_end.track;
+	fdscb.rec = disk.chain_end.record;
+
+	// First gap between the used extents that fits the two cylinders a new dataset takes
+	uint32_t cyl = ZDSFS_FIRST_DATA_CYL;
+	for(size_t i = 0; i < disk.extents.size(); i++) {
+		const auto& ext = disk.extents[i];
+		if(((cyl + 1) << 16) < (((uint32_t)ext.start_cc << 16) | ext.start_hh))
+			break;
+		if((uint32_t)ext.end_cc + 1 > cyl)
+			cyl = (uint32_t)ext.end_cc + 1;
+	}
+	*lastcyl = (int)cyl;
+	*lasthead = 0;
+	return 0;
+}
+
+/// @brief Find the empty DSCB following the one that ends the VTOC chain, it becomes the
+/// end of the chain once the current end is written over, when the track of the current
+/// end is full it's on the next one
+/// @param disk Disk to search on, the VTOC lock must be held
+/// @param next Location of the empty DSCB
+/// @return int Nonzero if the VTOC is full
+static int zdsfs::next_chain_end(zdsfs::driver_data& disk, virtual_disk::disk_loc& next)
+{
+	auto loc = disk.chain_end;
+	loc.record++;
+	zdsfs::dscb_fmt1 dscb;
+	// The driver goes on to the next track (and cylinder) when the record isn't there
+	const int r = disk.dev->read_disk(loc, &dscb, sizeof(dscb));
+	if(r < (int)sizeof(dscb))
+		return error::RESOURCE_UNAVAILABLE;
+	// Reported as the location that follows the record it read
+	next = disk.dev->get_last_disk_loc();
+	next.record--;
+	// Past the VTOC, or a DSCB that is already in use
+	if(next.cylinder >= ZDSFS_FIRST_DATA_CYL || dscb.name[0] != '\0')
+		return error::RESOURCE_UNAVAILABLE;
+	return 0;
 }
 
 /// @brief Creates a new file
@@ -218,12 +481,23 @@ static inline int zdsfs::find_free_space(virtual_disk::handle& dev, zdsfs::fdscb
 /// @param dev DASD device
 /// @param name Name of the file
 /// @return int Return code
-static inline int zdsfs::new_file(virtual_disk::handle& dev, const char *name)
+static inline int zdsfs::new_file(zdsfs::driver_data& disk, const char *name)
 {
 	debug_printf("zdsfs: creating new dataset %s", name);
+	// The name is looked up, the space found and the DSCB written as one update
+	const timeshare::scoped_sleep_mutex lock(disk.vtoc_lock);
+	zdsfs::dscb_fmt1 dscb;
+	int r = zdsfs::get_fdscb(disk, dscb, name);
+	if(r == 0) {
+		debug_printf("zdsfs: Dataset %s already exists", name);
+		return error::INVALID_PARAM;
+	} else if(r == error::INVALID_PARAM) {
+		return r; // Name doesn't fit on a DSCB
+	}
+
 	int datacyl, datahead;
 	zdsfs::fdscb fdscb;
-	int r = zdsfs::find_free_space(dev, fdscb, &datacyl, &datahead);
+	r = zdsfs::find_free_space(disk, fdscb, &datacyl, &datahead);
 	if(r < 0) {
 		/* No VTOC chain space found */
 		debug_printf("zdsfs: No VTOC chain space found");
@@ -233,7 +507,7 @@ static inline int zdsfs::new_file(virtual_disk::handle& dev, const char *name)
 	// TODO: Try to make it work without having to set it to zero
 	zdsfs::dscb_fmt1 dscb1;
 	storage::fill(&dscb1.name,  ' ', sizeof(dscb1.name));
-	storage::copy(reinterpret_cast<char *>(&dscb1.name), name, sizeof(dscb1.name));
+	storage::copy(reinterpret_cast<char *>(&dscb1.name), name, storage_string::length(name));
 	dscb1.format_id = '1';
 	storage::copy(&dscb1.serial_volume, "UDOS00", sizeof(dscb1.serial_volume));
 	dscb1.vol_seq[1] = 1;
@@ -258,14 +532,28 @@ static inline int zdsfs::new_file(virtual_disk::handle& dev, const char *name)
 	dscb1.start_hh = (uint16_t)datahead;
 	dscb1.end_hh = (uint16_t)datahead;
 
-	/// @todo Writing on the end of the chain means we need to make sure the chain actually
-	/// ends after writing this dataset!
+	// The DSCB goes over the one ending the chain, so the chain must still have an
+	// empty DSCB after it, it's found first so a full VTOC is left untouched
 	const virtual_disk::disk_loc loc = {
 		.cylinder = fdscb.cyl,
 		.track = fdscb.head,
 		.record = fdscb.rec,
 	};
-	dev.write_disk(loc, &dscb1, sizeof(dscb1));
+	virtual_disk::disk_loc next;
+	r = zdsfs::next_chain_end(disk, next);
+	if(r < 0) {
+		debug_printf("zdsfs: VTOC is full");
+		return r;
+	}
+	r = disk.dev->write_disk(loc, &dscb1, sizeof(dscb1));
+	if(r < 0)
+		return r;
+
+	// Keep the index in sync with what was written, the VTOC lock covers it too
+	r = zdsfs::index_add(disk, dscb1, loc);
+	if(r < 0)
+		return r;
+	disk.chain_end = next;
 
 	// Register the new dataset to the VFS
 	{
@@ -275,7 +563,7 @@ static inline int zdsfs::new_file(virtual_disk::handle& dev, const char *name)
 		ds_driver->add_node(*node);
 
 		// Custom per-node data
-		node->driver_data = storage::alloc(sizeof(zdsfs::node_data));
+		node->driver_data = storage::allocz(sizeof(zdsfs::node_data));
 		if(node->driver_data == nullptr) {
 			/** @todo Destroy node and undo allocations */
 			/*virtual_disk::node_destroy(node);*/
@@ -283,7 +571,7 @@ static inline int zdsfs::new_file(virtual_disk::handle& dev, const char *name)
 		}
 		auto *data = static_cast<zdsfs::node_data *>(node->driver_data);
 		data->dscb1 = dscb1; // Save the dscb
-		data->driver_data = &g_disks[0]; // Point to current ds_driver
+		data->driver_data = &disk; // Point to the disk it was created on
 	}
 	return 0;
 }
@@ -293,58 +581,70 @@ int zdsfs::init(virtual_disk::handle& dev)
 	// Regular dataset driver (files)
 	ds_driver = virtual_disk::driver::create();
 	debug_assert(ds_driver != nullptr);
-	ds_driver->open = [](virtual_disk::handle& hdl) -> int {
-		auto* driver_data = storage::alloc<zdsfs::handle_data>(sizeof(zdsfs::handle_data));
-		debug_assert(driver_data != nullptr);
-		driver_data->seekpos = 0;
-		hdl.driver_data = driver_data;
-		return 0;
-	};
-	ds_driver->close = [](virtual_disk::handle& hdl) -> int {
-		debug_assert(hdl.driver_data != nullptr);
-		storage::free(hdl.driver_data);
-		return 0;
-	};
-	ds_driver->read = [](virtual_disk::handle& hdl, void *buf, size_t n) -> int {
-		size_t size;
+	// The handles keep their position, the datasets are read thru the page cache
+	ds_driver->read_at = [](virtual_disk::node& node, size_t offset, void *buf, size_t n) -> int {
 		debug_assert(buf != nullptr);
-		zdsfs::node_data& data = *static_cast<zdsfs::node_data *>(hdl.node->driver_data);
-		int r = zdsfs::read_file(*data.driver_data->dev, data.dscb1, buf, &size);
+		zdsfs::node_data& data = *static_cast<zdsfs::node_data *>(node.driver_data);
+		int r = zdsfs::read_at(data, offset, buf, n);
 		if(r < 0) {
 			debug_printf("Can't read\x01\x11");
 			return r;
 		}
 		/// @todo A better way to transmit size_t stuff safely
-		debug_printf("size_of_zdsfs=%u", size);
-		return (int)size;
+		debug_printf("size_of_zdsfs=%u", (size_t)r);
+		return r;
+	};
+	// Dirty pages are written back over the records already on the disk
+	ds_driver->write_at = [](virtual_disk::node& node, size_t offset, const void *buf, size_t n) -> int {
+		debug_assert(buf != nullptr);
+		zdsfs::node_data& data = *static_cast<zdsfs::node_data *>(node.driver_data);
+		return zdsfs::write_at(data, offset, buf, n);
+	};
+	ds_driver->get_size = [](virtual_disk::node& node, size_t& size) -> int {
+		// The size is only known once all the records are mapped
+		zdsfs::node_data& data = *static_cast<zdsfs::node_data *>(node.driver_data);
+		int r = zdsfs::map_dataset(data);
+		if(r < 0)
+			return r;
+		size = data.mapped_size;
+		return 0;
 	};
 	ds_driver->ioctl = [](virtual_disk::handle& hdl, int cmd, va_list args) -> int {
-		auto* hdl_data = reinterpret_cast<zdsfs::handle_data *>(hdl.driver_data);
 		switch(cmd) {
 		case ZDSFS_IOCTL_FTELL: {
 			// We can't return because it will be converted onto an int, so we just
 			// copy the long over
 			long *num = va_arg(args, long *);
-			*num = hdl_data->seekpos;
+			// Data read ahead by a buffered handle hasn't been seen by the caller
+			*num = (long)hdl.offset - (long)hdl.read_buf.size;
 		} break;
 		case ZDSFS_IOCTL_SEEK: {
 			long offset = va_arg(args, long);
 			int whence = va_arg(args, int);
+			long base;
 			switch(whence) {
 			case ZDSFS_SEEK_CUR:
-				hdl_data->seekpos += offset;
-				/** @todo Check bounds */
+				base = (long)hdl.offset - (long)hdl.read_buf.size;
 				break;
-			case ZDSFS_SEEK_END:
-				/** @todo SEEK_END() w bounds check */
-				return error::UNIMPLEMENTED;
+			case ZDSFS_SEEK_END: {
+				// The size is only known once all the records are mapped
+				zdsfs::node_data& data = *static_cast<zdsfs::node_data *>(hdl.node->driver_data);
+				int r = zdsfs::map_dataset(data);
+				if(r < 0)
+					return r;
+				base = (long)data.mapped_size;
+			} break;
 			case ZDSFS_SEEK_SET:
-				hdl_data->seekpos = offset;
-				/** @todo Check bounds */
+				base = 0;
 				break;
 			default:
 				return -1;
 			}
+			// Seeking past the end is allowed, reads there return nothing
+			if(base + offset < 0)
+				return error::INVALID_PARAM;
+			hdl.offset = (size_t)(base + offset);
+			hdl.read_buf.consume(nullptr, hdl.read_buf.size);
 		} break;
 		default:
 			return -1;
@@ -366,15 +666,19 @@ int zdsfs::init(virtual_disk::handle& dev)
 	auto *ds_data = g_disks.insert();
 	if(ds_data == nullptr)
 		return error::ALLOCATION;
+	storage::fill(ds_data, 0, sizeof(*ds_data));
+	new (&ds_data->vtoc_lock) timeshare::sleep_mutex();
+	new (&ds_data->read_lock) timeshare::sleep_mutex();
 	ds_data->driver = ds_driver;
 	ds_data->dev = &dev;
+	const int built = zdsfs::build_index(*ds_data);
+	if(built < 0)
+		return built;
 
 	// Register all of the datasets of the disk onto the VFS
 	debug_printf("Adding disk\x01\x11 to the\x01\x12");
-	zdsfs::dscb_fmt1 dscb1;
-	zdsfs::fdscb fdscb;
-	zdsfs::get_vtoc_chain_fdscb(dev, fdscb);
-	while(zdsfs::next_dscb(dev, fdscb, dscb1) == 0) {
+	for(size_t e = 0; e < ds_data->entries.size(); e++) {
+		const auto& dscb1 = ds_data->entries[e].dscb;
 		char sname[sizeof(dscb1.name) + 1]; // Sanitized name
 		storage::copy(sname, dscb1.name, sizeof(dscb1.name));
 		sname[sizeof(dscb1.name)] = '\0';
@@ -396,7 +700,7 @@ int zdsfs::init(virtual_disk::handle& dev)
 		if(ds_node == nullptr) return error::ALLOCATION;
 
 		// Custom per-node data
-		ds_node->driver_data = storage::alloc(sizeof(zdsfs::node_data));
+		ds_node->driver_data = storage::allocz(sizeof(zdsfs::node_data));
 		if(ds_node->driver_data == nullptr) {
 			virtual_disk::node::destroy(*ds_node);
 			return error::ALLOCATION;
@@ -419,7 +723,7 @@ int zdsfs::init(virtual_disk::handle& dev)
 	// so we can already know it's not very smart to create an already existing file
 	pds_driver->_add_node = [](virtual_disk::node& node, virtual_disk::node& child) {
 		auto& node_data = *(reinterpret_cast<zdsfs::node_data*>(node.driver_data));
-		int r = zdsfs::new_file(*node_data.driver_data->dev, child.name);
+		int r = zdsfs::new_file(*node_data.driver_data, child.name);
 		if(r < 0) {
 			debug_printf("Can't create\x01\x11");
 			return r;
@@ -427,8 +731,10 @@ int zdsfs::init(virtual_disk::handle& dev)
 		return 0;
 	};
 	pds_driver->_remove_node = [](virtual_disk::node&, virtual_disk::node& child) {
-		if(child.driver_data != nullptr)
+		if(child.driver_data != nullptr) {
+			static_cast<zdsfs::node_data *>(child.driver_data)->blocks.~dynamic_list();
 			storage::free(child.driver_data);
+		}
 		return 0;
 	};
 	debug_printf("\x01\x0A\x01\x11");
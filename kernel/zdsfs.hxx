@@ -7,6 +7,8 @@
 
 #include <types.hxx>
 #include <vdisk.hxx>
+#include <storage.hxx>
+#include <semaphr.hxx>
 
 #define ZDSFS_IOCTL_NEW_FILE 0x01
 #define ZDSFS_IOCTL_FTELL 0x02
@@ -16,6 +18,11 @@
 #define ZDSFS_SEEK_CUR 1
 #define ZDSFS_SEEK_END 2
 
+#define ZDSFS_RECORD_SIZE 3450 // Biggest record of a dataset
+#define ZDSFS_INDEX_BUCKETS 64 // Buckets of the in-memory VTOC index
+#define ZDSFS_FIRST_DATA_CYL 1 // Cylinder 0 holds the IPL records and the VTOC
+#define ZDSFS_MAP_RECORDS 16 // Records read at once when walking past the mapped part of a dataset
+
 namespace zdsfs {
 	/**
 	 * @brief File dataset control block, used for tapes and disks and tracking files
@@ -89,6 +96,27 @@ namespace zdsfs {
 		* https://www.ibm.com/support/knowledgecenter/en/SSLTBW_2.1.0/com.ibm.zos.v2r1.idas300/s3022.htm */
 	} PACKED;
 
+	/**
+	 * @brief A dataset of the in-memory VTOC index
+	 * 
+	 */
+	struct index_entry {
+		zdsfs::dscb_fmt1 dscb;
+		virtual_disk::disk_loc loc; // Where the DSCB lives on the VTOC
+		size_t next; // Next entry of the hash bucket plus one, 0 ends the bucket
+	};
+
+	/**
+	 * @brief Cylinders and tracks used by a dataset, both ends are inclusive
+	 * 
+	 */
+	struct extent {
+		uint16_t start_cc;
+		uint16_t start_hh;
+		uint16_t end_cc;
+		uint16_t end_hh;
+	};
+
 	/**
 	 * @brief Global driver data
 	 * 
@@ -96,23 +124,43 @@ namespace zdsfs {
 	struct driver_data {
 		virtual_disk::driver *driver = nullptr;
 		virtual_disk::handle *dev = nullptr;
+		// Index of the VTOC built when the disk is added, kept in sync as datasets
+		// are created so lookups and allocations don't have to walk the chain
+		storage::dynamic_list<zdsfs::index_entry> entries;
+		size_t buckets[ZDSFS_INDEX_BUCKETS]; // First entry of each bucket plus one
+		storage::dynamic_list<zdsfs::extent> extents; // Used extents sorted by start
+		virtual_disk::disk_loc chain_end; // Empty DSCB that ends the VTOC chain
+		// Held while the VTOC and the index are updated, the holder waits for the disk
+		timeshare::sleep_mutex vtoc_lock;
+		// Records that can't be read straight into the caller's buffer go here, allocated
+		// on the first such read and kept for the other reads of the disk
+		uint8_t *scratch = nullptr;
+		// Held while a dataset is read, guards the scratch buffer and the maps of the datasets
+		timeshare::sleep_mutex read_lock;
 	};
 
 	/**
-	 * @brief Data stored per node by the driver
+	 * @brief A record of a dataset and the bytes of the dataset it holds
 	 * 
 	 */
-	struct node_data {
-		zdsfs::dscb_fmt1 dscb1;
-		zdsfs::driver_data *driver_data;
+	struct block {
+		virtual_disk::disk_loc loc;
+		size_t offset; // Offset of the first byte of the record within the dataset
+		size_t size;
 	};
-	
+
 	/**
-	 * @brief Data stored per handle by the ZDSFS driver
+	 * @brief Data stored per node by the driver
 	 * 
 	 */
-	struct handle_data {
-		long seekpos;
+	struct node_data {
+		zdsfs::dscb_fmt1 dscb1;
+		zdsfs::driver_data *driver_data;
+		// Records of the dataset seen so far, the sizes of the records can only be
+		// known by reading them, so the map grows as the dataset is read
+		storage::dynamic_list<zdsfs::block> blocks;
+		size_t mapped_size; // Bytes covered by the blocks
+		bool mapped_eof; // The whole dataset is mapped
 	};
 
 	int init(virtual_disk::handle& dev);
@@ -1490,7 +1490,12 @@ int jda_builtin_parpgm(jda_context& ctx)
     }
 
     elf64_load(buf, size, &entry);
-    io_svc(SVC_EXEC_AT, (uintptr_t)entry, (uintptr_t)"CHILD", 0);
+    /* The new job gets the pages of the program just loaded without copying them */
+    r = job_spawn((void (*)(void))entry, "CHILD");
+    if(r < 0) {
+        jda_report_error(ctx, "Error %i starting the program\r\n", r);
+        goto end_error;
+    }
     r = 0;
 end_error:
     if(buf != nullptr) {
@@ -0,0 +1,136 @@
+#include <aio.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <svc.h>
+
+/**
+ * @brief Register the ring of the context with the kernel
+ * 
+ * @param ctx The context, allocated with malloc since the kernel stores on the ring
+ * by it's real address, must stay at the same address until destroyed
+ * @return int 0 on success, negative on error
+ */
+STDAPI int aio_setup(struct aio_context *ctx)
+{
+    assert(ctx != NULL);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->id = (int)io_svc(SVC_AIO_SETUP, (uintptr_t)&ctx->ring, 0, 0);
+    return ctx->id < 0 ? ctx->id : 0;
+}
+
+/**
+ * @brief Unregister the ring, fails while requests are being performed
+ * 
+ * @param ctx The context
+ * @return int 0 on success, negative on error
+ */
+STDAPI int aio_destroy(struct aio_context *ctx)
+{
+    assert(ctx != NULL);
+    return (int)io_svc(SVC_AIO_DESTROY, (uintptr_t)ctx->id, 0, 0);
+}
+
+/**
+ * @brief Obtain the next free entry of the submission queue, it is given to the
+ * kernel by the next aio_submit
+ * 
+ * @param ctx The context
+ * @return struct aio_sqe* The entry, NULL if the queue is full
+ */
+STDAPI struct aio_sqe *aio_get_sqe(struct aio_context *ctx)
+{
+    struct aio_ring *ring = &ctx->ring;
+    struct aio_sqe *sqe;
+    if(ring->sq_tail - ring->sq_head >= AIO_RING_ENTRIES) {
+        return nullptr;
+    }
+    sqe = &ring->sqes[ring->sq_tail & (AIO_RING_ENTRIES - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    /* Visible to the kernel once it's prepared and submitted */
+    ring->sq_tail = ring->sq_tail + 1;
+    return sqe;
+}
+
+static void aio_prep(struct aio_sqe *sqe, int opcode, int fd, const void *buf, size_t len, uintptr_t user_data)
+{
+    sqe->opcode = opcode;
+    sqe->handle = (fd < 0 || fd >= FOPEN_MAX) ? -1 : (int)(uintptr_t)_files[fd].handle;
+    sqe->buf = (void *)buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+STDAPI void aio_prep_read(struct aio_sqe *sqe, int fd, void *buf, size_t len, uintptr_t user_data)
+{
+    aio_prep(sqe, AIO_OP_READ, fd, buf, len, user_data);
+}
+
+STDAPI void aio_prep_write(struct aio_sqe *sqe, int fd, const void *buf, size_t len, uintptr_t user_data)
+{
+    aio_prep(sqe, AIO_OP_WRITE, fd, buf, len, user_data);
+}
+
+STDAPI void aio_prep_readv(struct aio_sqe *sqe, int fd, const struct iovec *iov, int iovcnt, uintptr_t user_data)
+{
+    aio_prep(sqe, AIO_OP_READV, fd, iov, (size_t)iovcnt, user_data);
+}
+
+STDAPI void aio_prep_writev(struct aio_sqe *sqe, int fd, const struct iovec *iov, int iovcnt, uintptr_t user_data)
+{
+    aio_prep(sqe, AIO_OP_WRITEV, fd, iov, (size_t)iovcnt, user_data);
+}
+
+STDAPI void aio_prep_flush(struct aio_sqe *sqe, int fd, uintptr_t user_data)
+{
+    aio_prep(sqe, AIO_OP_FLUSH, fd, NULL, 0, user_data);
+}
+
+/**
+ * @brief Give the prepared entries to the kernel
+ * 
+ * @param ctx The context
+ * @return int Entries taken by the kernel, negative on error
+ */
+STDAPI int aio_submit(struct aio_context *ctx)
+{
+    return (int)io_svc(SVC_AIO_ENTER, (uintptr_t)ctx->id, 0, 0);
+}
+
+/**
+ * @brief Consume a completion without entering the kernel
+ * 
+ * @param ctx The context
+ * @param cqe Where to copy the completion to
+ * @return int 1 if a completion was consumed, 0 if there are none
+ */
+STDAPI int aio_peek_cqe(struct aio_context *ctx, struct aio_cqe *cqe)
+{
+    struct aio_ring *ring = &ctx->ring;
+    if(ring->cq_head == ring->cq_tail) {
+        return 0;
+    }
+    *cqe = ring->cqes[ring->cq_head & (AIO_RING_ENTRIES - 1)];
+    ring->cq_head = ring->cq_head + 1;
+    return 1;
+}
+
+/**
+ * @brief Wait for a completion, submitting whatever is pending on the way
+ * 
+ * @param ctx The context
+ * @param cqe Where to copy the completion to
+ * @return int 0 on success, negative on error
+ */
+STDAPI int aio_wait_cqe(struct aio_context *ctx, struct aio_cqe *cqe)
+{
+    while(!aio_peek_cqe(ctx, cqe)) {
+        /* Sleeps until a completion is posted */
+        int r = (int)io_svc(SVC_AIO_ENTER, (uintptr_t)ctx->id, AIO_ENTER_WAIT, 0);
+        if(r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* aio.h
+ *
+ * Asynchronous I/O thru a ring shared with the kernel, requests are placed
+ * on the ring and submitted in batches, the kernel posts their completions
+ * on the same ring so they can be consumed without an SVC */
+
+#ifndef __LIBIO_AIO_H__
+#define __LIBIO_AIO_H__ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <svc.h>
+#include <sys/uio.h>
+
+struct aio_context {
+    struct aio_ring ring;
+    int id; /* As given by the kernel */
+};
+
+int aio_setup(struct aio_context *ctx);
+int aio_destroy(struct aio_context *ctx);
+struct aio_sqe *aio_get_sqe(struct aio_context *ctx);
+void aio_prep_read(struct aio_sqe *sqe, int fd, void *buf, size_t len, uintptr_t user_data);
+void aio_prep_write(struct aio_sqe *sqe, int fd, const void *buf, size_t len, uintptr_t user_data);
+void aio_prep_readv(struct aio_sqe *sqe, int fd, const struct iovec *iov, int iovcnt, uintptr_t user_data);
+void aio_prep_writev(struct aio_sqe *sqe, int fd, const struct iovec *iov, int iovcnt, uintptr_t user_data);
+void aio_prep_flush(struct aio_sqe *sqe, int fd, uintptr_t user_data);
+int aio_submit(struct aio_context *ctx);
+int aio_peek_cqe(struct aio_context *ctx, struct aio_cqe *cqe);
+int aio_wait_cqe(struct aio_context *ctx, struct aio_cqe *cqe);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,3 +11,36 @@ STDAPI void job_get_stats(struct job_stats *stats)
     stats->used_size = pdb_area.pdb_used_bytes;
     stats->n_regions = 1;
 }
+
+/* Give the CPU to the next runnable thread */
+STDAPI void job_yield(void)
+{
+    io_svc(SVC_SCHED_YIELD, 0, 0, 0);
+}
+
+/* Start a thread on the current task, entry must never return */
+STDAPI void job_create_thread(void (*entry)(void))
+{
+    io_svc(SVC_THREAD_AT, (uintptr_t)entry, 0, 0);
+}
+
+/* Start a new job at entry running this same program, it's pages are shared with
+ * the new job until either of them stores on them */
+STDAPI int job_spawn(void (*entry)(void), const char *name)
+{
+    return (int)io_svc(SVC_JOB_SPAWN, (uintptr_t)entry, (uintptr_t)name, 0);
+}
+
+/* Run the calling thread at a priority, 0 is the highest, a negative priority
+ * only queries it, returns the previous priority */
+STDAPI int job_set_priority(int priority)
+{
+    return (int)io_svc(SVC_SCHED_PRIORITY, (uintptr_t)priority, 0, 0);
+}
+
+/* Obtain the CPU used by the calling thread, task or job, who is one of
+ * SCHED_USAGE_*, returns a negative error code if it isn't */
+STDAPI int job_get_usage(int who, struct sched_usage *usage)
+{
+    return (int)io_svc(SVC_SCHED_USAGE, (uintptr_t)who, (uintptr_t)usage, 0);
+}
@@ -14,6 +14,12 @@ struct job_stats {
 };
 
 void job_get_stats(struct job_stats *stats);
+void job_yield(void);
+void job_create_thread(void (*entry)(void));
+int job_spawn(void (*entry)(void), const char *name);
+int job_set_priority(int priority);
+struct sched_usage;
+int job_get_usage(int who, struct sched_usage *usage);
 
 #ifdef __cplusplus
 }
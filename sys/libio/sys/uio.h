@@ -0,0 +1,30 @@
+/* sys/uio.h
+ *
+ * Vectored I/O, reference:
+ * https://pubs.opengroup.org/onlinepubs/009696899/basedefs/sys/uio.h.html */
+
+#ifndef __SYS_UIO_H__
+#define __SYS_UIO_H__ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+/* Same layout as the vfs_iovec the kernel takes, so arrays are passed as they are */
+struct iovec {
+    void *iov_base; /* Start of the buffer */
+    size_t iov_len; /* Size of the buffer */
+};
+
+#define IOV_MAX 64 /* Most buffers taken on a single call */
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
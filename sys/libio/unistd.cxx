@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <svc.h>
+#include <sys/uio.h>
 
 /**
  * @brief Performs a raw IOCTL on a handle pointer
@@ -55,6 +56,30 @@ STDAPI ssize_t read(int fd, void *buf, size_t size)
     return r;
 }
 
+STDAPI ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    if(fd < 0 || fd > FOPEN_MAX) {
+        return -EBADF;
+    }
+
+    if(iovcnt < 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+    return (ssize_t)(int)io_svc(SVC_VFS_WRITEV, (uintptr_t)_files[fd].handle, (uintptr_t)iov, (uintptr_t)iovcnt);
+}
+
+STDAPI ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    if(fd < 0 || fd > FOPEN_MAX) {
+        return -EBADF;
+    }
+
+    if(iovcnt < 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+    return (ssize_t)(int)io_svc(SVC_VFS_READV, (uintptr_t)_files[fd].handle, (uintptr_t)iov, (uintptr_t)iovcnt);
+}
+
 STDAPI int seek(int fd, long offset, int whence)
 {
     if(fd < 0 || fd > FOPEN_MAX) {
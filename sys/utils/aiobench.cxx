@@ -0,0 +1,121 @@
+/* aiobench.c
+ *
+ * Reads files with the synchronous SVCs and then with the asynchronous ring,
+ * prints the time each took, aiobench [file]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <aio.h>
+
+#define AIOBENCH_MAX_FILES 8
+#define AIOBENCH_CHUNK_SIZE 16384
+
+/* Read into by the kernel thru it's real address, so it must be on the heap */
+static char (*buf)[AIOBENCH_CHUNK_SIZE];
+
+/* Microseconds since the TOD clock epoch */
+static unsigned long get_usec(void)
+{
+    unsigned long tod;
+    asm volatile("stck %0" : "=Q"(tod) : : "cc");
+    return tod >> 12;
+}
+
+static long bench_sync(int n_files, char **files, size_t *total)
+{
+    unsigned long start = get_usec();
+    int i;
+
+    *total = 0;
+    for(i = 0; i < n_files; i++) {
+        ssize_t n;
+        int fd = open(files[i], O_RDONLY);
+        if(fd < 0) {
+            perror("can't open file");
+            return -1;
+        }
+
+        while((n = read(fd, buf[i], sizeof(buf[i]))) > 0) {
+            *total += (size_t)n;
+        }
+        close(fd);
+    }
+    return (long)(get_usec() - start);
+}
+
+/* Every file has a read in flight until it reaches it's end */
+static long bench_async(int n_files, char **files, size_t *total)
+{
+    struct aio_context *ctx = (struct aio_context *)malloc(sizeof(*ctx));
+    unsigned long start = get_usec();
+    int fds[AIOBENCH_MAX_FILES];
+    int i, n_open = 0;
+
+    *total = 0;
+    if(ctx == NULL || aio_setup(ctx) < 0) {
+        fprintf(stderr, "can't setup the ring\r\n");
+        free(ctx);
+        return -1;
+    }
+
+    for(i = 0; i < n_files; i++) {
+        fds[i] = open(files[i], O_RDONLY);
+        if(fds[i] < 0) {
+            perror("can't open file");
+            continue;
+        }
+        aio_prep_read(aio_get_sqe(ctx), fds[i], buf[i], sizeof(buf[i]), (uintptr_t)i);
+        n_open++;
+    }
+
+    while(n_open > 0) {
+        struct aio_cqe cqe;
+        if(aio_wait_cqe(ctx, &cqe) < 0) {
+            break;
+        }
+
+        i = (int)cqe.user_data;
+        if(cqe.result <= 0) {
+            close(fds[i]);
+            n_open--;
+            continue;
+        }
+        *total += (size_t)cqe.result;
+        aio_prep_read(aio_get_sqe(ctx), fds[i], buf[i], sizeof(buf[i]), (uintptr_t)i);
+    }
+    aio_destroy(ctx);
+    free(ctx);
+    return (long)(get_usec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    size_t sync_total, async_total;
+    long sync_usec, async_usec;
+    int n_files = argc - 1;
+
+    if(n_files < 1) {
+        fprintf(stderr, "No arguments specified\r\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(n_files > AIOBENCH_MAX_FILES) {
+        n_files = AIOBENCH_MAX_FILES;
+    }
+
+    buf = (char (*)[AIOBENCH_CHUNK_SIZE])malloc(sizeof(*buf) * (size_t)n_files);
+    if(buf == NULL) {
+        fprintf(stderr, "can't allocate the buffers\r\n");
+        exit(EXIT_FAILURE);
+    }
+
+    sync_usec = bench_sync(n_files, &argv[1], &sync_total);
+    async_usec = bench_async(n_files, &argv[1], &async_total);
+    printf("sync: %u bytes in %li us\r\n", (unsigned int)sync_total, sync_usec);
+    printf("async: %u bytes in %li us\r\n", (unsigned int)async_total, async_usec);
+    exit(EXIT_SUCCESS);
+    return 0;
+}
@@ -6,18 +6,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <job.h>
 #include <css.h>
 
+#define CP_CHUNKS 4
+#define CP_CHUNK_SIZE 16384
+
+/* Data is read into these and written back from them without any copying */
+static char buf[CP_CHUNKS][CP_CHUNK_SIZE];
+
 int main(int argc, char **argv)
 {
-    FILE *in, out;
-    if(argc <= 1 + 2) {
+    struct iovec iov[CP_CHUNKS];
+    int in, out, i;
+
+    if(argc < 1 + 2) {
         fprintf(stderr, "No arguments specified\r\n");
+        exit(EXIT_FAILURE);
+    }
+
+    in = open(argv[1], O_RDONLY);
+    if(in < 0) {
+        perror("can't open source");
+        exit(EXIT_FAILURE);
+    }
+
+    out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC);
+    if(out < 0) {
+        perror("can't open destination");
+        close(in);
+        exit(EXIT_FAILURE);
     }
 
-    /** @todo Copy */
+    while(1) {
+        ssize_t n, w, left;
+
+        for(i = 0; i < CP_CHUNKS; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+        }
+
+        n = readv(in, iov, CP_CHUNKS);
+        if(n < 0) {
+            perror("can't read source");
+            break;
+        } else if(n == 0) {
+            break; /* End of file */
+        }
+
+        /* Write back just what was read */
+        left = n;
+        for(i = 0; i < CP_CHUNKS; i++) {
+            iov[i].iov_len = (size_t)left < sizeof(buf[i]) ? (size_t)left : sizeof(buf[i]);
+            left -= (ssize_t)iov[i].iov_len;
+        }
+
+        w = writev(out, iov, CP_CHUNKS);
+        if(w != n) {
+            perror("can't write destination");
+            break;
+        }
+    }
 
+    close(in);
+    close(out);
     exit(EXIT_SUCCESS);
     return 0;
 }
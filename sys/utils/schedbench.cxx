@@ -0,0 +1,105 @@
+/* schedbench.c
+ *
+ * Measures how long a thread that blocks on I/O takes to get the CPU back
+ * while CPU hogs run, prints the percentiles of the response times,
+ * schedbench [hogs] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <job.h>
+#include <aio.h>
+
+#define SCHEDBENCH_DEFAULT_HOGS 4
+#define SCHEDBENCH_DEFAULT_ROUNDS 200
+#define SCHEDBENCH_MAX_ROUNDS 1000
+
+static unsigned long samples[SCHEDBENCH_MAX_ROUNDS];
+static volatile unsigned long hog_loops;
+
+/* Microseconds since the TOD clock epoch */
+static unsigned long get_usec(void)
+{
+    unsigned long tod;
+    asm volatile("stck %0" : "=Q"(tod) : : "cc");
+    return tod >> 12;
+}
+
+/* Never blocks, so it ends up on the lowest priority */
+static void hog_fn(void)
+{
+    while(1) {
+        hog_loops++;
+    }
+}
+
+static int compare_usec(const void *s1, const void *s2)
+{
+    unsigned long a = *(const unsigned long *)s1;
+    unsigned long b = *(const unsigned long *)s2;
+    return (a > b) - (a < b);
+}
+
+static unsigned long percentile(int rounds, int p)
+{
+    int i = (rounds * p) / 100;
+    if(i >= rounds) {
+        i = rounds - 1;
+    }
+    return samples[i];
+}
+
+int main(int argc, char **argv)
+{
+    /* The kernel posts the completions thru the real address of the ring, so
+     * it must be on the heap */
+    struct aio_context *ctx;
+    int hogs = SCHEDBENCH_DEFAULT_HOGS;
+    int rounds = SCHEDBENCH_DEFAULT_ROUNDS;
+    int i;
+
+    if(argc > 1) {
+        hogs = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        rounds = atoi(argv[2]);
+    }
+    if(rounds <= 0 || rounds > SCHEDBENCH_MAX_ROUNDS) {
+        rounds = SCHEDBENCH_MAX_ROUNDS;
+    }
+
+    ctx = (struct aio_context *)malloc(sizeof(*ctx));
+    if(ctx == NULL || aio_setup(ctx) < 0) {
+        fprintf(stderr, "can't setup the ring\r\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < hogs; i++) {
+        job_create_thread(&hog_fn);
+    }
+
+    /* An empty submission is a no-op, the thread sleeps until a worker
+     * completes it and then waits for the CPU along with the hogs */
+    for(i = 0; i < rounds; i++) {
+        struct aio_cqe cqe;
+        unsigned long start = get_usec();
+        aio_get_sqe(ctx);
+        if(aio_wait_cqe(ctx, &cqe) < 0) {
+            fprintf(stderr, "can't wait for the completion\r\n");
+            break;
+        }
+        samples[i] = get_usec() - start;
+    }
+    rounds = i;
+    aio_destroy(ctx);
+    free(ctx);
+
+    if(rounds > 0) {
+        qsort(samples, (size_t)rounds, sizeof(samples[0]), &compare_usec);
+        printf("%i rounds with %i hogs, response time p50=%lu us p90=%lu us p99=%lu us max=%lu us\r\n",
+            rounds, hogs, percentile(rounds, 50), percentile(rounds, 90),
+            percentile(rounds, 99), samples[rounds - 1]);
+    }
+    exit(EXIT_SUCCESS);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* yieldbench.c
+ *
+ * Two threads hand the CPU to each other with yields, prints the time each
+ * round trip took, used to measure the cost of a context switch,
+ * yieldbench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <job.h>
+
+#define YIELDBENCH_DEFAULT_ROUNDS 10000
+
+static volatile int turn;
+static volatile int done;
+
+/* Microseconds since the TOD clock epoch */
+static unsigned long get_usec(void)
+{
+    unsigned long tod;
+    asm volatile("stck %0" : "=Q"(tod) : : "cc");
+    return tod >> 12;
+}
+
+/* Gives the turn back every time it gets it */
+static void partner_fn(void)
+{
+    while(!done) {
+        if(turn == 1) {
+            turn = 0;
+        }
+        job_yield();
+    }
+
+    while(1) {
+        job_yield();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = YIELDBENCH_DEFAULT_ROUNDS;
+    unsigned long start, elapsed;
+    long i;
+
+    if(argc > 1) {
+        rounds = (long)atoi(argv[1]);
+    }
+
+    job_create_thread(&partner_fn);
+
+    start = get_usec();
+    for(i = 0; i < rounds; i++) {
+        turn = 1;
+        while(turn == 1) {
+            job_yield();
+        }
+    }
+    elapsed = get_usec() - start;
+    done = 1;
+
+    printf("%li round trips in %lu us", rounds, elapsed);
+    if(rounds > 0) {
+        printf(", %lu ns each", (elapsed * 1000) / (unsigned long)rounds);
+    }
+    printf("\r\n");
+    exit(EXIT_SUCCESS);
+    return 0;
+}